@@ -0,0 +1,341 @@
+#include "bench_common.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_ble_mesh_generic_model_api.h"
+#include "esp_timer.h"
+#include "fanout.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "group_table.h"
+#include "mesh_tx.h"
+#include "metrics.h"
+#include "mqtt_app.h"
+#include "mqtt_host.h"
+#include "nvs_flash.h"
+#include "poller.h"
+#include "sd_host.h"
+#include "sdcard.h"
+#include "sdkconfig.h"
+#include "timestamp.h"
+#include "topic_table.h"
+#include "uplink.h"
+
+typedef struct {
+  int64_t post_us;
+  int32_t next; // next undelivered report of the same node, -1 for none
+} bench_report_t;
+
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static bench_match_t s_match;
+static bench_report_t *s_reports;
+static size_t s_capacity;
+static size_t s_posted;
+/* Per node FIFO of undelivered reports, linked through bench_report_t.next. */
+static int32_t s_node_head[BENCH_MAX_ADDR + 1];
+static int32_t s_node_tail[BENCH_MAX_ADDR + 1];
+static bench_latency_t s_latency;
+static uint32_t s_delivered;
+static uint64_t s_delivered_bytes; // payload bytes of those messages
+static int64_t s_last_delivery_us;
+
+void bench_latency_init(bench_latency_t *latency, size_t capacity) {
+  free(latency->samples);
+  latency->samples = malloc((capacity ? capacity : 1) * sizeof(*latency->samples));
+  latency->count = 0;
+  latency->capacity = latency->samples ? capacity : 0;
+}
+
+void bench_latency_add(bench_latency_t *latency, int64_t us) {
+  if (latency->count < latency->capacity) {
+    latency->samples[latency->count++] = us;
+  }
+}
+
+static int bench_cmp_i64(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+void bench_latency_print(const char *what, bench_latency_t *latency) {
+  if (latency->count == 0) {
+    printf("  %-26s no samples\n", what);
+    return;
+  }
+  qsort(latency->samples, latency->count, sizeof(*latency->samples), bench_cmp_i64);
+  printf("  %-26s p50 %8.3f ms  p99 %8.3f ms  max %8.3f ms  (%zu samples)\n", what,
+         latency->samples[latency->count / 2] / 1000.0, latency->samples[latency->count * 99 / 100] / 1000.0,
+         latency->samples[latency->count - 1] / 1000.0, latency->count);
+}
+
+/* A delivered message, or a record of a delivered batch. s_lock is held. */
+static void bench_deliver(const char *topic, int64_t queued_us, int64_t delivered_us) {
+  s_delivered++;
+  s_last_delivery_us = delivered_us;
+  if (s_match == BENCH_MATCH_POSTS) {
+    const char *slash = strrchr(topic, '/');
+    unsigned long addr = strtoul(slash ? slash + 1 : topic, NULL, 16);
+    if (addr <= BENCH_MAX_ADDR && s_node_head[addr] >= 0) {
+      bench_report_t *report = &s_reports[s_node_head[addr]];
+      s_node_head[addr] = report->next;
+      if (s_node_head[addr] < 0) {
+        s_node_tail[addr] = -1;
+      }
+      bench_latency_add(&s_latency, delivered_us - report->post_us);
+    }
+  } else if (s_match == BENCH_MATCH_OUTBOX) {
+    bench_latency_add(&s_latency, delivered_us - queued_us);
+  }
+}
+
+static void bench_publish_hook(const char *topic, const char *data, int len, int retain, int64_t queued_us,
+                               int64_t delivered_us, void *arg) {
+  if (retain) {
+    return; // snapshot
+  }
+#if CONFIG_GATEWAY_METRICS
+  if (strcmp(topic, CONFIG_GATEWAY_METRICS_TOPIC) == 0) {
+    return;
+  }
+#endif
+  pthread_mutex_lock(&s_lock);
+  s_delivered_bytes += len;
+#if CONFIG_GATEWAY_BATCH
+  if (strcmp(topic, CONFIG_GATEWAY_BATCH_TOPIC) == 0) {
+    // | topic length (1) | topic | payload length (2) | payload |, see batch.h
+    const uint8_t *pos = (const uint8_t *)data, *end = pos + len;
+    char record_topic[TOPIC_MAX_LEN + 1];
+    while (pos < end) {
+      size_t topic_len = *pos++;
+      memcpy(record_topic, pos, topic_len);
+      record_topic[topic_len] = '\0';
+      pos += topic_len;
+      pos += 2 + (pos[0] << 8 | pos[1]);
+      bench_deliver(record_topic, queued_us, delivered_us);
+    }
+    pthread_mutex_unlock(&s_lock);
+    return;
+  }
+#endif
+  bench_deliver(topic, queued_us, delivered_us);
+  pthread_mutex_unlock(&s_lock);
+}
+
+/* The part of the Generic Client callback in main.c that concerns the mesh TX scheduler. */
+static void bench_generic_client_cb(esp_ble_mesh_generic_client_cb_event_t event,
+                                    esp_ble_mesh_generic_client_cb_param_t *param) {
+  mesh_tx_on_client_event(event, param);
+  bool status = event == ESP_BLE_MESH_GENERIC_CLIENT_PUBLISH_EVT ||
+                (event == ESP_BLE_MESH_GENERIC_CLIENT_SET_STATE_EVT && !param->error_code);
+  if (status || (event == ESP_BLE_MESH_GENERIC_CLIENT_GET_STATE_EVT && !param->error_code)) {
+    fanout_on_status(param->params->ctx.addr, param->status_cb.onoff_status.present_onoff);
+  }
+  if (status) {
+    poller_on_status(param->params->ctx.addr, param->status_cb.onoff_status.present_onoff);
+  }
+}
+
+esp_err_t bench_gateway_start(const bench_gateway_config_t *config) {
+  esp_err_t err = nvs_flash_init();
+  if (err != ESP_OK) {
+    return err;
+  }
+  sd_host_set_root(config->sd_dir);
+  sd_init();
+  if (!config->keep) {
+    sd_host_wipe();
+  }
+  err = topic_table_init();
+  if (err != ESP_OK) {
+    return err;
+  }
+  err = timestamp_init();
+  if (err != ESP_OK) {
+    return err;
+  }
+  bench_run_reset(0, BENCH_MATCH_NONE);
+  mqtt_host_set_rtt_ms(config->rtt_ms);
+  mqtt_host_set_publish_hook(bench_publish_hook, NULL);
+  mqtt_host_set_broker_up(config->broker_up);
+  err = mqtt_offline_store_init();
+  if (err != ESP_OK) {
+    return err;
+  }
+  err = uplink_start();
+  if (err != ESP_OK) {
+    return err;
+  }
+  err = metrics_start();
+  if (err != ESP_OK) {
+    return err;
+  }
+  esp_ble_mesh_register_generic_client_callback(bench_generic_client_cb);
+  mesh_tx_set_keys(0, 0);
+  err = mesh_tx_start(NULL);
+  if (err != ESP_OK) {
+    return err;
+  }
+  err = group_table_init();
+  if (err != ESP_OK) {
+    return err;
+  }
+  err = fanout_start();
+  if (err != ESP_OK) {
+    return err;
+  }
+  err = poller_start();
+  if (err != ESP_OK) {
+    return err;
+  }
+  mqtt_app_start("mqtt://localhost", MQTT_URI_MAX_LEN, "", MQTT_USERNAME_MAX_LEN, "", MQTT_PASSWORD_MAX_LEN);
+  return ESP_OK;
+}
+
+bool bench_wait(bool (*done)(void), int64_t timeout_us) {
+  int64_t deadline = esp_timer_get_time() + timeout_us;
+  while (!done()) {
+    if (esp_timer_get_time() > deadline) {
+      return false;
+    }
+    vTaskDelay(pdMS_TO_TICKS(1));
+  }
+  return true;
+}
+
+void bench_sleep_until(int64_t deadline_us) {
+  int64_t wait = deadline_us - esp_timer_get_time();
+  if (wait > 0) {
+    struct timespec ts = {.tv_sec = wait / 1000000, .tv_nsec = (wait % 1000000) * 1000};
+    nanosleep(&ts, NULL);
+  }
+}
+
+static bool bench_is_connected(void) { return mqtt_is_connected(); }
+static bool bench_is_disconnected(void) { return !mqtt_is_connected(); }
+
+void bench_set_broker(bool up) {
+  mqtt_host_set_broker_up(up);
+  bench_wait(up ? bench_is_connected : bench_is_disconnected, BENCH_TIMEOUT_US);
+}
+
+void bench_run_reset(size_t capacity, bench_match_t match) {
+  pthread_mutex_lock(&s_lock);
+  free(s_reports);
+  s_reports = capacity ? malloc(capacity * sizeof(*s_reports)) : NULL;
+  s_capacity = s_reports ? capacity : 0;
+  s_posted = 0;
+  s_match = match;
+  memset(s_node_head, 0xff, sizeof(s_node_head));
+  memset(s_node_tail, 0xff, sizeof(s_node_tail));
+  bench_latency_init(&s_latency, capacity);
+  s_delivered = 0;
+  s_delivered_bytes = 0;
+  s_last_delivery_us = 0;
+  pthread_mutex_unlock(&s_lock);
+}
+
+bool bench_post(uint16_t addr, uint8_t onoff) {
+  uplink_stats_t before, after;
+  uplink_get_stats(&before);
+  pthread_mutex_lock(&s_lock);
+  int32_t index = -1;
+  if (s_posted < s_capacity) {
+    index = s_posted++;
+    s_reports[index].post_us = esp_timer_get_time();
+    s_reports[index].next = -1;
+    // Linked before posting, the delivery can arrive before uplink_post_onoff() returns.
+    if (s_match == BENCH_MATCH_POSTS && addr <= BENCH_MAX_ADDR) {
+      if (s_node_tail[addr] >= 0) {
+        s_reports[s_node_tail[addr]].next = index;
+      } else {
+        s_node_head[addr] = index;
+      }
+      s_node_tail[addr] = index;
+    }
+  }
+  pthread_mutex_unlock(&s_lock);
+
+  // a report from a node two hops away
+  esp_ble_mesh_msg_ctx_t ctx = {.addr = addr, .recv_op = ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_STATUS, .recv_rssi = -67,
+                                .recv_ttl = 5};
+  uplink_post_onoff(addr, onoff, &ctx);
+  uplink_get_stats(&after);
+  bool enqueued = after.enqueued != before.enqueued;
+  if (!enqueued && index >= 0 && s_match == BENCH_MATCH_POSTS && addr <= BENCH_MAX_ADDR) {
+    // Suppressed or spilled, not delivered live. It is still the tail unless it was delivered already, which a
+    // report that never reached the ring cannot be.
+    pthread_mutex_lock(&s_lock);
+    int32_t prev = -1;
+    for (int32_t i = s_node_head[addr]; i >= 0 && i != index; i = s_reports[i].next) {
+      prev = i;
+    }
+    if (prev >= 0) {
+      s_reports[prev].next = -1;
+    } else {
+      s_node_head[addr] = -1;
+    }
+    s_node_tail[addr] = prev;
+    pthread_mutex_unlock(&s_lock);
+  }
+  return enqueued;
+}
+
+int64_t bench_post_time(size_t index) {
+  pthread_mutex_lock(&s_lock);
+  int64_t us = index < s_posted ? s_reports[index].post_us : -1;
+  pthread_mutex_unlock(&s_lock);
+  return us;
+}
+
+size_t bench_posted(void) {
+  pthread_mutex_lock(&s_lock);
+  size_t posted = s_posted;
+  pthread_mutex_unlock(&s_lock);
+  return posted;
+}
+
+uint32_t bench_delivered(void) {
+  pthread_mutex_lock(&s_lock);
+  uint32_t delivered = s_delivered;
+  pthread_mutex_unlock(&s_lock);
+  return delivered;
+}
+
+uint64_t bench_delivered_bytes(void) {
+  pthread_mutex_lock(&s_lock);
+  uint64_t bytes = s_delivered_bytes;
+  pthread_mutex_unlock(&s_lock);
+  return bytes;
+}
+
+int64_t bench_last_delivery_us(void) {
+  pthread_mutex_lock(&s_lock);
+  int64_t us = s_last_delivery_us;
+  pthread_mutex_unlock(&s_lock);
+  return us;
+}
+
+static uint32_t s_expected;
+
+static bool bench_all_delivered(void) { return bench_delivered() >= s_expected; }
+
+bool bench_wait_delivered(uint32_t expected, int64_t timeout_us) {
+  s_expected = expected;
+  return bench_wait(bench_all_delivered, timeout_us);
+}
+
+void bench_record_latency(int64_t us) {
+  pthread_mutex_lock(&s_lock);
+  bench_latency_add(&s_latency, us);
+  pthread_mutex_unlock(&s_lock);
+}
+
+void bench_print_latency(const char *what) {
+  pthread_mutex_lock(&s_lock);
+  bench_latency_print(what, &s_latency);
+  pthread_mutex_unlock(&s_lock);
+}
@@ -0,0 +1,67 @@
+#ifndef _BENCH_COMMON_H_
+#define _BENCH_COMMON_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/*
+ * Shared plumbing of the host tools: gateway bring-up, posting mesh reports through the same path as the Generic
+ * OnOff status callback in main.c, and matching broker deliveries to the reports they came from.
+ */
+
+#define BENCH_MAX_ADDR 0x7fff
+#define BENCH_TIMEOUT_US (120 * 1000000LL)
+
+typedef enum {
+  BENCH_MATCH_NONE,   // only count deliveries
+  BENCH_MATCH_POSTS,  // latency from bench_post() to delivery, matched per node in FIFO order
+  BENCH_MATCH_OUTBOX, // latency from entering the client outbox to delivery
+} bench_match_t;
+
+typedef struct {
+  const char *sd_dir;
+  bool keep;       // keep the journal left in sd_dir by an earlier run
+  bool broker_up;  // broker state when the client starts
+  uint32_t rtt_ms; // broker round trip time
+} bench_gateway_config_t;
+
+typedef struct {
+  int64_t *samples; // microseconds
+  size_t count;
+  size_t capacity;
+} bench_latency_t;
+
+void bench_latency_init(bench_latency_t *latency, size_t capacity);
+void bench_latency_add(bench_latency_t *latency, int64_t us);
+/* Sorts the samples and prints p50/p99/max. */
+void bench_latency_print(const char *what, bench_latency_t *latency);
+
+/* Brings up the gateway core in the same order as app_main(), with the broker connection last. */
+esp_err_t bench_gateway_start(const bench_gateway_config_t *config);
+void bench_set_broker(bool up);
+bool bench_wait(bool (*done)(void), int64_t timeout_us);
+void bench_sleep_until(int64_t deadline_us);
+
+/* Starts a new measurement for up to capacity reports. */
+void bench_run_reset(size_t capacity, bench_match_t match);
+/* Posts a report like the mesh callback does. Returns true if it went into the ingest ring, false if it was
+ * suppressed as unchanged or overflowed. */
+bool bench_post(uint16_t addr, uint8_t onoff);
+/* Post time of the index-th report of the run, -1 if there is no such report. */
+int64_t bench_post_time(size_t index);
+size_t bench_posted(void);
+uint32_t bench_delivered(void);
+/* Payload bytes of the messages delivered in this run. */
+uint64_t bench_delivered_bytes(void);
+int64_t bench_last_delivery_us(void);
+/* Waits until at least expected messages were delivered in this run. */
+bool bench_wait_delivered(uint32_t expected, int64_t timeout_us);
+/* Adds a sample to the latency of the run, e.g. from a journal writer callback. */
+void bench_record_latency(int64_t us);
+/* Prints the latency of the run. */
+void bench_print_latency(const char *what);
+
+#endif // _BENCH_COMMON_H_
@@ -0,0 +1,313 @@
+/*
+ * Fuzzer and micro benchmark for the config vendor message parser of config_msg.h.
+ *
+ * The fuzzer feeds random payloads and mutations of valid TLV and legacy payloads to both parsers and checks that
+ * every field view lies inside the payload, respects its length limit and contains no NUL byte, and that required
+ * fields are present whenever the parser reports success. Valid payloads built from random fields must parse back to
+ * exactly those fields.
+ *
+ * Built with clang and -DGATEWAY_LIBFUZZER=ON the same checks are also available as a libFuzzer target,
+ * config_fuzz_libfuzzer.
+ */
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config_msg.h"
+
+#define FUZZ_MAX_MSG_LEN 384 // a segmented mesh access message carries at most 380 bytes
+
+static void fuzz_fail(const char *what, const uint8_t *msg, size_t len) {
+  fprintf(stderr, "config_fuzz: %s, payload of %zu bytes:", what, len);
+  for (size_t i = 0; i < len; i++) {
+    fprintf(stderr, " %02x", msg[i]);
+  }
+  fprintf(stderr, "\n");
+  abort();
+}
+
+static void fuzz_check_field(const config_field_t *field, size_t max_len, const uint8_t *msg, size_t len) {
+  if (field->len == 0) {
+    return;
+  }
+  const uint8_t *ptr = (const uint8_t *)field->ptr;
+  if (ptr < msg || ptr + field->len > msg + len) {
+    fuzz_fail("field outside of the payload", msg, len);
+  }
+  if (field->len > max_len) {
+    fuzz_fail("field longer than its limit", msg, len);
+  }
+  if (memchr(ptr, '\0', field->len)) {
+    fuzz_fail("NUL byte in a field", msg, len);
+  }
+}
+
+static void fuzz_check_one(const uint8_t *msg, size_t len) {
+  config_wifi_t wifi;
+  config_status_t status = config_msg_parse_wifi(msg, len, &wifi);
+  if (status > CONFIG_STATUS_DUPLICATE_FIELD || status == CONFIG_STATUS_NO_MEMORY) {
+    fuzz_fail("unexpected Wi-Fi status", msg, len);
+  }
+  if (status == CONFIG_STATUS_OK) {
+    fuzz_check_field(&wifi.ssid, WIFI_SSID_MAX_LEN - 1, msg, len);
+    fuzz_check_field(&wifi.password, WIFI_PSWD_MAX_LEN - 1, msg, len);
+    if (wifi.ssid.len == 0) {
+      fuzz_fail("Wi-Fi config accepted without SSID", msg, len);
+    }
+  }
+
+  config_mqtt_t mqtt;
+  status = config_msg_parse_mqtt(msg, len, &mqtt);
+  if (status > CONFIG_STATUS_DUPLICATE_FIELD || status == CONFIG_STATUS_NO_MEMORY) {
+    fuzz_fail("unexpected MQTT status", msg, len);
+  }
+  if (status == CONFIG_STATUS_OK) {
+    fuzz_check_field(&mqtt.uri, MQTT_URI_MAX_LEN - 1, msg, len);
+    fuzz_check_field(&mqtt.username, MQTT_USERNAME_MAX_LEN - 1, msg, len);
+    fuzz_check_field(&mqtt.password, MQTT_PASSWORD_MAX_LEN - 1, msg, len);
+    if (mqtt.uri.len == 0) {
+      fuzz_fail("MQTT config accepted without URI", msg, len);
+    }
+  }
+}
+
+#ifdef GATEWAY_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  fuzz_check_one(data, size);
+  return 0;
+}
+
+#else
+
+static uint64_t s_rng;
+
+static uint32_t fuzz_rand(void) {
+  // xorshift64*, reproducible from --seed on every platform
+  s_rng ^= s_rng >> 12;
+  s_rng ^= s_rng << 25;
+  s_rng ^= s_rng >> 27;
+  return (uint32_t)((s_rng * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+/* Random printable text without the separator characters, 0 to max_len bytes. */
+static size_t fuzz_rand_text(char *buf, size_t min_len, size_t max_len) {
+  size_t len = min_len + fuzz_rand() % (max_len - min_len + 1);
+  for (size_t i = 0; i < len; i++) {
+    char c;
+    do {
+      c = (char)(0x21 + fuzz_rand() % 94);
+    } while (c == '.' || c == '|');
+    buf[i] = c;
+  }
+  return len;
+}
+
+static size_t fuzz_put_tlv(uint8_t *msg, size_t pos, uint8_t type, const char *value, size_t len) {
+  msg[pos] = type;
+  msg[pos + 1] = (uint8_t)len;
+  memcpy(msg + pos + 2, value, len);
+  return pos + 2 + len;
+}
+
+static bool fuzz_field_equals(const config_field_t *field, const char *value, size_t len) {
+  return field->len == len && (len == 0 || memcmp(field->ptr, value, len) == 0);
+}
+
+/* Builds a valid payload, in TLV or legacy encoding, and checks that it parses back to the same fields. Leaves the
+ * payload in msg as a seed for mutation. */
+static size_t fuzz_round_trip(uint8_t *msg, bool mqtt, bool legacy) {
+  char a[64], b[64], c[64];
+  size_t len = 0;
+  if (!mqtt) {
+    size_t a_len = fuzz_rand_text(a, 1, WIFI_SSID_MAX_LEN - 1);
+    size_t b_len = fuzz_rand_text(b, 0, WIFI_PSWD_MAX_LEN - 1);
+    if (legacy) {
+      len = (size_t)sprintf((char *)msg, "%.*s.%.*s", (int)a_len, a, (int)b_len, b);
+    } else {
+      // some unknown field in between, newer provisioners may send those
+      len = fuzz_put_tlv(msg, len, CONFIG_TLV_WIFI_PASSWORD, b, b_len);
+      len = fuzz_put_tlv(msg, len, 0x1f, c, fuzz_rand() % 8);
+      len = fuzz_put_tlv(msg, len, CONFIG_TLV_WIFI_SSID, a, a_len);
+    }
+    config_wifi_t wifi;
+    if (config_msg_parse_wifi(msg, len, &wifi) != CONFIG_STATUS_OK || !fuzz_field_equals(&wifi.ssid, a, a_len) ||
+        !fuzz_field_equals(&wifi.password, b, b_len)) {
+      fuzz_fail("valid Wi-Fi config does not round trip", msg, len);
+    }
+  } else {
+    size_t a_len = fuzz_rand_text(a, 1, MQTT_URI_MAX_LEN - 1);
+    size_t b_len = fuzz_rand_text(b, 0, MQTT_USERNAME_MAX_LEN - 1);
+    size_t c_len = fuzz_rand_text(c, 0, MQTT_PASSWORD_MAX_LEN - 1);
+    if (legacy) {
+      len = (size_t)sprintf((char *)msg, "%.*s|%.*s|%.*s", (int)a_len, a, (int)b_len, b, (int)c_len, c);
+    } else {
+      len = fuzz_put_tlv(msg, len, CONFIG_TLV_MQTT_URI, a, a_len);
+      len = fuzz_put_tlv(msg, len, CONFIG_TLV_MQTT_USERNAME, b, b_len);
+      len = fuzz_put_tlv(msg, len, CONFIG_TLV_MQTT_PASSWORD, c, c_len);
+    }
+    config_mqtt_t config;
+    if (config_msg_parse_mqtt(msg, len, &config) != CONFIG_STATUS_OK || !fuzz_field_equals(&config.uri, a, a_len) ||
+        !fuzz_field_equals(&config.username, b, b_len) || !fuzz_field_equals(&config.password, c, c_len)) {
+      fuzz_fail("valid MQTT config does not round trip", msg, len);
+    }
+  }
+  return len;
+}
+
+static size_t fuzz_mutate(uint8_t *msg, size_t len) {
+  int mutations = 1 + fuzz_rand() % 4;
+  for (int i = 0; i < mutations; i++) {
+    switch (fuzz_rand() % 5) {
+    case 0: // flip a byte
+      if (len) {
+        msg[fuzz_rand() % len] = (uint8_t)fuzz_rand();
+      }
+      break;
+    case 1: // truncate
+      if (len) {
+        len = fuzz_rand() % len;
+      }
+      break;
+    case 2: // append garbage
+      while (len < FUZZ_MAX_MSG_LEN && fuzz_rand() % 4) {
+        msg[len++] = (uint8_t)fuzz_rand();
+      }
+      break;
+    case 3: // duplicate the payload, which repeats every field
+      if (len && len * 2 <= FUZZ_MAX_MSG_LEN) {
+        memcpy(msg + len, msg, len);
+        len *= 2;
+      }
+      break;
+    default: // put in a separator or a small value that looks like a type or length
+      if (len) {
+        static const uint8_t interesting[] = {'.', '|', 0x00, 0x01, 0x02, 0x10, 0x11, 0x12, 0x1f, 0x20, 0xff};
+        msg[fuzz_rand() % len] = interesting[fuzz_rand() % sizeof(interesting)];
+      }
+      break;
+    }
+  }
+  return len;
+}
+
+static void fuzz_run(long iterations) {
+  static uint8_t msg[FUZZ_MAX_MSG_LEN];
+  for (long i = 0; i < iterations; i++) {
+    size_t len;
+    if (i % 4 == 0) {
+      len = fuzz_rand() % FUZZ_MAX_MSG_LEN;
+      for (size_t j = 0; j < len; j++) {
+        msg[j] = (uint8_t)fuzz_rand();
+      }
+    } else {
+      len = fuzz_round_trip(msg, fuzz_rand() & 1, fuzz_rand() & 1);
+      len = fuzz_mutate(msg, len);
+    }
+    fuzz_check_one(msg, len);
+  }
+  printf("fuzz: %ld payloads, no violations\n", iterations);
+}
+
+static double bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench_parse(const char *name, const uint8_t *msg, size_t len, bool mqtt, long iterations) {
+  volatile size_t sink = 0;
+  double start = bench_now_ns();
+  for (long i = 0; i < iterations; i++) {
+    if (mqtt) {
+      config_mqtt_t config;
+      config_msg_parse_mqtt(msg, len, &config);
+      sink += config.password.len;
+    } else {
+      config_wifi_t config;
+      config_msg_parse_wifi(msg, len, &config);
+      sink += config.password.len;
+    }
+  }
+  double elapsed = bench_now_ns() - start;
+  printf("%-12s %3zu bytes  %7.1f ns/parse\n", name, len, elapsed / iterations);
+  (void)sink;
+}
+
+static void bench_run(long iterations) {
+  uint8_t msg[FUZZ_MAX_MSG_LEN];
+  size_t len;
+
+  len = (size_t)sprintf((char *)msg, "gateway-net.correct horse battery");
+  bench_parse("wifi text", msg, len, false, iterations);
+  len = 0;
+  len = fuzz_put_tlv(msg, len, CONFIG_TLV_WIFI_SSID, "gateway-net", 11);
+  len = fuzz_put_tlv(msg, len, CONFIG_TLV_WIFI_PASSWORD, "correct horse battery", 21);
+  bench_parse("wifi tlv", msg, len, false, iterations);
+
+  len = (size_t)sprintf((char *)msg, "mqtt://10.0.0.2:1883|gateway|s3cret-passw0rd");
+  bench_parse("mqtt text", msg, len, true, iterations);
+  len = 0;
+  len = fuzz_put_tlv(msg, len, CONFIG_TLV_MQTT_URI, "mqtt://10.0.0.2:1883", 20);
+  len = fuzz_put_tlv(msg, len, CONFIG_TLV_MQTT_USERNAME, "gateway", 7);
+  len = fuzz_put_tlv(msg, len, CONFIG_TLV_MQTT_PASSWORD, "s3cret-passw0rd", 15);
+  bench_parse("mqtt tlv", msg, len, true, iterations);
+}
+
+static void usage(const char *prog) {
+  printf("usage: %s [--iterations N] [--seed N] [--bench]\n"
+         "  --iterations N  payloads to fuzz, or parses per case with --bench (default 1000000)\n"
+         "  --seed N        random seed (default: time)\n"
+         "  --bench         measure parse time instead of fuzzing\n",
+         prog);
+}
+
+int main(int argc, char **argv) {
+  static const struct option options[] = {
+      {"iterations", required_argument, NULL, 'i'},
+      {"seed", required_argument, NULL, 's'},
+      {"bench", no_argument, NULL, 'b'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+  long iterations = 1000000;
+  uint64_t seed = (uint64_t)time(NULL);
+  bool bench = false;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "i:s:bh", options, NULL)) != -1) {
+    switch (opt) {
+    case 'i':
+      iterations = strtol(optarg, NULL, 0);
+      break;
+    case 's':
+      seed = strtoull(optarg, NULL, 0);
+      break;
+    case 'b':
+      bench = true;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (iterations <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (bench) {
+    bench_run(iterations);
+    return 0;
+  }
+  printf("fuzz: seed %llu\n", (unsigned long long)seed);
+  s_rng = seed ? seed : 1;
+  fuzz_run(iterations);
+  return 0;
+}
+
+#endif // GATEWAY_LIBFUZZER
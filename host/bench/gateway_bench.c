@@ -0,0 +1,588 @@
+/*
+ * Throughput and latency benchmark for the gateway core on a development machine.
+ *
+ * The mesh side is represented by uplink_post_onoff(), which is what the Generic OnOff status callback in main.c
+ * calls, the broker by the in-process stand-in of mqtt_host.h and the SD card by a directory.
+ *
+ *   ingest    broker up: mesh report -> broker delivery
+ *   spill     broker down: mesh report -> RAM tier or committed SD journal record
+ *   replay    broker comes back: backlog -> broker, prefilled with a spill run if there is no backlog yet. With
+ *             compaction enabled the backlog is compacted first.
+ *   commands  bursts of Generic OnOff Sets to every node through the mesh TX scheduler and the simulated mesh of
+ *             mesh_host.h: submit -> status, coalescing and retries
+ *   fanout    bulk commands to every node, most of them in groups: messages sent, confirmations and fallbacks
+ *   poll      full refresh sweep of the poller over every node, some of which changed state unnoticed
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+#include "bench_common.h"
+#include "compactor.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "fanout.h"
+#include "group_table.h"
+#include "journal.h"
+#include "journal_writer.h"
+#include "mesh_host.h"
+#include "mesh_tx.h"
+#include "metrics.h"
+#include "node_shadow.h"
+#include "offline_buffer.h"
+#include "poller.h"
+#include "sdkconfig.h"
+#include "uplink.h"
+
+typedef struct {
+  const char *scenario;
+  int nodes;
+  int rate; // reports per second, 0 posts as fast as possible
+  int count;
+  int rtt_ms;
+  int loss; // percent of mesh messages lost
+  const char *sd_dir;
+  bool keep;
+} bench_options_t;
+
+static bench_options_t s_opt = {
+    .scenario = "all",
+    .nodes = 64,
+    .rate = 1000,
+    .count = 5000,
+    .rtt_ms = 20,
+    .loss = 2,
+    .sd_dir = "bench_sd",
+};
+
+static uint8_t s_node_state[BENCH_MAX_ADDR + 1];
+static bool s_match_commits;
+static uint32_t s_committed;
+static size_t s_ram_before;
+static size_t s_sd_first; // index of the first report that went to the SD tier during a spill run
+
+static void bench_flush_callback(uint32_t records, bool synced) {
+  if (!s_match_commits) {
+    return;
+  }
+  int64_t now = esp_timer_get_time();
+  if (s_committed == 0) {
+    // Spilling only starts once the RAM tier is full, so it holds exactly the reports before the first SD record.
+    s_sd_first = offline_buffer_count() - s_ram_before;
+  }
+  for (uint32_t i = 0; i < records; i++) {
+    int64_t posted = bench_post_time(s_sd_first + s_committed + i);
+    if (posted >= 0) {
+      bench_record_latency(now - posted);
+    }
+  }
+  s_committed += records;
+}
+
+/* Posts count reports round robin over the nodes, flipping the state of the node every time so that no report is
+ * suppressed as unchanged. */
+static void bench_post_reports(void) {
+  int64_t start = esp_timer_get_time();
+  for (int i = 0; i < s_opt.count; i++) {
+    if (s_opt.rate > 0) {
+      bench_sleep_until(start + (int64_t)i * 1000000 / s_opt.rate);
+    }
+    uint16_t addr = 1 + i % s_opt.nodes;
+    s_node_state[addr] ^= 1;
+    bench_post(addr, s_node_state[addr]);
+  }
+}
+
+static void bench_start_run(bench_match_t match, bool match_commits) {
+  s_match_commits = false;
+  bench_run_reset(s_opt.count, match);
+  s_committed = 0;
+  s_ram_before = offline_buffer_count();
+  s_match_commits = match_commits;
+}
+
+/* Payload bytes per delivered message, and the batches published since the last call. */
+static void bench_print_payload(void) {
+  uint32_t delivered = bench_delivered();
+  printf("  payload                    %.1f bytes/msg\n",
+         delivered ? (double)bench_delivered_bytes() / delivered : 0.0);
+#if CONFIG_GATEWAY_BATCH
+  static batch_stats_t printed;
+  batch_stats_t stats;
+  batch_get_stats(&stats);
+  uint32_t batches = stats.batches - printed.batches;
+  if (batches) {
+    printf("  %u batches, %.1f records each, %.0f %% full on average, %u published when full\n", batches,
+           (double)(stats.records - printed.records) / batches,
+           100.0 * (stats.bytes - printed.bytes) / batches / CONFIG_GATEWAY_BATCH_MAX_BYTES, stats.full - printed.full);
+  }
+  printed = stats;
+#endif
+}
+
+static void bench_ingest(void) {
+  printf("ingest: %d reports from %d nodes, rate %s, broker rtt %d ms\n", s_opt.count, s_opt.nodes,
+         s_opt.rate ? "limited" : "unlimited", s_opt.rtt_ms);
+  bench_set_broker(true);
+  bench_start_run(BENCH_MATCH_POSTS, false);
+  uplink_stats_t before, after;
+  uplink_get_stats(&before);
+
+  int64_t start = esp_timer_get_time();
+  bench_post_reports();
+  uplink_get_stats(&after);
+  uint32_t expected = after.enqueued - before.enqueued;
+  bool complete = bench_wait_delivered(expected, BENCH_TIMEOUT_US);
+  int64_t elapsed = bench_last_delivery_us() - start;
+
+  printf("  delivered %u of %u enqueued, %u overflowed (%u spilled, %u dropped), ring high watermark %u\n",
+         bench_delivered(), expected, after.overflows - before.overflows, after.spilled - before.spilled,
+         after.dropped - before.dropped, after.high_watermark);
+  printf("  throughput                 %.0f msgs/s%s\n", bench_delivered() * 1e6 / (elapsed > 0 ? elapsed : 1),
+         complete ? "" : " (timed out)");
+  bench_print_payload();
+  bench_print_latency("post -> broker");
+}
+
+static uint32_t s_spill_accounted_target;
+
+/* Reports lost on the way to the offline store. A spilled overflow that finds the writer queue full is counted by
+ * both the uplink and the writer. */
+static uint32_t bench_lost(const uplink_stats_t *uplink, const journal_writer_stats_t *writer) {
+#if CONFIG_GATEWAY_UPLINK_OVERFLOW_SPILL
+  return writer->dropped + writer->refused;
+#else
+  return writer->dropped + writer->refused + uplink->dropped;
+#endif
+}
+
+static bool bench_spill_settled(void) {
+  uplink_stats_t uplink;
+  journal_writer_stats_t writer;
+  uplink_get_stats(&uplink);
+  journal_writer_get_stats(&writer);
+  uint32_t accounted = offline_buffer_count() + writer.committed + bench_lost(&uplink, &writer);
+  return journal_writer_pending() == 0 && accounted >= s_spill_accounted_target;
+}
+
+static void bench_spill(void) {
+  printf("spill: %d reports from %d nodes with the broker down, RAM tier %d bytes\n", s_opt.count, s_opt.nodes,
+         CONFIG_GATEWAY_OFFLINE_RAM_BUDGET);
+  bench_set_broker(false);
+  bench_start_run(BENCH_MATCH_NONE, true);
+  uplink_stats_t uplink_before, uplink_after;
+  journal_writer_stats_t writer_before, writer_after;
+  journal_stats_t journal_before, journal_after;
+  uplink_get_stats(&uplink_before);
+  journal_writer_get_stats(&writer_before);
+  journal_get_stats(&journal_before);
+
+  // The RAM tier takes reports until it is full, everything after that goes to the card in order.
+  int64_t start = esp_timer_get_time();
+  bench_post_reports();
+  s_spill_accounted_target =
+      s_ram_before + writer_before.committed + bench_lost(&uplink_before, &writer_before) + s_opt.count;
+  bool complete = bench_wait(bench_spill_settled, BENCH_TIMEOUT_US);
+  int64_t elapsed = esp_timer_get_time() - start;
+
+  uplink_get_stats(&uplink_after);
+  journal_writer_get_stats(&writer_after);
+  journal_get_stats(&journal_after);
+  uint32_t flushes = writer_after.flushes - writer_before.flushes;
+  uint32_t committed = writer_after.committed - writer_before.committed;
+  printf("  RAM tier %zu messages, SD %u records in %u group commits (avg %.1f, max %u), %u dropped\n",
+         offline_buffer_count() - s_ram_before, committed, flushes, flushes ? (double)committed / flushes : 0.0,
+         writer_after.max_batch, bench_lost(&uplink_after, &writer_after) - bench_lost(&uplink_before, &writer_before));
+  printf("  %u segments sealed, %u evicted (%u bytes), %u records refused, %ld bytes on SD\n",
+         journal_after.sealed - journal_before.sealed, journal_after.evicted - journal_before.evicted,
+         journal_after.evicted_bytes - journal_before.evicted_bytes, journal_after.refused - journal_before.refused,
+         journal_size());
+  printf("  throughput                 %.0f msgs/s%s\n", s_opt.count * 1e6 / (elapsed > 0 ? elapsed : 1),
+         complete ? "" : " (timed out)");
+  if (uplink_after.overflows != uplink_before.overflows) {
+    printf("  %u reports overflowed the ingest ring, the SD latency below is approximate\n",
+           uplink_after.overflows - uplink_before.overflows);
+  }
+  bench_print_latency("post -> SD commit");
+  s_match_commits = false;
+}
+
+/* Counts the journal records left to replay, the checkpoint is not taken into account. */
+static uint32_t bench_journal_records(void) {
+  uint32_t records = 0;
+  journal_record_t record;
+  for (uint32_t segment = journal_oldest_segment(); segment <= journal_active_segment(); segment++) {
+    journal_reader_t reader;
+    if (journal_reader_open(&reader, segment, 0) != ESP_OK) {
+      continue;
+    }
+    while (journal_reader_next(&reader, &record) == ESP_OK) {
+      records++;
+    }
+    journal_reader_close(&reader);
+  }
+  return records;
+}
+
+static bool bench_journal_empty(void) { return journal_size() == 0; }
+
+#if CONFIG_GATEWAY_COMPACT
+static uint32_t s_compactor_passes;
+
+static bool bench_compactor_passed(void) {
+  compactor_stats_t stats;
+  compactor_get_stats(&stats);
+  return stats.passes > s_compactor_passes;
+}
+
+/* Seals the active segment so that the whole backlog can be compacted and waits for a pass over it. The task is
+ * kicked twice, the first kick may land in a pass that started before the seal. */
+static void bench_compact(void) {
+  compactor_stats_t before, after;
+  compactor_get_stats(&before);
+  journal_rotate();
+  int64_t start = esp_timer_get_time();
+  for (int i = 0; i < 2; i++) {
+    compactor_get_stats(&after);
+    s_compactor_passes = after.passes;
+    compactor_kick();
+    bench_wait(bench_compactor_passed, BENCH_TIMEOUT_US);
+  }
+  int64_t elapsed = esp_timer_get_time() - start;
+  compactor_get_stats(&after);
+  printf("compaction: %u records dropped from %u segments, %u bytes saved, %.1f ms\n",
+         after.dropped - before.dropped, after.rewritten - before.rewritten, after.bytes_saved - before.bytes_saved,
+         elapsed / 1000.0);
+}
+#endif
+
+static void bench_replay(void) {
+  if (offline_buffer_count() == 0 && journal_size() == 0) {
+    printf("replay: no backlog, prefilling\n");
+    bench_set_broker(false);
+    bench_start_run(BENCH_MATCH_NONE, false);
+    bench_post_reports();
+    s_spill_accounted_target = s_opt.count;
+    bench_wait(bench_spill_settled, BENCH_TIMEOUT_US);
+  }
+  bench_set_broker(false);
+  journal_flush(false);
+#if CONFIG_GATEWAY_COMPACT
+  bench_compact();
+#endif
+  uint32_t backlog = offline_buffer_count() + bench_journal_records();
+  printf("replay: %u messages backlog (%zu in RAM, %ld bytes on SD), broker rtt %d ms, window %d\n", backlog,
+         offline_buffer_count(), journal_size(), s_opt.rtt_ms, CONFIG_GATEWAY_REPLAY_WINDOW);
+
+  bench_run_reset(backlog, BENCH_MATCH_OUTBOX);
+  int64_t start = esp_timer_get_time();
+  bench_set_broker(true);
+  bool complete = bench_wait_delivered(backlog, BENCH_TIMEOUT_US);
+  int64_t elapsed = bench_last_delivery_us() - start;
+  // Segments are deleted once the replay task has seen the last acknowledgement.
+  bench_wait(bench_journal_empty, 1000000);
+
+  printf("  delivered %u of %u, %ld bytes left on SD\n", bench_delivered(), backlog, journal_size());
+  printf("  throughput                 %.0f msgs/s%s\n", bench_delivered() * 1e6 / (elapsed > 0 ? elapsed : 1),
+         complete ? "" : " (timed out)");
+  bench_print_payload();
+  bench_print_latency("outbox -> broker");
+}
+
+#define BENCH_COMMAND_BURSTS 3
+#define BENCH_COMMAND_GAP_MS 200
+#define BENCH_MESH_LATENCY_MS 30
+#define BENCH_FANOUT_GROUP_SIZE 16
+#define BENCH_FANOUT_GROUP_BASE 0xC000
+#define BENCH_POLL_STALE_EVERY 10
+
+static pthread_mutex_t s_command_lock = PTHREAD_MUTEX_INITIALIZER;
+static bench_latency_t s_command_latency;
+static uint32_t s_command_results[MESH_TX_FAILED + 1];
+static uint32_t s_command_expected;
+
+static void bench_command_done(uint16_t addr, mesh_tx_op_t op, mesh_tx_result_t result, uint8_t onoff,
+                               uint32_t submitted) {
+  pthread_mutex_lock(&s_command_lock);
+  s_command_results[result]++;
+  if (result == MESH_TX_OK) {
+    bench_latency_add(&s_command_latency, metrics_now() - submitted);
+  }
+  pthread_mutex_unlock(&s_command_lock);
+}
+
+static bool bench_commands_done(void) {
+  pthread_mutex_lock(&s_command_lock);
+  uint32_t done = 0;
+  for (int i = 0; i <= MESH_TX_FAILED; i++) {
+    done += s_command_results[i];
+  }
+  pthread_mutex_unlock(&s_command_lock);
+  return done >= s_command_expected;
+}
+
+/* A dashboard switching all lights: every burst toggles every node, the next burst comes in while the previous one
+ * is still being sent, so most of its commands replace queued ones. */
+static void bench_commands(void) {
+  printf("commands: %d bursts toggling %d nodes %d ms apart, mesh latency %d ms, loss %d%%, window %d, interval %d "
+         "ms\n",
+         BENCH_COMMAND_BURSTS, s_opt.nodes, BENCH_COMMAND_GAP_MS, BENCH_MESH_LATENCY_MS, s_opt.loss,
+         CONFIG_GATEWAY_MESH_TX_WINDOW, CONFIG_GATEWAY_MESH_TX_INTERVAL_MS);
+  mesh_host_set_latency_ms(BENCH_MESH_LATENCY_MS);
+  mesh_host_set_loss(s_opt.loss / 100.0);
+  memset(s_command_results, 0, sizeof(s_command_results));
+  bench_latency_init(&s_command_latency, BENCH_COMMAND_BURSTS * s_opt.nodes);
+  mesh_tx_stats_t before, after;
+  mesh_tx_get_stats(&before);
+  uint32_t messages_before = mesh_host_messages_sent();
+
+  uint32_t refused = 0;
+  int64_t start = esp_timer_get_time();
+  for (int burst = 0; burst < BENCH_COMMAND_BURSTS; burst++) {
+    bench_sleep_until(start + (int64_t)burst * BENCH_COMMAND_GAP_MS * 1000);
+    for (uint16_t addr = 1; addr <= s_opt.nodes; addr++) {
+      s_node_state[addr] ^= 1;
+      if (mesh_tx_submit(addr, MESH_TX_SET, s_node_state[addr], bench_command_done) != ESP_OK) {
+        refused++;
+      }
+    }
+  }
+  pthread_mutex_lock(&s_command_lock);
+  s_command_expected = BENCH_COMMAND_BURSTS * s_opt.nodes - refused;
+  pthread_mutex_unlock(&s_command_lock);
+  bool complete = bench_wait(bench_commands_done, BENCH_TIMEOUT_US);
+  int64_t elapsed = esp_timer_get_time() - start;
+
+  mesh_tx_get_stats(&after);
+  int in_target = 0;
+  for (uint16_t addr = 1; addr <= s_opt.nodes; addr++) {
+    in_target += mesh_host_node_state(addr) == s_node_state[addr];
+  }
+  printf("  %u acknowledged, %u superseded, %u timed out, %u failed, %u refused\n", s_command_results[MESH_TX_OK],
+         s_command_results[MESH_TX_SUPERSEDED], s_command_results[MESH_TX_TIMEOUT], s_command_results[MESH_TX_FAILED],
+         refused);
+  printf("  %u mesh messages, %u retries, queue high watermark %u\n", mesh_host_messages_sent() - messages_before,
+         after.retries - before.retries, after.queued_max);
+  printf("  %d of %d nodes in the requested state, all done after %.0f ms%s\n", in_target, s_opt.nodes,
+         elapsed / 1000.0, complete ? "" : " (timed out)");
+  bench_latency_print("submit -> status", &s_command_latency);
+}
+
+static pthread_mutex_t s_fanout_lock = PTHREAD_MUTEX_INITIALIZER;
+static fanout_result_t s_fanout_result;
+static bool s_fanout_done;
+
+static void bench_fanout_done(const fanout_result_t *result) {
+  pthread_mutex_lock(&s_fanout_lock);
+  s_fanout_result = *result;
+  s_fanout_done = true;
+  pthread_mutex_unlock(&s_fanout_lock);
+}
+
+static bool bench_fanout_finished(void) {
+  pthread_mutex_lock(&s_fanout_lock);
+  bool done = s_fanout_done;
+  pthread_mutex_unlock(&s_fanout_lock);
+  return done;
+}
+
+/* One bulk command for every node. Nodes already in the requested state publish nothing; the gateway has heard
+ * the state of every node before, so they are asked with a Get. */
+static void bench_fanout_command(const uint16_t *addrs, uint8_t onoff) {
+  int already = 0;
+  for (uint16_t addr = 1; addr <= s_opt.nodes; addr++) {
+    bool changed;
+    node_shadow_update(addr, mesh_host_node_state(addr), &changed);
+    already += mesh_host_node_state(addr) == onoff;
+  }
+  s_fanout_done = false;
+  uint32_t messages_before = mesh_host_messages_sent();
+  if (fanout_submit(addrs, s_opt.nodes, onoff, bench_fanout_done) != ESP_OK) {
+    printf("  switching %s: refused\n", onoff ? "on" : "off");
+    return;
+  }
+  bool complete = bench_wait(bench_fanout_finished, BENCH_TIMEOUT_US);
+  const fanout_result_t *r = &s_fanout_result;
+  int in_target = 0;
+  for (uint16_t addr = 1; addr <= s_opt.nodes; addr++) {
+    in_target += mesh_host_node_state(addr) == onoff;
+  }
+  printf("  switching %s, %d nodes in that state already:\n", onoff ? "on" : "off", already);
+  printf("    %u groups + %u unicast + %u Gets, %u mesh messages in all (%d for acknowledged Sets to every node)\n",
+         r->groups, r->unicasts, r->probed, mesh_host_messages_sent() - messages_before, s_opt.nodes);
+  printf("    %u confirmed, %u acknowledged after the window, %u failed, %d of %d in the requested state\n",
+         r->confirmed, r->acked, r->failed, in_target, s_opt.nodes);
+  printf("    done after %u ms%s\n", r->elapsed_ms, complete ? "" : " (timed out)");
+}
+
+/* A floor switched from a dashboard: every node is a member of one group of BENCH_FANOUT_GROUP_SIZE, except the
+ * remainder that does not fill a group. */
+static void bench_fanout(void) {
+  printf("fanout: %d nodes in groups of %d, mesh latency %d ms, loss %d%%, window %d ms\n", s_opt.nodes,
+         BENCH_FANOUT_GROUP_SIZE, BENCH_MESH_LATENCY_MS, s_opt.loss, CONFIG_GATEWAY_FANOUT_WINDOW_MS);
+  mesh_host_set_latency_ms(BENCH_MESH_LATENCY_MS);
+  mesh_host_set_loss(s_opt.loss / 100.0);
+  mesh_host_set_publish(true);
+  uint16_t *addrs = malloc(s_opt.nodes * sizeof(*addrs));
+  if (!addrs) {
+    return;
+  }
+  for (uint16_t addr = 1; addr <= s_opt.nodes; addr++) {
+    addrs[addr - 1] = addr;
+  }
+  for (int first = 0; first + BENCH_FANOUT_GROUP_SIZE <= s_opt.nodes; first += BENCH_FANOUT_GROUP_SIZE) {
+    uint16_t group = BENCH_FANOUT_GROUP_BASE + first / BENCH_FANOUT_GROUP_SIZE;
+    group_table_set(group, &addrs[first], BENCH_FANOUT_GROUP_SIZE);
+    for (int i = first; i < first + BENCH_FANOUT_GROUP_SIZE; i++) {
+      mesh_host_subscribe(addrs[i], group);
+    }
+  }
+  bench_fanout_command(addrs, 1);
+  bench_fanout_command(addrs, 0);
+  mesh_host_set_publish(false);
+  free(addrs);
+}
+
+static bool bench_poll_done(void) {
+  poller_stats_t stats;
+  poller_get_stats(&stats);
+  return stats.due == 0;
+}
+
+/* Nodes that missed a publication: every node announces its state, then every BENCH_POLL_STALE_EVERY-th node
+ * changes state without publishing it, and a sweep has to find them. */
+static void bench_poll(void) {
+  printf("poll: sweep over %d nodes, every %dth one stale, mesh latency %d ms, loss %d%%, window %d\n", s_opt.nodes,
+         BENCH_POLL_STALE_EVERY, BENCH_MESH_LATENCY_MS, s_opt.loss, CONFIG_GATEWAY_POLL_WINDOW);
+  mesh_host_set_latency_ms(BENCH_MESH_LATENCY_MS);
+  mesh_host_set_loss(s_opt.loss / 100.0);
+  int stale = 0;
+  for (uint16_t addr = 1; addr <= s_opt.nodes; addr++) {
+    uint8_t onoff = mesh_host_node_state(addr);
+    mesh_host_publish_status(addr, onoff);
+    if (addr % BENCH_POLL_STALE_EVERY == 0) {
+      mesh_host_set_node_state(addr, !onoff);
+      stale++;
+    }
+  }
+  poller_stats_t before, after;
+  poller_get_stats(&before);
+  uint32_t messages_before = mesh_host_messages_sent();
+  int64_t start = esp_timer_get_time();
+  poller_sweep();
+  bool complete = bench_wait(bench_poll_done, BENCH_TIMEOUT_US);
+  int64_t elapsed = esp_timer_get_time() - start;
+  poller_get_stats(&after);
+  printf("  %u Gets, %u answered, %u unanswered, %u mesh messages\n", after.polls - before.polls,
+         after.answered - before.answered, after.timeouts - before.timeouts,
+         mesh_host_messages_sent() - messages_before);
+  printf("  %u of %d stale nodes found, sweep done after %.0f ms%s\n", after.changed - before.changed, stale,
+         elapsed / 1000.0, complete ? "" : " (timed out)");
+}
+
+static void bench_usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [--scenario ingest|spill|replay|commands|fanout|poll|all] [--nodes N] [--rate N] [--count N]\n"
+          "          [--rtt-ms N] [--loss PERCENT] [--sd-dir DIR] [--keep]\n"
+          "  --rate 0 posts as fast as possible, --keep starts with the journal left in DIR by an earlier run,\n"
+          "  --loss is the share of mesh messages lost in the commands, fanout and poll scenarios\n",
+          name);
+}
+
+static bool bench_parse_options(int argc, char **argv) {
+  static const struct option options[] = {
+      {"scenario", required_argument, NULL, 's'}, {"nodes", required_argument, NULL, 'n'},
+      {"rate", required_argument, NULL, 'r'},     {"count", required_argument, NULL, 'c'},
+      {"rtt-ms", required_argument, NULL, 't'},   {"sd-dir", required_argument, NULL, 'd'},
+      {"loss", required_argument, NULL, 'l'},     {"keep", no_argument, NULL, 'k'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "s:n:r:c:t:l:d:kh", options, NULL)) != -1) {
+    switch (c) {
+    case 's':
+      s_opt.scenario = optarg;
+      break;
+    case 'n':
+      s_opt.nodes = atoi(optarg);
+      break;
+    case 'r':
+      s_opt.rate = atoi(optarg);
+      break;
+    case 'c':
+      s_opt.count = atoi(optarg);
+      break;
+    case 't':
+      s_opt.rtt_ms = atoi(optarg);
+      break;
+    case 'l':
+      s_opt.loss = atoi(optarg);
+      break;
+    case 'd':
+      s_opt.sd_dir = optarg;
+      break;
+    case 'k':
+      s_opt.keep = true;
+      break;
+    default:
+      return false;
+    }
+  }
+  return s_opt.nodes >= 1 && s_opt.nodes <= BENCH_MAX_ADDR && s_opt.count > 0 && s_opt.rate >= 0 &&
+         s_opt.rtt_ms >= 0 && s_opt.loss >= 0 && s_opt.loss <= 100;
+}
+
+int main(int argc, char **argv) {
+  if (!bench_parse_options(argc, argv)) {
+    bench_usage(argv[0]);
+    return 2;
+  }
+  bool all = strcmp(s_opt.scenario, "all") == 0;
+  bool ingest = all || strcmp(s_opt.scenario, "ingest") == 0;
+  bool spill = all || strcmp(s_opt.scenario, "spill") == 0;
+  bool replay = all || strcmp(s_opt.scenario, "replay") == 0;
+  bool commands = all || strcmp(s_opt.scenario, "commands") == 0;
+  bool fanout = all || strcmp(s_opt.scenario, "fanout") == 0;
+  bool poll = all || strcmp(s_opt.scenario, "poll") == 0;
+  if (!ingest && !spill && !replay && !commands && !fanout && !poll) {
+    bench_usage(argv[0]);
+    return 2;
+  }
+  if (!getenv("GATEWAY_LOG_LEVEL")) {
+    esp_log_level_set("*", ESP_LOG_ERROR); // overflow warnings would drown the report
+  }
+
+  bench_gateway_config_t config = {
+      .sd_dir = s_opt.sd_dir,
+      .keep = s_opt.keep,
+      .broker_up = !s_opt.keep,
+      .rtt_ms = s_opt.rtt_ms,
+  };
+  ESP_ERROR_CHECK(bench_gateway_start(&config));
+  journal_writer_register_flush_callback(bench_flush_callback);
+
+  if (ingest) {
+    bench_ingest();
+  }
+  if (spill) {
+    bench_spill();
+  }
+  if (replay) {
+    bench_replay();
+  }
+  if (commands) {
+    bench_commands();
+  }
+  if (fanout) {
+    bench_fanout();
+  }
+  if (poll) {
+    bench_poll();
+  }
+  return 0;
+}
@@ -0,0 +1,404 @@
+/*
+ * Synthetic BLE mesh traffic for the host build of the gateway core.
+ *
+ * Generic OnOff status reports from virtual node addresses are posted through uplink_post_onoff(), the same path
+ * the status callback in main.c takes, either generated from a load pattern or replayed from a trace file. The
+ * reports end up at the broker stand-in of mqtt_host.h, optionally with a broker outage in the middle of the run.
+ *
+ * Trace files are plain text, one report per line, '#' starts a comment:
+ *
+ *   <time_ms>,<addr>,<onoff>
+ *
+ * time_ms is relative to the start of the run and must not decrease, addr is a unicast address in decimal or 0x
+ * hexadecimal. --record writes the reports of a run in this format, so a generated run can be replayed exactly.
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_common.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "journal.h"
+#include "journal_writer.h"
+#include "metrics.h"
+#include "mqtt_host.h"
+#include "offline_buffer.h"
+#include "sdkconfig.h"
+#include "uplink.h"
+
+#define TRAFFIC_MAX_LINE 128
+#define TRAFFIC_DRAIN_IDLE_US (2 * 1000000LL)
+
+typedef enum {
+  TRAFFIC_PATTERN_STEADY,  // evenly spaced reports
+  TRAFFIC_PATTERN_POISSON, // exponentially distributed gaps, like independent nodes
+  TRAFFIC_PATTERN_BURST,   // groups of reports from consecutive nodes, like the replies to a group command
+} traffic_pattern_t;
+
+typedef struct {
+  int64_t t_us;
+  uint16_t addr;
+  uint8_t onoff;
+} traffic_event_t;
+
+typedef struct {
+  int nodes;
+  int base_addr;
+  double rate; // reports per second, averaged over the run
+  double duration_s;
+  traffic_pattern_t pattern;
+  int burst_size;
+  double change_prob; // probability that a report carries a new state
+  unsigned seed;
+  const char *trace;
+  const char *record;
+  double speed;
+  int rtt_ms;
+  int64_t outage_at_us;
+  int64_t outage_len_us;
+  const char *sd_dir;
+} traffic_options_t;
+
+static traffic_options_t s_opt = {
+    .nodes = 32,
+    .base_addr = 1,
+    .rate = 200,
+    .duration_s = 10,
+    .pattern = TRAFFIC_PATTERN_POISSON,
+    .burst_size = 16,
+    .change_prob = 1.0,
+    .seed = 1,
+    .speed = 1.0,
+    .rtt_ms = 20,
+    .outage_at_us = -1,
+    .sd_dir = "traffic_sd",
+};
+
+static traffic_event_t *s_events;
+static size_t s_event_count;
+static size_t s_event_capacity;
+
+static bool traffic_add_event(int64_t t_us, uint16_t addr, uint8_t onoff) {
+  if (s_event_count == s_event_capacity) {
+    size_t capacity = s_event_capacity ? s_event_capacity * 2 : 1024;
+    traffic_event_t *events = realloc(s_events, capacity * sizeof(*events));
+    if (!events) {
+      return false;
+    }
+    s_events = events;
+    s_event_capacity = capacity;
+  }
+  s_events[s_event_count++] = (traffic_event_t){.t_us = t_us, .addr = addr, .onoff = onoff};
+  return true;
+}
+
+static double traffic_uniform(void) { return (rand() + 1.0) / ((double)RAND_MAX + 2.0); }
+
+static bool traffic_generate(void) {
+  static uint8_t state[BENCH_MAX_ADDR + 1];
+  int64_t end_us = (int64_t)(s_opt.duration_s * 1e6);
+  double t = 0;
+  int next_node = 0;
+  srand(s_opt.seed);
+  while ((int64_t)t < end_us) {
+    int reports = s_opt.pattern == TRAFFIC_PATTERN_BURST ? s_opt.burst_size : 1;
+    for (int i = 0; i < reports; i++) {
+      int node = s_opt.pattern == TRAFFIC_PATTERN_BURST ? next_node++ % s_opt.nodes : rand() % s_opt.nodes;
+      uint16_t addr = s_opt.base_addr + node;
+      if (traffic_uniform() < s_opt.change_prob) {
+        state[addr] ^= 1;
+      }
+      if (!traffic_add_event((int64_t)t, addr, state[addr])) {
+        return false;
+      }
+    }
+    switch (s_opt.pattern) {
+    case TRAFFIC_PATTERN_STEADY:
+      t += 1e6 / s_opt.rate;
+      break;
+    case TRAFFIC_PATTERN_POISSON:
+      t += -log(traffic_uniform()) * 1e6 / s_opt.rate;
+      break;
+    case TRAFFIC_PATTERN_BURST:
+      t += s_opt.burst_size * 1e6 / s_opt.rate;
+      break;
+    }
+  }
+  return true;
+}
+
+static bool traffic_load_trace(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "cannot open trace %s\n", path);
+    return false;
+  }
+  char line[TRAFFIC_MAX_LINE];
+  int line_no = 0;
+  int64_t last_us = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), f)) {
+    line_no++;
+    char *comment = strchr(line, '#');
+    if (comment) {
+      *comment = '\0';
+    }
+    if (strspn(line, " \t\r\n") == strlen(line)) {
+      continue;
+    }
+    double t_ms;
+    char addr_text[16];
+    unsigned onoff;
+    unsigned long addr;
+    char *end;
+    if (sscanf(line, " %lf , %15[^, \t] , %u", &t_ms, addr_text, &onoff) != 3 ||
+        (addr = strtoul(addr_text, &end, 0), *end != '\0') || addr < 1 || addr > BENCH_MAX_ADDR || onoff > 1 ||
+        t_ms * 1000 < last_us) {
+      fprintf(stderr, "%s:%d: expected <time_ms>,<addr>,<onoff> in time order\n", path, line_no);
+      ok = false;
+      break;
+    }
+    last_us = (int64_t)(t_ms * 1000);
+    ok = traffic_add_event(last_us, addr, onoff);
+  }
+  fclose(f);
+  return ok;
+}
+
+static bool traffic_record(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    fprintf(stderr, "cannot create %s\n", path);
+    return false;
+  }
+  fprintf(f, "# time_ms,addr,onoff\n");
+  for (size_t i = 0; i < s_event_count; i++) {
+    fprintf(f, "%.3f,0x%04x,%u\n", s_events[i].t_us / 1000.0, s_events[i].addr, s_events[i].onoff);
+  }
+  return fclose(f) == 0;
+}
+
+static void *traffic_outage_thread(void *arg) {
+  int64_t start = *(int64_t *)arg;
+  bench_sleep_until(start + s_opt.outage_at_us);
+  mqtt_host_set_broker_up(false);
+  bench_sleep_until(start + s_opt.outage_at_us + s_opt.outage_len_us);
+  mqtt_host_set_broker_up(true);
+  return NULL;
+}
+
+/* Waits until expected messages were delivered or nothing was delivered for a while. */
+static bool traffic_drain(uint32_t expected) {
+  uint32_t delivered = bench_delivered();
+  int64_t idle_since = esp_timer_get_time();
+  while (delivered < expected) {
+    if (bench_wait_delivered(delivered + 1, 100000)) {
+      delivered = bench_delivered();
+      idle_since = esp_timer_get_time();
+    } else if (esp_timer_get_time() - idle_since > TRAFFIC_DRAIN_IDLE_US) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void traffic_run(void) {
+  uplink_stats_t uplink_before, uplink_after;
+  journal_writer_stats_t writer_before, writer_after;
+  uplink_get_stats(&uplink_before);
+  journal_writer_get_stats(&writer_before);
+  bench_run_reset(s_event_count, BENCH_MATCH_POSTS);
+
+  int64_t start = esp_timer_get_time();
+  pthread_t outage;
+  bool has_outage = s_opt.outage_at_us >= 0;
+  if (has_outage) {
+    pthread_create(&outage, NULL, traffic_outage_thread, &start);
+  }
+  for (size_t i = 0; i < s_event_count; i++) {
+    bench_sleep_until(start + (int64_t)(s_events[i].t_us / s_opt.speed));
+    bench_post(s_events[i].addr, s_events[i].onoff);
+  }
+  int64_t posted_us = esp_timer_get_time() - start;
+  if (has_outage) {
+    pthread_join(outage, NULL);
+  }
+
+  // Everything that made it into the ring or was spilled is delivered eventually, unless the offline store had to
+  // drop it. A spilled overflow that finds the writer queue full is counted by both the uplink and the writer.
+  uplink_get_stats(&uplink_after);
+  journal_writer_get_stats(&writer_after);
+  uint32_t lost = (writer_after.dropped - writer_before.dropped) + (writer_after.refused - writer_before.refused);
+#if CONFIG_GATEWAY_UPLINK_OVERFLOW_SPILL
+  lost -= uplink_after.dropped - uplink_before.dropped;
+#endif
+  uint32_t expected = (uplink_after.enqueued - uplink_before.enqueued) + (uplink_after.spilled - uplink_before.spilled);
+  expected = expected > lost ? expected - lost : 0;
+  bool complete = traffic_drain(expected);
+  uplink_get_stats(&uplink_after);
+  journal_writer_get_stats(&writer_after);
+  int64_t elapsed = bench_last_delivery_us() - start;
+
+  printf("  posted %zu reports in %.2f s (%.0f reports/s offered)\n", s_event_count, posted_us / 1e6,
+         s_event_count * 1e6 / (posted_us > 0 ? posted_us : 1));
+  printf("  %u suppressed as unchanged, %u enqueued, %u overflowed (%u spilled, %u dropped), ring high watermark "
+         "%u\n",
+         uplink_after.suppressed - uplink_before.suppressed, uplink_after.enqueued - uplink_before.enqueued,
+         uplink_after.overflows - uplink_before.overflows, uplink_after.spilled - uplink_before.spilled,
+         uplink_after.dropped - uplink_before.dropped, uplink_after.high_watermark);
+  printf("  delivered %u of %u expected, %u lost in the offline store%s\n", bench_delivered(), expected, lost,
+         complete ? "" : ", the rest is still in the backlog");
+  printf("  offline store: %zu messages in RAM, %ld bytes on SD, %u SD group commits\n", offline_buffer_count(),
+         journal_size(), writer_after.flushes - writer_before.flushes);
+  printf("  throughput                 %.0f msgs/s\n", bench_delivered() * 1e6 / (elapsed > 0 ? elapsed : 1));
+  if (has_outage) {
+    printf("  replayed and live messages of a node interleave after the outage, the latency is approximate\n");
+  }
+  bench_print_latency("post -> broker");
+#if CONFIG_GATEWAY_METRICS
+  char report[METRICS_REPORT_MAX_LEN];
+  if (metrics_format(report, sizeof(report)) > 0) {
+    printf("  metrics %s\n", report);
+  }
+#endif
+}
+
+static void traffic_usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  --nodes N              virtual nodes (32)\n"
+          "  --base-addr A          first unicast address (1)\n"
+          "  --rate R               reports per second (200)\n"
+          "  --duration S           length of a generated run in seconds (10)\n"
+          "  --pattern P            steady, poisson or burst (poisson)\n"
+          "  --burst-size N         reports per burst (16)\n"
+          "  --change-prob P        probability that a report changes the node state (1.0)\n"
+          "  --seed N               random seed (1)\n"
+          "  --trace FILE           replay FILE instead of generating reports\n"
+          "  --speed X              replay speed factor (1.0)\n"
+          "  --record FILE          write the reports of this run as a trace\n"
+          "  --outage AT_MS:LEN_MS  take the broker down for LEN_MS, AT_MS into the run\n"
+          "  --rtt-ms N             broker round trip time (20)\n"
+          "  --sd-dir DIR           SD card directory (traffic_sd)\n",
+          name);
+}
+
+static bool traffic_parse_options(int argc, char **argv) {
+  static const struct option options[] = {
+      {"nodes", required_argument, NULL, 'n'},       {"base-addr", required_argument, NULL, 'a'},
+      {"rate", required_argument, NULL, 'r'},        {"duration", required_argument, NULL, 'D'},
+      {"pattern", required_argument, NULL, 'p'},     {"burst-size", required_argument, NULL, 'b'},
+      {"change-prob", required_argument, NULL, 'P'}, {"seed", required_argument, NULL, 'S'},
+      {"trace", required_argument, NULL, 'T'},       {"speed", required_argument, NULL, 'x'},
+      {"record", required_argument, NULL, 'R'},      {"outage", required_argument, NULL, 'o'},
+      {"rtt-ms", required_argument, NULL, 't'},      {"sd-dir", required_argument, NULL, 'd'},
+      {"help", no_argument, NULL, 'h'},              {NULL, 0, NULL, 0},
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "n:a:r:D:p:b:P:S:T:x:R:o:t:d:h", options, NULL)) != -1) {
+    switch (c) {
+    case 'n':
+      s_opt.nodes = atoi(optarg);
+      break;
+    case 'a':
+      s_opt.base_addr = strtol(optarg, NULL, 0);
+      break;
+    case 'r':
+      s_opt.rate = atof(optarg);
+      break;
+    case 'D':
+      s_opt.duration_s = atof(optarg);
+      break;
+    case 'p':
+      if (strcmp(optarg, "steady") == 0) {
+        s_opt.pattern = TRAFFIC_PATTERN_STEADY;
+      } else if (strcmp(optarg, "poisson") == 0) {
+        s_opt.pattern = TRAFFIC_PATTERN_POISSON;
+      } else if (strcmp(optarg, "burst") == 0) {
+        s_opt.pattern = TRAFFIC_PATTERN_BURST;
+      } else {
+        return false;
+      }
+      break;
+    case 'b':
+      s_opt.burst_size = atoi(optarg);
+      break;
+    case 'P':
+      s_opt.change_prob = atof(optarg);
+      break;
+    case 'S':
+      s_opt.seed = strtoul(optarg, NULL, 0);
+      break;
+    case 'T':
+      s_opt.trace = optarg;
+      break;
+    case 'x':
+      s_opt.speed = atof(optarg);
+      break;
+    case 'R':
+      s_opt.record = optarg;
+      break;
+    case 'o': {
+      double at_ms, len_ms;
+      if (sscanf(optarg, "%lf:%lf", &at_ms, &len_ms) != 2 || at_ms < 0 || len_ms < 0) {
+        return false;
+      }
+      s_opt.outage_at_us = (int64_t)(at_ms * 1000);
+      s_opt.outage_len_us = (int64_t)(len_ms * 1000);
+      break;
+    }
+    case 't':
+      s_opt.rtt_ms = atoi(optarg);
+      break;
+    case 'd':
+      s_opt.sd_dir = optarg;
+      break;
+    default:
+      return false;
+    }
+  }
+  return s_opt.nodes >= 1 && s_opt.base_addr >= 1 && s_opt.base_addr + s_opt.nodes - 1 <= BENCH_MAX_ADDR &&
+         s_opt.rate > 0 && s_opt.duration_s > 0 && s_opt.burst_size >= 1 && s_opt.change_prob >= 0 &&
+         s_opt.change_prob <= 1 && s_opt.speed > 0 && s_opt.rtt_ms >= 0;
+}
+
+int main(int argc, char **argv) {
+  if (!traffic_parse_options(argc, argv)) {
+    traffic_usage(argv[0]);
+    return 2;
+  }
+  if (!(s_opt.trace ? traffic_load_trace(s_opt.trace) : traffic_generate())) {
+    return 1;
+  }
+  if (s_opt.record && !traffic_record(s_opt.record)) {
+    return 1;
+  }
+  if (!getenv("GATEWAY_LOG_LEVEL")) {
+    esp_log_level_set("*", ESP_LOG_ERROR);
+  }
+
+  bench_gateway_config_t config = {
+      .sd_dir = s_opt.sd_dir,
+      .broker_up = true,
+      .rtt_ms = s_opt.rtt_ms,
+  };
+  ESP_ERROR_CHECK(bench_gateway_start(&config));
+  bench_set_broker(true);
+
+  if (s_opt.trace) {
+    printf("trace %s: %zu reports, speed %.2fx, broker rtt %d ms\n", s_opt.trace, s_event_count, s_opt.speed,
+           s_opt.rtt_ms);
+  } else {
+    static const char *patterns[] = {"steady", "poisson", "burst"};
+    printf("%s: %zu reports from %d nodes at %.0f/s for %.1f s, change probability %.2f, broker rtt %d ms\n",
+           patterns[s_opt.pattern], s_event_count, s_opt.nodes, s_opt.rate, s_opt.duration_s, s_opt.change_prob,
+           s_opt.rtt_ms);
+  }
+  traffic_run();
+  return 0;
+}
@@ -0,0 +1,50 @@
+#ifndef _HOST_ESP_BLE_MESH_DEFS_H_
+#define _HOST_ESP_BLE_MESH_DEFS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/* The parts of the ESP-BLE-MESH definitions the gateway core uses, with the values of ESP-IDF. */
+
+#define ESP_BLE_MESH_ADDR_UNASSIGNED 0x0000
+#define ESP_BLE_MESH_ADDR_ALL_NODES 0xFFFF
+#define ESP_BLE_MESH_ADDR_IS_UNICAST(addr) ((addr) && (addr) < 0x8000)
+#define ESP_BLE_MESH_ADDR_IS_GROUP(addr) ((addr) >= 0xC000 && (addr) <= 0xFF00)
+
+#define ESP_BLE_MESH_KEY_UNUSED 0xFFFF
+#define ESP_BLE_MESH_TTL_DEFAULT 0xFF
+
+#define ESP_BLE_MESH_MODEL_ID_GEN_ONOFF_SRV 0x1000
+
+#define ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET 0x8201
+#define ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET 0x8202
+#define ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET_UNACK 0x8203
+#define ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_STATUS 0x8204
+
+typedef uint32_t esp_ble_mesh_opcode_t;
+
+typedef struct esp_ble_mesh_model esp_ble_mesh_model_t;
+
+typedef struct {
+  uint16_t net_idx;
+  uint16_t app_idx;
+  uint16_t addr;
+  uint16_t recv_dst;
+  int8_t recv_rssi;
+  uint32_t recv_op;
+  uint8_t recv_ttl;
+  uint8_t send_rel;
+  uint8_t send_ttl;
+} esp_ble_mesh_msg_ctx_t;
+
+typedef struct {
+  esp_ble_mesh_opcode_t opcode;
+  esp_ble_mesh_model_t *model;
+  esp_ble_mesh_msg_ctx_t ctx;
+  int32_t msg_timeout;
+  uint8_t msg_role;
+} esp_ble_mesh_client_common_param_t;
+
+#endif // _HOST_ESP_BLE_MESH_DEFS_H_
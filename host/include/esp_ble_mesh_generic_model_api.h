@@ -0,0 +1,58 @@
+#ifndef _HOST_ESP_BLE_MESH_GENERIC_MODEL_API_H_
+#define _HOST_ESP_BLE_MESH_GENERIC_MODEL_API_H_
+
+#include "esp_ble_mesh_defs.h"
+
+/* Generic OnOff part of the Generic Client API, served by the simulated mesh of mesh_host.h. */
+
+typedef struct {
+  bool op_en;
+  uint8_t onoff;
+  uint8_t tid;
+  uint8_t trans_time;
+  uint8_t delay;
+} esp_ble_mesh_gen_onoff_set_t;
+
+typedef union {
+  esp_ble_mesh_gen_onoff_set_t onoff_set;
+} esp_ble_mesh_generic_client_set_state_t;
+
+typedef union {
+  uint8_t unused; // Generic OnOff Get has no parameters
+} esp_ble_mesh_generic_client_get_state_t;
+
+typedef struct {
+  bool op_en;
+  uint8_t present_onoff;
+  uint8_t target_onoff;
+  uint8_t remain_time;
+} esp_ble_mesh_gen_onoff_status_cb_t;
+
+typedef union {
+  esp_ble_mesh_gen_onoff_status_cb_t onoff_status;
+} esp_ble_mesh_gen_client_status_cb_t;
+
+typedef struct {
+  int error_code;
+  esp_ble_mesh_client_common_param_t *params;
+  esp_ble_mesh_gen_client_status_cb_t status_cb;
+} esp_ble_mesh_generic_client_cb_param_t;
+
+typedef enum {
+  ESP_BLE_MESH_GENERIC_CLIENT_GET_STATE_EVT,
+  ESP_BLE_MESH_GENERIC_CLIENT_SET_STATE_EVT,
+  ESP_BLE_MESH_GENERIC_CLIENT_PUBLISH_EVT,
+  ESP_BLE_MESH_GENERIC_CLIENT_TIMEOUT_EVT,
+  ESP_BLE_MESH_GENERIC_CLIENT_EVT_MAX,
+} esp_ble_mesh_generic_client_cb_event_t;
+
+typedef void (*esp_ble_mesh_generic_client_cb_t)(esp_ble_mesh_generic_client_cb_event_t event,
+                                                 esp_ble_mesh_generic_client_cb_param_t *param);
+
+esp_err_t esp_ble_mesh_register_generic_client_callback(esp_ble_mesh_generic_client_cb_t callback);
+esp_err_t esp_ble_mesh_generic_client_get_state(esp_ble_mesh_client_common_param_t *params,
+                                                esp_ble_mesh_generic_client_get_state_t *get_state);
+esp_err_t esp_ble_mesh_generic_client_set_state(esp_ble_mesh_client_common_param_t *params,
+                                                esp_ble_mesh_generic_client_set_state_t *set_state);
+
+#endif // _HOST_ESP_BLE_MESH_GENERIC_MODEL_API_H_
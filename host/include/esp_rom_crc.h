@@ -0,0 +1,9 @@
+#ifndef _HOST_ESP_ROM_CRC_H_
+#define _HOST_ESP_ROM_CRC_H_
+
+#include <stdint.h>
+
+/* Same result and chaining behaviour as the ROM function: esp_rom_crc32_le(0, buf, len) is the standard CRC-32. */
+uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len);
+
+#endif // _HOST_ESP_ROM_CRC_H_
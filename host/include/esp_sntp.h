@@ -0,0 +1,23 @@
+#ifndef _HOST_ESP_SNTP_H_
+#define _HOST_ESP_SNTP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+/* The clock of the development machine is set already, the SNTP client only remembers that it was started. */
+
+typedef enum {
+  ESP_SNTP_OPMODE_POLL,
+  ESP_SNTP_OPMODE_LISTENONLY,
+} esp_sntp_operatingmode_t;
+
+typedef void (*sntp_sync_time_cb_t)(struct timeval *tv);
+
+void esp_sntp_setoperatingmode(esp_sntp_operatingmode_t operating_mode);
+void esp_sntp_setservername(uint8_t idx, const char *server);
+void sntp_set_time_sync_notification_cb(sntp_sync_time_cb_t callback);
+void esp_sntp_init(void);
+bool esp_sntp_enabled(void);
+
+#endif // _HOST_ESP_SNTP_H_
@@ -0,0 +1,11 @@
+#ifndef _HOST_ESP_TIMER_H_
+#define _HOST_ESP_TIMER_H_
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/* Microseconds since the process started. */
+int64_t esp_timer_get_time(void);
+
+#endif // _HOST_ESP_TIMER_H_
@@ -0,0 +1,41 @@
+#ifndef _HOST_FREERTOS_H_
+#define _HOST_FREERTOS_H_
+
+/*
+ * Minimal FreeRTOS API on top of POSIX threads, enough to run the gateway pipeline on a development machine. The
+ * tick rate is 1 kHz so that tick arithmetic in the gateway code keeps its meaning.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define configTICK_RATE_HZ 1000
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS (1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(((uint64_t)(ms) * configTICK_RATE_HZ) / 1000))
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+
+#define BIT0 0x00000001
+#define BIT1 0x00000002
+#define BIT2 0x00000004
+#define BIT3 0x00000008
+#define BIT4 0x00000010
+
+#define configASSERT(x)                                                                                                \
+  do {                                                                                                                 \
+    if (!(x)) {                                                                                                        \
+      host_freertos_assert(__FILE__, __LINE__, #x);                                                                    \
+    }                                                                                                                  \
+  } while (0)
+
+void host_freertos_assert(const char *file, int line, const char *expr);
+
+#endif // _HOST_FREERTOS_H_
@@ -0,0 +1,38 @@
+#ifndef _HOST_MESH_HOST_H_
+#define _HOST_MESH_HOST_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/*
+ * Control side of the simulated mesh behind the host Generic Client API.
+ *
+ * Every node address answers: an acknowledged Set or a Get is answered with a Generic OnOff Status after the
+ * configured latency, from a mesh thread, like ESP-BLE-MESH raises client events from the BTC task. A message is
+ * lost with the configured probability and then raises ESP_BLE_MESH_GENERIC_CLIENT_TIMEOUT_EVT once its
+ * msg_timeout has passed. Like the real client, a second acknowledged message with the same opcode to a node that
+ * has not answered yet is refused, and so is any acknowledged message while tx_limit of them are outstanding.
+ *
+ * A Set to a group address reaches the nodes subscribed with mesh_host_subscribe(), each one lost independently.
+ * With publication on, a node whose state a Set changed publishes a Generic OnOff Status after the latency.
+ */
+
+void mesh_host_set_latency_ms(uint32_t latency_ms);
+/* Probability in [0, 1] that a message or its answer is lost. */
+void mesh_host_set_loss(double loss);
+void mesh_host_set_tx_limit(uint32_t limit);
+void mesh_host_set_publish(bool publish);
+esp_err_t mesh_host_subscribe(uint16_t node, uint16_t group);
+/* State of a node as it was last set, 0 for nodes that were never set. */
+uint8_t mesh_host_node_state(uint16_t addr);
+/* Set messages received by nodes (acknowledged and unacknowledged) and messages sent in total since start. */
+uint32_t mesh_host_sets_received(void);
+uint32_t mesh_host_messages_sent(void);
+/* Calls the callback for the Generic OnOff Status that node addr publishes by itself. */
+void mesh_host_publish_status(uint16_t addr, uint8_t onoff);
+/* Changes the state of node addr without a publication, like a local switch whose publication got lost. */
+void mesh_host_set_node_state(uint16_t addr, uint8_t onoff);
+
+#endif // _HOST_MESH_HOST_H_
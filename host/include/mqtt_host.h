@@ -0,0 +1,27 @@
+#ifndef _HOST_MQTT_HOST_H_
+#define _HOST_MQTT_HOST_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Control side of the in-process broker stand-in behind the host esp-mqtt client.
+ *
+ * Every publish is held in the client outbox for the configured round trip time and is then delivered: the publish
+ * hook sees it and the client raises MQTT_EVENT_PUBLISHED for it. Taking the broker down raises
+ * MQTT_EVENT_DISCONNECTED, bringing it up again raises MQTT_EVENT_CONNECTED and resends what is left in the outbox,
+ * like esp-mqtt does. The outbox is only dropped when the client is destroyed.
+ */
+
+/* Called from the broker thread for every delivered message. Times are esp_timer_get_time() microseconds. */
+typedef void (*mqtt_host_publish_hook_t)(const char *topic, const char *data, int len, int retain, int64_t queued_us,
+                                         int64_t delivered_us, void *arg);
+
+void mqtt_host_set_broker_up(bool up);
+void mqtt_host_set_rtt_ms(uint32_t rtt_ms);
+void mqtt_host_set_publish_hook(mqtt_host_publish_hook_t hook, void *arg);
+/* Number of messages delivered since the process started. */
+uint32_t mqtt_host_delivered(void);
+
+#endif // _HOST_MQTT_HOST_H_
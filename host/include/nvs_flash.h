@@ -0,0 +1,10 @@
+#ifndef _HOST_NVS_FLASH_H_
+#define _HOST_NVS_FLASH_H_
+
+#include "nvs.h"
+
+/* The host NVS lives in process memory, it starts out empty on every run. */
+esp_err_t nvs_flash_init(void);
+esp_err_t nvs_flash_erase(void);
+
+#endif // _HOST_NVS_FLASH_H_
@@ -0,0 +1,10 @@
+#ifndef _HOST_SD_HOST_H_
+#define _HOST_SD_HOST_H_
+
+/* Directory that stands in for the SD card mount point. Must be set before sd_init(), defaults to "sdcard" in the
+ * working directory. */
+void sd_host_set_root(const char *path);
+/* Deletes every file in the SD card directory. */
+void sd_host_wipe(void);
+
+#endif // _HOST_SD_HOST_H_
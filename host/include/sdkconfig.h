@@ -0,0 +1,201 @@
+#ifndef _HOST_SDKCONFIG_H_
+#define _HOST_SDKCONFIG_H_
+
+/*
+ * Gateway options for host builds. Mirrors the defaults of main/Kconfig.projbuild and has to be kept in sync with
+ * it. Every value can be overridden from the compiler command line, e.g. -DCONFIG_GATEWAY_UPLINK_RING_SIZE=256.
+ * Choices are selected with the HOST_* switches below.
+ */
+
+#ifndef CONFIG_GATEWAY_OFFLINE_RAM_BUDGET
+#define CONFIG_GATEWAY_OFFLINE_RAM_BUDGET 16384
+#endif
+
+#ifndef CONFIG_GATEWAY_FACTORY_RESET_GPIO
+#define CONFIG_GATEWAY_FACTORY_RESET_GPIO -1
+#endif
+
+#ifndef CONFIG_GATEWAY_WIFI_BACKOFF_MIN_MS
+#define CONFIG_GATEWAY_WIFI_BACKOFF_MIN_MS 500
+#endif
+#ifndef CONFIG_GATEWAY_WIFI_BACKOFF_MAX_MS
+#define CONFIG_GATEWAY_WIFI_BACKOFF_MAX_MS 60000
+#endif
+
+/* Offline journal */
+#ifndef CONFIG_GATEWAY_JOURNAL_WRITE_BUFFER_SIZE
+#define CONFIG_GATEWAY_JOURNAL_WRITE_BUFFER_SIZE 4096
+#endif
+#ifndef CONFIG_GATEWAY_JOURNAL_SEGMENT_SIZE_KB
+#define CONFIG_GATEWAY_JOURNAL_SEGMENT_SIZE_KB 64
+#endif
+#ifndef CONFIG_GATEWAY_JOURNAL_MAX_SIZE_KB
+#define CONFIG_GATEWAY_JOURNAL_MAX_SIZE_KB 262144
+#endif
+#if defined(HOST_JOURNAL_DROP_NEW)
+#define CONFIG_GATEWAY_JOURNAL_DROP_NEW 1
+#else
+#define CONFIG_GATEWAY_JOURNAL_EVICT_OLDEST 1
+#endif
+#ifndef CONFIG_GATEWAY_JOURNAL_QUEUE_LEN
+#define CONFIG_GATEWAY_JOURNAL_QUEUE_LEN 32
+#endif
+#ifndef CONFIG_GATEWAY_JOURNAL_FLUSH_INTERVAL_MS
+#define CONFIG_GATEWAY_JOURNAL_FLUSH_INTERVAL_MS 200
+#endif
+#ifndef CONFIG_GATEWAY_JOURNAL_FLUSH_MAX_RECORDS
+#define CONFIG_GATEWAY_JOURNAL_FLUSH_MAX_RECORDS 32
+#endif
+#if defined(HOST_JOURNAL_FSYNC_NEVER)
+#define CONFIG_GATEWAY_JOURNAL_FSYNC_NEVER 1
+#elif defined(HOST_JOURNAL_FSYNC_PERIODIC)
+#define CONFIG_GATEWAY_JOURNAL_FSYNC_PERIODIC 1
+#ifndef CONFIG_GATEWAY_JOURNAL_FSYNC_PERIOD_MS
+#define CONFIG_GATEWAY_JOURNAL_FSYNC_PERIOD_MS 5000
+#endif
+#else
+#define CONFIG_GATEWAY_JOURNAL_FSYNC_PER_BATCH 1
+#endif
+
+/* Backlog replay */
+#ifndef CONFIG_GATEWAY_REPLAY_WINDOW
+#define CONFIG_GATEWAY_REPLAY_WINDOW 16
+#endif
+#ifndef CONFIG_GATEWAY_REPLAY_MAX_BYTES_IN_FLIGHT
+#define CONFIG_GATEWAY_REPLAY_MAX_BYTES_IN_FLIGHT 8192
+#endif
+#ifndef CONFIG_GATEWAY_REPLAY_MAX_OUTBOX_SIZE
+#define CONFIG_GATEWAY_REPLAY_MAX_OUTBOX_SIZE 16384
+#endif
+#ifndef CONFIG_GATEWAY_REPLAY_CHECKPOINT_EVERY
+#define CONFIG_GATEWAY_REPLAY_CHECKPOINT_EVERY 32
+#endif
+#if defined(HOST_COMPACT_LATEST)
+#define CONFIG_GATEWAY_COMPACT_LATEST 1
+#define CONFIG_GATEWAY_COMPACT 1
+#elif defined(HOST_COMPACT_TRANSITIONS)
+#define CONFIG_GATEWAY_COMPACT_TRANSITIONS 1
+#define CONFIG_GATEWAY_COMPACT 1
+#else
+#define CONFIG_GATEWAY_COMPACT_OFF 1
+#endif
+
+/* Uplink */
+#ifndef CONFIG_GATEWAY_TOPIC_TEMPLATE
+#define CONFIG_GATEWAY_TOPIC_TEMPLATE "ble_mesh/%04x"
+#endif
+#ifndef CONFIG_GATEWAY_TOPIC_TABLE_SIZE
+#define CONFIG_GATEWAY_TOPIC_TABLE_SIZE 256
+#endif
+#ifndef CONFIG_GATEWAY_UPLINK_RING_SIZE
+#define CONFIG_GATEWAY_UPLINK_RING_SIZE 64
+#endif
+#if defined(HOST_UPLINK_OVERFLOW_DROP)
+#define CONFIG_GATEWAY_UPLINK_OVERFLOW_DROP 1
+#else
+#define CONFIG_GATEWAY_UPLINK_OVERFLOW_SPILL 1
+#endif
+#ifndef CONFIG_GATEWAY_NODE_SHADOW_SIZE
+#define CONFIG_GATEWAY_NODE_SHADOW_SIZE 256
+#endif
+#if !defined(HOST_NO_SUPPRESS_UNCHANGED) && !defined(CONFIG_GATEWAY_SUPPRESS_UNCHANGED)
+#define CONFIG_GATEWAY_SUPPRESS_UNCHANGED 1
+#endif
+#ifndef CONFIG_GATEWAY_SNAPSHOT_INTERVAL_S
+#define CONFIG_GATEWAY_SNAPSHOT_INTERVAL_S 300
+#endif
+#if defined(HOST_UPLINK_TIMESTAMP) && !defined(CONFIG_GATEWAY_UPLINK_TIMESTAMP)
+#define CONFIG_GATEWAY_UPLINK_TIMESTAMP 1
+#endif
+#ifndef CONFIG_GATEWAY_SNTP_SERVER
+#define CONFIG_GATEWAY_SNTP_SERVER "pool.ntp.org"
+#endif
+#if defined(HOST_PAYLOAD_JSON)
+#define CONFIG_GATEWAY_PAYLOAD_JSON 1
+#elif defined(HOST_PAYLOAD_CBOR)
+#define CONFIG_GATEWAY_PAYLOAD_CBOR 1
+#else
+#define CONFIG_GATEWAY_PAYLOAD_TEXT 1
+#endif
+#if defined(HOST_BATCH) && !defined(CONFIG_GATEWAY_BATCH)
+#define CONFIG_GATEWAY_BATCH 1
+#endif
+#if CONFIG_GATEWAY_BATCH
+#ifndef CONFIG_GATEWAY_BATCH_TOPIC
+#define CONFIG_GATEWAY_BATCH_TOPIC "ble_mesh/batch"
+#endif
+#ifndef CONFIG_GATEWAY_BATCH_MAX_BYTES
+#define CONFIG_GATEWAY_BATCH_MAX_BYTES 1024
+#endif
+#ifndef CONFIG_GATEWAY_BATCH_MAX_DELAY_MS
+#define CONFIG_GATEWAY_BATCH_MAX_DELAY_MS 50
+#endif
+#endif
+
+/* Mesh TX */
+// Messages go to the simulated mesh of mesh_host.h.
+#ifndef CONFIG_GATEWAY_MESH_TX_WINDOW
+#define CONFIG_GATEWAY_MESH_TX_WINDOW 6
+#endif
+#ifndef CONFIG_GATEWAY_MESH_TX_INTERVAL_MS
+#define CONFIG_GATEWAY_MESH_TX_INTERVAL_MS 20
+#endif
+#ifndef CONFIG_GATEWAY_MESH_TX_TIMEOUT_MS
+#define CONFIG_GATEWAY_MESH_TX_TIMEOUT_MS 2000
+#endif
+#ifndef CONFIG_GATEWAY_MESH_TX_RETRIES
+#define CONFIG_GATEWAY_MESH_TX_RETRIES 2
+#endif
+#ifndef CONFIG_GATEWAY_MESH_TX_DESTINATIONS
+#define CONFIG_GATEWAY_MESH_TX_DESTINATIONS 256
+#endif
+
+/* Bulk commands */
+#ifndef CONFIG_GATEWAY_GROUP_TABLE_SIZE
+#define CONFIG_GATEWAY_GROUP_TABLE_SIZE 32
+#endif
+#ifndef CONFIG_GATEWAY_FANOUT_WINDOW_MS
+#define CONFIG_GATEWAY_FANOUT_WINDOW_MS 3000
+#endif
+#ifndef CONFIG_GATEWAY_FANOUT_JOBS
+#define CONFIG_GATEWAY_FANOUT_JOBS 4
+#endif
+
+/* State polling */
+#ifndef CONFIG_GATEWAY_POLL
+#define CONFIG_GATEWAY_POLL 1
+#endif
+#ifndef CONFIG_GATEWAY_POLL_WINDOW
+#define CONFIG_GATEWAY_POLL_WINDOW 4
+#endif
+#ifndef CONFIG_GATEWAY_POLL_MIN_INTERVAL_S
+#define CONFIG_GATEWAY_POLL_MIN_INTERVAL_S 30
+#endif
+#ifndef CONFIG_GATEWAY_POLL_MAX_INTERVAL_S
+#define CONFIG_GATEWAY_POLL_MAX_INTERVAL_S 600
+#endif
+
+/* Downlink */
+// Not part of the host build, the benchmark submits commands to the mesh TX scheduler and the fanout directly.
+#ifndef CONFIG_GATEWAY_DOWNLINK_TOPIC
+#define CONFIG_GATEWAY_DOWNLINK_TOPIC "ble_mesh/+/set"
+#endif
+#ifndef CONFIG_GATEWAY_DOWNLINK_BULK_TOPIC
+#define CONFIG_GATEWAY_DOWNLINK_BULK_TOPIC "ble_mesh/bulk/set"
+#endif
+#ifndef CONFIG_GATEWAY_DOWNLINK_GROUP_TOPIC
+#define CONFIG_GATEWAY_DOWNLINK_GROUP_TOPIC "ble_mesh/group/+/members"
+#endif
+
+/* Metrics */
+#if !defined(HOST_NO_METRICS) && !defined(CONFIG_GATEWAY_METRICS)
+#define CONFIG_GATEWAY_METRICS 1
+#endif
+#ifndef CONFIG_GATEWAY_METRICS_TOPIC
+#define CONFIG_GATEWAY_METRICS_TOPIC "ble_mesh/gateway/metrics"
+#endif
+#ifndef CONFIG_GATEWAY_METRICS_INTERVAL_S
+#define CONFIG_GATEWAY_METRICS_INTERVAL_S 60
+#endif
+
+#endif // _HOST_SDKCONFIG_H_
@@ -0,0 +1,300 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_ble_mesh_generic_model_api.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mesh_host.h"
+
+/*
+ * Generic Client API backed by a simulated mesh, see mesh_host.h. Answers and timeouts are raised from a mesh
+ * thread in the order they fall due.
+ */
+
+static const char *TAG = "MESH_HOST";
+
+#define MESH_HOST_MAX_ADDR 0x10000
+
+typedef struct host_pending {
+  struct host_pending *next;
+  esp_ble_mesh_client_common_param_t params;
+  esp_ble_mesh_generic_client_cb_event_t event;
+  int64_t due_us;
+  bool acked; // answer to an acknowledged message, counts against tx_limit
+} host_pending_t;
+
+typedef struct {
+  uint16_t group;
+  uint16_t node;
+} host_subscription_t;
+
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_cond;
+static pthread_once_t s_once = PTHREAD_ONCE_INIT;
+static pthread_t s_thread;
+static esp_ble_mesh_generic_client_cb_t s_callback;
+static host_pending_t *s_pending; // sorted by due_us
+static uint32_t s_outstanding;
+static uint32_t s_latency_ms = 30;
+static double s_loss;
+static uint32_t s_tx_limit = 10;
+static uint32_t s_sets_received;
+static uint32_t s_messages_sent;
+static uint64_t s_rng = 0x9E3779B97F4A7C15ULL;
+static uint8_t s_state[MESH_HOST_MAX_ADDR];
+static bool s_publish;
+static host_subscription_t *s_subscriptions;
+static size_t s_subscription_count;
+
+/* Called with s_lock held. */
+static double mesh_host_random(void) {
+  s_rng ^= s_rng >> 12;
+  s_rng ^= s_rng << 25;
+  s_rng ^= s_rng >> 27;
+  return (double)((s_rng * 0x2545F4914F6CDD1DULL) >> 11) / (double)(1ULL << 53);
+}
+
+/* Called with s_lock held. */
+static void mesh_host_insert(host_pending_t *pending) {
+  host_pending_t **link = &s_pending;
+  while (*link && (*link)->due_us <= pending->due_us) {
+    link = &(*link)->next;
+  }
+  pending->next = *link;
+  *link = pending;
+  pthread_cond_broadcast(&s_cond);
+}
+
+static void mesh_host_dispatch(esp_ble_mesh_generic_client_cb_event_t event, esp_ble_mesh_client_common_param_t *params,
+                               uint8_t onoff) {
+  esp_ble_mesh_generic_client_cb_param_t param = {
+      .params = params,
+      .status_cb.onoff_status.present_onoff = onoff,
+  };
+  if (s_callback) {
+    s_callback(event, &param);
+  }
+}
+
+static void *mesh_host_thread(void *arg) {
+  pthread_mutex_lock(&s_lock);
+  for (;;) {
+    host_pending_t *pending = s_pending;
+    if (!pending) {
+      pthread_cond_wait(&s_cond, &s_lock);
+      continue;
+    }
+    int64_t now = esp_timer_get_time();
+    if (pending->due_us > now) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      int64_t wait_us = pending->due_us - now;
+      deadline.tv_sec += wait_us / 1000000;
+      deadline.tv_nsec += (wait_us % 1000000) * 1000;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&s_cond, &s_lock, &deadline);
+      continue;
+    }
+    s_pending = pending->next;
+    if (pending->acked) {
+      s_outstanding--;
+    }
+    uint8_t onoff = s_state[pending->params.ctx.addr];
+    pthread_mutex_unlock(&s_lock);
+    mesh_host_dispatch(pending->event, &pending->params, onoff);
+    free(pending);
+    pthread_mutex_lock(&s_lock);
+  }
+  return NULL;
+}
+
+static void mesh_host_init_once(void) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&s_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_create(&s_thread, NULL, mesh_host_thread, NULL);
+  pthread_detach(s_thread);
+}
+
+/* Queues an event for the mesh thread. Called with s_lock held. */
+static bool mesh_host_schedule(const esp_ble_mesh_client_common_param_t *params,
+                               esp_ble_mesh_generic_client_cb_event_t event, int64_t delay_ms, bool acked) {
+  host_pending_t *pending = calloc(1, sizeof(*pending));
+  if (!pending) {
+    return false;
+  }
+  pending->params = *params;
+  pending->event = event;
+  pending->acked = acked;
+  pending->due_us = esp_timer_get_time() + delay_ms * 1000;
+  if (acked) {
+    s_outstanding++;
+  }
+  mesh_host_insert(pending);
+  return true;
+}
+
+static int64_t mesh_host_latency_ms(void) { return s_latency_ms / 2 + mesh_host_random() * s_latency_ms; }
+
+/* A Set that reached node: applies it and, if publication is on and the state changed, publishes the new state.
+ * Called with s_lock held. */
+static void mesh_host_apply(uint16_t node, uint8_t onoff) {
+  bool changed = s_state[node] != onoff;
+  s_state[node] = onoff;
+  s_sets_received++;
+  if (changed && s_publish && mesh_host_random() >= s_loss) {
+    esp_ble_mesh_client_common_param_t params = {
+        .opcode = ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_STATUS,
+        .ctx.addr = node,
+    };
+    mesh_host_schedule(&params, ESP_BLE_MESH_GENERIC_CLIENT_PUBLISH_EVT, mesh_host_latency_ms(), false);
+  }
+}
+
+/* Sends one message. A node applies a Set when the message gets through, even if its answer is then lost. A Set to
+ * a group reaches each member independently. */
+static esp_err_t mesh_host_send(esp_ble_mesh_client_common_param_t *params, bool set, uint8_t onoff) {
+  pthread_once(&s_once, mesh_host_init_once);
+  uint16_t addr = params->ctx.addr;
+  bool acked = params->opcode != ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET_UNACK;
+  pthread_mutex_lock(&s_lock);
+  if (acked) {
+    if (s_outstanding >= s_tx_limit) {
+      pthread_mutex_unlock(&s_lock);
+      return ESP_FAIL;
+    }
+    for (host_pending_t *p = s_pending; p; p = p->next) {
+      if (p->params.ctx.addr == addr && p->params.opcode == params->opcode) {
+        pthread_mutex_unlock(&s_lock);
+        ESP_LOGD(TAG, "Busy, 0x%04x has not answered yet", addr);
+        return ESP_FAIL;
+      }
+    }
+  }
+  s_messages_sent++;
+  bool lost = false;
+  if (ESP_BLE_MESH_ADDR_IS_UNICAST(addr)) {
+    lost = mesh_host_random() < s_loss;
+    if (set && !lost) {
+      mesh_host_apply(addr, onoff);
+    }
+  } else if (set) {
+    for (size_t i = 0; i < s_subscription_count; i++) {
+      if ((s_subscriptions[i].group == addr || addr == ESP_BLE_MESH_ADDR_ALL_NODES) &&
+          mesh_host_random() >= s_loss) {
+        mesh_host_apply(s_subscriptions[i].node, onoff);
+      }
+    }
+  }
+  esp_err_t err = ESP_OK;
+  if (acked) {
+    // an answer can be lost as well as the message itself
+    lost = lost || mesh_host_random() < s_loss;
+    esp_ble_mesh_generic_client_cb_event_t event = ESP_BLE_MESH_GENERIC_CLIENT_TIMEOUT_EVT;
+    if (!lost) {
+      event = params->opcode == ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET ? ESP_BLE_MESH_GENERIC_CLIENT_GET_STATE_EVT
+                                                                    : ESP_BLE_MESH_GENERIC_CLIENT_SET_STATE_EVT;
+    }
+    if (!mesh_host_schedule(params, event, lost ? params->msg_timeout : mesh_host_latency_ms(), true)) {
+      err = ESP_ERR_NO_MEM;
+    }
+  }
+  pthread_mutex_unlock(&s_lock);
+  return err;
+}
+
+esp_err_t esp_ble_mesh_register_generic_client_callback(esp_ble_mesh_generic_client_cb_t callback) {
+  s_callback = callback;
+  return ESP_OK;
+}
+
+esp_err_t esp_ble_mesh_generic_client_get_state(esp_ble_mesh_client_common_param_t *params,
+                                                esp_ble_mesh_generic_client_get_state_t *get_state) {
+  return mesh_host_send(params, false, 0);
+}
+
+esp_err_t esp_ble_mesh_generic_client_set_state(esp_ble_mesh_client_common_param_t *params,
+                                                esp_ble_mesh_generic_client_set_state_t *set_state) {
+  return mesh_host_send(params, true, set_state->onoff_set.onoff);
+}
+
+void mesh_host_set_latency_ms(uint32_t latency_ms) {
+  pthread_mutex_lock(&s_lock);
+  s_latency_ms = latency_ms;
+  pthread_mutex_unlock(&s_lock);
+}
+
+void mesh_host_set_loss(double loss) {
+  pthread_mutex_lock(&s_lock);
+  s_loss = loss;
+  pthread_mutex_unlock(&s_lock);
+}
+
+void mesh_host_set_tx_limit(uint32_t limit) {
+  pthread_mutex_lock(&s_lock);
+  s_tx_limit = limit;
+  pthread_mutex_unlock(&s_lock);
+}
+
+void mesh_host_set_publish(bool publish) {
+  pthread_mutex_lock(&s_lock);
+  s_publish = publish;
+  pthread_mutex_unlock(&s_lock);
+}
+
+esp_err_t mesh_host_subscribe(uint16_t node, uint16_t group) {
+  pthread_mutex_lock(&s_lock);
+  host_subscription_t *subscriptions =
+      realloc(s_subscriptions, (s_subscription_count + 1) * sizeof(*s_subscriptions));
+  if (subscriptions) {
+    s_subscriptions = subscriptions;
+    s_subscriptions[s_subscription_count++] = (host_subscription_t){.group = group, .node = node};
+  }
+  pthread_mutex_unlock(&s_lock);
+  return subscriptions ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+uint8_t mesh_host_node_state(uint16_t addr) {
+  pthread_mutex_lock(&s_lock);
+  uint8_t onoff = s_state[addr];
+  pthread_mutex_unlock(&s_lock);
+  return onoff;
+}
+
+uint32_t mesh_host_sets_received(void) {
+  pthread_mutex_lock(&s_lock);
+  uint32_t count = s_sets_received;
+  pthread_mutex_unlock(&s_lock);
+  return count;
+}
+
+uint32_t mesh_host_messages_sent(void) {
+  pthread_mutex_lock(&s_lock);
+  uint32_t count = s_messages_sent;
+  pthread_mutex_unlock(&s_lock);
+  return count;
+}
+
+void mesh_host_publish_status(uint16_t addr, uint8_t onoff) {
+  pthread_mutex_lock(&s_lock);
+  s_state[addr] = onoff;
+  pthread_mutex_unlock(&s_lock);
+  esp_ble_mesh_client_common_param_t params = {
+      .opcode = ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_STATUS,
+      .ctx.addr = addr,
+  };
+  mesh_host_dispatch(ESP_BLE_MESH_GENERIC_CLIENT_PUBLISH_EVT, &params, onoff);
+}
+
+void mesh_host_set_node_state(uint16_t addr, uint8_t onoff) {
+  pthread_mutex_lock(&s_lock);
+  s_state[addr] = onoff;
+  pthread_mutex_unlock(&s_lock);
+}
@@ -0,0 +1,343 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_sntp.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+
+/* Logging */
+
+static esp_log_level_t s_log_level = ESP_LOG_WARN;
+static pthread_once_t s_log_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t s_log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void esp_log_init(void) {
+  const char *env = getenv("GATEWAY_LOG_LEVEL");
+  if (env && *env >= '0' && *env <= '5') {
+    s_log_level = (esp_log_level_t)(*env - '0');
+  }
+}
+
+void esp_log_level_set(const char *tag, esp_log_level_t level) {
+  pthread_once(&s_log_once, esp_log_init);
+  s_log_level = level;
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...) {
+  static const char letters[] = "NEWIDV";
+  pthread_once(&s_log_once, esp_log_init);
+  if (level > s_log_level) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  pthread_mutex_lock(&s_log_lock);
+  fprintf(stderr, "%c (%lld) %s: ", letters[level], (long long)(esp_timer_get_time() / 1000), tag);
+  vfprintf(stderr, format, args);
+  fputc('\n', stderr);
+  pthread_mutex_unlock(&s_log_lock);
+  va_end(args);
+}
+
+/* Errors */
+
+const char *esp_err_to_name(esp_err_t code) {
+  switch (code) {
+  case ESP_OK:
+    return "ESP_OK";
+  case ESP_FAIL:
+    return "ESP_FAIL";
+  case ESP_ERR_NO_MEM:
+    return "ESP_ERR_NO_MEM";
+  case ESP_ERR_INVALID_ARG:
+    return "ESP_ERR_INVALID_ARG";
+  case ESP_ERR_INVALID_STATE:
+    return "ESP_ERR_INVALID_STATE";
+  case ESP_ERR_INVALID_SIZE:
+    return "ESP_ERR_INVALID_SIZE";
+  case ESP_ERR_NOT_FOUND:
+    return "ESP_ERR_NOT_FOUND";
+  case ESP_ERR_NOT_SUPPORTED:
+    return "ESP_ERR_NOT_SUPPORTED";
+  case ESP_ERR_TIMEOUT:
+    return "ESP_ERR_TIMEOUT";
+  case ESP_ERR_INVALID_RESPONSE:
+    return "ESP_ERR_INVALID_RESPONSE";
+  case ESP_ERR_INVALID_CRC:
+    return "ESP_ERR_INVALID_CRC";
+  case ESP_ERR_NVS_NOT_INITIALIZED:
+    return "ESP_ERR_NVS_NOT_INITIALIZED";
+  case ESP_ERR_NVS_NOT_FOUND:
+    return "ESP_ERR_NVS_NOT_FOUND";
+  case ESP_ERR_NVS_INVALID_LENGTH:
+    return "ESP_ERR_NVS_INVALID_LENGTH";
+  case ESP_ERR_NVS_NO_FREE_PAGES:
+    return "ESP_ERR_NVS_NO_FREE_PAGES";
+  default:
+    return "UNKNOWN ERROR";
+  }
+}
+
+void esp_host_abort(const char *file, int line, const char *expr, esp_err_t err) {
+  fprintf(stderr, "ESP_ERROR_CHECK failed: esp_err_t 0x%x (%s) at %s:%d\nexpression: %s\n", err,
+          esp_err_to_name(err), file, line, expr);
+  abort();
+}
+
+/* CRC, bitwise reflected CRC-32 with the same pre and post inversion as the ROM implementation */
+
+uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len) {
+  crc = ~crc;
+  while (len--) {
+    crc ^= *buf++;
+    for (int i = 0; i < 8; i++) {
+      crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+    }
+  }
+  return ~crc;
+}
+
+/* Timer */
+
+static struct timespec s_timer_start;
+static pthread_once_t s_timer_once = PTHREAD_ONCE_INIT;
+
+static void esp_timer_start_clock(void) { clock_gettime(CLOCK_MONOTONIC, &s_timer_start); }
+
+int64_t esp_timer_get_time(void) {
+  pthread_once(&s_timer_once, esp_timer_start_clock);
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)(now.tv_sec - s_timer_start.tv_sec) * 1000000 + (now.tv_nsec - s_timer_start.tv_nsec) / 1000;
+}
+
+/* SNTP */
+
+static bool s_sntp_enabled;
+
+void esp_sntp_setoperatingmode(esp_sntp_operatingmode_t operating_mode) {}
+
+void esp_sntp_setservername(uint8_t idx, const char *server) {}
+
+void sntp_set_time_sync_notification_cb(sntp_sync_time_cb_t callback) {}
+
+void esp_sntp_init(void) { s_sntp_enabled = true; }
+
+bool esp_sntp_enabled(void) { return s_sntp_enabled; }
+
+/* NVS, a flat in-memory list of namespace/key/value entries */
+
+#define NVS_HOST_MAX_HANDLES 16
+#define NVS_HOST_KEY_LEN 16
+
+typedef enum {
+  NVS_HOST_TYPE_U32,
+  NVS_HOST_TYPE_STR,
+  NVS_HOST_TYPE_BLOB,
+} nvs_host_type_t;
+
+typedef struct nvs_host_entry {
+  struct nvs_host_entry *next;
+  char ns[NVS_HOST_KEY_LEN];
+  char key[NVS_HOST_KEY_LEN];
+  nvs_host_type_t type;
+  size_t length;
+  uint8_t value[];
+} nvs_host_entry_t;
+
+static pthread_mutex_t s_nvs_lock = PTHREAD_MUTEX_INITIALIZER;
+static nvs_host_entry_t *s_nvs_entries;
+static char s_nvs_handles[NVS_HOST_MAX_HANDLES][NVS_HOST_KEY_LEN];
+static bool s_nvs_initialized;
+
+esp_err_t nvs_flash_init(void) {
+  s_nvs_initialized = true;
+  return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void) {
+  pthread_mutex_lock(&s_nvs_lock);
+  while (s_nvs_entries) {
+    nvs_host_entry_t *next = s_nvs_entries->next;
+    free(s_nvs_entries);
+    s_nvs_entries = next;
+  }
+  pthread_mutex_unlock(&s_nvs_lock);
+  return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle) {
+  if (!s_nvs_initialized) {
+    return ESP_ERR_NVS_NOT_INITIALIZED;
+  }
+  if (!name || strlen(name) >= NVS_HOST_KEY_LEN) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  pthread_mutex_lock(&s_nvs_lock);
+  for (int i = 0; i < NVS_HOST_MAX_HANDLES; i++) {
+    if (s_nvs_handles[i][0] == '\0') {
+      strcpy(s_nvs_handles[i], name);
+      pthread_mutex_unlock(&s_nvs_lock);
+      *out_handle = i + 1;
+      return ESP_OK;
+    }
+  }
+  pthread_mutex_unlock(&s_nvs_lock);
+  return ESP_ERR_NO_MEM;
+}
+
+void nvs_close(nvs_handle_t handle) {
+  if (handle >= 1 && handle <= NVS_HOST_MAX_HANDLES) {
+    pthread_mutex_lock(&s_nvs_lock);
+    s_nvs_handles[handle - 1][0] = '\0';
+    pthread_mutex_unlock(&s_nvs_lock);
+  }
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) { return ESP_OK; }
+
+/* Called with s_nvs_lock held. Returns the namespace of the handle or NULL. */
+static const char *nvs_host_namespace(nvs_handle_t handle) {
+  if (handle < 1 || handle > NVS_HOST_MAX_HANDLES || s_nvs_handles[handle - 1][0] == '\0') {
+    return NULL;
+  }
+  return s_nvs_handles[handle - 1];
+}
+
+/* Called with s_nvs_lock held. Returns the link that points at the entry, or at the NULL that ends the list. */
+static nvs_host_entry_t **nvs_host_find(const char *ns, const char *key) {
+  nvs_host_entry_t **link = &s_nvs_entries;
+  while (*link && (strcmp((*link)->ns, ns) != 0 || strcmp((*link)->key, key) != 0)) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+static esp_err_t nvs_host_set(nvs_handle_t handle, const char *key, nvs_host_type_t type, const void *value,
+                              size_t length) {
+  if (!key || strlen(key) >= NVS_HOST_KEY_LEN) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  nvs_host_entry_t *entry = malloc(sizeof(*entry) + length);
+  if (!entry) {
+    return ESP_ERR_NO_MEM;
+  }
+  pthread_mutex_lock(&s_nvs_lock);
+  const char *ns = nvs_host_namespace(handle);
+  if (!ns) {
+    pthread_mutex_unlock(&s_nvs_lock);
+    free(entry);
+    return ESP_ERR_INVALID_ARG;
+  }
+  snprintf(entry->ns, sizeof(entry->ns), "%s", ns);
+  snprintf(entry->key, sizeof(entry->key), "%s", key);
+  entry->type = type;
+  entry->length = length;
+  memcpy(entry->value, value, length);
+  nvs_host_entry_t **link = nvs_host_find(ns, key);
+  if (*link) {
+    entry->next = (*link)->next;
+    free(*link);
+  } else {
+    entry->next = NULL;
+  }
+  *link = entry;
+  pthread_mutex_unlock(&s_nvs_lock);
+  return ESP_OK;
+}
+
+/* out_value may be NULL to query the length. */
+static esp_err_t nvs_host_get(nvs_handle_t handle, const char *key, nvs_host_type_t type, void *out_value,
+                              size_t *length) {
+  pthread_mutex_lock(&s_nvs_lock);
+  const char *ns = nvs_host_namespace(handle);
+  if (!ns || !key) {
+    pthread_mutex_unlock(&s_nvs_lock);
+    return ESP_ERR_INVALID_ARG;
+  }
+  nvs_host_entry_t *entry = *nvs_host_find(ns, key);
+  esp_err_t err = ESP_OK;
+  if (!entry || entry->type != type) {
+    err = ESP_ERR_NVS_NOT_FOUND;
+  } else if (!out_value) {
+    *length = entry->length;
+  } else if (*length < entry->length) {
+    err = ESP_ERR_NVS_INVALID_LENGTH;
+  } else {
+    memcpy(out_value, entry->value, entry->length);
+    *length = entry->length;
+  }
+  pthread_mutex_unlock(&s_nvs_lock);
+  return err;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length) {
+  return nvs_host_set(handle, key, NVS_HOST_TYPE_BLOB, value, length);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length) {
+  return nvs_host_get(handle, key, NVS_HOST_TYPE_BLOB, out_value, length);
+}
+
+esp_err_t nvs_set_str(nvs_handle_t handle, const char *key, const char *value) {
+  return nvs_host_set(handle, key, NVS_HOST_TYPE_STR, value, strlen(value) + 1);
+}
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char *key, char *out_value, size_t *length) {
+  return nvs_host_get(handle, key, NVS_HOST_TYPE_STR, out_value, length);
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value) {
+  return nvs_host_set(handle, key, NVS_HOST_TYPE_U32, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *out_value) {
+  size_t length = sizeof(*out_value);
+  return nvs_host_get(handle, key, NVS_HOST_TYPE_U32, out_value, &length);
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key) {
+  pthread_mutex_lock(&s_nvs_lock);
+  const char *ns = nvs_host_namespace(handle);
+  if (!ns || !key) {
+    pthread_mutex_unlock(&s_nvs_lock);
+    return ESP_ERR_INVALID_ARG;
+  }
+  nvs_host_entry_t **link = nvs_host_find(ns, key);
+  nvs_host_entry_t *entry = *link;
+  if (entry) {
+    *link = entry->next;
+    free(entry);
+  }
+  pthread_mutex_unlock(&s_nvs_lock);
+  return entry ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle) {
+  pthread_mutex_lock(&s_nvs_lock);
+  const char *ns = nvs_host_namespace(handle);
+  if (!ns) {
+    pthread_mutex_unlock(&s_nvs_lock);
+    return ESP_ERR_INVALID_ARG;
+  }
+  nvs_host_entry_t **link = &s_nvs_entries;
+  while (*link) {
+    if (strcmp((*link)->ns, ns) == 0) {
+      nvs_host_entry_t *entry = *link;
+      *link = entry->next;
+      free(entry);
+    } else {
+      link = &(*link)->next;
+    }
+  }
+  pthread_mutex_unlock(&s_nvs_lock);
+  return ESP_OK;
+}
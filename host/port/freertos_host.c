@@ -0,0 +1,333 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+struct host_task {
+  pthread_t thread;
+  TaskFunction_t code;
+  void *parameters;
+  char name[16];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint32_t notify;
+};
+
+struct host_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  UBaseType_t length;
+  UBaseType_t item_size;
+  UBaseType_t head;
+  UBaseType_t count;
+  uint8_t *storage;
+};
+
+struct host_mutex {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int taken;
+};
+
+struct host_event_group {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  EventBits_t bits;
+};
+
+static pthread_key_t s_task_key;
+static pthread_once_t s_task_key_once = PTHREAD_ONCE_INIT;
+static struct timespec s_start;
+
+static void host_make_task_key(void) {
+  pthread_key_create(&s_task_key, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &s_start);
+}
+
+void host_freertos_assert(const char *file, int line, const char *expr) {
+  fprintf(stderr, "%s:%d: assertion failed: %s\n", file, line, expr);
+  abort();
+}
+
+TickType_t xTaskGetTickCount(void) {
+  pthread_once(&s_task_key_once, host_make_task_key);
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t ms = (int64_t)(now.tv_sec - s_start.tv_sec) * 1000 + (now.tv_nsec - s_start.tv_nsec) / 1000000;
+  return (TickType_t)(ms * configTICK_RATE_HZ / 1000);
+}
+
+/* Absolute CLOCK_MONOTONIC deadline for a timeout in ticks, all condition variables use that clock. */
+static struct timespec host_deadline(TickType_t ticks) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t ns = (uint64_t)ticks * (1000000000ULL / configTICK_RATE_HZ);
+  ts.tv_sec += ns / 1000000000ULL;
+  ts.tv_nsec += ns % 1000000000ULL;
+  if (ts.tv_nsec >= 1000000000L) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000L;
+  }
+  return ts;
+}
+
+/* Waits on cond until woken or the deadline passed. Returns 0 on timeout. */
+static int host_wait(pthread_cond_t *cond, pthread_mutex_t *lock, TickType_t ticks, const struct timespec *deadline) {
+  if (ticks == portMAX_DELAY) {
+    pthread_cond_wait(cond, lock);
+    return 1;
+  }
+  return pthread_cond_timedwait(cond, lock, deadline) != ETIMEDOUT;
+}
+
+static void host_cond_init(pthread_cond_t *cond) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+static void *host_task_entry(void *arg) {
+  struct host_task *task = arg;
+  pthread_setspecific(s_task_key, task);
+  task->code(task->parameters);
+  return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task_code, const char *name, uint32_t stack_depth, void *parameters,
+                       UBaseType_t priority, TaskHandle_t *created_task) {
+  pthread_once(&s_task_key_once, host_make_task_key);
+  struct host_task *task = calloc(1, sizeof(*task));
+  if (!task) {
+    return pdFAIL;
+  }
+  task->code = task_code;
+  task->parameters = parameters;
+  snprintf(task->name, sizeof(task->name), "%s", name ? name : "");
+  pthread_mutex_init(&task->lock, NULL);
+  host_cond_init(&task->cond);
+  if (created_task) {
+    *created_task = task;
+  }
+  if (pthread_create(&task->thread, NULL, host_task_entry, task) != 0) {
+    free(task);
+    return pdFAIL;
+  }
+  pthread_detach(task->thread);
+  return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+  if (!task || task == xTaskGetCurrentTaskHandle()) {
+    pthread_exit(NULL);
+  }
+  // Deleting another task is not supported on the host, the gateway never does it.
+}
+
+void vTaskDelay(TickType_t ticks) {
+  struct timespec ts = {
+      .tv_sec = ticks / configTICK_RATE_HZ,
+      .tv_nsec = (long)(ticks % configTICK_RATE_HZ) * (1000000000L / configTICK_RATE_HZ),
+  };
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+  }
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+  pthread_once(&s_task_key_once, host_make_task_key);
+  return pthread_getspecific(s_task_key);
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  configASSERT(task);
+  pthread_mutex_lock(&task->lock);
+  task->notify++;
+  pthread_cond_signal(&task->cond);
+  pthread_mutex_unlock(&task->lock);
+  return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_count_on_exit, TickType_t ticks_to_wait) {
+  struct host_task *task = xTaskGetCurrentTaskHandle();
+  configASSERT(task);
+  struct timespec deadline = host_deadline(ticks_to_wait);
+  pthread_mutex_lock(&task->lock);
+  while (task->notify == 0 && ticks_to_wait > 0) {
+    if (!host_wait(&task->cond, &task->lock, ticks_to_wait, &deadline)) {
+      break;
+    }
+  }
+  uint32_t value = task->notify;
+  if (value > 0) {
+    task->notify = clear_count_on_exit ? 0 : value - 1;
+  }
+  pthread_mutex_unlock(&task->lock);
+  return value;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+  struct host_queue *queue = calloc(1, sizeof(*queue));
+  if (!queue) {
+    return NULL;
+  }
+  queue->storage = malloc((size_t)length * item_size);
+  if (!queue->storage) {
+    free(queue);
+    return NULL;
+  }
+  queue->length = length;
+  queue->item_size = item_size;
+  pthread_mutex_init(&queue->lock, NULL);
+  host_cond_init(&queue->not_empty);
+  host_cond_init(&queue->not_full);
+  return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+  if (queue) {
+    free(queue->storage);
+    free(queue);
+  }
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait) {
+  struct timespec deadline = host_deadline(ticks_to_wait);
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == queue->length) {
+    if (ticks_to_wait == 0 || !host_wait(&queue->not_full, &queue->lock, ticks_to_wait, &deadline)) {
+      pthread_mutex_unlock(&queue->lock);
+      return pdFAIL;
+    }
+  }
+  UBaseType_t slot = (queue->head + queue->count) % queue->length;
+  memcpy(queue->storage + (size_t)slot * queue->item_size, item, queue->item_size);
+  queue->count++;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+  return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *buffer, TickType_t ticks_to_wait) {
+  struct timespec deadline = host_deadline(ticks_to_wait);
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == 0) {
+    if (ticks_to_wait == 0 || !host_wait(&queue->not_empty, &queue->lock, ticks_to_wait, &deadline)) {
+      pthread_mutex_unlock(&queue->lock);
+      return pdFAIL;
+    }
+  }
+  memcpy(buffer, queue->storage + (size_t)queue->head * queue->item_size, queue->item_size);
+  queue->head = (queue->head + 1) % queue->length;
+  queue->count--;
+  pthread_cond_signal(&queue->not_full);
+  pthread_mutex_unlock(&queue->lock);
+  return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+  pthread_mutex_lock(&queue->lock);
+  UBaseType_t count = queue->count;
+  pthread_mutex_unlock(&queue->lock);
+  return count;
+}
+
+/* FreeRTOS mutexes may be given by another task than the one that took them, so they are built on a condition
+ * variable rather than mapped to a pthread mutex. */
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+  struct host_mutex *mutex = calloc(1, sizeof(*mutex));
+  if (!mutex) {
+    return NULL;
+  }
+  pthread_mutex_init(&mutex->lock, NULL);
+  host_cond_init(&mutex->cond);
+  return mutex;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) { free(semaphore); }
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait) {
+  struct timespec deadline = host_deadline(ticks_to_wait);
+  pthread_mutex_lock(&semaphore->lock);
+  while (semaphore->taken) {
+    if (ticks_to_wait == 0 || !host_wait(&semaphore->cond, &semaphore->lock, ticks_to_wait, &deadline)) {
+      pthread_mutex_unlock(&semaphore->lock);
+      return pdFAIL;
+    }
+  }
+  semaphore->taken = 1;
+  pthread_mutex_unlock(&semaphore->lock);
+  return pdPASS;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+  pthread_mutex_lock(&semaphore->lock);
+  semaphore->taken = 0;
+  pthread_cond_signal(&semaphore->cond);
+  pthread_mutex_unlock(&semaphore->lock);
+  return pdPASS;
+}
+
+EventGroupHandle_t xEventGroupCreate(void) {
+  struct host_event_group *group = calloc(1, sizeof(*group));
+  if (!group) {
+    return NULL;
+  }
+  pthread_mutex_init(&group->lock, NULL);
+  host_cond_init(&group->cond);
+  return group;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group) {
+  pthread_mutex_lock(&group->lock);
+  EventBits_t bits = group->bits;
+  pthread_mutex_unlock(&group->lock);
+  return bits;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits) {
+  pthread_mutex_lock(&group->lock);
+  group->bits |= bits;
+  EventBits_t result = group->bits;
+  pthread_cond_broadcast(&group->cond);
+  pthread_mutex_unlock(&group->lock);
+  return result;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits) {
+  pthread_mutex_lock(&group->lock);
+  EventBits_t previous = group->bits;
+  group->bits &= ~bits;
+  pthread_mutex_unlock(&group->lock);
+  return previous;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear_on_exit,
+                                BaseType_t wait_for_all, TickType_t ticks_to_wait) {
+  struct timespec deadline = host_deadline(ticks_to_wait);
+  pthread_mutex_lock(&group->lock);
+  for (;;) {
+    EventBits_t set = group->bits & bits;
+    if (wait_for_all ? set == bits : set != 0) {
+      break;
+    }
+    if (ticks_to_wait == 0 || !host_wait(&group->cond, &group->lock, ticks_to_wait, &deadline)) {
+      break;
+    }
+  }
+  EventBits_t result = group->bits;
+  if (clear_on_exit && (wait_for_all ? (result & bits) == bits : (result & bits) != 0)) {
+    group->bits &= ~bits;
+  }
+  pthread_mutex_unlock(&group->lock);
+  return result;
+}
@@ -0,0 +1,294 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mqtt_client.h"
+#include "mqtt_host.h"
+
+/*
+ * esp-mqtt client backed by an in-process broker stand-in. There is a single broker and at most one live client.
+ * Events are dispatched from the broker thread, like esp-mqtt dispatches them from its own task.
+ */
+
+static const char *TAG = "MQTT_HOST";
+
+typedef struct host_message {
+  struct host_message *next;
+  int msg_id;
+  int qos;
+  int retain;
+  int len;
+  int64_t queued_us;
+  int64_t due_us;
+  char *topic;
+  char data[];
+} host_message_t;
+
+struct esp_mqtt_client {
+  esp_event_handler_t handler;
+  void *handler_arg;
+  bool started;
+  bool connected;
+  bool destroyed;
+  int next_msg_id;
+  host_message_t *head;
+  host_message_t *tail;
+  int outbox_size;
+};
+
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_cond;
+static pthread_once_t s_once = PTHREAD_ONCE_INIT;
+static pthread_t s_thread;
+static struct esp_mqtt_client *s_client;
+static bool s_broker_up = true;
+static uint32_t s_rtt_ms;
+static uint32_t s_delivered;
+static mqtt_host_publish_hook_t s_hook;
+static void *s_hook_arg;
+
+static void mqtt_host_dispatch(struct esp_mqtt_client *client, esp_mqtt_event_id_t id, int msg_id) {
+  esp_mqtt_event_t event = {
+      .event_id = id,
+      .client = client,
+      .msg_id = msg_id,
+  };
+  if (client->handler) {
+    client->handler(client->handler_arg, "MQTT_EVENTS", id, &event);
+  }
+}
+
+/* Called with s_lock held. */
+static void mqtt_host_drop_outbox(struct esp_mqtt_client *client) {
+  while (client->head) {
+    host_message_t *message = client->head;
+    client->head = message->next;
+    free(message);
+  }
+  client->tail = NULL;
+  client->outbox_size = 0;
+}
+
+static void *mqtt_host_broker_thread(void *arg) {
+  pthread_mutex_lock(&s_lock);
+  for (;;) {
+    struct esp_mqtt_client *client = s_client;
+    if (!client) {
+      pthread_cond_wait(&s_cond, &s_lock);
+      continue;
+    }
+    bool should_connect = client->started && !client->destroyed && s_broker_up;
+    if (should_connect != client->connected) {
+      client->connected = should_connect;
+      if (client->destroyed) {
+        mqtt_host_drop_outbox(client);
+      } else if (should_connect) {
+        // Messages left in the outbox are sent again once the connection is back.
+        int64_t due = esp_timer_get_time() + (int64_t)s_rtt_ms * 1000;
+        for (host_message_t *message = client->head; message; message = message->next) {
+          message->due_us = due;
+        }
+      }
+      pthread_mutex_unlock(&s_lock);
+      mqtt_host_dispatch(client, should_connect ? MQTT_EVENT_CONNECTED : MQTT_EVENT_DISCONNECTED, 0);
+      pthread_mutex_lock(&s_lock);
+      continue;
+    }
+    host_message_t *message = client->connected ? client->head : NULL;
+    int64_t now = esp_timer_get_time();
+    if (message && message->due_us <= now) {
+      client->head = message->next;
+      if (!client->head) {
+        client->tail = NULL;
+      }
+      client->outbox_size -= message->len + (int)strlen(message->topic);
+      s_delivered++;
+      mqtt_host_publish_hook_t hook = s_hook;
+      void *hook_arg = s_hook_arg;
+      pthread_mutex_unlock(&s_lock);
+      if (hook) {
+        hook(message->topic, message->data, message->len, message->retain, message->queued_us, now, hook_arg);
+      }
+      if (message->qos > 0) {
+        mqtt_host_dispatch(client, MQTT_EVENT_PUBLISHED, message->msg_id);
+      }
+      free(message);
+      pthread_mutex_lock(&s_lock);
+      continue;
+    }
+    if (message) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      int64_t wait_us = message->due_us - now;
+      deadline.tv_sec += wait_us / 1000000;
+      deadline.tv_nsec += (wait_us % 1000000) * 1000;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&s_cond, &s_lock, &deadline);
+    } else {
+      pthread_cond_wait(&s_cond, &s_lock);
+    }
+  }
+  return NULL;
+}
+
+static void mqtt_host_init_once(void) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&s_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_create(&s_thread, NULL, mqtt_host_broker_thread, NULL);
+  pthread_detach(s_thread);
+}
+
+void mqtt_host_set_broker_up(bool up) {
+  pthread_once(&s_once, mqtt_host_init_once);
+  pthread_mutex_lock(&s_lock);
+  s_broker_up = up;
+  pthread_cond_broadcast(&s_cond);
+  pthread_mutex_unlock(&s_lock);
+}
+
+void mqtt_host_set_rtt_ms(uint32_t rtt_ms) {
+  pthread_mutex_lock(&s_lock);
+  s_rtt_ms = rtt_ms;
+  pthread_mutex_unlock(&s_lock);
+}
+
+void mqtt_host_set_publish_hook(mqtt_host_publish_hook_t hook, void *arg) {
+  pthread_mutex_lock(&s_lock);
+  s_hook = hook;
+  s_hook_arg = arg;
+  pthread_mutex_unlock(&s_lock);
+}
+
+uint32_t mqtt_host_delivered(void) {
+  pthread_mutex_lock(&s_lock);
+  uint32_t delivered = s_delivered;
+  pthread_mutex_unlock(&s_lock);
+  return delivered;
+}
+
+esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t *config) {
+  pthread_once(&s_once, mqtt_host_init_once);
+  struct esp_mqtt_client *client = calloc(1, sizeof(*client));
+  if (!client) {
+    return NULL;
+  }
+  client->next_msg_id = 1;
+  pthread_mutex_lock(&s_lock);
+  s_client = client;
+  pthread_mutex_unlock(&s_lock);
+  ESP_LOGI(TAG, "Client for %s", config->broker.address.uri ? config->broker.address.uri : "(null)");
+  return client;
+}
+
+esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client, esp_mqtt_event_id_t event,
+                                         esp_event_handler_t event_handler, void *event_handler_arg) {
+  pthread_mutex_lock(&s_lock);
+  client->handler = event_handler;
+  client->handler_arg = event_handler_arg;
+  pthread_mutex_unlock(&s_lock);
+  return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client) {
+  pthread_mutex_lock(&s_lock);
+  client->started = true;
+  pthread_cond_broadcast(&s_cond);
+  pthread_mutex_unlock(&s_lock);
+  return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_stop(esp_mqtt_client_handle_t client) {
+  pthread_mutex_lock(&s_lock);
+  client->started = false;
+  pthread_cond_broadcast(&s_cond);
+  pthread_mutex_unlock(&s_lock);
+  return ESP_OK;
+}
+
+/* There is only the one broker, the settings are just logged. */
+esp_err_t esp_mqtt_set_config(esp_mqtt_client_handle_t client, const esp_mqtt_client_config_t *config) {
+  (void)client;
+  ESP_LOGI(TAG, "Client reconfigured for %s", config->broker.address.uri ? config->broker.address.uri : "(null)");
+  return ESP_OK;
+}
+
+/* The handle stays allocated, events for it may still be in flight on the broker thread. */
+esp_err_t esp_mqtt_client_destroy(esp_mqtt_client_handle_t client) {
+  pthread_mutex_lock(&s_lock);
+  client->destroyed = true;
+  pthread_cond_broadcast(&s_cond);
+  pthread_mutex_unlock(&s_lock);
+  return ESP_OK;
+}
+
+int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos,
+                            int retain, bool store) {
+  if (len <= 0) {
+    len = data ? (int)strlen(data) : 0;
+  }
+  size_t topic_len = strlen(topic);
+  host_message_t *message = malloc(sizeof(*message) + len + topic_len + 1);
+  if (!message) {
+    return -1;
+  }
+  memcpy(message->data, data, len);
+  message->topic = message->data + len;
+  memcpy(message->topic, topic, topic_len + 1);
+  message->len = len;
+  message->qos = qos;
+  message->retain = retain;
+  message->next = NULL;
+  message->queued_us = esp_timer_get_time();
+
+  pthread_mutex_lock(&s_lock);
+  if (!client->connected) {
+    pthread_mutex_unlock(&s_lock);
+    free(message);
+    return -1;
+  }
+  message->due_us = message->queued_us + (int64_t)s_rtt_ms * 1000;
+  message->msg_id = qos > 0 ? client->next_msg_id++ : 0;
+  if (client->next_msg_id > 0xffff) {
+    client->next_msg_id = 1;
+  }
+  if (client->tail) {
+    client->tail->next = message;
+  } else {
+    client->head = message;
+  }
+  client->tail = message;
+  client->outbox_size += len + (int)topic_len;
+  int msg_id = message->msg_id;
+  pthread_cond_broadcast(&s_cond);
+  pthread_mutex_unlock(&s_lock);
+  return msg_id;
+}
+
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos,
+                            int retain) {
+  return esp_mqtt_client_enqueue(client, topic, data, len, qos, retain, true);
+}
+
+int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t client, const char *topic, int qos) {
+  pthread_mutex_lock(&s_lock);
+  int msg_id = client->connected ? client->next_msg_id++ : -1;
+  pthread_mutex_unlock(&s_lock);
+  return msg_id;
+}
+
+int esp_mqtt_client_get_outbox_size(esp_mqtt_client_handle_t client) {
+  pthread_mutex_lock(&s_lock);
+  int size = client->outbox_size;
+  pthread_mutex_unlock(&s_lock);
+  return size;
+}
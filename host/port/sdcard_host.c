@@ -0,0 +1,132 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "sd_host.h"
+#include "sdcard.h"
+
+/* sdcard.h on top of a plain directory of the development machine. */
+
+#define TAG "SDCARD"
+
+#define SD_MAX_PATH_LENGTH 512
+
+static char s_root[SD_MAX_PATH_LENGTH - 32] = "sdcard";
+
+static void sd_host_path(char *path, const char *filename) {
+  snprintf(path, SD_MAX_PATH_LENGTH, "%s/%s", s_root, filename);
+}
+
+void sd_host_set_root(const char *path) { snprintf(s_root, sizeof(s_root), "%s", path); }
+
+static void sd_host_unlink(const char *filename, void *arg) { sd_delete_file(filename); }
+
+void sd_host_wipe(void) { sd_for_each_file(sd_host_unlink, NULL); }
+
+void sd_init(void) {
+  if (mkdir(s_root, 0755) != 0) {
+    struct stat st;
+    if (stat(s_root, &st) != 0 || !S_ISDIR(st.st_mode)) {
+      ESP_LOGE(TAG, "Failed to create %s", s_root);
+      return;
+    }
+  }
+  ESP_LOGI(TAG, "Using %s as SD card", s_root);
+}
+
+void sd_delete_file(const char *filename) {
+  char path[SD_MAX_PATH_LENGTH];
+  sd_host_path(path, filename);
+  if (unlink(path) != 0) {
+    ESP_LOGE(TAG, "File does not exist");
+  }
+}
+
+void sd_append_to_file(const char *filename, const char *buffer) {
+  FILE *f = sd_open_file(filename, "a");
+  if (f == NULL) {
+    return;
+  }
+  fprintf(f, "%s\n", buffer);
+  fclose(f);
+}
+
+FILE *sd_open_file_for_read(const char *filename) { return sd_open_file(filename, "r"); }
+
+FILE *sd_open_file(const char *filename, const char *mode) {
+  char path[SD_MAX_PATH_LENGTH];
+  sd_host_path(path, filename);
+  FILE *f = fopen(path, mode);
+  if (f == NULL) {
+    ESP_LOGI(TAG, "Failed to open file %s (%s)", path, mode);
+  }
+  return f;
+}
+
+void sd_close_file(FILE *f) { fclose(f); }
+
+esp_err_t sd_read_line_from_file(FILE *f, char *buffer, size_t size) {
+  if (fgets(buffer, size, f)) {
+    char *pos = strchr(buffer, '\n');
+    if (pos) {
+      *pos = '\0';
+    }
+    return ESP_OK;
+  }
+  return ESP_FAIL;
+}
+
+void sd_clear_file(const char *filename) {
+  FILE *f = sd_open_file(filename, "w");
+  if (f) {
+    fclose(f);
+  }
+}
+
+esp_err_t sd_truncate_file(const char *filename, long size) {
+  char path[SD_MAX_PATH_LENGTH];
+  sd_host_path(path, filename);
+  if (truncate(path, size) != 0) {
+    ESP_LOGE(TAG, "Failed to truncate file %s to %ld", path, size);
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+esp_err_t sd_rename_file(const char *from, const char *to) {
+  char path_from[SD_MAX_PATH_LENGTH];
+  char path_to[SD_MAX_PATH_LENGTH];
+  sd_host_path(path_from, from);
+  sd_host_path(path_to, to);
+  if (rename(path_from, path_to) != 0) {
+    ESP_LOGE(TAG, "Failed to rename %s to %s", path_from, path_to);
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+void sd_for_each_file(sd_file_cb_t callback, void *arg) {
+  DIR *dir = opendir(s_root);
+  if (dir == NULL) {
+    ESP_LOGE(TAG, "Failed to open directory %s", s_root);
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_type == DT_REG) {
+      callback(entry->d_name, arg);
+    }
+  }
+  closedir(dir);
+}
+
+long sd_get_file_size(const char *filename) {
+  char path[SD_MAX_PATH_LENGTH];
+  sd_host_path(path, filename);
+  struct stat st;
+  return stat(path, &st) == 0 ? (long)st.st_size : 0;
+}
@@ -0,0 +1,569 @@
+/*
+ * Unit tests of the gateway core, run by ctest: the journal's recovery paths (torn tail, interrupted rewrite,
+ * wrapped segment names, a segment that cannot be opened) and eviction, the periodic fsync of the write-behind queue,
+ * the compaction policy the binary was built with, the config message parser, MQTT topic filter matching, group
+ * resolution and the size of the metrics report.
+ *
+ *   gateway_test [sd-dir]
+ *
+ * sd-dir stands in for the SD card and is wiped. Every failed check is printed; the exit status is 1 if any failed.
+ * The binaries are built with a small journal, see CMakeLists.txt, so that eviction needs only a few records.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "compactor.h"
+#include "config_msg.h"
+#include "group_table.h"
+#include "journal.h"
+#include "journal_writer.h"
+#include "metrics.h"
+#include "mqtt_app.h"
+#include "payload.h"
+#include "sd_host.h"
+#include "sdcard.h"
+#include "sdkconfig.h"
+#include "timestamp.h"
+
+#define TEST_MAX_RECORDS 64
+#define TEST_NODE 0x0005
+
+static const char *s_sd_dir;
+static int s_checks;
+static int s_failures;
+
+#define CHECK(cond)                                                                                                  \
+  do {                                                                                                               \
+    s_checks++;                                                                                                      \
+    if (!(cond)) {                                                                                                   \
+      s_failures++;                                                                                                  \
+      fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond);                        \
+    }                                                                                                                \
+  } while (0)
+
+/* ---- journal ---- */
+
+static void test_segment_name(uint32_t segment, const char *suffix, char *name) {
+  snprintf(name, 16, "jrnl%04x.%s", (unsigned)(segment & 0xffff), suffix);
+}
+
+/* Starts over with an empty card. */
+static void test_journal_reset(void) {
+  sd_host_wipe();
+  CHECK(journal_open() == ESP_OK);
+}
+
+static void test_append_value(uint16_t topic_id, uint8_t value) {
+  payload_report_t report = {.model_id = 0x1000, .value = value, .ttl = PAYLOAD_TTL_UNKNOWN};
+  char data[PAYLOAD_REPORT_LEN];
+  CHECK(journal_append_id(topic_id, TIMESTAMP_NONE, data, payload_pack(&report, data)) == ESP_OK);
+}
+
+/* Reads segment into values, the value of a packed report or the first data byte of anything else. Returns the
+ * number of records, -1 if the segment cannot be opened. */
+static int test_read_segment(uint32_t segment, uint8_t *values) {
+  journal_reader_t reader;
+  if (journal_reader_open(&reader, segment, 0) != ESP_OK) {
+    return -1;
+  }
+  journal_record_t record;
+  int count = 0;
+  while (count < TEST_MAX_RECORDS && journal_reader_next(&reader, &record) == ESP_OK) {
+    payload_report_t report;
+    bool packed = payload_unpack(record.topic_id, record.data, record.data_len, &report);
+    values[count++] = packed ? report.value : (uint8_t)record.data[0];
+  }
+  journal_reader_close(&reader);
+  return count;
+}
+
+static void test_journal_torn_tail(void) {
+  test_journal_reset();
+  test_append_value(TEST_NODE, 1);
+  test_append_value(TEST_NODE, 2);
+  CHECK(journal_flush(true) == ESP_OK);
+  long size = journal_size();
+  uint32_t active = journal_active_segment();
+
+  // half a record, as a power loss in the middle of an append leaves it
+  char name[16];
+  test_segment_name(active, "bin", name);
+  FILE *f = sd_open_file(name, "ab");
+  CHECK(f != NULL);
+  if (f) {
+    const uint8_t torn[] = {JOURNAL_RECORD_MAGIC, JOURNAL_RECORD_MQTT_ID, 11, 0, 0xde, 0xad};
+    fwrite(torn, 1, sizeof(torn), f);
+    sd_close_file(f);
+  }
+  CHECK(sd_get_file_size(name) == size + 6);
+
+  CHECK(journal_open() == ESP_OK);
+  CHECK(journal_size() == size);
+  CHECK(sd_get_file_size(name) == size);
+  test_append_value(TEST_NODE, 3);
+  uint8_t values[TEST_MAX_RECORDS];
+  CHECK(test_read_segment(active, values) == 3);
+  CHECK(values[0] == 1 && values[1] == 2 && values[2] == 3);
+}
+
+/* Leaves a copy of segment with only its first record in jrnlXXXX.tmp, as journal_rewrite() does. */
+static void test_write_rewrite_copy(uint32_t segment) {
+  char name[16];
+  char rewrite_name[16];
+  test_segment_name(segment, "bin", name);
+  test_segment_name(segment, "tmp", rewrite_name);
+  uint8_t record[JOURNAL_HEADER_LEN + 2 + PAYLOAD_REPORT_LEN];
+  FILE *in = sd_open_file(name, "rb");
+  FILE *out = sd_open_file(rewrite_name, "wb");
+  CHECK(in && out);
+  if (in && out) {
+    CHECK(fread(record, 1, sizeof(record), in) == sizeof(record));
+    CHECK(fwrite(record, 1, sizeof(record), out) == sizeof(record));
+  }
+  if (in) {
+    sd_close_file(in);
+  }
+  if (out) {
+    sd_close_file(out);
+  }
+}
+
+static bool test_file_exists(const char *name) {
+  FILE *f = sd_open_file_for_read(name);
+  if (f) {
+    sd_close_file(f);
+  }
+  return f != NULL;
+}
+
+static void test_journal_rewrite_recovery(void) {
+  test_journal_reset();
+  uint32_t sealed = journal_active_segment();
+  test_append_value(TEST_NODE, 1);
+  test_append_value(TEST_NODE, 2);
+  CHECK(journal_rotate() == ESP_OK);
+  test_append_value(TEST_NODE, 3);
+  CHECK(journal_flush(true) == ESP_OK);
+  char name[16];
+  char rewrite_name[16];
+  test_segment_name(sealed, "bin", name);
+  test_segment_name(sealed, "tmp", rewrite_name);
+  uint8_t values[TEST_MAX_RECORDS];
+
+  // interrupted before the original was deleted: the copy is discarded
+  test_write_rewrite_copy(sealed);
+  CHECK(journal_open() == ESP_OK);
+  CHECK(!test_file_exists(rewrite_name));
+  CHECK(test_read_segment(sealed, values) == 2);
+  CHECK(journal_oldest_segment() == sealed && journal_active_segment() == sealed + 1);
+
+  // interrupted between deleting the original and renaming the copy: the copy takes its place
+  test_write_rewrite_copy(sealed);
+  sd_delete_file(name);
+  CHECK(journal_open() == ESP_OK);
+  CHECK(!test_file_exists(rewrite_name));
+  CHECK(test_read_segment(sealed, values) == 1);
+  CHECK(values[0] == 1);
+  CHECK(journal_oldest_segment() == sealed && journal_active_segment() == sealed + 1);
+  CHECK(test_read_segment(sealed + 1, values) == 1 && values[0] == 3);
+}
+
+static void test_journal_wrapped_names(void) {
+  test_journal_reset();
+  for (uint8_t value = 1; value <= 3; value++) {
+    test_append_value(TEST_NODE, value);
+    if (value < 3) {
+      CHECK(journal_rotate() == ESP_OK);
+    }
+  }
+  CHECK(journal_flush(true) == ESP_OK);
+  // the names of segments 0xfffe..0x10000, without a manifest to give them their high bits
+  for (uint32_t segment = 0; segment < 3; segment++) {
+    char from[16];
+    char to[16];
+    test_segment_name(segment, "bin", from);
+    test_segment_name(segment + 0xfffe, "bin", to);
+    CHECK(sd_rename_file(from, to) == ESP_OK);
+  }
+  sd_delete_file("jrnl.man");
+
+  CHECK(journal_open() == ESP_OK);
+  uint32_t oldest = journal_oldest_segment();
+  CHECK((oldest & 0xffff) == 0xfffe);
+  CHECK(journal_active_segment() == oldest + 2);
+  uint8_t values[TEST_MAX_RECORDS];
+  for (uint32_t i = 0; i < 3; i++) {
+    CHECK(test_read_segment(oldest + i, values) == 1 && values[0] == i + 1);
+  }
+}
+
+/* A segment that cannot be opened when it becomes the active one, a directory in its place, only loses the records
+ * appended until it can be. */
+static void test_journal_reopen(void) {
+  test_journal_reset();
+  test_append_value(TEST_NODE, 1);
+  uint32_t next = journal_active_segment() + 1;
+  char name[16];
+  char path[512];
+  test_segment_name(next, "bin", name);
+  snprintf(path, sizeof(path), "%s/%s", s_sd_dir, name);
+  CHECK(mkdir(path, 0755) == 0);
+  journal_stats_t before;
+  journal_get_stats(&before);
+
+  CHECK(journal_rotate() != ESP_OK);
+  CHECK(journal_active_segment() == next);
+  payload_report_t report = {.model_id = 0x1000, .value = 2, .ttl = PAYLOAD_TTL_UNKNOWN};
+  char data[PAYLOAD_REPORT_LEN];
+  CHECK(journal_append_id(TEST_NODE, TIMESTAMP_NONE, data, payload_pack(&report, data)) == ESP_ERR_INVALID_STATE);
+  journal_stats_t stats;
+  journal_get_stats(&stats);
+  CHECK(stats.failed == before.failed + 1);
+
+  CHECK(rmdir(path) == 0);
+  test_append_value(TEST_NODE, 3);
+  uint8_t values[TEST_MAX_RECORDS];
+  CHECK(test_read_segment(next, values) == 1 && values[0] == 3);
+  journal_get_stats(&stats);
+  CHECK(stats.failed == before.failed + 1);
+}
+
+static void test_journal_eviction(void) {
+  test_journal_reset();
+  journal_stats_t before;
+  journal_get_stats(&before);
+  const long max_size = CONFIG_GATEWAY_JOURNAL_MAX_SIZE_KB * 1024L;
+  const long record_len = JOURNAL_HEADER_LEN + 2 + PAYLOAD_REPORT_LEN;
+  const int records = 2 * max_size / record_len;
+  for (int i = 0; i < records; i++) {
+    test_append_value(TEST_NODE, i);
+    CHECK(journal_size() <= max_size);
+  }
+  journal_stats_t stats;
+  journal_get_stats(&stats);
+  CHECK(stats.evicted > before.evicted);
+  CHECK(stats.refused == before.refused);
+  CHECK(journal_oldest_segment() > 0);
+
+  // what is left are the newest records, without a gap
+  uint8_t values[TEST_MAX_RECORDS];
+  uint8_t expected = (uint8_t)(records - 1);
+  for (uint32_t segment = journal_active_segment() + 1; segment-- > journal_oldest_segment();) {
+    int count = test_read_segment(segment, values);
+    CHECK(count > 0);
+    for (int i = count - 1; i >= 0; i--) {
+      CHECK(values[i] == expected);
+      expected--;
+    }
+  }
+
+  // a segment a reader has open is not evicted, records are refused instead
+  journal_reader_t reader;
+  uint32_t oldest = journal_oldest_segment();
+  CHECK(journal_reader_open(&reader, oldest, 0) == ESP_OK);
+  esp_err_t err = ESP_OK;
+  for (int i = 0; i < records && err == ESP_OK; i++) {
+    payload_report_t report = {.model_id = 0x1000, .ttl = PAYLOAD_TTL_UNKNOWN};
+    char data[PAYLOAD_REPORT_LEN];
+    err = journal_append_id(TEST_NODE, TIMESTAMP_NONE, data, payload_pack(&report, data));
+  }
+  CHECK(err == ESP_ERR_NO_MEM);
+  CHECK(journal_oldest_segment() == oldest);
+  journal_get_stats(&stats);
+  CHECK(stats.refused > before.refused);
+  journal_reader_close(&reader);
+}
+
+#if CONFIG_GATEWAY_JOURNAL_FSYNC_PERIODIC
+
+/* A batch committed before the fsync is due is synced when the period is over, with no further records coming. */
+static void test_journal_writer_periodic_sync(void) {
+  test_journal_reset();
+  CHECK(journal_writer_start() == ESP_OK);
+  payload_report_t report = {.model_id = 0x1000, .value = 1, .ttl = PAYLOAD_TTL_UNKNOWN};
+  char data[PAYLOAD_REPORT_LEN];
+  CHECK(journal_writer_submit(TEST_NODE, TIMESTAMP_NONE, data, payload_pack(&report, data)) == ESP_OK);
+  journal_writer_stats_t stats;
+  journal_writer_get_stats(&stats);
+  for (int i = 0; i < 500 && stats.committed == 0; i++) {
+    vTaskDelay(pdMS_TO_TICKS(10));
+    journal_writer_get_stats(&stats);
+  }
+  CHECK(stats.committed == 1);
+  CHECK(stats.syncs == 0);
+  vTaskDelay(pdMS_TO_TICKS(2 * CONFIG_GATEWAY_JOURNAL_FSYNC_PERIOD_MS));
+  journal_writer_get_stats(&stats);
+  CHECK(stats.syncs == 1);
+  CHECK(stats.flushes == 1);
+}
+
+#endif
+
+#if CONFIG_GATEWAY_COMPACT
+
+/* Kicks the compactor and waits for a pass after those counted in stats, which it updates. */
+static void test_compactor_wait(compactor_stats_t *stats) {
+  uint32_t passes = stats->passes;
+  compactor_kick();
+  for (int i = 0; i < 500 && stats->passes == passes; i++) {
+    vTaskDelay(pdMS_TO_TICKS(10));
+    compactor_get_stats(stats);
+  }
+  CHECK(stats->passes > passes);
+}
+
+/* Sealed segments 1 e 1 0 | 0 1 and the active segment 1, e being an event and the rest states of a node topic. */
+static void test_compaction(void) {
+  test_journal_reset();
+  uint32_t first = journal_active_segment();
+  test_append_value(TEST_NODE, 1);
+  CHECK(journal_append("event", "e", 1) == ESP_OK);
+  test_append_value(TEST_NODE, 1);
+  test_append_value(TEST_NODE, 0);
+  CHECK(journal_rotate() == ESP_OK);
+  test_append_value(TEST_NODE, 0);
+  test_append_value(TEST_NODE, 1);
+  CHECK(journal_rotate() == ESP_OK);
+  test_append_value(TEST_NODE, 1);
+  CHECK(journal_flush(true) == ESP_OK);
+  journal_set_replay_position(first, 0);
+
+  CHECK(compactor_start() == ESP_OK);
+  compactor_stats_t stats = {0};
+  test_compactor_wait(&stats);
+
+  uint8_t values[TEST_MAX_RECORDS];
+#if CONFIG_GATEWAY_COMPACT_LATEST
+  // only the newest sealed record of the topic is left, and the event
+  CHECK(test_read_segment(first, values) == 1 && values[0] == 'e');
+  CHECK(test_read_segment(first + 1, values) == 1 && values[0] == 1);
+  CHECK(stats.dropped == 4 && stats.rewritten == 2);
+#else
+  // each run of equal states is left as its newest record, the active segment does not count as newer
+  CHECK(test_read_segment(first, values) == 2 && values[0] == 'e' && values[1] == 1);
+  CHECK(test_read_segment(first + 1, values) == 2 && values[0] == 0 && values[1] == 1);
+  CHECK(stats.dropped == 2 && stats.rewritten == 1);
+#endif
+  // the active segment is never compacted
+  CHECK(test_read_segment(first + 2, values) == 1 && values[0] == 1);
+
+  // once it is sealed, the next pass reads it and drops the newest record before it, which both policies find
+  // redundant, rewriting only the segment that record is in
+  compactor_stats_t before = stats;
+  CHECK(journal_rotate() == ESP_OK);
+  test_append_value(TEST_NODE, 0);
+  test_compactor_wait(&stats);
+#if CONFIG_GATEWAY_COMPACT_LATEST
+  CHECK(test_read_segment(first + 1, values) == 0);
+#else
+  CHECK(test_read_segment(first + 1, values) == 1 && values[0] == 0);
+#endif
+  CHECK(test_read_segment(first + 2, values) == 1 && values[0] == 1);
+  CHECK(stats.dropped == before.dropped + 1 && stats.rewritten == before.rewritten + 1);
+}
+
+#endif
+
+/* ---- config message parser ---- */
+
+static bool test_field_is(const config_field_t *field, const char *value) {
+  return field->len == strlen(value) && (field->len == 0 || memcmp(field->ptr, value, field->len) == 0);
+}
+
+#define TEST_PARSE(parse, msg, config) parse((const uint8_t *)(msg), sizeof(msg) - 1, config)
+
+static void test_config_wifi(void) {
+  config_wifi_t wifi;
+  CHECK(TEST_PARSE(config_msg_parse_wifi, "\x01\x04home\x02\x06secret", &wifi) == CONFIG_STATUS_OK);
+  CHECK(test_field_is(&wifi.ssid, "home") && test_field_is(&wifi.password, "secret"));
+  // any order, unknown types skipped
+  CHECK(TEST_PARSE(config_msg_parse_wifi, "\x02\x02pw\x7f\x01x\x01\x02" "ap", &wifi) == CONFIG_STATUS_OK);
+  CHECK(test_field_is(&wifi.ssid, "ap") && test_field_is(&wifi.password, "pw"));
+  CHECK(TEST_PARSE(config_msg_parse_wifi, "\x01\x02" "ap", &wifi) == CONFIG_STATUS_OK);
+  CHECK(test_field_is(&wifi.password, ""));
+
+  CHECK(config_msg_parse_wifi(NULL, 0, &wifi) == CONFIG_STATUS_EMPTY);
+  CHECK(TEST_PARSE(config_msg_parse_wifi, "\x01\x05home", &wifi) == CONFIG_STATUS_TRUNCATED);
+  CHECK(TEST_PARSE(config_msg_parse_wifi, "\x01\x04home\x02", &wifi) == CONFIG_STATUS_TRUNCATED);
+  CHECK(TEST_PARSE(config_msg_parse_wifi, "\x02\x02pw", &wifi) == CONFIG_STATUS_MISSING_FIELD);
+  CHECK(TEST_PARSE(config_msg_parse_wifi, "\x01\x00", &wifi) == CONFIG_STATUS_MISSING_FIELD);
+  CHECK(TEST_PARSE(config_msg_parse_wifi, "\x01\x01" "a\x01\x01" "b", &wifi) == CONFIG_STATUS_DUPLICATE_FIELD);
+  CHECK(TEST_PARSE(config_msg_parse_wifi, "\x01\x03" "a\0b", &wifi) == CONFIG_STATUS_MALFORMED);
+  CHECK(TEST_PARSE(config_msg_parse_wifi, "\x01\x20" "0123456789abcdef0123456789abcdef", &wifi) ==
+        CONFIG_STATUS_FIELD_TOO_LONG);
+  CHECK(TEST_PARSE(config_msg_parse_wifi, "\x01\x1f" "0123456789abcdef0123456789abcde", &wifi) == CONFIG_STATUS_OK);
+
+  // legacy text, split at the first '.', with or without the terminator older provisioners sent
+  CHECK(TEST_PARSE(config_msg_parse_wifi, "home.se.cret", &wifi) == CONFIG_STATUS_OK);
+  CHECK(test_field_is(&wifi.ssid, "home") && test_field_is(&wifi.password, "se.cret"));
+  CHECK(config_msg_parse_wifi((const uint8_t *)"home.pw", 8, &wifi) == CONFIG_STATUS_OK);
+  CHECK(test_field_is(&wifi.ssid, "home") && test_field_is(&wifi.password, "pw"));
+  CHECK(TEST_PARSE(config_msg_parse_wifi, "home.", &wifi) == CONFIG_STATUS_OK);
+  CHECK(test_field_is(&wifi.password, ""));
+  CHECK(TEST_PARSE(config_msg_parse_wifi, "home", &wifi) == CONFIG_STATUS_MALFORMED);
+  CHECK(TEST_PARSE(config_msg_parse_wifi, ".pw", &wifi) == CONFIG_STATUS_MISSING_FIELD);
+}
+
+static void test_config_mqtt(void) {
+  config_mqtt_t mqtt;
+  CHECK(TEST_PARSE(config_msg_parse_mqtt, "\x10\x0dmqtt://broker\x11\x04user\x12\x04pass", &mqtt) ==
+        CONFIG_STATUS_OK);
+  CHECK(test_field_is(&mqtt.uri, "mqtt://broker") && test_field_is(&mqtt.username, "user") &&
+        test_field_is(&mqtt.password, "pass"));
+  CHECK(TEST_PARSE(config_msg_parse_mqtt, "\x10\x01u", &mqtt) == CONFIG_STATUS_OK);
+  CHECK(test_field_is(&mqtt.username, "") && test_field_is(&mqtt.password, ""));
+  CHECK(TEST_PARSE(config_msg_parse_mqtt, "\x11\x04user", &mqtt) == CONFIG_STATUS_MISSING_FIELD);
+  CHECK(TEST_PARSE(config_msg_parse_mqtt, "\x10\x01u\x10\x01v", &mqtt) == CONFIG_STATUS_DUPLICATE_FIELD);
+  // the Wi-Fi types are unknown here
+  CHECK(TEST_PARSE(config_msg_parse_mqtt, "\x01\x02" "ap\x10\x01u", &mqtt) == CONFIG_STATUS_OK);
+  CHECK(test_field_is(&mqtt.uri, "u"));
+
+  // legacy text, exactly three fields
+  CHECK(TEST_PARSE(config_msg_parse_mqtt, "mqtt://broker|user|pass", &mqtt) == CONFIG_STATUS_OK);
+  CHECK(test_field_is(&mqtt.uri, "mqtt://broker") && test_field_is(&mqtt.username, "user") &&
+        test_field_is(&mqtt.password, "pass"));
+  CHECK(TEST_PARSE(config_msg_parse_mqtt, "mqtt://broker||", &mqtt) == CONFIG_STATUS_OK);
+  CHECK(test_field_is(&mqtt.username, "") && test_field_is(&mqtt.password, ""));
+  CHECK(TEST_PARSE(config_msg_parse_mqtt, "mqtt://broker|user", &mqtt) == CONFIG_STATUS_MALFORMED);
+  CHECK(TEST_PARSE(config_msg_parse_mqtt, "mqtt://broker|user|pass|x", &mqtt) == CONFIG_STATUS_MALFORMED);
+  CHECK(TEST_PARSE(config_msg_parse_mqtt, "|user|pass", &mqtt) == CONFIG_STATUS_MISSING_FIELD);
+}
+
+/* ---- MQTT topic filters ---- */
+
+static bool test_matches(const char *filter, const char *topic) {
+  return mqtt_topic_matches(filter, topic, strlen(topic));
+}
+
+static void test_topic_matches(void) {
+  CHECK(test_matches("a/b", "a/b"));
+  CHECK(!test_matches("a/b", "a/bc"));
+  CHECK(!test_matches("a/b", "a"));
+  CHECK(!test_matches("a/b", "a/b/c"));
+  CHECK(test_matches("a/+/c", "a/b/c"));
+  CHECK(test_matches("a/+/c", "a//c"));
+  CHECK(!test_matches("a/+/c", "a/b/d"));
+  CHECK(!test_matches("a/+", "a/b/c"));
+  CHECK(test_matches("a/+", "a/"));
+  CHECK(test_matches("a/#", "a/b/c"));
+  CHECK(test_matches("a/#", "a/"));
+  CHECK(test_matches("a/#", "a"));
+  CHECK(!test_matches("a/#", "ab"));
+  CHECK(!test_matches("a/#", "b/a"));
+  CHECK(test_matches("#", "a/b"));
+  CHECK(test_matches("+/#", "a"));
+  // the topic is not NUL terminated where topic_len ends
+  CHECK(mqtt_topic_matches("a/b", "a/bc", 3));
+  CHECK(!mqtt_topic_matches("a/bc", "a/bc", 3));
+}
+
+/* ---- group resolution ---- */
+
+static void test_group_table_resolve(void) {
+  CHECK(group_table_init() == ESP_OK);
+  const uint16_t big[] = {3, 1, 2, 4};
+  const uint16_t pair[] = {5, 6};
+  const uint16_t overlap[] = {4, 5};
+  const uint16_t outside[] = {6, 9};
+  CHECK(group_table_set(0xc000, big, 4) == ESP_OK);
+  CHECK(group_table_set(0xc001, pair, 2) == ESP_OK);
+  CHECK(group_table_set(0xc002, overlap, 2) == ESP_OK);
+  CHECK(group_table_set(0xc003, outside, 2) == ESP_OK);
+  CHECK(group_table_count() == 4);
+
+  uint16_t dests[16];
+  size_t groups;
+  size_t unicasts;
+  // the biggest group first, then the one that still adds two targets, the overlapping one adds nothing
+  const uint16_t all[] = {1, 2, 3, 4, 5, 6, 7};
+  CHECK(group_table_resolve(all, 7, dests, &groups, &unicasts) == ESP_OK);
+  CHECK(groups == 2 && unicasts == 1);
+  CHECK(dests[0] == 0xc000 && dests[1] == 0xc001 && dests[2] == 7);
+
+  // 0xc001 would reach 6, which is not a target, and 0xc002 only adds 5
+  const uint16_t most[] = {1, 2, 3, 4, 5};
+  CHECK(group_table_resolve(most, 5, dests, &groups, &unicasts) == ESP_OK);
+  CHECK(groups == 1 && unicasts == 1);
+  CHECK(dests[0] == 0xc000 && dests[1] == 5);
+
+  const uint16_t few[] = {2, 9};
+  CHECK(group_table_resolve(few, 2, dests, &groups, &unicasts) == ESP_OK);
+  CHECK(groups == 0 && unicasts == 2);
+  CHECK(dests[0] == 2 && dests[1] == 9);
+
+  CHECK(group_table_resolve(NULL, 0, dests, &groups, &unicasts) == ESP_OK);
+  CHECK(groups == 0 && unicasts == 0);
+
+  // a forgotten group is not used any more
+  CHECK(group_table_set(0xc000, NULL, 0) == ESP_OK);
+  CHECK(group_table_resolve(most, 5, dests, &groups, &unicasts) == ESP_OK);
+  CHECK(groups == 1 && unicasts == 3);
+  CHECK(dests[0] == 0xc002 && dests[1] == 1 && dests[2] == 2 && dests[3] == 3);
+}
+
+/* ---- metrics report ---- */
+
+#if CONFIG_GATEWAY_METRICS
+
+/* The report with every counter and maximum at 10 digits and every bucket of every stage in use. */
+static void test_metrics_report(void) {
+  for (int counter = 0; counter < METRICS_COUNTER_COUNT; counter++) {
+    metrics_add(counter, 4000000000u);
+  }
+  for (int stage = 0; stage < METRICS_STAGE_COUNT; stage++) {
+    for (int bucket = 0; bucket < METRICS_BUCKETS; bucket++) {
+      metrics_record(stage, 64u << bucket);
+    }
+    metrics_record(stage, 4000000000u);
+  }
+  char report[METRICS_REPORT_MAX_LEN];
+  size_t len = metrics_format(report, sizeof(report));
+  CHECK(len > 0 && len < sizeof(report));
+}
+
+#endif
+
+int main(int argc, char **argv) {
+  if (argc > 2) {
+    fprintf(stderr, "usage: %s [sd-dir]\n", argv[0]);
+    return 2;
+  }
+  if (!getenv("GATEWAY_LOG_LEVEL")) {
+    esp_log_level_set("*", ESP_LOG_ERROR); // the recovery paths warn by design
+  }
+  s_sd_dir = argc > 1 ? argv[1] : "test_sdcard";
+  sd_host_set_root(s_sd_dir);
+  sd_init();
+
+  test_config_wifi();
+  test_config_mqtt();
+  test_topic_matches();
+  test_group_table_resolve();
+#if CONFIG_GATEWAY_METRICS
+  test_metrics_report();
+#endif
+  test_journal_torn_tail();
+  test_journal_rewrite_recovery();
+  test_journal_wrapped_names();
+  test_journal_reopen();
+  test_journal_eviction();
+#if CONFIG_GATEWAY_COMPACT
+  test_compaction();
+#endif
+#if CONFIG_GATEWAY_JOURNAL_FSYNC_PERIODIC
+  test_journal_writer_periodic_sync(); // last, the writer task keeps running
+#endif
+
+  printf("%s: %d of %d checks failed\n", argv[0], s_failures, s_checks);
+  return s_failures ? 1 : 0;
+}
@@ -0,0 +1,86 @@
+#include "batch.h"
+
+#if CONFIG_GATEWAY_BATCH
+
+#include <string.h>
+
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "metrics.h"
+#include "offline_buffer.h"
+#include "payload.h"
+#include "topic_table.h"
+
+#define BATCH_FRAME_LEN 3 // topic length and payload length
+#define BATCH_MAX_DELAY pdMS_TO_TICKS(CONFIG_GATEWAY_BATCH_MAX_DELAY_MS)
+
+_Static_assert(CONFIG_GATEWAY_BATCH_MAX_BYTES >=
+                   BATCH_FRAME_LEN + TOPIC_MAX_LEN + PAYLOAD_MAX_LEN(OFFLINE_BUFFER_MAX_DATA_LEN),
+               "CONFIG_GATEWAY_BATCH_MAX_BYTES must hold the largest record");
+
+static SemaphoreHandle_t s_lock;
+static batch_stats_t s_stats;
+
+esp_err_t batch_init(void) {
+  if (!s_lock) {
+    s_lock = xSemaphoreCreateMutex();
+  }
+  return s_lock ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+bool batch_add(batch_t *batch, const char *topic, const char *payload, size_t len) {
+  size_t topic_len = strlen(topic);
+  if (batch->len + BATCH_FRAME_LEN + topic_len + len > sizeof(batch->data)) {
+    return false;
+  }
+  if (batch->count == 0) {
+    batch->started = xTaskGetTickCount();
+  }
+  char *out = batch->data + batch->len;
+  *out++ = topic_len;
+  memcpy(out, topic, topic_len);
+  out += topic_len;
+  *out++ = len >> 8;
+  *out++ = len;
+  memcpy(out, payload, len);
+  batch->len = out + len - batch->data;
+  batch->count++;
+  return true;
+}
+
+bool batch_due(const batch_t *batch) {
+  return batch->count > 0 && xTaskGetTickCount() - batch->started >= BATCH_MAX_DELAY;
+}
+
+TickType_t batch_wait_ticks(const batch_t *batch) {
+  if (batch->count == 0) {
+    return portMAX_DELAY;
+  }
+  TickType_t elapsed = xTaskGetTickCount() - batch->started;
+  return elapsed >= BATCH_MAX_DELAY ? 0 : BATCH_MAX_DELAY - elapsed;
+}
+
+void batch_published(const batch_t *batch, bool full) {
+  metrics_count(METRICS_COUNTER_BATCHES);
+  metrics_add(METRICS_COUNTER_BATCH_RECORDS, batch->count);
+  metrics_add(METRICS_COUNTER_BATCH_BYTES, batch->len);
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  s_stats.batches++;
+  s_stats.records += batch->count;
+  s_stats.bytes += batch->len;
+  s_stats.full += full;
+  xSemaphoreGive(s_lock);
+}
+
+void batch_get_stats(batch_stats_t *stats) {
+  if (!s_lock) {
+    *stats = (batch_stats_t){0};
+    return;
+  }
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  *stats = s_stats;
+  xSemaphoreGive(s_lock);
+}
+
+#endif
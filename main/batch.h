@@ -0,0 +1,71 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#include "sdkconfig.h"
+
+/*
+ * Batched publishes. With CONFIG_GATEWAY_BATCH, live node reports and replayed records are not published one by one
+ * but collected into a batch, which goes out as a single QoS 1 message on CONFIG_GATEWAY_BATCH_TOPIC once the next
+ * record would not fit into CONFIG_GATEWAY_BATCH_MAX_BYTES or CONFIG_GATEWAY_BATCH_MAX_DELAY_MS after its first
+ * record. One PUBACK then covers all of its records.
+ *
+ * The payload of a batch is its records one after another, each framed as
+ *
+ *   | topic length (1) | topic | payload length (2, big endian) | payload |
+ *
+ * with the topic and payload the record would have been published with on its own.
+ *
+ * The uplink publisher task and the replay task each own a batch; a batch is not thread safe. Live and replayed
+ * records never share a batch, and neither do records from different journal segments.
+ */
+
+typedef struct {
+  uint32_t batches; // batches published
+  uint32_t records; // records in them
+  uint32_t bytes;   // payload bytes of them, bytes / (batches * CONFIG_GATEWAY_BATCH_MAX_BYTES) is the fill ratio
+  uint32_t full;    // batches published because the next record did not fit, the rest were due
+} batch_stats_t;
+
+#if CONFIG_GATEWAY_BATCH
+
+typedef struct {
+  char data[CONFIG_GATEWAY_BATCH_MAX_BYTES];
+  size_t len;
+  uint16_t count;
+  TickType_t started; // when the first record was added
+} batch_t;
+
+/* Sets up the statistics, before either owner starts. */
+esp_err_t batch_init(void);
+
+static inline void batch_reset(batch_t *batch) {
+  batch->len = 0;
+  batch->count = 0;
+}
+
+/* Adds a record. Returns false if it does not fit, the caller publishes the batch and adds the record again. Every
+ * record of up to TOPIC_MAX_LEN and PAYLOAD_MAX_LEN(OFFLINE_BUFFER_MAX_DATA_LEN) bytes fits into an empty batch. */
+bool batch_add(batch_t *batch, const char *topic, const char *payload, size_t len);
+/* Whether the batch has been open for CONFIG_GATEWAY_BATCH_MAX_DELAY_MS. */
+bool batch_due(const batch_t *batch);
+/* Ticks until the batch is due, portMAX_DELAY for an empty batch. */
+TickType_t batch_wait_ticks(const batch_t *batch);
+/* Accounts for a batch that was handed to the MQTT client, before it is reset. */
+void batch_published(const batch_t *batch, bool full);
+void batch_get_stats(batch_stats_t *stats);
+
+#else
+
+static inline esp_err_t batch_init(void) { return ESP_OK; }
+static inline void batch_get_stats(batch_stats_t *stats) { *stats = (batch_stats_t){0}; }
+
+#endif
+
+#endif // _BATCH_H_
@@ -0,0 +1,351 @@
+#include "compactor.h"
+
+#if CONFIG_GATEWAY_COMPACT
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "journal.h"
+#include "metrics.h"
+#include "payload.h"
+#include "sdkconfig.h"
+#include "topic_table.h"
+
+static const char *TAG = "COMPACTOR";
+
+#define COMPACTOR_SIZE CONFIG_GATEWAY_NODE_SHADOW_SIZE
+#define COMPACTOR_MASK (COMPACTOR_SIZE - 1)
+#define COMPACTOR_PERIOD pdMS_TO_TICKS(1000)
+// smallest record: a header and a topic string of length 0
+#define COMPACTOR_MAX_RECORDS (CONFIG_GATEWAY_JOURNAL_SEGMENT_SIZE_KB * 1024L / (JOURNAL_HEADER_LEN + 1))
+
+/* A node topic in the segments of this pass newer than the one being compacted: the data of its oldest record
+ * there, which is the next newer record for the segment at hand, and its newest record in the pass. A free slot has
+ * topic_id 0 and slots are only freed between passes. */
+typedef struct {
+  uint16_t topic_id;
+  bool untracked;     // the topic had no room in some newer segment, its older records are all kept
+  bool newest_known;  // the newest record was tracked, newest_crc is valid
+  uint32_t crc;
+  uint32_t newest_segment;
+  uint32_t newest_crc;
+} compactor_newer_t;
+
+/* A node topic in the segment being compacted. */
+typedef struct {
+  uint16_t topic_id;
+  uint32_t first_crc;
+  uint32_t last_crc;
+  size_t last_index; // of the newest record
+} compactor_seen_t;
+
+/* A node topic in the segments compacted by earlier passes: where its newest record there is, the only one a newer
+ * record can still make redundant. Slots are never freed, a topic keeps its slot when its segment is gone. */
+typedef struct {
+  uint16_t topic_id;
+  bool known; // the newest record was tracked, it is never dropped otherwise
+  bool drop;  // marked for compactor_drop_last()
+  uint32_t segment;
+  uint32_t crc;
+} compactor_last_t;
+
+static SemaphoreHandle_t s_lock;
+static TaskHandle_t s_task;
+static compactor_newer_t s_newer[COMPACTOR_SIZE];
+static compactor_seen_t s_seen[COMPACTOR_SIZE];
+static compactor_last_t s_last[COMPACTOR_SIZE];
+static uint32_t s_compacted; // segments below have been compacted by a pass
+static uint8_t *s_drop; // one bit per record of the segment at hand
+static compactor_stats_t s_stats;
+
+static inline unsigned compactor_hash(uint16_t topic_id) { return (topic_id * 40503u >> 4) & COMPACTOR_MASK; }
+
+/* Returns the slot holding topic_id, or the free slot where it would be inserted, or NULL if the table is full. */
+static compactor_newer_t *compactor_find_newer(uint16_t topic_id) {
+  unsigned slot = compactor_hash(topic_id);
+  for (unsigned probe = 0; probe < COMPACTOR_SIZE; probe++) {
+    compactor_newer_t *entry = &s_newer[(slot + probe) & COMPACTOR_MASK];
+    if (entry->topic_id == topic_id || entry->topic_id == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static compactor_seen_t *compactor_find_seen(uint16_t topic_id) {
+  unsigned slot = compactor_hash(topic_id);
+  for (unsigned probe = 0; probe < COMPACTOR_SIZE; probe++) {
+    compactor_seen_t *entry = &s_seen[(slot + probe) & COMPACTOR_MASK];
+    if (entry->topic_id == topic_id || entry->topic_id == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static compactor_last_t *compactor_find_last(uint16_t topic_id) {
+  unsigned slot = compactor_hash(topic_id);
+  for (unsigned probe = 0; probe < COMPACTOR_SIZE; probe++) {
+    compactor_last_t *entry = &s_last[(slot + probe) & COMPACTOR_MASK];
+    if (entry->topic_id == topic_id || entry->topic_id == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+/* Whether a record is redundant given the next newer record of the same topic. */
+static inline bool compactor_supersedes(uint32_t crc, uint32_t newer_crc) {
+#if CONFIG_GATEWAY_COMPACT_TRANSITIONS
+  return crc == newer_crc;
+#else
+  return true;
+#endif
+}
+
+static inline void compactor_drop(size_t index) { s_drop[index / 8] |= 1 << (index % 8); }
+
+/* Rewrites segment without the records marked in s_drop. */
+static void compactor_rewrite(uint32_t segment, size_t count, uint32_t dropped) {
+  if (dropped == 0) {
+    return;
+  }
+  long saved;
+  esp_err_t err = journal_rewrite(segment, s_drop, count, &saved);
+  if (err != ESP_OK) {
+    ESP_LOGD(TAG, "Segment %04x not rewritten (%s)", segment, esp_err_to_name(err));
+    return;
+  }
+  ESP_LOGD(TAG, "Segment %04x: %u of %u records dropped, %ld bytes saved", segment, dropped, count, saved);
+  for (uint32_t i = 0; i < dropped; i++) {
+    metrics_count(METRICS_COUNTER_COMPACTED);
+  }
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  s_stats.rewritten++;
+  s_stats.dropped += dropped;
+  s_stats.bytes_saved += saved;
+  xSemaphoreGive(s_lock);
+}
+
+/* Marks the redundant records of segment in s_drop and rewrites it without them, then records the oldest record of
+ * every topic in s_newer for the older segments. */
+static void compactor_segment(uint32_t segment) {
+  journal_reader_t reader;
+  if (journal_reader_open(&reader, segment, 0) != ESP_OK) {
+    return;
+  }
+  memset(s_seen, 0, sizeof(s_seen));
+  memset(s_drop, 0, (COMPACTOR_MAX_RECORDS + 7) / 8);
+  journal_record_t record;
+  size_t count = 0;
+  uint32_t dropped = 0;
+  while (count < COMPACTOR_MAX_RECORDS && journal_reader_next(&reader, &record) == ESP_OK) {
+    size_t index = count++;
+    if (!topic_id_is_node(record.topic_id)) {
+      continue;
+    }
+    const char *state;
+    size_t state_len = payload_state(record.data, record.data_len, &state);
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)state, state_len);
+    compactor_seen_t *seen = compactor_find_seen(record.topic_id);
+    if (!seen) {
+      // no room to follow the topic in this segment, keep it here and in every older segment
+      compactor_newer_t *newer = compactor_find_newer(record.topic_id);
+      if (newer) {
+        if (newer->topic_id == 0) {
+          *newer = (compactor_newer_t){.topic_id = record.topic_id, .newest_segment = segment};
+        }
+        newer->untracked = true;
+      }
+      continue;
+    }
+    if (seen->topic_id == 0) {
+      *seen = (compactor_seen_t){.topic_id = record.topic_id, .first_crc = crc};
+    } else if (compactor_supersedes(seen->last_crc, crc)) {
+      compactor_drop(seen->last_index);
+      dropped++;
+    }
+    seen->last_crc = crc;
+    seen->last_index = index;
+  }
+  journal_reader_close(&reader);
+
+  for (int i = 0; i < COMPACTOR_SIZE; i++) {
+    const compactor_seen_t *seen = &s_seen[i];
+    if (seen->topic_id == 0) {
+      continue;
+    }
+    compactor_newer_t *newer = compactor_find_newer(seen->topic_id);
+    if (newer && newer->topic_id == seen->topic_id && !newer->untracked &&
+        compactor_supersedes(seen->last_crc, newer->crc)) {
+      compactor_drop(seen->last_index);
+      dropped++;
+    }
+    // a topic without room in s_newer was not in it before either, so older segments keep all of its records
+    if (!newer) {
+      continue;
+    }
+    if (newer->topic_id == 0) {
+      *newer = (compactor_newer_t){.topic_id = seen->topic_id,
+                                   .newest_known = true,
+                                   .newest_segment = segment,
+                                   .newest_crc = seen->last_crc};
+    }
+    newer->untracked = false;
+    newer->crc = seen->first_crc;
+  }
+  compactor_rewrite(segment, count, dropped);
+}
+
+/* Drops the newest record of every topic whose s_last entry is marked and points at segment, if it is still the
+ * record the entry describes. */
+static void compactor_drop_last(uint32_t segment) {
+  journal_reader_t reader;
+  bool opened = journal_reader_open(&reader, segment, 0) == ESP_OK;
+  memset(s_seen, 0, sizeof(s_seen));
+  memset(s_drop, 0, (COMPACTOR_MAX_RECORDS + 7) / 8);
+  journal_record_t record;
+  size_t count = 0;
+  while (opened && count < COMPACTOR_MAX_RECORDS && journal_reader_next(&reader, &record) == ESP_OK) {
+    size_t index = count++;
+    const compactor_last_t *last = topic_id_is_node(record.topic_id) ? compactor_find_last(record.topic_id) : NULL;
+    if (!last || !last->drop || last->topic_id != record.topic_id || last->segment != segment) {
+      continue;
+    }
+    compactor_seen_t *seen = compactor_find_seen(record.topic_id);
+    if (seen) {
+      const char *state;
+      size_t state_len = payload_state(record.data, record.data_len, &state);
+      *seen = (compactor_seen_t){.topic_id = record.topic_id,
+                                 .last_crc = esp_rom_crc32_le(0, (const uint8_t *)state, state_len),
+                                 .last_index = index};
+    }
+  }
+  if (opened) {
+    journal_reader_close(&reader);
+  }
+
+  // the marks are cleared even if the segment could not be read
+  uint32_t dropped = 0;
+  for (int i = 0; i < COMPACTOR_SIZE; i++) {
+    compactor_last_t *last = &s_last[i];
+    if (!last->drop || last->segment != segment) {
+      continue;
+    }
+    last->drop = false;
+    const compactor_seen_t *seen = compactor_find_seen(last->topic_id);
+    if (seen && seen->topic_id == last->topic_id && seen->last_crc == last->crc) {
+      compactor_drop(seen->last_index);
+      dropped++;
+    }
+  }
+  compactor_rewrite(segment, count, dropped);
+}
+
+/* The segments of earlier passes only hold one record per topic that the segments of this pass can make redundant,
+ * the newest one. Marks those that are and drops them, then moves the s_last entries to the newest records of this
+ * pass. */
+static void compactor_merge(uint32_t first, bool older_rewritable) {
+  for (int i = 0; i < COMPACTOR_SIZE; i++) {
+    compactor_last_t *last = &s_last[i];
+    const compactor_newer_t *newer = last->topic_id ? compactor_find_newer(last->topic_id) : NULL;
+    last->drop = older_rewritable && newer && newer->topic_id == last->topic_id && !newer->untracked && last->known &&
+                 last->segment < first && compactor_supersedes(last->crc, newer->crc) &&
+                 journal_rewritable(last->segment);
+  }
+  for (int i = 0; i < COMPACTOR_SIZE; i++) {
+    if (s_last[i].drop) {
+      compactor_drop_last(s_last[i].segment);
+    }
+  }
+  for (int i = 0; i < COMPACTOR_SIZE; i++) {
+    const compactor_newer_t *newer = &s_newer[i];
+    compactor_last_t *last = newer->topic_id ? compactor_find_last(newer->topic_id) : NULL;
+    if (last) {
+      *last = (compactor_last_t){.topic_id = newer->topic_id,
+                                 .known = newer->newest_known,
+                                 .segment = newer->newest_segment,
+                                 .crc = newer->newest_crc};
+    }
+  }
+}
+
+/* Compacts the segments sealed since the last pass, newest first, and the records of older segments they make
+ * redundant. */
+static void compactor_pass(void) {
+  uint32_t active = journal_active_segment();
+  // until the replay position is known no segment is rewritable, the segments wait for a later pass then
+  if (active > 0 && journal_rewritable(active - 1)) {
+    uint32_t oldest = journal_oldest_segment();
+    uint32_t first = s_compacted > oldest ? s_compacted : oldest;
+    memset(s_newer, 0, sizeof(s_newer));
+    // everything older than the first segment that is not rewritable is off limits as well
+    bool older_rewritable = true;
+    for (uint32_t segment = active; segment-- > first;) {
+      if (!journal_rewritable(segment)) {
+        older_rewritable = false;
+        break;
+      }
+      compactor_segment(segment);
+    }
+    compactor_merge(first, older_rewritable);
+    s_compacted = active;
+  }
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  s_stats.passes++;
+  xSemaphoreGive(s_lock);
+}
+
+static void compactor_task(void *pvParameters) {
+  uint32_t compacted = UINT32_MAX; // a backlog from before the boot is compacted right away
+  for (;;) {
+    bool kicked = ulTaskNotifyTake(pdTRUE, COMPACTOR_PERIOD) > 0;
+    uint32_t active = journal_active_segment();
+    if (kicked || active != compacted) {
+      compacted = active;
+      compactor_pass();
+    }
+  }
+}
+
+esp_err_t compactor_start(void) {
+  if (s_task) {
+    return ESP_OK;
+  }
+  s_lock = xSemaphoreCreateMutex();
+  s_drop = malloc((COMPACTOR_MAX_RECORDS + 7) / 8);
+  if (!s_lock || !s_drop) {
+    return ESP_ERR_NO_MEM;
+  }
+  if (xTaskCreate(compactor_task, "compactor", 3072, NULL, 2, &s_task) != pdPASS) {
+    ESP_LOGE(TAG, "Could not start compactor task");
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+void compactor_kick(void) {
+  if (s_task) {
+    xTaskNotifyGive(s_task);
+  }
+}
+
+void compactor_get_stats(compactor_stats_t *stats) {
+  if (!s_lock) {
+    *stats = (compactor_stats_t){0};
+    return;
+  }
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  *stats = s_stats;
+  xSemaphoreGive(s_lock);
+}
+
+#endif
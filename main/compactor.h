@@ -0,0 +1,54 @@
+#ifndef _COMPACTOR_H_
+#define _COMPACTOR_H_
+
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+/*
+ * Backlog compaction. Records on node topics (topic ids 0x0001..0x7fff, see topic_table.h) carry the state of a
+ * node, and after a long outage most of them are outdated by the time they would be replayed. Whenever a journal
+ * segment has been sealed, a low priority task rewrites the sealed segments the replay has not reached yet without
+ * the records on node topics that a newer record makes redundant:
+ *
+ *   CONFIG_GATEWAY_COMPACT_LATEST       every record but the newest of its topic
+ *   CONFIG_GATEWAY_COMPACT_TRANSITIONS  every record whose state (payload_state()) equals that of the next newer
+ *                                       record of its topic, so that each run of equal states is kept as its newest
+ *                                       record
+ *
+ * Records on fixed topics and records that carry a topic string are events and are never dropped. Records in the
+ * active segment are never dropped either, and neither are the records of a node topic once more topics than
+ * CONFIG_GATEWAY_NODE_SHADOW_SIZE show up, the compactor then errs on the side of keeping too much.
+ *
+ * Passes are incremental. A pass reads the segments sealed since the previous one, newest first. In the segments
+ * compacted before, only the newest record of a topic can still become redundant, and the compactor remembers where
+ * that record is. So besides the new segments a pass only reads the older segments that hold such a record, at
+ * most one per topic in the new segments, never the whole backlog. After a reboot the first pass covers every
+ * sealed segment once.
+ */
+
+typedef struct {
+  uint32_t passes;      // passes over the sealed segments
+  uint32_t rewritten;   // segments rewritten
+  uint32_t dropped;     // records dropped
+  uint32_t bytes_saved; // bytes those records took in the journal
+} compactor_stats_t;
+
+#if CONFIG_GATEWAY_COMPACT
+
+/* Starts the compactor task. The journal must be open and the replay initialised. */
+esp_err_t compactor_start(void);
+/* Runs a pass now, even if no segment has been sealed since the last one. */
+void compactor_kick(void);
+void compactor_get_stats(compactor_stats_t *stats);
+
+#else
+
+static inline esp_err_t compactor_start(void) { return ESP_OK; }
+static inline void compactor_kick(void) {}
+static inline void compactor_get_stats(compactor_stats_t *stats) { *stats = (compactor_stats_t){0}; }
+
+#endif
+
+#endif // _COMPACTOR_H_
@@ -0,0 +1,147 @@
+#include "config_msg.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+typedef struct {
+  uint8_t type;
+  uint8_t max_len;
+  bool required;
+  size_t offset; // of the config_field_t in the config struct
+} config_field_spec_t;
+
+static const config_field_spec_t s_wifi_fields[] = {
+    {CONFIG_TLV_WIFI_SSID, WIFI_SSID_MAX_LEN - 1, true, offsetof(config_wifi_t, ssid)},
+    {CONFIG_TLV_WIFI_PASSWORD, WIFI_PSWD_MAX_LEN - 1, false, offsetof(config_wifi_t, password)},
+};
+
+static const config_field_spec_t s_mqtt_fields[] = {
+    {CONFIG_TLV_MQTT_URI, MQTT_URI_MAX_LEN - 1, true, offsetof(config_mqtt_t, uri)},
+    {CONFIG_TLV_MQTT_USERNAME, MQTT_USERNAME_MAX_LEN - 1, false, offsetof(config_mqtt_t, username)},
+    {CONFIG_TLV_MQTT_PASSWORD, MQTT_PASSWORD_MAX_LEN - 1, false, offsetof(config_mqtt_t, password)},
+};
+
+#define CONFIG_FIELD_COUNT(specs) (sizeof(specs) / sizeof((specs)[0]))
+
+static inline config_field_t *config_field_at(void *config, const config_field_spec_t *spec) {
+  return (config_field_t *)((uint8_t *)config + spec->offset);
+}
+
+/* Stores a value for spec after checking its length and that it has no NUL byte. */
+static config_status_t config_set_field(void *config, const config_field_spec_t *spec, const uint8_t *value,
+                                        size_t len) {
+  if (len > spec->max_len) {
+    return CONFIG_STATUS_FIELD_TOO_LONG;
+  }
+  if (memchr(value, '\0', len)) {
+    return CONFIG_STATUS_MALFORMED;
+  }
+  config_field_t *field = config_field_at(config, spec);
+  field->ptr = (const char *)value;
+  field->len = len;
+  return CONFIG_STATUS_OK;
+}
+
+/* A required field that is present but empty counts as missing. */
+static config_status_t config_check_required(const config_field_spec_t *specs, size_t spec_count, void *config) {
+  for (size_t i = 0; i < spec_count; i++) {
+    if (specs[i].required && config_field_at(config, &specs[i])->len == 0) {
+      return CONFIG_STATUS_MISSING_FIELD;
+    }
+  }
+  return CONFIG_STATUS_OK;
+}
+
+static config_status_t config_parse_tlv(const uint8_t *msg, size_t len, const config_field_spec_t *specs,
+                                        size_t spec_count, void *config) {
+  uint32_t seen = 0;
+  size_t pos = 0;
+  while (pos < len) {
+    if (len - pos < 2 || msg[pos + 1] > len - pos - 2) {
+      return CONFIG_STATUS_TRUNCATED;
+    }
+    uint8_t type = msg[pos];
+    uint8_t field_len = msg[pos + 1];
+    const uint8_t *value = msg + pos + 2;
+    pos += 2 + field_len;
+    for (size_t i = 0; i < spec_count; i++) {
+      if (specs[i].type != type) {
+        continue;
+      }
+      if (seen & (1u << i)) {
+        return CONFIG_STATUS_DUPLICATE_FIELD;
+      }
+      seen |= 1u << i;
+      config_status_t status = config_set_field(config, &specs[i], value, field_len);
+      if (status != CONFIG_STATUS_OK) {
+        return status;
+      }
+      break;
+    }
+  }
+  return config_check_required(specs, spec_count, config);
+}
+
+/* Splits legacy text into spec_count fields. With split_once only the first separator counts and the last field
+ * takes the rest of the text, otherwise there must be exactly spec_count - 1 separators. */
+static config_status_t config_parse_text(const uint8_t *msg, size_t len, char separator, bool split_once,
+                                         const config_field_spec_t *specs, size_t spec_count, void *config) {
+  // Older provisioners sent the C string including its terminator.
+  const uint8_t *nul = memchr(msg, '\0', len);
+  if (nul) {
+    len = nul - msg;
+  }
+  size_t start = 0;
+  for (size_t i = 0; i < spec_count; i++) {
+    bool last = i + 1 == spec_count;
+    const uint8_t *end;
+    if (last) {
+      end = split_once ? msg + len : memchr(msg + start, separator, len - start);
+      if (end && end != msg + len) {
+        return CONFIG_STATUS_MALFORMED; // too many fields
+      }
+      end = msg + len;
+    } else {
+      end = memchr(msg + start, separator, len - start);
+      if (!end) {
+        return CONFIG_STATUS_MALFORMED;
+      }
+    }
+    config_status_t status = config_set_field(config, &specs[i], msg + start, end - (msg + start));
+    if (status != CONFIG_STATUS_OK) {
+      return status;
+    }
+    start = end - msg + 1;
+  }
+  return config_check_required(specs, spec_count, config);
+}
+
+config_status_t config_msg_parse_wifi(const uint8_t *msg, size_t len, config_wifi_t *config) {
+  memset(config, 0, sizeof(*config));
+  if (!msg || len == 0) {
+    return CONFIG_STATUS_EMPTY;
+  }
+  if (msg[0] >= CONFIG_MSG_LEGACY_MIN) {
+    return config_parse_text(msg, len, '.', true, s_wifi_fields, CONFIG_FIELD_COUNT(s_wifi_fields), config);
+  }
+  return config_parse_tlv(msg, len, s_wifi_fields, CONFIG_FIELD_COUNT(s_wifi_fields), config);
+}
+
+config_status_t config_msg_parse_mqtt(const uint8_t *msg, size_t len, config_mqtt_t *config) {
+  memset(config, 0, sizeof(*config));
+  if (!msg || len == 0) {
+    return CONFIG_STATUS_EMPTY;
+  }
+  if (msg[0] >= CONFIG_MSG_LEGACY_MIN) {
+    return config_parse_text(msg, len, '|', false, s_mqtt_fields, CONFIG_FIELD_COUNT(s_mqtt_fields), config);
+  }
+  return config_parse_tlv(msg, len, s_mqtt_fields, CONFIG_FIELD_COUNT(s_mqtt_fields), config);
+}
+
+void config_field_copy(const config_field_t *field, char *buf, size_t size) {
+  size_t len = field->len < size ? field->len : size - 1;
+  if (len) {
+    memcpy(buf, field->ptr, len);
+  }
+  buf[len] = '\0';
+}
@@ -0,0 +1,70 @@
+#ifndef _CONFIG_MSG_H_
+#define _CONFIG_MSG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mqtt_app.h"
+#include "wifi_connect.h"
+
+/*
+ * Parser for the payload of the Wi-Fi and MQTT config vendor messages. It works in place on the received buffer: the
+ * parsed fields are views into it, nothing is copied and nothing is allocated.
+ *
+ * Payload encoding, a sequence of type-length-value fields:
+ *
+ *   | type (1) | length (1) | value (length) | type (1) | ...
+ *
+ * Fields may come in any order, unknown types are skipped so that newer provisioners can add fields. Every field
+ * that is described below must occur at most once; values must not contain NUL bytes.
+ *
+ * Provisioners that predate the TLV encoding send text, which is recognised by a first byte that is not a valid
+ * field type (any printable character):
+ *
+ *   Wi-Fi  <ssid>.<password>            split at the first '.'
+ *   MQTT   <uri>|<username>|<password>  exactly three fields
+ */
+
+#define CONFIG_TLV_WIFI_SSID 0x01
+#define CONFIG_TLV_WIFI_PASSWORD 0x02
+#define CONFIG_TLV_MQTT_URI 0x10
+#define CONFIG_TLV_MQTT_USERNAME 0x11
+#define CONFIG_TLV_MQTT_PASSWORD 0x12
+
+/* The first byte of a legacy text payload is at least this, the first byte of a TLV payload is a field type. */
+#define CONFIG_MSG_LEGACY_MIN 0x20
+
+/* Status codes sent back in the config status messages. 1 to 4 keep the meaning they had in older firmware. */
+typedef enum {
+  CONFIG_STATUS_OK = 0,
+  CONFIG_STATUS_EMPTY = 1,          // empty payload
+  CONFIG_STATUS_NO_MEMORY = 2,      // no longer produced, the parser does not allocate
+  CONFIG_STATUS_MALFORMED = 3,      // missing separator, NUL byte in a value
+  CONFIG_STATUS_FIELD_TOO_LONG = 4, // a value does not fit into its buffer
+  CONFIG_STATUS_TRUNCATED = 5,      // a TLV field runs past the end of the payload
+  CONFIG_STATUS_MISSING_FIELD = 6,  // a required field is not present or empty
+  CONFIG_STATUS_DUPLICATE_FIELD = 7,
+} config_status_t;
+
+typedef struct {
+  const char *ptr; // points into the parsed payload, not NUL terminated
+  size_t len;
+} config_field_t;
+
+typedef struct {
+  config_field_t ssid;     // required, at most WIFI_SSID_MAX_LEN - 1 bytes
+  config_field_t password; // may be empty, at most WIFI_PSWD_MAX_LEN - 1 bytes
+} config_wifi_t;
+
+typedef struct {
+  config_field_t uri;      // required, at most MQTT_URI_MAX_LEN - 1 bytes
+  config_field_t username; // may be empty, at most MQTT_USERNAME_MAX_LEN - 1 bytes
+  config_field_t password; // may be empty, at most MQTT_PASSWORD_MAX_LEN - 1 bytes
+} config_mqtt_t;
+
+config_status_t config_msg_parse_wifi(const uint8_t *msg, size_t len, config_wifi_t *config);
+config_status_t config_msg_parse_mqtt(const uint8_t *msg, size_t len, config_mqtt_t *config);
+/* Copies a field into a NUL terminated buffer of size bytes. The parser already checked that it fits. */
+void config_field_copy(const config_field_t *field, char *buf, size_t size);
+
+#endif // _CONFIG_MSG_H_
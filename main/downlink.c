@@ -0,0 +1,246 @@
+#include "downlink.h"
+
+#if CONFIG_GATEWAY_DOWNLINK
+
+#include "esp_ble_mesh_defs.h"
+#include "esp_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "fanout.h"
+#include "group_table.h"
+#include "mesh_tx.h"
+#include "metrics.h"
+#include "mqtt_app.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "DOWNLINK";
+
+#define DOWNLINK_RESULT_MAX_LEN 48
+#define DOWNLINK_BULK_RESULT_MAX_LEN 128
+#define DOWNLINK_TOPIC_MAX_LEN 96
+
+/* The command topic is <prefix>+<suffix>, results go to <prefix><addr><suffix>/result. Results are only queued in
+ * the client outbox, they are published from the mesh callbacks on the BLE host task, which must not wait for the
+ * broker. */
+static const char *s_prefix_end;
+
+static void downlink_publish_result(uint16_t addr, const char *result) {
+  const char *filter = CONFIG_GATEWAY_DOWNLINK_TOPIC;
+  char topic[DOWNLINK_TOPIC_MAX_LEN];
+  int n = snprintf(topic, sizeof(topic), "%.*s%04x%s/result", (int)(s_prefix_end - filter), filter, addr,
+                   s_prefix_end + 1);
+  if (n < 0 || n >= (int)sizeof(topic)) {
+    return;
+  }
+  mqtt_enqueue(topic, result, strlen(result), 1, 0);
+}
+
+/* Parses 1 to 4 hexadecimal digits. */
+static bool downlink_parse_hex(const char *p, size_t len, uint16_t *value) {
+  if (len == 0 || len > 4) {
+    return false;
+  }
+  *value = 0;
+  for (size_t i = 0; i < len; i++) {
+    char c = p[i];
+    int v;
+    if (c >= '0' && c <= '9') {
+      v = c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      v = c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      v = c - 'A' + 10;
+    } else {
+      return false;
+    }
+    *value = *value << 4 | v;
+  }
+  return true;
+}
+
+/* Parses <prefix><hex address><suffix> for a filter <prefix>+<suffix>. Returns 0 if the topic does not match. */
+static uint16_t downlink_parse_addr(const char *filter, const char *topic, int topic_len) {
+  const char *plus = strchr(filter, '+');
+  size_t prefix_len = plus - filter;
+  size_t suffix_len = strlen(plus + 1);
+  uint16_t addr;
+  if ((size_t)topic_len <= prefix_len + suffix_len || strncmp(topic, filter, prefix_len) != 0 ||
+      strncmp(topic + topic_len - suffix_len, plus + 1, suffix_len) != 0 ||
+      !downlink_parse_hex(topic + prefix_len, topic_len - prefix_len - suffix_len, &addr)) {
+    return ESP_BLE_MESH_ADDR_UNASSIGNED;
+  }
+  return addr;
+}
+
+/* Parses a comma separated list of hexadecimal unicast addresses and ranges, "5,7-a", into addrs. Returns the
+ * number of addresses, or -1 for a malformed list or one with more than max addresses. */
+static int downlink_parse_addr_list(const char *p, const char *end, uint16_t *addrs, size_t max) {
+  size_t count = 0;
+  while (p < end) {
+    const char *item_end = memchr(p, ',', end - p);
+    if (!item_end) {
+      item_end = end;
+    }
+    const char *dash = memchr(p, '-', item_end - p);
+    uint16_t first, last;
+    if (!downlink_parse_hex(p, (dash ? dash : item_end) - p, &first) ||
+        (dash && !downlink_parse_hex(dash + 1, item_end - dash - 1, &last))) {
+      return -1;
+    }
+    if (!dash) {
+      last = first;
+    }
+    if (!ESP_BLE_MESH_ADDR_IS_UNICAST(first) || !ESP_BLE_MESH_ADDR_IS_UNICAST(last) || last < first ||
+        count + (last - first + 1u) > max) {
+      return -1;
+    }
+    for (uint32_t addr = first; addr <= last; addr++) {
+      addrs[count++] = addr;
+    }
+    p = item_end < end ? item_end + 1 : end;
+  }
+  return count;
+}
+
+/* Returns 0 or 1, or -1 for a payload that is not an on/off value. */
+static int downlink_parse_onoff(const char *data, int data_len) {
+  static const char *const values[] = {"0", "off", "false", "1", "on", "true"};
+  for (int i = 0; i < 6; i++) {
+    if (data_len == (int)strlen(values[i]) && strncasecmp(data, values[i], data_len) == 0) {
+      return i >= 3;
+    }
+  }
+  return -1;
+}
+
+/* Outcome of a command, from the mesh TX scheduler. */
+static void downlink_on_done(uint16_t addr, mesh_tx_op_t op, mesh_tx_result_t result, uint8_t onoff,
+                             uint32_t submitted) {
+  char result_json[DOWNLINK_RESULT_MAX_LEN];
+  switch (result) {
+  case MESH_TX_OK:
+    if (op == MESH_TX_SET_UNACK) {
+      snprintf(result_json, sizeof(result_json), "{\"sent\":1}");
+      break;
+    }
+    metrics_record_since(METRICS_STAGE_COMMAND, submitted);
+    snprintf(result_json, sizeof(result_json), "{\"onoff\":%u,\"ms\":%u}", onoff, (metrics_now() - submitted) / 1000);
+    break;
+  case MESH_TX_TIMEOUT:
+    metrics_count(METRICS_COUNTER_COMMAND_TIMEOUT);
+    snprintf(result_json, sizeof(result_json), "{\"error\":\"timeout\"}");
+    break;
+  case MESH_TX_SUPERSEDED:
+    snprintf(result_json, sizeof(result_json), "{\"error\":\"superseded\"}");
+    break;
+  default:
+    snprintf(result_json, sizeof(result_json), "{\"error\":\"send\"}");
+    break;
+  }
+  downlink_publish_result(addr, result_json);
+}
+
+/* Runs in the MQTT task. Submitting never waits for the mesh stack, the scheduler sends the command later. */
+static void downlink_on_data(const char *topic, int topic_len, const char *data, int data_len) {
+  // the default bulk topic matches the command filter as well, downlink_on_bulk() takes it
+  if ((size_t)topic_len == strlen(CONFIG_GATEWAY_DOWNLINK_BULK_TOPIC) &&
+      strncmp(topic, CONFIG_GATEWAY_DOWNLINK_BULK_TOPIC, topic_len) == 0) {
+    return;
+  }
+  uint16_t addr = downlink_parse_addr(CONFIG_GATEWAY_DOWNLINK_TOPIC, topic, topic_len);
+  int onoff = downlink_parse_onoff(data, data_len);
+  if (addr == ESP_BLE_MESH_ADDR_UNASSIGNED || onoff < 0) {
+    ESP_LOGW(TAG, "Ignoring command %.*s: %.*s", topic_len, topic, data_len, data);
+    return;
+  }
+  // Groups cannot answer a Set with a single status, they get it unacknowledged.
+  mesh_tx_op_t op = ESP_BLE_MESH_ADDR_IS_UNICAST(addr) ? MESH_TX_SET : MESH_TX_SET_UNACK;
+  esp_err_t err = mesh_tx_submit(addr, op, onoff, downlink_on_done);
+  if (err == ESP_ERR_NO_MEM) {
+    downlink_publish_result(addr, "{\"error\":\"busy\"}");
+  } else if (err != ESP_OK) {
+    ESP_LOGW(TAG, "No AppKey bound yet, dropping command for 0x%04x", addr);
+    downlink_publish_result(addr, "{\"error\":\"send\"}");
+  }
+}
+
+static void downlink_on_bulk_done(const fanout_result_t *result) {
+  char result_json[DOWNLINK_BULK_RESULT_MAX_LEN];
+  snprintf(result_json, sizeof(result_json),
+           "{\"onoff\":%u,\"nodes\":%u,\"groups\":%u,\"unicast\":%u,\"confirmed\":%u,\"acked\":%u,\"failed\":%u,"
+           "\"ms\":%u}",
+           result->onoff, result->nodes, result->groups, result->unicasts, result->confirmed, result->acked,
+           result->failed, result->elapsed_ms);
+  mqtt_enqueue(CONFIG_GATEWAY_DOWNLINK_BULK_TOPIC "/result", result_json, strlen(result_json), 1, 0);
+}
+
+/* Payload "<on/off value> <address list>", e.g. "on 10-3f,52". */
+static void downlink_on_bulk(const char *topic, int topic_len, const char *data, int data_len) {
+  const char *space = memchr(data, ' ', data_len);
+  int onoff = space ? downlink_parse_onoff(data, space - data) : -1;
+  uint16_t *addrs = malloc(GROUP_TABLE_MAX_MEMBERS * sizeof(*addrs));
+  int count = -1;
+  if (onoff >= 0 && addrs) {
+    count = downlink_parse_addr_list(space + 1, data + data_len, addrs, GROUP_TABLE_MAX_MEMBERS);
+  }
+  esp_err_t err = count > 0 ? fanout_submit(addrs, count, onoff, downlink_on_bulk_done) : ESP_ERR_INVALID_ARG;
+  free(addrs);
+  const char *error = NULL;
+  if (err == ESP_ERR_INVALID_ARG) {
+    ESP_LOGW(TAG, "Ignoring bulk command %.*s", data_len, data);
+    error = "{\"error\":\"malformed\"}";
+  } else if (err == ESP_ERR_NO_MEM) {
+    error = "{\"error\":\"busy\"}";
+  } else if (err != ESP_OK) {
+    error = "{\"error\":\"send\"}";
+  }
+  if (error) {
+    mqtt_enqueue(CONFIG_GATEWAY_DOWNLINK_BULK_TOPIC "/result", error, strlen(error), 1, 0);
+  }
+}
+
+/* Payload: the member list of the group in the topic, like the address list of a bulk command. An empty payload
+ * forgets the group. */
+static void downlink_on_group(const char *topic, int topic_len, const char *data, int data_len) {
+  uint16_t group = downlink_parse_addr(CONFIG_GATEWAY_DOWNLINK_GROUP_TOPIC, topic, topic_len);
+  uint16_t *members = malloc(GROUP_TABLE_MAX_MEMBERS * sizeof(*members));
+  int count = -1;
+  if (ESP_BLE_MESH_ADDR_IS_GROUP(group) && members) {
+    count = downlink_parse_addr_list(data, data + data_len, members, GROUP_TABLE_MAX_MEMBERS);
+  }
+  if (count < 0) {
+    ESP_LOGW(TAG, "Ignoring group members %.*s: %.*s", topic_len, topic, data_len, data);
+  } else if (group_table_set(group, members, count) == ESP_OK) {
+    ESP_LOGI(TAG, "Group 0x%04x has %d members", group, count);
+  }
+  free(members);
+}
+
+/* A filter for per-address topics needs exactly one '+' level for the address. */
+static bool downlink_check_filter(const char *filter, int wildcards) {
+  const char *plus = strchr(filter, '+');
+  int found = plus ? 1 + (strchr(plus + 1, '+') != NULL) : 0;
+  if (found != wildcards || strchr(filter, '#')) {
+    ESP_LOGE(TAG, "Topic filter %s needs exactly %d '+' level(s) and no '#'", filter, wildcards);
+    return false;
+  }
+  return true;
+}
+
+esp_err_t downlink_start(void) {
+  if (!downlink_check_filter(CONFIG_GATEWAY_DOWNLINK_TOPIC, 1) ||
+      !downlink_check_filter(CONFIG_GATEWAY_DOWNLINK_BULK_TOPIC, 0) ||
+      !downlink_check_filter(CONFIG_GATEWAY_DOWNLINK_GROUP_TOPIC, 1)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  s_prefix_end = strchr(CONFIG_GATEWAY_DOWNLINK_TOPIC, '+');
+  mqtt_app_subscribe(CONFIG_GATEWAY_DOWNLINK_TOPIC, downlink_on_data);
+  mqtt_app_subscribe(CONFIG_GATEWAY_DOWNLINK_BULK_TOPIC, downlink_on_bulk);
+  mqtt_app_subscribe(CONFIG_GATEWAY_DOWNLINK_GROUP_TOPIC, downlink_on_group);
+  return ESP_OK;
+}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef _DOWNLINK_H_
+#define _DOWNLINK_H_
+
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+/*
+ * MQTT to mesh commands. Messages on CONFIG_GATEWAY_DOWNLINK_TOPIC, "ble_mesh/+/set" by default, where the '+'
+ * level is the destination address in hexadecimal (a node or a group), are sent as Generic OnOff Set through the
+ * mesh TX scheduler, see mesh_tx.h. Payload "1", "on" or "true" switches on, "0", "off" or "false" off.
+ *
+ * The outcome is published, QoS 1 and not retained, to the command topic with "/result" appended:
+ *
+ *   {"onoff":<present state>,"ms":<round trip>}  the node answered
+ *   {"error":"timeout"}                            no answer within CONFIG_GATEWAY_MESH_TX_TIMEOUT_MS, retries included
+ *   {"error":"superseded"}                         a newer command for the address came in before this one was done
+ *   {"error":"busy"}                               the scheduler has no room for another destination
+ *   {"error":"send"}                               no AppKey yet, or the mesh stack did not take the message
+ *   {"sent":1}                                     group address, sent unacknowledged
+ *
+ * Bulk commands go to CONFIG_GATEWAY_DOWNLINK_BULK_TOPIC, "ble_mesh/bulk/set" by default, with an on/off value, a
+ * space and a comma separated list of hexadecimal unicast addresses and ranges as payload, e.g. "off 10-3f,52".
+ * They are sent as a few group messages where the group table allows, see fanout.h, and the outcome is published
+ * to the bulk topic with "/result" appended:
+ *
+ *   {"onoff":0,"nodes":49,"groups":2,"unicast":1,"confirmed":47,"acked":2,"failed":0,"ms":2480}
+ *   {"error":"malformed"}, {"error":"busy"} or {"error":"send"}
+ *
+ * The bulk topic is never taken as a command for a single address, although the default one matches the default
+ * command filter.
+ *
+ * The group table is fed from CONFIG_GATEWAY_DOWNLINK_GROUP_TOPIC, "ble_mesh/group/+/members" by default, where
+ * the '+' level is the group address in hexadecimal and the payload the member list in the same format. Whoever
+ * configures the subscriptions of the nodes publishes it retained, so the gateway gets it again on every connection;
+ * an empty payload removes the group.
+ */
+
+#if CONFIG_GATEWAY_DOWNLINK
+
+/* Subscribes to the command topic. The mesh TX scheduler must be started. */
+esp_err_t downlink_start(void);
+
+#else
+
+static inline esp_err_t downlink_start(void) { return ESP_OK; }
+
+#endif
+
+#endif // _DOWNLINK_H_
@@ -0,0 +1,344 @@
+#include "fanout.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_ble_mesh_defs.h"
+#include "esp_log.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "group_table.h"
+#include "mesh_tx.h"
+#include "metrics.h"
+#include "node_shadow.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "FANOUT";
+
+typedef enum {
+  FANOUT_FREE,
+  FANOUT_SENDING,    // Sets Unacknowledged queued in the scheduler
+  FANOUT_COLLECTING, // all sent, collecting status publications until the deadline
+  FANOUT_FALLBACK,   // acknowledged Sets to the nodes that did not confirm
+} fanout_phase_t;
+
+typedef enum {
+  FANOUT_NODE_PENDING,
+  FANOUT_NODE_CONFIRMED,
+  FANOUT_NODE_FALLBACK,
+  FANOUT_NODE_ACKED,
+  FANOUT_NODE_FAILED,
+} fanout_node_t;
+
+typedef struct {
+  fanout_phase_t phase;
+  uint8_t onoff;
+  uint16_t *targets; // sorted
+  uint8_t *nodes;    // fanout_node_t of every target
+  uint16_t *dests;   // destinations of the current phase, set to 0 once their send is accounted for
+  size_t count;
+  size_t dest_count;
+  size_t outstanding; // sends of the current phase not accounted for yet
+  size_t groups;
+  size_t unicasts;
+  size_t probed;
+  size_t confirmed;
+  size_t acked;
+  size_t failed;
+  uint32_t submitted; // metrics_now()
+  TickType_t deadline;
+  fanout_done_cb_t done;
+} fanout_job_t;
+
+/* A command that completed while s_lock was held, its callback is called once the lock is released. */
+typedef struct {
+  fanout_done_cb_t done;
+  fanout_result_t result;
+} fanout_completion_t;
+
+static SemaphoreHandle_t s_lock;
+static TaskHandle_t s_task;
+static fanout_job_t s_jobs[CONFIG_GATEWAY_FANOUT_JOBS];
+
+static int fanout_cmp_addr(const void *a, const void *b) { return *(const uint16_t *)a - *(const uint16_t *)b; }
+
+/* The fanout_* helpers below are called with s_lock held. */
+
+static void fanout_finish(fanout_job_t *job, fanout_completion_t *completion) {
+  *completion = (fanout_completion_t){
+      .done = job->done,
+      .result =
+          {
+              .onoff = job->onoff,
+              .nodes = job->count,
+              .groups = job->groups,
+              .unicasts = job->unicasts,
+              .probed = job->probed,
+              .confirmed = job->confirmed,
+              .acked = job->acked,
+              .failed = job->failed,
+              .elapsed_ms = (metrics_now() - job->submitted) / 1000,
+          },
+  };
+  metrics_record_since(METRICS_STAGE_FANOUT, job->submitted);
+  free(job->targets);
+  free(job->nodes);
+  free(job->dests);
+  memset(job, 0, sizeof(*job));
+}
+
+/* Moves job on to its next phase if the current one is over. Returns true if the job completed. */
+static bool fanout_advance(fanout_job_t *job, fanout_completion_t *completion) {
+  if (job->phase == FANOUT_SENDING && job->outstanding == 0) {
+    job->phase = FANOUT_COLLECTING;
+    job->deadline = xTaskGetTickCount() + pdMS_TO_TICKS(CONFIG_GATEWAY_FANOUT_WINDOW_MS);
+    xTaskNotifyGive(s_task);
+  }
+  if ((job->phase == FANOUT_COLLECTING && job->confirmed == job->count) ||
+      (job->phase == FANOUT_FALLBACK && job->outstanding == 0)) {
+    fanout_finish(job, completion);
+    return true;
+  }
+  return false;
+}
+
+/* Returns the job in phase that still waits for the send to addr, and marks that send as accounted for. */
+static fanout_job_t *fanout_take_dest(fanout_phase_t phase, uint16_t addr) {
+  for (int i = 0; i < CONFIG_GATEWAY_FANOUT_JOBS; i++) {
+    fanout_job_t *job = &s_jobs[i];
+    if (job->phase != phase) {
+      continue;
+    }
+    for (size_t d = 0; d < job->dest_count; d++) {
+      if (job->dests[d] == addr) {
+        job->dests[d] = ESP_BLE_MESH_ADDR_UNASSIGNED;
+        job->outstanding--;
+        return job;
+      }
+    }
+  }
+  return NULL;
+}
+
+static void fanout_complete(const fanout_completion_t *completion) {
+  if (completion->done) {
+    completion->done(&completion->result);
+  }
+}
+
+/* Outcome of a message sent for a command, from the mesh TX scheduler. */
+static void fanout_on_sent(uint16_t addr, mesh_tx_op_t op, mesh_tx_result_t result, uint8_t onoff,
+                           uint32_t submitted) {
+  fanout_completion_t completion = {0};
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  fanout_job_t *job = fanout_take_dest(op == MESH_TX_SET_UNACK ? FANOUT_SENDING : FANOUT_FALLBACK, addr);
+  if (job && job->phase == FANOUT_FALLBACK) {
+    uint16_t *target = bsearch(&addr, job->targets, job->count, sizeof(addr), fanout_cmp_addr);
+    if (result == MESH_TX_OK && onoff == job->onoff) {
+      job->nodes[target - job->targets] = FANOUT_NODE_ACKED;
+      job->acked++;
+    } else {
+      job->nodes[target - job->targets] = FANOUT_NODE_FAILED;
+      job->failed++;
+    }
+  }
+  if (job) {
+    fanout_advance(job, &completion);
+  }
+  xSemaphoreGive(s_lock);
+  fanout_complete(&completion);
+}
+
+/* Submits a message to every destination. dests is a private copy: the job can complete, and its own list be freed,
+ * while this is still running. */
+static void fanout_send(const uint16_t *dests, size_t count, mesh_tx_op_t op, uint8_t onoff) {
+  for (size_t i = 0; i < count; i++) {
+    if (mesh_tx_submit(dests[i], op, onoff, fanout_on_sent) != ESP_OK) {
+      ESP_LOGW(TAG, "Scheduler refused message to 0x%04x", dests[i]);
+      fanout_on_sent(dests[i], op, MESH_TX_FAILED, 0, 0);
+    }
+  }
+}
+
+void fanout_on_status(uint16_t addr, uint8_t onoff) {
+  if (!s_lock) {
+    return;
+  }
+  fanout_completion_t completions[CONFIG_GATEWAY_FANOUT_JOBS] = {0};
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  for (int i = 0; i < CONFIG_GATEWAY_FANOUT_JOBS; i++) {
+    fanout_job_t *job = &s_jobs[i];
+    if ((job->phase != FANOUT_SENDING && job->phase != FANOUT_COLLECTING) || job->onoff != onoff) {
+      continue;
+    }
+    uint16_t *target = bsearch(&addr, job->targets, job->count, sizeof(addr), fanout_cmp_addr);
+    if (target && job->nodes[target - job->targets] == FANOUT_NODE_PENDING) {
+      job->nodes[target - job->targets] = FANOUT_NODE_CONFIRMED;
+      job->confirmed++;
+      fanout_advance(job, &completions[i]);
+    }
+  }
+  xSemaphoreGive(s_lock);
+  for (int i = 0; i < CONFIG_GATEWAY_FANOUT_JOBS; i++) {
+    fanout_complete(&completions[i]);
+  }
+}
+
+esp_err_t fanout_submit(const uint16_t *addrs, size_t count, uint8_t onoff, fanout_done_cb_t done) {
+  if (!s_task) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (count == 0 || count > GROUP_TABLE_MAX_MEMBERS) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  uint16_t *targets = malloc(count * sizeof(*targets));
+  uint8_t *nodes = calloc(count, sizeof(*nodes));
+  uint16_t *dests = malloc(count * sizeof(*dests));
+  uint16_t *sends = malloc(count * sizeof(*sends));
+  uint16_t *probes = malloc(count * sizeof(*probes));
+  size_t unique = 0, groups = 0, unicasts = 0, probed = 0;
+  esp_err_t err = ESP_ERR_NO_MEM;
+  if (targets && nodes && dests && sends && probes) {
+    memcpy(targets, addrs, count * sizeof(*targets));
+    qsort(targets, count, sizeof(*targets), fanout_cmp_addr);
+    for (size_t i = 0; i < count; i++) {
+      if (ESP_BLE_MESH_ADDR_IS_UNICAST(targets[i]) && (unique == 0 || targets[unique - 1] != targets[i])) {
+        targets[unique++] = targets[i];
+      }
+    }
+    err = unique ? group_table_resolve(targets, unique, dests, &groups, &unicasts) : ESP_ERR_INVALID_ARG;
+  }
+  if (err == ESP_OK) {
+    // A node already in the requested state publishes nothing, it is asked for its state instead.
+    node_shadow_entry_t known;
+    for (size_t i = 0; i < unique; i++) {
+      if (node_shadow_get(targets[i], &known) && known.onoff == onoff) {
+        probes[probed++] = targets[i];
+      }
+    }
+  }
+  fanout_job_t *job = NULL;
+  if (err == ESP_OK) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < CONFIG_GATEWAY_FANOUT_JOBS && !job; i++) {
+      job = s_jobs[i].phase == FANOUT_FREE ? &s_jobs[i] : NULL;
+    }
+    if (job) {
+      *job = (fanout_job_t){
+          .phase = FANOUT_SENDING,
+          .onoff = onoff,
+          .targets = targets,
+          .nodes = nodes,
+          .dests = dests,
+          .count = unique,
+          .dest_count = groups + unicasts,
+          .outstanding = groups + unicasts,
+          .groups = groups,
+          .unicasts = unicasts,
+          .probed = probed,
+          .submitted = metrics_now(),
+          .done = done,
+      };
+      memcpy(sends, dests, (groups + unicasts) * sizeof(*sends));
+    } else {
+      err = ESP_ERR_NO_MEM;
+    }
+    xSemaphoreGive(s_lock);
+  }
+  if (err != ESP_OK) {
+    free(targets);
+    free(nodes);
+    free(dests);
+    free(sends);
+    free(probes);
+    return err;
+  }
+  ESP_LOGI(TAG, "%s for %u nodes: %u group and %u unicast messages, %u Gets", onoff ? "On" : "Off", unique, groups,
+           unicasts, probed);
+  fanout_send(sends, groups + unicasts, MESH_TX_SET_UNACK, onoff);
+  // The answers come through fanout_on_status(). A Get that is lost, or answered with the other state, leaves the
+  // node to the fallback Set.
+  for (size_t i = 0; i < probed; i++) {
+    mesh_tx_submit(probes[i], MESH_TX_GET, 0, NULL);
+  }
+  free(sends);
+  free(probes);
+  return ESP_OK;
+}
+
+/* Ends the collection window of job: the nodes that did not confirm get an acknowledged Set. Returns how many,
+ * with their addresses copied to sends. */
+static size_t fanout_expire(fanout_job_t *job, uint16_t *sends) {
+  size_t count = 0;
+  for (size_t i = 0; i < job->count; i++) {
+    if (job->nodes[i] == FANOUT_NODE_PENDING) {
+      job->nodes[i] = FANOUT_NODE_FALLBACK;
+      job->dests[count] = job->targets[i];
+      sends[count++] = job->targets[i];
+      metrics_count(METRICS_COUNTER_FANOUT_FALLBACK);
+    }
+  }
+  job->phase = FANOUT_FALLBACK;
+  job->dest_count = count;
+  job->outstanding = count;
+  return count;
+}
+
+static void fanout_task(void *pvParameters) {
+  uint16_t *sends = malloc(GROUP_TABLE_MAX_MEMBERS * sizeof(*sends));
+  configASSERT(sends);
+  for (;;) {
+    TickType_t wait = portMAX_DELAY;
+    fanout_completion_t completion = {0};
+    size_t count = 0;
+    uint8_t onoff = 0;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    TickType_t now = xTaskGetTickCount();
+    for (int i = 0; i < CONFIG_GATEWAY_FANOUT_JOBS; i++) {
+      fanout_job_t *job = &s_jobs[i];
+      if (job->phase != FANOUT_COLLECTING) {
+        continue;
+      }
+      if ((int32_t)(job->deadline - now) > 0) {
+        if (job->deadline - now < wait) {
+          wait = job->deadline - now;
+        }
+        continue;
+      }
+      // One job per round, its fallback Sets are submitted without the lock held.
+      onoff = job->onoff;
+      count = fanout_expire(job, sends);
+      if (count == 0) {
+        fanout_advance(job, &completion);
+      }
+      wait = 0;
+      break;
+    }
+    xSemaphoreGive(s_lock);
+    fanout_complete(&completion);
+    if (count > 0) {
+      fanout_send(sends, count, MESH_TX_SET, onoff);
+    }
+    if (wait > 0) {
+      ulTaskNotifyTake(pdTRUE, wait);
+    }
+  }
+}
+
+esp_err_t fanout_start(void) {
+  if (s_task) {
+    return ESP_OK;
+  }
+  s_lock = xSemaphoreCreateMutex();
+  if (!s_lock) {
+    return ESP_ERR_NO_MEM;
+  }
+  if (xTaskCreate(fanout_task, "fanout", 3072, NULL, 5, &s_task) != pdPASS) {
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
@@ -0,0 +1,47 @@
+#ifndef _FANOUT_H_
+#define _FANOUT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/*
+ * Bulk on/off commands. The target nodes are resolved into group and unicast addresses with group_table_resolve()
+ * and every one of them gets a single Generic OnOff Set Unacknowledged through the mesh TX scheduler, so switching
+ * a floor costs a few messages instead of one acknowledged Set per node.
+ *
+ * Confirmation comes from the Generic OnOff Status the nodes publish when their state changes. A node that already
+ * is in the requested state publishes nothing, so every node the node shadow knows in that state is sent a Generic
+ * OnOff Get as well, and its answer counts like a publication. Statuses with the requested state are collected until
+ * CONFIG_GATEWAY_FANOUT_WINDOW_MS after the last Set went out; a node that has not confirmed by then is sent an
+ * acknowledged unicast Set. The command completes once every node confirmed or answered that Set.
+ *
+ * The Gets only cover what the shadow knows. A node that switched to the requested state without the gateway
+ * hearing of it, or that the shadow does not know at all, still waits for the window and costs an acknowledged Set.
+ */
+
+typedef struct {
+  uint8_t onoff;
+  uint16_t nodes;      // target nodes after removing duplicates
+  uint16_t groups;     // group messages sent
+  uint16_t unicasts;   // unicast messages sent before the window, fallback Sets not included
+  uint16_t probed;     // Gets to nodes the shadow knew in the requested state
+  uint16_t confirmed;  // nodes that published or answered a Get with the requested state within the window
+  uint16_t acked;      // nodes that answered the fallback Set with the requested state
+  uint16_t failed;     // nodes that did neither
+  uint32_t elapsed_ms; // command submitted -> completed
+} fanout_result_t;
+
+/* Called once per command, from the fanout task or the Generic Client callback. */
+typedef void (*fanout_done_cb_t)(const fanout_result_t *result);
+
+/* Starts the fanout task. The mesh TX scheduler and the group table must be up. */
+esp_err_t fanout_start(void);
+/* Starts a bulk command for count unicast addresses, which need not be sorted or unique. Returns ESP_ERR_NO_MEM
+ * when CONFIG_GATEWAY_FANOUT_JOBS commands are running already, done is not called then. */
+esp_err_t fanout_submit(const uint16_t *addrs, size_t count, uint8_t onoff, fanout_done_cb_t done);
+/* A Generic OnOff Status from addr, published or answering a Set or Get, called from the Generic Client callback. */
+void fanout_on_status(uint16_t addr, uint8_t onoff);
+
+#endif // _FANOUT_H_
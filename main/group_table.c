@@ -0,0 +1,171 @@
+#include "group_table.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "sdkconfig.h"
+
+static const char *TAG = "GROUP_TABLE";
+
+typedef struct {
+  uint16_t addr; // group address, 0 marks a free entry
+  uint16_t count;
+  uint16_t capacity;
+  uint16_t *members; // sorted
+} group_entry_t;
+
+static SemaphoreHandle_t s_lock;
+static group_entry_t s_groups[CONFIG_GATEWAY_GROUP_TABLE_SIZE];
+static size_t s_count;
+
+static int group_cmp_addr(const void *a, const void *b) { return *(const uint16_t *)a - *(const uint16_t *)b; }
+
+/* Returns the entry of group, or a free entry if create is set, or NULL. Called with s_lock held. */
+static group_entry_t *group_find(uint16_t group, bool create) {
+  group_entry_t *free_entry = NULL;
+  for (int i = 0; i < CONFIG_GATEWAY_GROUP_TABLE_SIZE; i++) {
+    if (s_groups[i].addr == group) {
+      return &s_groups[i];
+    }
+    if (!free_entry && s_groups[i].addr == 0) {
+      free_entry = &s_groups[i];
+    }
+  }
+  if (create && free_entry) {
+    free_entry->addr = group;
+    free_entry->count = 0;
+    s_count++;
+  }
+  return create ? free_entry : NULL;
+}
+
+/* Called with s_lock held. */
+static void group_forget(group_entry_t *entry) {
+  free(entry->members);
+  memset(entry, 0, sizeof(*entry));
+  s_count--;
+}
+
+/* Makes room for capacity members. Called with s_lock held. */
+static bool group_reserve(group_entry_t *entry, size_t capacity) {
+  if (capacity <= entry->capacity) {
+    return true;
+  }
+  uint16_t *members = realloc(entry->members, capacity * sizeof(*members));
+  if (!members) {
+    return false;
+  }
+  entry->members = members;
+  entry->capacity = capacity;
+  return true;
+}
+
+esp_err_t group_table_init(void) {
+  if (s_lock) {
+    return ESP_OK;
+  }
+  s_lock = xSemaphoreCreateMutex();
+  return s_lock ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+esp_err_t group_table_set(uint16_t group, const uint16_t *members, size_t count) {
+  if (count > GROUP_TABLE_MAX_MEMBERS) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  esp_err_t err = ESP_OK;
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  group_entry_t *entry = group_find(group, count > 0);
+  if (count == 0) {
+    if (entry) {
+      group_forget(entry);
+    }
+  } else if (!entry || !group_reserve(entry, count)) {
+    err = ESP_ERR_NO_MEM;
+    if (entry && entry->count == 0) {
+      group_forget(entry);
+    }
+  } else {
+    memcpy(entry->members, members, count * sizeof(*members));
+    qsort(entry->members, count, sizeof(*members), group_cmp_addr);
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (unique == 0 || entry->members[unique - 1] != entry->members[i]) {
+        entry->members[unique++] = entry->members[i];
+      }
+    }
+    entry->count = unique;
+  }
+  xSemaphoreGive(s_lock);
+  if (err == ESP_ERR_NO_MEM) {
+    ESP_LOGW(TAG, "No room for group 0x%04x with %u members", group, count);
+  }
+  return err;
+}
+
+size_t group_table_count(void) {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  size_t count = s_count;
+  xSemaphoreGive(s_lock);
+  return count;
+}
+
+esp_err_t group_table_resolve(const uint16_t *targets, size_t count, uint16_t *dests, size_t *groups,
+                              size_t *unicasts) {
+  *groups = 0;
+  *unicasts = 0;
+  bool *covered = calloc(count ? count : 1, sizeof(*covered));
+  if (!covered) {
+    return ESP_ERR_NO_MEM;
+  }
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  // Only groups that reach no node outside the targets can be used.
+  bool usable[CONFIG_GATEWAY_GROUP_TABLE_SIZE];
+  for (int i = 0; i < CONFIG_GATEWAY_GROUP_TABLE_SIZE; i++) {
+    const group_entry_t *entry = &s_groups[i];
+    usable[i] = entry->addr != 0 && entry->count >= 2;
+    for (size_t m = 0; usable[i] && m < entry->count; m++) {
+      usable[i] = bsearch(&entry->members[m], targets, count, sizeof(*targets), group_cmp_addr) != NULL;
+    }
+  }
+  for (;;) {
+    int best = -1;
+    size_t best_gain = 1;
+    for (int i = 0; i < CONFIG_GATEWAY_GROUP_TABLE_SIZE; i++) {
+      if (!usable[i]) {
+        continue;
+      }
+      size_t gain = 0;
+      for (size_t m = 0; m < s_groups[i].count; m++) {
+        const uint16_t *target = bsearch(&s_groups[i].members[m], targets, count, sizeof(*targets), group_cmp_addr);
+        gain += !covered[target - targets];
+      }
+      if (gain > best_gain) {
+        best = i;
+        best_gain = gain;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    usable[best] = false;
+    for (size_t m = 0; m < s_groups[best].count; m++) {
+      const uint16_t *target = bsearch(&s_groups[best].members[m], targets, count, sizeof(*targets), group_cmp_addr);
+      covered[target - targets] = true;
+    }
+    dests[(*groups)++] = s_groups[best].addr;
+  }
+  xSemaphoreGive(s_lock);
+  for (size_t i = 0; i < count; i++) {
+    if (!covered[i]) {
+      dests[*groups + (*unicasts)++] = targets[i];
+    }
+  }
+  free(covered);
+  return ESP_OK;
+}
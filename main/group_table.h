@@ -0,0 +1,33 @@
+#ifndef _GROUP_TABLE_H_
+#define _GROUP_TABLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/*
+ * Which nodes' Generic OnOff Servers are subscribed to which group address, so that a command for many nodes can go
+ * out as a few group messages. Up to CONFIG_GATEWAY_GROUP_TABLE_SIZE groups with up to GROUP_TABLE_MAX_MEMBERS
+ * members each; member lists are kept sorted.
+ *
+ * The Config Server of a node only reports subscription changes on that node, so the gateway cannot learn them from
+ * the mesh. The table is fed only from the member lists published by whoever configures the network on
+ * CONFIG_GATEWAY_DOWNLINK_GROUP_TOPIC, see downlink.h.
+ */
+
+#define GROUP_TABLE_MAX_MEMBERS 1024
+
+esp_err_t group_table_init(void);
+/* Replaces the members of group. count 0 forgets the group. Returns ESP_ERR_NO_MEM if the table is full. */
+esp_err_t group_table_set(uint16_t group, const uint16_t *members, size_t count);
+size_t group_table_count(void);
+
+/* Resolves targets, sorted unicast addresses without duplicates, into the fewest sends that reach all of them and
+ * no other node: group addresses whose members are all targets, picked greedily by how many targets not yet
+ * covered they add, and unicast addresses for the rest. A group is only used if it adds at least two targets.
+ * dests needs room for count addresses; the groups come first. Returns ESP_ERR_NO_MEM if no scratch memory. */
+esp_err_t group_table_resolve(const uint16_t *targets, size_t count, uint16_t *dests, size_t *groups,
+                              size_t *unicasts);
+
+#endif // _GROUP_TABLE_H_
@@ -0,0 +1,742 @@
+#include "journal.h"
+
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/unistd.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "metrics.h"
+#include "sdcard.h"
+#include "sdkconfig.h"
+#include "timestamp.h"
+#include "topic_table.h"
+
+static const char *TAG = "JOURNAL";
+
+#define JOURNAL_MAX_NAME_LEN 16
+#define JOURNAL_SEGMENT_PREFIX "jrnl"
+#define JOURNAL_SEGMENT_SUFFIX ".bin"
+#define JOURNAL_REWRITE_SUFFIX ".tmp"
+#define JOURNAL_SEGMENT_MASK 0xffff // segment ids are 32 bits, names only hold the low 16
+#define JOURNAL_MANIFEST_NAME "jrnl.man"
+#define JOURNAL_MANIFEST_LEN 24
+#define JOURNAL_SEGMENT_SIZE (CONFIG_GATEWAY_JOURNAL_SEGMENT_SIZE_KB * 1024L)
+#define JOURNAL_MAX_SIZE (CONFIG_GATEWAY_JOURNAL_MAX_SIZE_KB * 1024L)
+#define JOURNAL_NO_SEGMENT UINT32_MAX
+#define JOURNAL_MAX_PINS 4
+
+_Static_assert(CONFIG_GATEWAY_JOURNAL_MAX_SIZE_KB == 0 ||
+                   CONFIG_GATEWAY_JOURNAL_MAX_SIZE_KB >= 2 * CONFIG_GATEWAY_JOURNAL_SEGMENT_SIZE_KB,
+               "CONFIG_GATEWAY_JOURNAL_MAX_SIZE_KB must hold at least two segments");
+
+static SemaphoreHandle_t s_lock;
+static FILE *s_file;
+static uint32_t s_oldest;
+static uint32_t s_active;
+static long s_active_size;
+static long s_size;        // all segments
+static long s_oldest_size; // -1 until known, the oldest segment is the one replay and eviction look at
+static uint32_t s_pinned[JOURNAL_MAX_PINS] = {JOURNAL_NO_SEGMENT, JOURNAL_NO_SEGMENT, JOURNAL_NO_SEGMENT,
+                                               JOURNAL_NO_SEGMENT}; // segments open readers are on
+static uint32_t s_rewrite_floor = JOURNAL_NO_SEGMENT; // segments below are never rewritten
+static journal_stats_t s_stats;
+static bool s_open_failed; // the active segment could not be opened for appending, see journal_reopen()
+static char s_write_buffer[CONFIG_GATEWAY_JOURNAL_WRITE_BUFFER_SIZE];
+
+static uint32_t journal_crc(const uint8_t *header, const uint8_t *payload, uint16_t len) {
+  uint32_t crc = esp_rom_crc32_le(0, header + 1, 3);
+  return esp_rom_crc32_le(crc, payload, len);
+}
+
+/* Reads one record into payload. Returns ESP_ERR_NOT_FOUND on a clean end of file and ESP_ERR_INVALID_CRC or
+ * ESP_ERR_INVALID_SIZE if the record at the current position is torn or corrupt. */
+static esp_err_t journal_read_record(FILE *f, uint8_t *type, uint8_t *payload, uint16_t *len) {
+  uint8_t header[JOURNAL_HEADER_LEN];
+  size_t n = fread(header, 1, sizeof(header), f);
+  if (n == 0) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  if (n != sizeof(header) || header[0] != JOURNAL_RECORD_MAGIC ||
+      (header[1] != JOURNAL_RECORD_MQTT && header[1] != JOURNAL_RECORD_MQTT_ID &&
+       header[1] != JOURNAL_RECORD_MQTT_ID_TS)) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  uint16_t length = header[2] | (header[3] << 8);
+  if (length > JOURNAL_MAX_PAYLOAD_LEN) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  if (fread(payload, 1, length, f) != length) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  uint32_t crc = header[4] | (header[5] << 8) | (header[6] << 16) | ((uint32_t)header[7] << 24);
+  if (crc != journal_crc(header, payload, length)) {
+    return ESP_ERR_INVALID_CRC;
+  }
+  *type = header[1];
+  *len = length;
+  return ESP_OK;
+}
+
+/* Returns the offset just past the last intact record. */
+static long journal_scan(const char *filename) {
+  FILE *f = sd_open_file(filename, "rb");
+  if (!f) {
+    return 0;
+  }
+  uint8_t type;
+  uint8_t payload[JOURNAL_MAX_PAYLOAD_LEN];
+  uint16_t len;
+  long end = 0;
+  esp_err_t err;
+  while ((err = journal_read_record(f, &type, payload, &len)) == ESP_OK) {
+    end += JOURNAL_HEADER_LEN + len;
+  }
+  if (err != ESP_ERR_NOT_FOUND) {
+    ESP_LOGW(TAG, "Corrupt record at offset %ld (%s)", end, esp_err_to_name(err));
+  }
+  sd_close_file(f);
+  return end;
+}
+
+static void journal_segment_name(uint32_t segment, char *name) {
+  snprintf(name, JOURNAL_MAX_NAME_LEN, JOURNAL_SEGMENT_PREFIX "%04x" JOURNAL_SEGMENT_SUFFIX,
+           segment & JOURNAL_SEGMENT_MASK);
+}
+
+static void journal_rewrite_name(uint32_t segment, char *name) {
+  snprintf(name, JOURNAL_MAX_NAME_LEN, JOURNAL_SEGMENT_PREFIX "%04x" JOURNAL_REWRITE_SUFFIX,
+           segment & JOURNAL_SEGMENT_MASK);
+}
+
+/* Number of open readers on segment. Called with s_lock held. */
+static int journal_pins(uint32_t segment) {
+  int pins = 0;
+  for (int i = 0; i < JOURNAL_MAX_PINS; i++) {
+    pins += s_pinned[i] == segment;
+  }
+  return pins;
+}
+
+/* Keeps segment from being evicted or rewritten until journal_unpin(). Called with s_lock held. */
+static bool journal_pin(uint32_t segment) {
+  for (int i = 0; i < JOURNAL_MAX_PINS; i++) {
+    if (s_pinned[i] == JOURNAL_NO_SEGMENT) {
+      s_pinned[i] = segment;
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Called with s_lock held. */
+static void journal_unpin(uint32_t segment) {
+  for (int i = 0; i < JOURNAL_MAX_PINS; i++) {
+    if (s_pinned[i] == segment) {
+      s_pinned[i] = JOURNAL_NO_SEGMENT;
+      return;
+    }
+  }
+}
+
+static void journal_put_u32(uint8_t *p, uint32_t value) {
+  p[0] = value & 0xff;
+  p[1] = (value >> 8) & 0xff;
+  p[2] = (value >> 16) & 0xff;
+  p[3] = value >> 24;
+}
+
+static uint32_t journal_get_u32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Called with s_lock held, after every change of the segment range. */
+static void journal_write_manifest(void) {
+  uint8_t manifest[JOURNAL_MANIFEST_LEN];
+  journal_put_u32(manifest, JOURNAL_MANIFEST_MAGIC);
+  journal_put_u32(manifest + 4, s_oldest);
+  journal_put_u32(manifest + 8, s_active);
+  journal_put_u32(manifest + 12, s_size - s_active_size);
+  journal_put_u32(manifest + 16, s_oldest < s_active && s_oldest_size > 0 ? s_oldest_size : 0);
+  journal_put_u32(manifest + 20, esp_rom_crc32_le(0, manifest, JOURNAL_MANIFEST_LEN - 4));
+  FILE *f = sd_open_file(JOURNAL_MANIFEST_NAME, "wb");
+  if (!f) {
+    ESP_LOGE(TAG, "Could not write manifest");
+    return;
+  }
+  if (fwrite(manifest, 1, sizeof(manifest), f) != sizeof(manifest)) {
+    ESP_LOGE(TAG, "Could not write manifest");
+  }
+  sd_close_file(f);
+}
+
+/* Reads the manifest into manifest. Returns false if there is none or it is corrupt. */
+static bool journal_read_manifest(uint8_t *manifest) {
+  FILE *f = sd_open_file(JOURNAL_MANIFEST_NAME, "rb");
+  if (!f) {
+    return false;
+  }
+  size_t n = fread(manifest, 1, JOURNAL_MANIFEST_LEN, f);
+  sd_close_file(f);
+  return n == JOURNAL_MANIFEST_LEN && journal_get_u32(manifest) == JOURNAL_MANIFEST_MAGIC &&
+         journal_get_u32(manifest + 20) == esp_rom_crc32_le(0, manifest, JOURNAL_MANIFEST_LEN - 4);
+}
+
+/* Takes the size of the sealed segments from manifest if it matches the segment range. */
+static bool journal_apply_manifest(const uint8_t *manifest, long *sealed_size) {
+  if (journal_get_u32(manifest + 4) != s_oldest || journal_get_u32(manifest + 8) != s_active) {
+    return false;
+  }
+  *sealed_size = journal_get_u32(manifest + 12);
+  uint32_t oldest_size = journal_get_u32(manifest + 16);
+  if (oldest_size > 0) {
+    s_oldest_size = oldest_size;
+  }
+  return true;
+}
+
+static esp_err_t journal_open_for_append(void) {
+  char name[JOURNAL_MAX_NAME_LEN];
+  journal_segment_name(s_active, name);
+  s_file = sd_open_file(name, "ab");
+  if (!s_file) {
+    return ESP_FAIL;
+  }
+  setvbuf(s_file, s_write_buffer, _IOFBF, sizeof(s_write_buffer));
+  return ESP_OK;
+}
+
+typedef struct {
+  bool anchored;
+  uint32_t anchor; // a segment id near those on the card, see journal_segment_id()
+  bool found;
+  uint32_t min;
+  uint32_t max;
+  bool rewrite_found; // a jrnlXXXX.tmp left behind by journal_rewrite()
+  uint32_t rewrite;
+  bool rewrite_original; // and its jrnlXXXX.bin is still there
+} journal_dir_scan_t;
+
+/* The segment id with the low 16 bits of name_id that is closest to anchor. Names wrap around after 65536 segments,
+ * the ids do not, so that the checkpoint of the replay stays comparable. This holds as long as the segments on the
+ * card span fewer than 32768 ids. */
+static uint32_t journal_segment_id(uint32_t anchor, uint32_t name_id) {
+  return anchor + (int16_t)(name_id - (anchor & JOURNAL_SEGMENT_MASK));
+}
+
+static void journal_dir_entry(const char *filename, void *arg) {
+  journal_dir_scan_t *scan = arg;
+  // FATFS without long file name support reports names in upper case
+  if (strlen(filename) != 12 || strncasecmp(filename, JOURNAL_SEGMENT_PREFIX, 4) != 0) {
+    return;
+  }
+  bool rewrite = strcasecmp(filename + 8, JOURNAL_REWRITE_SUFFIX) == 0;
+  if (!rewrite && strcasecmp(filename + 8, JOURNAL_SEGMENT_SUFFIX) != 0) {
+    return;
+  }
+  char *end;
+  char id[5] = {filename[4], filename[5], filename[6], filename[7], '\0'};
+  uint32_t name_id = strtoul(id, &end, 16);
+  if (*end != '\0') {
+    return;
+  }
+  if (!scan->anchored) {
+    // without a manifest the ids start over above the range of the names, which keeps them from going below 0
+    scan->anchor = name_id + JOURNAL_SEGMENT_MASK + 1;
+    scan->anchored = true;
+  }
+  uint32_t segment = journal_segment_id(scan->anchor, name_id);
+  if (rewrite) {
+    scan->rewrite_found = true;
+    scan->rewrite = segment;
+    return;
+  }
+  if (!scan->found || segment < scan->min) {
+    scan->min = segment;
+  }
+  if (!scan->found || segment > scan->max) {
+    scan->max = segment;
+  }
+  scan->found = true;
+}
+
+static void journal_dir_find_original(const char *filename, void *arg) {
+  journal_dir_scan_t *scan = arg;
+  char name[JOURNAL_MAX_NAME_LEN];
+  journal_segment_name(scan->rewrite, name);
+  if (strcasecmp(filename, name) == 0) {
+    scan->rewrite_original = true;
+  }
+}
+
+/* A power loss during journal_rewrite() leaves the new copy next to the original, or, between deleting the
+ * original and renaming the copy, the copy alone. Either way one complete version is kept. */
+static void journal_recover_rewrite(journal_dir_scan_t *scan) {
+  char from[JOURNAL_MAX_NAME_LEN];
+  char to[JOURNAL_MAX_NAME_LEN];
+  journal_rewrite_name(scan->rewrite, from);
+  journal_segment_name(scan->rewrite, to);
+  sd_for_each_file(journal_dir_find_original, scan);
+  if (scan->rewrite_original) {
+    ESP_LOGW(TAG, "Discarding unfinished rewrite of segment %04x", scan->rewrite);
+    sd_delete_file(from);
+  } else {
+    ESP_LOGW(TAG, "Completing rewrite of segment %04x", scan->rewrite);
+    sd_rename_file(from, to);
+  }
+}
+
+esp_err_t journal_open(void) {
+  if (!s_lock) {
+    s_lock = xSemaphoreCreateMutex();
+    if (!s_lock) {
+      return ESP_ERR_NO_MEM;
+    }
+  }
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  if (s_file) {
+    fclose(s_file);
+    s_file = NULL;
+  }
+
+  // the ids of the manifest give the names on the card their high bits
+  uint8_t manifest[JOURNAL_MANIFEST_LEN] = {0};
+  bool manifest_found = journal_read_manifest(manifest);
+  const journal_dir_scan_t anchored = {.anchored = manifest_found, .anchor = journal_get_u32(manifest + 8)};
+  journal_dir_scan_t scan = anchored;
+  sd_for_each_file(journal_dir_entry, &scan);
+  if (scan.rewrite_found) {
+    journal_recover_rewrite(&scan);
+    scan = anchored;
+    sd_for_each_file(journal_dir_entry, &scan);
+  }
+  uint32_t empty = manifest_found ? journal_get_u32(manifest + 8) : 0;
+  s_oldest = scan.found ? scan.min : empty;
+  s_active = scan.found ? scan.max : empty;
+
+  char name[JOURNAL_MAX_NAME_LEN];
+  s_size = 0;
+  s_oldest_size = -1;
+  bool rebuild = !manifest_found || !journal_apply_manifest(manifest, &s_size);
+  if (rebuild) {
+    for (uint32_t segment = s_oldest; segment < s_active; segment++) {
+      journal_segment_name(segment, name);
+      long size = journal_scan(name);
+      if (segment == s_oldest) {
+        s_oldest_size = size;
+      }
+      s_size += size;
+    }
+  }
+  journal_segment_name(s_active, name);
+  long file_size = sd_get_file_size(name);
+  s_active_size = journal_scan(name);
+  if (file_size > s_active_size) {
+    ESP_LOGW(TAG, "Dropping %ld bytes of torn tail from %s", file_size - s_active_size, name);
+    sd_truncate_file(name, s_active_size);
+  }
+  s_size += s_active_size;
+  if (rebuild) {
+    journal_write_manifest();
+  }
+  esp_err_t err = journal_open_for_append();
+  xSemaphoreGive(s_lock);
+
+  ESP_LOGI(TAG, "Journal opened, segments %04x..%04x, %ld bytes pending%s", s_oldest, s_active, s_size,
+           rebuild ? ", manifest rebuilt" : "");
+  return err;
+}
+
+/* Seals the active segment and starts the next one. Called with s_lock held. */
+static esp_err_t journal_seal(void) {
+  if (s_file) {
+    fclose(s_file);
+    s_file = NULL;
+  }
+  if (s_oldest == s_active) {
+    s_oldest_size = s_active_size;
+  }
+  s_active++;
+  s_active_size = 0;
+  s_stats.sealed++;
+  journal_write_manifest();
+  ESP_LOGI(TAG, "Sealed segment %04x", s_active - 1);
+  return journal_open_for_append();
+}
+
+/* Returns the size of the oldest segment, which must be sealed. Called with s_lock held. */
+static long journal_oldest_size(void) {
+  if (s_oldest_size < 0) {
+    char name[JOURNAL_MAX_NAME_LEN];
+    journal_segment_name(s_oldest, name);
+    s_oldest_size = sd_get_file_size(name);
+  }
+  return s_oldest_size;
+}
+
+/* Called with s_lock held. */
+static void journal_remove_oldest(void) {
+  char name[JOURNAL_MAX_NAME_LEN];
+  journal_segment_name(s_oldest, name);
+  s_size -= journal_oldest_size();
+  sd_delete_file(name);
+  s_oldest++;
+  s_oldest_size = -1;
+  journal_write_manifest();
+}
+
+/* Applies the size cap to a record of len bytes. Returns false if it does not fit. Called with s_lock held. */
+static bool journal_make_room(long len) {
+  if (JOURNAL_MAX_SIZE == 0 || s_size + len <= JOURNAL_MAX_SIZE) {
+    return true;
+  }
+#if CONFIG_GATEWAY_JOURNAL_EVICT_OLDEST
+  while (s_size + len > JOURNAL_MAX_SIZE && s_oldest < s_active && journal_pins(s_oldest) == 0) {
+    long size = journal_oldest_size();
+    ESP_LOGW(TAG, "Journal full, evicting segment %04x (%ld bytes)", s_oldest, size);
+    s_stats.evicted++;
+    metrics_count(METRICS_COUNTER_JOURNAL_EVICTED);
+    s_stats.evicted_bytes += size;
+    journal_remove_oldest();
+  }
+#endif
+  return s_size + len <= JOURNAL_MAX_SIZE;
+}
+
+/* Opens the active segment again if journal_seal() or journal_open() could not, so that one SD error does not lose
+ * every later record. Returns false if it still cannot be opened. Called with s_lock held. */
+static bool journal_reopen(void) {
+  if (s_file) {
+    return true;
+  }
+  if (journal_open_for_append() != ESP_OK) {
+    if (!s_open_failed) {
+      ESP_LOGE(TAG, "Cannot open segment %04x, records are lost until it can be opened", s_active);
+      s_open_failed = true;
+    }
+    return false;
+  }
+  if (s_open_failed) {
+    ESP_LOGW(TAG, "Segment %04x opened again, %u records lost so far", s_active, s_stats.failed);
+    s_open_failed = false;
+  }
+  return true;
+}
+
+/* Fills in the header of a record whose payload starts at record + JOURNAL_HEADER_LEN. */
+static void journal_frame(uint8_t *record, uint8_t type, uint16_t len) {
+  record[0] = JOURNAL_RECORD_MAGIC;
+  record[1] = type;
+  record[2] = len & 0xff;
+  record[3] = len >> 8;
+  journal_put_u32(record + 4, journal_crc(record, record + JOURNAL_HEADER_LEN, len));
+}
+
+/* Frames payload, which must start at record + JOURNAL_HEADER_LEN, and appends it to the active segment. */
+static esp_err_t journal_write_record(uint8_t *record, uint8_t type, uint16_t len) {
+  journal_frame(record, type, len);
+
+  esp_err_t err = ESP_OK;
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  if (s_file && s_active_size > 0 && s_active_size + JOURNAL_HEADER_LEN + len > JOURNAL_SEGMENT_SIZE) {
+    err = journal_seal();
+  }
+  if (!journal_reopen()) {
+    s_stats.failed++;
+    err = ESP_ERR_INVALID_STATE;
+  } else if (!journal_make_room(JOURNAL_HEADER_LEN + len)) {
+    s_stats.refused++;
+    err = ESP_ERR_NO_MEM;
+  } else if (fwrite(record, 1, JOURNAL_HEADER_LEN + len, s_file) != JOURNAL_HEADER_LEN + len) {
+    ESP_LOGE(TAG, "Failed to append record");
+    s_stats.failed++;
+    err = ESP_FAIL;
+  } else {
+    s_active_size += JOURNAL_HEADER_LEN + len;
+    s_size += JOURNAL_HEADER_LEN + len;
+  }
+  xSemaphoreGive(s_lock);
+  return err;
+}
+
+esp_err_t journal_append(const char *topic, const char *data, size_t data_len) {
+  size_t topic_len = strlen(topic);
+  if (topic_len > JOURNAL_MAX_TOPIC_LEN || data_len > JOURNAL_MAX_DATA_LEN) {
+    ESP_LOGE(TAG, "Record too large, topic %u data %u", topic_len, data_len);
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  uint8_t record[JOURNAL_HEADER_LEN + JOURNAL_MAX_PAYLOAD_LEN];
+  uint8_t *payload = record + JOURNAL_HEADER_LEN;
+  payload[0] = topic_len;
+  memcpy(payload + 1, topic, topic_len);
+  memcpy(payload + 1 + topic_len, data, data_len);
+  return journal_write_record(record, JOURNAL_RECORD_MQTT, 1 + topic_len + data_len);
+}
+
+esp_err_t journal_append_id(uint16_t topic_id, uint64_t timestamp, const char *data, size_t data_len) {
+  if (data_len > JOURNAL_MAX_DATA_LEN) {
+    ESP_LOGE(TAG, "Record too large, data %u", data_len);
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  uint8_t record[JOURNAL_HEADER_LEN + 10 + JOURNAL_MAX_DATA_LEN];
+  uint8_t *payload = record + JOURNAL_HEADER_LEN;
+  payload[0] = topic_id & 0xff;
+  payload[1] = topic_id >> 8;
+  if (timestamp == TIMESTAMP_NONE) {
+    memcpy(payload + 2, data, data_len);
+    return journal_write_record(record, JOURNAL_RECORD_MQTT_ID, 2 + data_len);
+  }
+  journal_put_u32(payload + 2, timestamp & 0xffffffff);
+  journal_put_u32(payload + 6, timestamp >> 32);
+  memcpy(payload + 10, data, data_len);
+  return journal_write_record(record, JOURNAL_RECORD_MQTT_ID_TS, 10 + data_len);
+}
+
+esp_err_t journal_flush(bool sync) {
+  esp_err_t err = ESP_OK;
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  if (!s_file) {
+    err = ESP_ERR_INVALID_STATE;
+  } else if (fflush(s_file) != 0 || (sync && fsync(fileno(s_file)) != 0)) {
+    ESP_LOGE(TAG, "Failed to flush journal");
+    err = ESP_FAIL;
+  }
+  xSemaphoreGive(s_lock);
+  return err;
+}
+
+long journal_size(void) { return s_size; }
+
+esp_err_t journal_rotate(void) {
+  esp_err_t err = ESP_OK;
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  if (s_active_size > 0) {
+    err = journal_seal();
+  }
+  xSemaphoreGive(s_lock);
+  return err;
+}
+
+uint32_t journal_oldest_segment(void) { return s_oldest; }
+
+uint32_t journal_active_segment(void) { return s_active; }
+
+long journal_segment_size(uint32_t segment) {
+  long size = 0;
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  if (segment == s_active) {
+    size = s_active_size;
+  } else if (segment == s_oldest) {
+    size = journal_oldest_size();
+  } else if (segment > s_oldest && segment < s_active) {
+    char name[JOURNAL_MAX_NAME_LEN];
+    journal_segment_name(segment, name);
+    size = sd_get_file_size(name);
+  }
+  xSemaphoreGive(s_lock);
+  return size;
+}
+
+esp_err_t journal_delete_oldest(void) {
+  esp_err_t err = ESP_OK;
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  if (s_oldest >= s_active) {
+    err = ESP_ERR_INVALID_STATE;
+  } else {
+    journal_remove_oldest();
+  }
+  xSemaphoreGive(s_lock);
+  return err;
+}
+
+void journal_set_replay_position(uint32_t segment, long offset) {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  s_rewrite_floor = offset > 0 ? segment + 1 : segment;
+  xSemaphoreGive(s_lock);
+}
+
+/* Called with s_lock held. */
+static bool journal_rewritable_locked(uint32_t segment) {
+  return segment >= s_oldest && segment >= s_rewrite_floor && segment < s_active;
+}
+
+bool journal_rewritable(uint32_t segment) {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  bool rewritable = journal_rewritable_locked(segment);
+  xSemaphoreGive(s_lock);
+  return rewritable;
+}
+
+/* Copies the records of segment that are not marked in drop to jrnlXXXX.tmp. Returns the size of the copy. */
+static long journal_copy_kept(uint32_t segment, const uint8_t *drop, size_t count) {
+  char name[JOURNAL_MAX_NAME_LEN];
+  journal_segment_name(segment, name);
+  FILE *in = sd_open_file(name, "rb");
+  if (!in) {
+    return -1;
+  }
+  journal_rewrite_name(segment, name);
+  FILE *out = sd_open_file(name, "wb");
+  if (!out) {
+    sd_close_file(in);
+    return -1;
+  }
+  uint8_t record[JOURNAL_HEADER_LEN + JOURNAL_MAX_PAYLOAD_LEN];
+  uint8_t type;
+  uint16_t len;
+  long size = 0;
+  for (size_t index = 0; journal_read_record(in, &type, record + JOURNAL_HEADER_LEN, &len) == ESP_OK; index++) {
+    if (index < count && (drop[index / 8] & (1 << (index % 8)))) {
+      continue;
+    }
+    journal_frame(record, type, len);
+    if (fwrite(record, 1, JOURNAL_HEADER_LEN + len, out) != JOURNAL_HEADER_LEN + len) {
+      size = -1;
+      break;
+    }
+    size += JOURNAL_HEADER_LEN + len;
+  }
+  sd_close_file(in);
+  if (size >= 0 && (fflush(out) != 0 || fsync(fileno(out)) != 0)) {
+    size = -1;
+  }
+  sd_close_file(out);
+  return size;
+}
+
+esp_err_t journal_rewrite(uint32_t segment, const uint8_t *drop, size_t count, long *saved) {
+  *saved = 0;
+  // pinned while it is copied, so that eviction cannot delete the original in between
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  bool pinned = journal_rewritable_locked(segment) && journal_pin(segment);
+  xSemaphoreGive(s_lock);
+  if (!pinned) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  long size = journal_copy_kept(segment, drop, count);
+  char name[JOURNAL_MAX_NAME_LEN];
+  char rewrite_name[JOURNAL_MAX_NAME_LEN];
+  journal_segment_name(segment, name);
+  journal_rewrite_name(segment, rewrite_name);
+  esp_err_t err = ESP_OK;
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  journal_unpin(segment);
+  if (size < 0) {
+    ESP_LOGE(TAG, "Could not rewrite segment %04x", segment);
+    sd_delete_file(rewrite_name);
+    err = ESP_FAIL;
+  } else if (!journal_rewritable_locked(segment) || journal_pins(segment) > 0) {
+    // replay reached the segment while it was copied
+    sd_delete_file(rewrite_name);
+    err = ESP_ERR_INVALID_STATE;
+  } else {
+    long old_size = segment == s_oldest ? journal_oldest_size() : sd_get_file_size(name);
+    // the manifest would not match the segment sizes from here on, journal_open() rebuilds it if it is missing
+    sd_delete_file(JOURNAL_MANIFEST_NAME);
+    sd_delete_file(name);
+    if (sd_rename_file(rewrite_name, name) != ESP_OK) {
+      err = ESP_FAIL;
+    }
+    if (segment == s_oldest) {
+      s_oldest_size = size;
+    }
+    s_size -= old_size - size;
+    *saved = old_size - size;
+    journal_write_manifest();
+  }
+  xSemaphoreGive(s_lock);
+  return err;
+}
+
+void journal_get_stats(journal_stats_t *stats) {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  *stats = s_stats;
+  xSemaphoreGive(s_lock);
+}
+
+esp_err_t journal_reader_open(journal_reader_t *reader, uint32_t segment, long offset) {
+  if (segment == s_active) {
+    // make everything appended so far visible to the reader's own file handle
+    journal_flush(false);
+  }
+  char name[JOURNAL_MAX_NAME_LEN];
+  journal_segment_name(segment, name);
+  // pinned before the open, so that eviction cannot delete the file in between
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  bool pinned = segment >= s_oldest && segment <= s_active && journal_pin(segment);
+  xSemaphoreGive(s_lock);
+  reader->f = pinned ? sd_open_file(name, "rb") : NULL;
+  reader->segment = pinned ? segment : JOURNAL_NO_SEGMENT;
+  reader->offset = 0;
+  if (!reader->f) {
+    journal_reader_close(reader);
+    return ESP_FAIL;
+  }
+  if (offset > 0 && fseek(reader->f, offset, SEEK_SET) != 0) {
+    journal_reader_close(reader);
+    return ESP_FAIL;
+  }
+  reader->offset = offset;
+  return ESP_OK;
+}
+
+esp_err_t journal_reader_next(journal_reader_t *reader, journal_record_t *record) {
+  uint8_t type;
+  uint8_t payload[JOURNAL_MAX_PAYLOAD_LEN];
+  uint16_t len;
+  esp_err_t err = journal_read_record(reader->f, &type, payload, &len);
+  if (err != ESP_OK) {
+    return err;
+  }
+  const uint8_t *data;
+  record->timestamp = TIMESTAMP_NONE;
+  if (type == JOURNAL_RECORD_MQTT_ID || type == JOURNAL_RECORD_MQTT_ID_TS) {
+    size_t header_len = type == JOURNAL_RECORD_MQTT_ID_TS ? 10 : 2;
+    if (len < header_len) {
+      return ESP_ERR_INVALID_SIZE;
+    }
+    record->topic_id = payload[0] | (payload[1] << 8);
+    record->topic[0] = '\0';
+    if (type == JOURNAL_RECORD_MQTT_ID_TS) {
+      record->timestamp = journal_get_u32(payload + 2) | (uint64_t)journal_get_u32(payload + 6) << 32;
+    }
+    data = payload + header_len;
+  } else {
+    uint8_t topic_len = payload[0];
+    if (len < 1 + topic_len || topic_len > JOURNAL_MAX_TOPIC_LEN) {
+      return ESP_ERR_INVALID_SIZE;
+    }
+    record->topic_id = TOPIC_ID_NONE;
+    memcpy(record->topic, payload + 1, topic_len);
+    record->topic[topic_len] = '\0';
+    data = payload + 1 + topic_len;
+  }
+  record->data_len = len - (data - payload);
+  if (record->data_len > JOURNAL_MAX_DATA_LEN) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  memcpy(record->data, data, record->data_len);
+  record->data[record->data_len] = '\0';
+  reader->offset += JOURNAL_HEADER_LEN + len;
+  return ESP_OK;
+}
+
+void journal_reader_close(journal_reader_t *reader) {
+  if (reader->f) {
+    sd_close_file(reader->f);
+    reader->f = NULL;
+  }
+  if (reader->segment != JOURNAL_NO_SEGMENT) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    journal_unpin(reader->segment);
+    xSemaphoreGive(s_lock);
+    reader->segment = JOURNAL_NO_SEGMENT;
+  }
+}
@@ -0,0 +1,126 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "esp_err.h"
+
+/*
+ * Store-and-forward journal for messages that could not be published.
+ *
+ * The journal is a series of segment files jrnlXXXX.bin on the SD card, XXXX being the hexadecimal segment id.
+ * Records are always appended to the newest (active) segment. journal_rotate() seals it and starts a new one, so
+ * that sealed segments can be replayed while new records keep coming in; a segment is deleted once it has been
+ * replayed completely. The active segment is also sealed once it reaches CONFIG_GATEWAY_JOURNAL_SEGMENT_SIZE_KB, so
+ * that a long outage leaves many small files rather than one huge one.
+ *
+ * The total size is capped at CONFIG_GATEWAY_JOURNAL_MAX_SIZE_KB. A record that does not fit either evicts the
+ * oldest sealed segments or is refused, see the GATEWAY_JOURNAL_FULL_POLICY choice. A segment a reader has open is
+ * never evicted, the record is refused instead.
+ *
+ * journal_rewrite() replaces a sealed segment by a copy without some of its records, for the compactor. The copy is
+ * written to jrnlXXXX.tmp and renamed over the original; journal_open() finishes or discards a rewrite that a power
+ * loss interrupted. Segments the replay may still hold offsets into, see journal_set_replay_position(), and
+ * segments a reader has open are never rewritten.
+ *
+ * jrnl.man, the manifest, holds the segment range and the size of the sealed segments, so that journal_open() only
+ * has to scan the active segment. It is rewritten whenever a segment is sealed or deleted:
+ *
+ *   offset  size  field
+ *   0       4     magic        JOURNAL_MANIFEST_MAGIC
+ *   4       4     oldest       oldest segment id
+ *   8       4     active       active segment id
+ *   12      4     sealed_size  bytes in segments oldest..active-1
+ *   16      4     oldest_size  bytes in segment oldest, 0 if it is the active one
+ *   20      4     crc          CRC-32 (esp_rom_crc32_le, seed 0) over the fields above
+ *
+ * A missing or corrupt manifest, or one whose range does not match the segment files, is rebuilt by scanning every
+ * segment.
+ *
+ * On-disk format, all integers little endian. A segment has no header, it is a plain sequence of records so that
+ * it can always be appended to:
+ *
+ *   offset  size  field
+ *   0       1     magic     JOURNAL_RECORD_MAGIC
+ *   1       1     type      JOURNAL_RECORD_MQTT, JOURNAL_RECORD_MQTT_ID or JOURNAL_RECORD_MQTT_ID_TS
+ *   2       2     length    payload length in bytes, at most JOURNAL_MAX_PAYLOAD_LEN
+ *   4       4     crc       CRC-32 (esp_rom_crc32_le, seed 0) over type, length and payload
+ *   8       n     payload
+ *
+ * JOURNAL_RECORD_MQTT payload:    | topic_len (1) | topic (topic_len) | data (length - 1 - topic_len) |
+ * JOURNAL_RECORD_MQTT_ID payload: | topic_id (2) | data (length - 2) |, topic ids are described in topic_table.h
+ * JOURNAL_RECORD_MQTT_ID_TS payload: | topic_id (2) | timestamp (8) | data (length - 10) |, see timestamp.h
+ *
+ * Readers stop at the first record with a bad magic, an unknown type, a short read or a CRC mismatch. Such a tail
+ * is what a power loss in the middle of an append leaves behind; journal_open() truncates it away from the active
+ * segment.
+ */
+
+#define JOURNAL_RECORD_MAGIC 0xA5
+#define JOURNAL_RECORD_MQTT 0x01
+#define JOURNAL_RECORD_MQTT_ID 0x02
+#define JOURNAL_RECORD_MQTT_ID_TS 0x03
+#define JOURNAL_MANIFEST_MAGIC 0x4e414d4a // "JMAN"
+
+#define JOURNAL_HEADER_LEN 8
+#define JOURNAL_MAX_TOPIC_LEN 64
+#define JOURNAL_MAX_DATA_LEN 190
+#define JOURNAL_MAX_PAYLOAD_LEN (1 + JOURNAL_MAX_TOPIC_LEN + JOURNAL_MAX_DATA_LEN)
+
+typedef struct {
+  uint16_t topic_id;                     // TOPIC_ID_NONE for records that carry the topic string
+  char topic[JOURNAL_MAX_TOPIC_LEN + 1]; // empty for records that carry a topic id
+  char data[JOURNAL_MAX_DATA_LEN + 1]; // always NUL terminated, data_len excludes the terminator
+  size_t data_len;
+  uint64_t timestamp; // TIMESTAMP_NONE for records without one
+} journal_record_t;
+
+typedef struct {
+  FILE *f;
+  uint32_t segment;
+  long offset; // offset of the next record to read
+} journal_reader_t;
+
+typedef struct {
+  uint32_t sealed;        // segments sealed, by journal_rotate() or because they were full
+  uint32_t evicted;       // segments deleted before they were replayed because the journal was full
+  uint32_t evicted_bytes; // bytes in those segments
+  uint32_t refused;       // records refused because the journal was full
+  uint32_t failed;        // records lost to SD errors, the active segment could not be opened or written
+} journal_stats_t;
+
+esp_err_t journal_open(void);
+/* Both return ESP_ERR_NO_MEM if the journal is full and the record was refused, and ESP_ERR_INVALID_STATE if the
+ * active segment cannot be opened; it is opened again on every append until that works. */
+esp_err_t journal_append(const char *topic, const char *data, size_t data_len);
+esp_err_t journal_append_id(uint16_t topic_id, uint64_t timestamp, const char *data, size_t data_len);
+esp_err_t journal_flush(bool sync);
+/* Total size of all segments in bytes. */
+long journal_size(void);
+
+/* Seals the active segment if it holds any records and starts a new one. */
+esp_err_t journal_rotate(void);
+uint32_t journal_oldest_segment(void);
+uint32_t journal_active_segment(void);
+long journal_segment_size(uint32_t segment);
+/* Deletes the oldest segment. Only sealed segments can be deleted. */
+esp_err_t journal_delete_oldest(void);
+/* Replay has read everything before offset in segment. Segments before it, and segment itself unless offset is 0,
+ * are no longer rewritten. Until the first call no segment is. */
+void journal_set_replay_position(uint32_t segment, long offset);
+/* Whether segment is sealed and past the replay position, so that journal_rewrite() may change it. */
+bool journal_rewritable(uint32_t segment);
+/* Rewrites segment without the records whose bit is set in drop, bit i (drop[i / 8] & (1 << i % 8)) standing for
+ * the i-th record and records from count on being kept. saved receives the bytes removed. Returns
+ * ESP_ERR_INVALID_STATE if the segment is not rewritable or a reader opened it in the meantime. */
+esp_err_t journal_rewrite(uint32_t segment, const uint8_t *drop, size_t count, long *saved);
+void journal_get_stats(journal_stats_t *stats);
+
+esp_err_t journal_reader_open(journal_reader_t *reader, uint32_t segment, long offset);
+esp_err_t journal_reader_next(journal_reader_t *reader, journal_record_t *record);
+void journal_reader_close(journal_reader_t *reader);
+
+#endif // _JOURNAL_H_
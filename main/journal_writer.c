@@ -0,0 +1,169 @@
+#include "journal_writer.h"
+
+#include "esp_log.h"
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "journal.h"
+#include "metrics.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "JOURNAL_WRITER";
+
+typedef struct {
+  uint64_t timestamp;
+  uint16_t topic_id;
+  uint8_t data_len;
+  char data[JOURNAL_MAX_DATA_LEN];
+} journal_writer_item_t;
+
+static QueueHandle_t s_queue;
+static TaskHandle_t s_task;
+static journal_writer_flush_cb_t s_flush_cb;
+static journal_writer_stats_t s_stats;
+
+static bool journal_writer_should_sync(TickType_t now, TickType_t *last_sync) {
+#if CONFIG_GATEWAY_JOURNAL_FSYNC_PER_BATCH
+  return true;
+#elif CONFIG_GATEWAY_JOURNAL_FSYNC_PERIODIC
+  if (now - *last_sync >= pdMS_TO_TICKS(CONFIG_GATEWAY_JOURNAL_FSYNC_PERIOD_MS)) {
+    *last_sync = now;
+    return true;
+  }
+  return false;
+#else
+  return false;
+#endif
+}
+
+/* Returns how long the writer task may wait for the next record before the periodic fsync of the batches it committed
+ * since the last one is due, portMAX_DELAY if none is. */
+static TickType_t journal_writer_sync_wait(TickType_t now, TickType_t last_sync, bool unsynced) {
+#if CONFIG_GATEWAY_JOURNAL_FSYNC_PERIODIC
+  if (unsynced) {
+    TickType_t elapsed = now - last_sync;
+    TickType_t period = pdMS_TO_TICKS(CONFIG_GATEWAY_JOURNAL_FSYNC_PERIOD_MS);
+    return elapsed >= period ? 0 : period - elapsed;
+  }
+#endif
+  return portMAX_DELAY;
+}
+
+/* Brings the journal up to date on the card after traffic stopped with batches committed but not yet synced. */
+static void journal_writer_sync(TickType_t *last_sync, bool *unsynced) {
+  if (!journal_writer_should_sync(xTaskGetTickCount(), last_sync)) {
+    return;
+  }
+  if (journal_flush(true) != ESP_OK) {
+    ESP_LOGE(TAG, "Periodic fsync failed");
+    return;
+  }
+  s_stats.syncs++;
+  *unsynced = false;
+  ESP_LOGD(TAG, "Synced committed records");
+}
+
+static void journal_writer_flush(uint32_t batch, TickType_t *last_sync, bool *unsynced) {
+  bool sync = journal_writer_should_sync(xTaskGetTickCount(), last_sync);
+  uint32_t start = metrics_now();
+  if (journal_flush(sync) != ESP_OK) {
+    ESP_LOGE(TAG, "Group commit of %u records failed", batch);
+    return;
+  }
+  metrics_record_since(METRICS_STAGE_SD_COMMIT, start);
+  s_stats.committed += batch;
+  s_stats.flushes++;
+  s_stats.last_batch = batch;
+  if (batch > s_stats.max_batch) {
+    s_stats.max_batch = batch;
+  }
+  if (sync) {
+    s_stats.syncs++;
+  }
+  *unsynced = !sync;
+  ESP_LOGD(TAG, "Committed %u records%s", batch, sync ? " (synced)" : "");
+  if (s_flush_cb) {
+    s_flush_cb(batch, sync);
+  }
+}
+
+static void journal_writer_task(void *pvParameters) {
+  const TickType_t interval = pdMS_TO_TICKS(CONFIG_GATEWAY_JOURNAL_FLUSH_INTERVAL_MS);
+  journal_writer_item_t item;
+  uint32_t batch = 0;
+  TickType_t batch_start = 0;
+  TickType_t last_sync = xTaskGetTickCount();
+  bool unsynced = false; // batches were committed after the last fsync
+
+  for (;;) {
+    TickType_t wait = portMAX_DELAY;
+    if (batch > 0) {
+      TickType_t elapsed = xTaskGetTickCount() - batch_start;
+      wait = elapsed >= interval ? 0 : interval - elapsed;
+    } else {
+      // no batch whose flush would sync, so wake up for the periodic fsync by itself
+      wait = journal_writer_sync_wait(xTaskGetTickCount(), last_sync, unsynced);
+    }
+    if (xQueueReceive(s_queue, &item, wait) == pdTRUE) {
+      esp_err_t err = journal_append_id(item.topic_id, item.timestamp, item.data, item.data_len);
+      if (err == ESP_ERR_NO_MEM) {
+        s_stats.refused++;
+      } else if (err == ESP_OK && batch++ == 0) {
+        batch_start = xTaskGetTickCount();
+      }
+    }
+    if (batch > 0 &&
+        (batch >= CONFIG_GATEWAY_JOURNAL_FLUSH_MAX_RECORDS || xTaskGetTickCount() - batch_start >= interval)) {
+      journal_writer_flush(batch, &last_sync, &unsynced);
+      batch = 0;
+    } else if (batch == 0 && unsynced) {
+      journal_writer_sync(&last_sync, &unsynced);
+    }
+  }
+}
+
+esp_err_t journal_writer_start(void) {
+  if (s_task) {
+    return ESP_OK;
+  }
+  s_queue = xQueueCreate(CONFIG_GATEWAY_JOURNAL_QUEUE_LEN, sizeof(journal_writer_item_t));
+  if (!s_queue) {
+    ESP_LOGE(TAG, "Could not allocate write-behind queue");
+    return ESP_ERR_NO_MEM;
+  }
+  if (xTaskCreate(journal_writer_task, "jrnl_writer", 4096, NULL, 4, &s_task) != pdPASS) {
+    ESP_LOGE(TAG, "Could not start writer task");
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+esp_err_t journal_writer_submit(uint16_t topic_id, uint64_t timestamp, const char *data, size_t data_len) {
+  if (!s_queue) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (data_len > JOURNAL_MAX_DATA_LEN) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  journal_writer_item_t item;
+  item.timestamp = timestamp;
+  item.topic_id = topic_id;
+  memcpy(item.data, data, data_len);
+  item.data_len = data_len;
+  if (xQueueSend(s_queue, &item, 0) != pdTRUE) {
+    s_stats.dropped++;
+    ESP_LOGW(TAG, "Write-behind queue full, record for topic 0x%04x dropped", topic_id);
+    return ESP_ERR_NO_MEM;
+  }
+  s_stats.submitted++;
+  return ESP_OK;
+}
+
+uint32_t journal_writer_pending(void) { return s_queue ? uxQueueMessagesWaiting(s_queue) : 0; }
+
+void journal_writer_register_flush_callback(journal_writer_flush_cb_t callback) { s_flush_cb = callback; }
+
+void journal_writer_get_stats(journal_writer_stats_t *stats) { *stats = s_stats; }
@@ -0,0 +1,31 @@
+#ifndef _JOURNAL_WRITER_H_
+#define _JOURNAL_WRITER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+typedef struct {
+  uint32_t submitted;   // records accepted into the queue
+  uint32_t dropped;     // records rejected because the queue was full
+  uint32_t refused;     // records the journal refused because it was full
+  uint32_t committed;   // records handed to the journal by a completed flush
+  uint32_t flushes;     // completed group commits
+  uint32_t syncs;       // fsync calls
+  uint32_t last_batch;  // records committed by the most recent flush
+  uint32_t max_batch;   // largest batch committed so far
+} journal_writer_stats_t;
+
+/* Called from the writer task after every group commit with the number of records it committed. */
+typedef void (*journal_writer_flush_cb_t)(uint32_t records, bool synced);
+
+esp_err_t journal_writer_start(void);
+esp_err_t journal_writer_submit(uint16_t topic_id, uint64_t timestamp, const char *data, size_t data_len);
+/* Records queued but not yet appended to the journal. */
+uint32_t journal_writer_pending(void);
+void journal_writer_register_flush_callback(journal_writer_flush_cb_t callback);
+void journal_writer_get_stats(journal_writer_stats_t *stats);
+
+#endif // _JOURNAL_WRITER_H_
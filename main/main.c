@@ -2,6 +2,7 @@
 #include <string.h>
 #include <sys/unistd.h>
 
+#include "driver/gpio.h"
 #include "esp_ble_mesh_common_api.h"
 #include "esp_ble_mesh_config_model_api.h"
 #include "esp_ble_mesh_generic_model_api.h"
@@ -9,15 +10,26 @@
 #include "esp_ble_mesh_provisioning_api.h"
 #include "esp_gatt_common_api.h"
 #include "esp_log.h"
+#include "esp_system.h"
 #include "nvs_flash.h"
 #include <sys/time.h>
 
 #include "ble_mesh_init.h"
 #include "ble_mesh_nvs.h"
+#include "config_msg.h"
+#include "downlink.h"
+#include "fanout.h"
+#include "group_table.h"
+#include "mesh_tx.h"
+#include "metrics.h"
 #include "mqtt_app.h"
 #include "mqtt_client.h"
+#include "poller.h"
 #include "sdcard.h"
 #include "secrets.h"
+#include "timestamp.h"
+#include "topic_table.h"
+#include "uplink.h"
 #include "wifi_connect.h"
 
 #include "sdkconfig.h"
@@ -38,6 +50,9 @@
 #define ESP_BLE_MESH_MQTT_CONFIG_MODEL_OP_SEND ESP_BLE_MESH_MODEL_OP_3(0x02, CID_ESP)
 #define ESP_BLE_MESH_MQTT_CONFIG_MODEL_OP_STATUS ESP_BLE_MESH_MODEL_OP_3(0x03, CID_ESP)
 
+/* Shortest config message: "a." in the legacy encoding. Shorter messages are answered with an error status. */
+#define VENDOR_CONFIG_MIN_LEN 2
+
 static nvs_handle_t NVS_HANDLE;
 
 static char wifi_ssid_from_ble[WIFI_SSID_MAX_LEN];
@@ -48,6 +63,21 @@ static char mqtt_password[MQTT_PASSWORD_MAX_LEN];
 
 static uint8_t dev_uuid[16] = {0xdd, 0xdd};
 
+/* Mesh side state of the gateway that the mesh stack does not keep itself, stored under GATEWAY_STATE_KEY in the
+ * ble_mesh NVS namespace. The stack restores its own provisioning data (CONFIG_BLE_MESH_SETTINGS). */
+#define GATEWAY_STATE_KEY "gateway"
+
+static struct gateway_state {
+  uint16_t net_idx;
+  uint16_t app_idx;
+  uint16_t addr;
+} __attribute__((packed)) gateway_state = {
+    .net_idx = ESP_BLE_MESH_KEY_UNUSED,
+    .app_idx = ESP_BLE_MESH_KEY_UNUSED,
+};
+
+static bool network_started;
+
 static esp_ble_mesh_client_t onoff_client;
 
 static esp_ble_mesh_cfg_srv_t config_server = {
@@ -68,13 +98,14 @@ static esp_ble_mesh_model_t root_models[] = {
     ESP_BLE_MESH_MODEL_GEN_ONOFF_CLI(&onoff_cli_pub, &onoff_client),
 };
 
+/* No minimum length here, vendor_dispatch() checks it so that short messages still get a status reply. */
 static esp_ble_mesh_model_op_t wifi_config_model_op[] = {
-    ESP_BLE_MESH_MODEL_OP(ESP_BLE_MESH_WIFI_CONFIG_MODEL_OP_SEND, 2),
+    ESP_BLE_MESH_MODEL_OP(ESP_BLE_MESH_WIFI_CONFIG_MODEL_OP_SEND, 0),
     ESP_BLE_MESH_MODEL_OP_END,
 };
 
 static esp_ble_mesh_model_op_t mqtt_config_model_op[] = {
-    ESP_BLE_MESH_MODEL_OP(ESP_BLE_MESH_MQTT_CONFIG_MODEL_OP_SEND, 2),
+    ESP_BLE_MESH_MODEL_OP(ESP_BLE_MESH_MQTT_CONFIG_MODEL_OP_SEND, 0),
     ESP_BLE_MESH_MODEL_OP_END,
 };
 
@@ -123,17 +154,13 @@ static esp_err_t restore_wifi_config(void) {
   }
   size_t size = sizeof(wifi_ssid_from_ble);
   err = nvs_get_str(NVS_HANDLE, "ssid", wifi_ssid_from_ble, &size);
-  if (err != ESP_OK) {
-    return ESP_FAIL;
-  }
-  size = sizeof(wifi_pswd_from_ble);
-  err = nvs_get_str(NVS_HANDLE, "password", wifi_pswd_from_ble, &size);
-  if (err != ESP_OK) {
-    return ESP_FAIL;
+  if (err == ESP_OK) {
+    size = sizeof(wifi_pswd_from_ble);
+    err = nvs_get_str(NVS_HANDLE, "password", wifi_pswd_from_ble, &size);
   }
   nvs_close(NVS_HANDLE);
 
-  return ESP_OK;
+  return err == ESP_OK ? ESP_OK : ESP_FAIL;
 }
 
 static esp_err_t store_mqtt_config(const char *uri, const char *username, const char *password) {
@@ -161,27 +188,90 @@ static esp_err_t restore_mqtt_config(void) {
   }
   size_t size = sizeof(mqtt_uri);
   err = nvs_get_str(NVS_HANDLE, "uri", mqtt_uri, &size);
-  if (err != ESP_OK) {
-    return ESP_FAIL;
-  }
-  size = sizeof(mqtt_username);
-  err = nvs_get_str(NVS_HANDLE, "username", mqtt_username, &size);
-  if (err != ESP_OK) {
-    return ESP_FAIL;
+  if (err == ESP_OK) {
+    size = sizeof(mqtt_username);
+    err = nvs_get_str(NVS_HANDLE, "username", mqtt_username, &size);
   }
-  size = sizeof(mqtt_password);
-  err = nvs_get_str(NVS_HANDLE, "password", mqtt_password, &size);
-  if (err != ESP_OK) {
-    return ESP_FAIL;
+  if (err == ESP_OK) {
+    size = sizeof(mqtt_password);
+    err = nvs_get_str(NVS_HANDLE, "password", mqtt_password, &size);
   }
   nvs_close(NVS_HANDLE);
 
-  return ESP_OK;
+  return err == ESP_OK ? ESP_OK : ESP_FAIL;
+}
+
+static void store_gateway_state(void) {
+  nvs_handle_t handle;
+  if (ble_mesh_nvs_open(&handle) != ESP_OK) {
+    return;
+  }
+  ble_mesh_nvs_store(handle, GATEWAY_STATE_KEY, &gateway_state, sizeof(gateway_state));
+  nvs_close(handle);
+}
+
+static void restore_gateway_state(void) {
+  nvs_handle_t handle;
+  if (ble_mesh_nvs_open(&handle) != ESP_OK) {
+    return;
+  }
+  bool exist = false;
+  ble_mesh_nvs_restore(handle, GATEWAY_STATE_KEY, &gateway_state, sizeof(gateway_state), &exist);
+  nvs_close(handle);
+  if (exist) {
+    ESP_LOGI(TAG, "Restored net_idx 0x%04x, app_idx 0x%04x, addr 0x%04x", gateway_state.net_idx,
+             gateway_state.app_idx, gateway_state.addr);
+    mesh_tx_set_keys(gateway_state.net_idx, gateway_state.app_idx);
+  }
+}
+
+/* Starts Wi-Fi and MQTT with the stored credentials, once per boot. Credentials that arrive later over the vendor
+ * models are applied by their handlers. */
+static void start_network(void) {
+  if (network_started) {
+    return;
+  }
+  esp_err_t err = restore_wifi_config();
+  if (err == ESP_OK) {
+    network_started = true;
+    wifi_init_sta(wifi_ssid_from_ble, WIFI_SSID_MAX_LEN, wifi_pswd_from_ble, WIFI_PSWD_MAX_LEN);
+  }
+  err = restore_mqtt_config();
+  if (err == ESP_OK) {
+    network_started = true;
+    mqtt_app_start(mqtt_uri, MQTT_URI_MAX_LEN, mqtt_username, MQTT_USERNAME_MAX_LEN, mqtt_password,
+                   MQTT_PASSWORD_MAX_LEN);
+  }
+}
+
+/* Wipes the mesh provisioning data, the stored credentials and the gateway state, and reboots unprovisioned. The
+ * offline journal on the SD card is kept. */
+static void factory_reset(void) {
+  ESP_LOGW(TAG, "Factory reset");
+  nvs_flash_erase();
+  esp_restart();
+}
+
+/* A factory reset is requested by holding CONFIG_GATEWAY_FACTORY_RESET_GPIO low while the gateway boots. */
+static bool factory_reset_requested(void) {
+#if CONFIG_GATEWAY_FACTORY_RESET_GPIO >= 0
+  gpio_reset_pin(CONFIG_GATEWAY_FACTORY_RESET_GPIO);
+  gpio_set_direction(CONFIG_GATEWAY_FACTORY_RESET_GPIO, GPIO_MODE_INPUT);
+  gpio_set_pull_mode(CONFIG_GATEWAY_FACTORY_RESET_GPIO, GPIO_PULLUP_ONLY);
+  vTaskDelay(pdMS_TO_TICKS(10));
+  return gpio_get_level(CONFIG_GATEWAY_FACTORY_RESET_GPIO) == 0;
+#else
+  return false;
+#endif
 }
 
 static void prov_complete(uint16_t net_idx, uint16_t addr, uint8_t flags, uint32_t iv_index) {
   ESP_LOGI(TAG, "net_idx: 0x%04x, addr: 0x%04x", net_idx, addr);
   ESP_LOGI(TAG, "flags: 0x%02x, iv_index: 0x%08x", flags, iv_index);
+  gateway_state.net_idx = net_idx;
+  gateway_state.addr = addr;
+  store_gateway_state();
+  mesh_tx_set_keys(net_idx, gateway_state.app_idx);
 }
 
 static void ble_mesh_provisioning_cb(esp_ble_mesh_prov_cb_event_t event, esp_ble_mesh_prov_cb_param_t *param) {
@@ -205,17 +295,11 @@ static void ble_mesh_provisioning_cb(esp_ble_mesh_prov_cb_event_t event, esp_ble
     prov_complete(param->node_prov_complete.net_idx, param->node_prov_complete.addr, param->node_prov_complete.flags,
                   param->node_prov_complete.iv_index);
     ESP_LOGI(TAG, "Try restore credentials");
-    esp_err_t err = restore_wifi_config();
-    if (err == ESP_OK) {
-      wifi_init_sta(wifi_ssid_from_ble, WIFI_SSID_MAX_LEN, wifi_pswd_from_ble, WIFI_PSWD_MAX_LEN);
-    }
-    err = restore_mqtt_config();
-    if (err == ESP_OK) {
-      mqtt_app_start(mqtt_uri, MQTT_URI_MAX_LEN, mqtt_username, MQTT_USERNAME_MAX_LEN, mqtt_password,
-                     MQTT_PASSWORD_MAX_LEN);
-    }
+    start_network();
     break;
   case ESP_BLE_MESH_NODE_PROV_RESET_EVT:
+    // The provisioner removed the gateway from the network (Config Node Reset).
+    factory_reset();
     break;
   case ESP_BLE_MESH_NODE_SET_UNPROV_DEV_NAME_COMP_EVT:
     ESP_LOGI(TAG, "ESP_BLE_MESH_NODE_SET_UNPROV_DEV_NAME_COMP_EVT, err_code %d",
@@ -231,29 +315,40 @@ static void ble_mesh_generic_client_cb(esp_ble_mesh_generic_client_cb_event_t ev
   ESP_LOGI(TAG, "Generic client, event %u, error code %d, opcode is 0x%04x", event, param->error_code,
            param->params->opcode);
 
+  mesh_tx_on_client_event(event, param);
   switch (event) {
   case ESP_BLE_MESH_GENERIC_CLIENT_GET_STATE_EVT:
     ESP_LOGI(TAG, "ESP_BLE_MESH_GENERIC_CLIENT_GET_STATE_EVT");
     if (param->params->opcode == ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET) {
       ESP_LOGI(TAG, "ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET, onoff %d", param->status_cb.onoff_status.present_onoff);
     }
+    // Gets are sent by the poller and by bulk commands, mesh_tx_on_client_event() above hands the answer to the
+    // poller, a bulk command takes it like a publication.
+    if (!param->error_code) {
+      fanout_on_status(param->params->ctx.addr, param->status_cb.onoff_status.present_onoff);
+    }
     break;
   case ESP_BLE_MESH_GENERIC_CLIENT_SET_STATE_EVT:
     ESP_LOGI(TAG, "ESP_BLE_MESH_GENERIC_CLIENT_SET_STATE_EVT");
     if (param->params->opcode == ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET) {
       ESP_LOGI(TAG, "ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET, onoff %d", param->status_cb.onoff_status.present_onoff);
+      if (!param->error_code) {
+        // The status answering a Set does not come as a publication, forward it like one.
+        uplink_post_onoff(param->params->ctx.addr, param->status_cb.onoff_status.present_onoff, &param->params->ctx);
+        fanout_on_status(param->params->ctx.addr, param->status_cb.onoff_status.present_onoff);
+        poller_on_status(param->params->ctx.addr, param->status_cb.onoff_status.present_onoff);
+      }
     }
     break;
   case ESP_BLE_MESH_GENERIC_CLIENT_PUBLISH_EVT:
     ESP_LOGI(TAG, "ESP_BLE_MESH_GENERIC_CLIENT_PUBLISH_EVT");
     ESP_LOGI(TAG, "addr: %04x, status: %d", param->params->ctx.addr, param->status_cb.onoff_status.present_onoff);
-    char topic[16];
-    char status[2];
-    snprintf(topic, 16, "ble_mesh/%04x", param->params->ctx.addr);
-    snprintf(status, 2, "%d", param->status_cb.onoff_status.present_onoff);
-    mqtt_send_message(topic, status);
+    uplink_post_onoff(param->params->ctx.addr, param->status_cb.onoff_status.present_onoff, &param->params->ctx);
+    fanout_on_status(param->params->ctx.addr, param->status_cb.onoff_status.present_onoff);
+    poller_on_status(param->params->ctx.addr, param->status_cb.onoff_status.present_onoff);
     break;
   case ESP_BLE_MESH_GENERIC_CLIENT_TIMEOUT_EVT:
+    ESP_LOGW(TAG, "Generic OnOff message 0x%04x to 0x%04x timed out", param->params->opcode, param->params->ctx.addr);
     break;
   default:
     break;
@@ -269,6 +364,9 @@ static void ble_mesh_config_server_cb(esp_ble_mesh_cfg_server_cb_event_t event,
       ESP_LOGI(TAG, "net_idx 0x%04x, app_idx 0x%04x", param->value.state_change.appkey_add.net_idx,
                param->value.state_change.appkey_add.app_idx);
       ESP_LOG_BUFFER_HEX("AppKey", param->value.state_change.appkey_add.app_key, 16);
+      gateway_state.app_idx = param->value.state_change.appkey_add.app_idx;
+      store_gateway_state();
+      mesh_tx_set_keys(param->value.state_change.appkey_add.net_idx, gateway_state.app_idx);
       break;
     case ESP_BLE_MESH_MODEL_OP_MODEL_APP_BIND:
       ESP_LOGI(TAG, "ESP_BLE_MESH_MODEL_OP_MODEL_APP_BIND");
@@ -284,6 +382,8 @@ static void ble_mesh_config_server_cb(esp_ble_mesh_cfg_server_cb_event_t event,
       ESP_LOGI(TAG, "elem_addr 0x%04x, sub_addr 0x%04x, cid 0x%04x, mod_id 0x%04x",
                param->value.state_change.mod_sub_add.element_addr, param->value.state_change.mod_sub_add.sub_addr,
                param->value.state_change.mod_sub_add.company_id, param->value.state_change.mod_sub_add.model_id);
+      // Only subscriptions of the gateway's own models show up here, and it has no Generic OnOff Server. The group
+      // table learns the memberships of the nodes only from CONFIG_GATEWAY_DOWNLINK_GROUP_TOPIC, see downlink.h.
       break;
     case ESP_BLE_MESH_MODEL_OP_MODEL_SUB_DELETE:
       ESP_LOGI(TAG, "ESP_BLE_MESH_MODEL_OP_MODEL_SUB_DELETE");
@@ -291,162 +391,124 @@ static void ble_mesh_config_server_cb(esp_ble_mesh_cfg_server_cb_event_t event,
                param->value.state_change.mod_sub_add.element_addr, param->value.state_change.mod_sub_add.sub_addr,
                param->value.state_change.mod_sub_add.company_id, param->value.state_change.mod_sub_add.model_id);
 
+      break;
     default:
       break;
     }
   }
 }
 
-static void example_ble_mesh_custom_model_cb(esp_ble_mesh_model_cb_event_t event,
-                                             esp_ble_mesh_model_cb_param_t *param) {
-  switch (event) {
-  case ESP_BLE_MESH_MODEL_OPERATION_EVT:
-    ESP_LOGI(TAG, "Received message for Custom Model %d", param->model_operation.model->vnd.vnd_model_id);
-    if (param->model_operation.opcode == ESP_BLE_MESH_WIFI_CONFIG_MODEL_OP_SEND) {
-      uint16_t status = 0;
-      ESP_LOGI(TAG, "Wifi config message received");
-      if (param->model_operation.length == 0) {
-        status = 1; // invalid message
-        esp_err_t err = esp_ble_mesh_server_model_send_msg(&vnd_models[0], param->model_operation.ctx,
-                                                           ESP_BLE_MESH_WIFI_CONFIG_MODEL_OP_STATUS, sizeof(status),
-                                                           (uint8_t *)&status);
-        ESP_LOGE(TAG, "Invalid WiFi Config message length: %zu", param->model_operation.length);
-        if (err) {
-          ESP_LOGE(TAG, "Failed to send message 0x%06x", ESP_BLE_MESH_WIFI_CONFIG_MODEL_OP_STATUS);
-        }
-        return;
-      }
-
-      ESP_LOGI(TAG, "Recv 0x%06" PRIx32 ", msg %s, len %d", param->model_operation.opcode, param->model_operation.msg,
-               param->model_operation.length);
-      // copy message in a null terminated string
-      size_t message_size = sizeof(char) * param->model_operation.length + 1;
-      char *message = malloc(message_size);
-      if (!message) {
-        status = 2; // out of memory
-        esp_err_t err = esp_ble_mesh_server_model_send_msg(&vnd_models[1], param->model_operation.ctx,
-                                                           ESP_BLE_MESH_MQTT_CONFIG_MODEL_OP_STATUS, sizeof(status),
-                                                           (uint8_t *)&status);
-        ESP_LOGE(TAG, "Could not allocate memory for WiFi Config message");
-        if (err) {
-          ESP_LOGE(TAG, "Failed to send message 0x%06x", ESP_BLE_MESH_MQTT_CONFIG_MODEL_OP_STATUS);
-        }
-        return;
-      }
-
-      snprintf(message, message_size, "%s", param->model_operation.msg);
-      char *e = strchr(message, '.');
-      if (!e) {
-        status = 3; // no separator
-        esp_err_t err = esp_ble_mesh_server_model_send_msg(&vnd_models[0], param->model_operation.ctx,
-                                                           ESP_BLE_MESH_WIFI_CONFIG_MODEL_OP_STATUS, sizeof(status),
-                                                           (uint8_t *)&status);
-        ESP_LOGE(TAG, "No separator for WiFi Config message");
-        if (err) {
-          ESP_LOGE(TAG, "Failed to send message 0x%06x", ESP_BLE_MESH_WIFI_CONFIG_MODEL_OP_STATUS);
-        }
-        free(message);
-        return;
-      }
+/*
+ * Vendor opcode dispatch. A 3-octet vendor opcode is | 0b11 | 6 bit opcode | company id (16) |, so with a single
+ * company id the 6 bit opcode alone identifies the message and indexes vendor_ops directly. Handlers are split into
+ * parse, after which the status reply is sent, and apply, which runs only for messages that parsed successfully.
+ */
+#define VENDOR_OP_INDEX(opcode) (((opcode) >> 16) & 0x3F)
+#define VENDOR_OP_COUNT 64
+
+typedef union {
+  config_wifi_t wifi;
+  config_mqtt_t mqtt;
+} vendor_msg_t;
+
+typedef struct {
+  config_status_t (*parse)(const uint8_t *msg, size_t len, vendor_msg_t *out);
+  void (*apply)(const vendor_msg_t *msg);
+  uint16_t min_len;            // shorter messages are answered with a status without calling parse
+  uint32_t status_opcode;      // 0 for messages that get no status reply
+  esp_ble_mesh_model_t *model; // model the status is sent from
+  const char *name;
+} vendor_op_t;
+
+static config_status_t wifi_config_parse(const uint8_t *msg, size_t len, vendor_msg_t *out) {
+  return config_msg_parse_wifi(msg, len, &out->wifi);
+}
 
-      int index = (int)(e - message);
-      size_t wifi_ssid_from_ble_size = (sizeof(char) * index) + 1;
-      size_t wifi_pswd_from_ble_size = (sizeof(char) * strlen(message) - (index + 1)) + 1;
-      if (wifi_ssid_from_ble_size > WIFI_SSID_MAX_LEN || wifi_pswd_from_ble_size > WIFI_PSWD_MAX_LEN) {
-        status = 4; // invalid parameters length
-        esp_err_t err = esp_ble_mesh_server_model_send_msg(&vnd_models[0], param->model_operation.ctx,
-                                                           ESP_BLE_MESH_WIFI_CONFIG_MODEL_OP_STATUS, sizeof(status),
-                                                           (uint8_t *)&status);
-        ESP_LOGE(TAG, "Invalid parameters length for WiFi Config message");
-        if (err) {
-          ESP_LOGE(TAG, "Failed to send message 0x%06x", ESP_BLE_MESH_WIFI_CONFIG_MODEL_OP_STATUS);
-        }
-        free(message);
-        return;
-      }
+static void wifi_config_apply(const vendor_msg_t *msg) {
+  config_field_copy(&msg->wifi.ssid, wifi_ssid_from_ble, sizeof(wifi_ssid_from_ble));
+  config_field_copy(&msg->wifi.password, wifi_pswd_from_ble, sizeof(wifi_pswd_from_ble));
+  ESP_LOGI(TAG, "ssid %s, pswd %s", wifi_ssid_from_ble, wifi_pswd_from_ble);
+  store_wifi_config(wifi_ssid_from_ble, wifi_pswd_from_ble);
+  wifi_init_sta(wifi_ssid_from_ble, WIFI_SSID_MAX_LEN, wifi_pswd_from_ble, WIFI_PSWD_MAX_LEN);
+}
 
-      snprintf(wifi_ssid_from_ble, wifi_ssid_from_ble_size, "%s", message);
-      snprintf(wifi_pswd_from_ble, wifi_pswd_from_ble_size, "%s", &message[index + 1]);
-      free(message);
-
-      ESP_LOGI(TAG, "message %s, idx: %d, ssid %s, pswd %s, ssid_size %zu, pswd_size %zu", message, index,
-               wifi_ssid_from_ble, wifi_pswd_from_ble, wifi_ssid_from_ble_size, wifi_pswd_from_ble_size);
-      esp_err_t err = esp_ble_mesh_server_model_send_msg(&vnd_models[0], param->model_operation.ctx,
-                                                         ESP_BLE_MESH_WIFI_CONFIG_MODEL_OP_STATUS, sizeof(status),
-                                                         (uint8_t *)&status);
-      if (err) {
-        ESP_LOGE(TAG, "Failed to send message 0x%06x", ESP_BLE_MESH_WIFI_CONFIG_MODEL_OP_STATUS);
-      }
-      store_wifi_config(wifi_ssid_from_ble, wifi_pswd_from_ble);
-      wifi_init_sta(wifi_ssid_from_ble, wifi_ssid_from_ble_size - 1, wifi_pswd_from_ble, wifi_pswd_from_ble_size - 1);
-    }
+static config_status_t mqtt_config_parse(const uint8_t *msg, size_t len, vendor_msg_t *out) {
+  return config_msg_parse_mqtt(msg, len, &out->mqtt);
+}
 
-    if (param->model_operation.opcode == ESP_BLE_MESH_MQTT_CONFIG_MODEL_OP_SEND) {
-      ESP_LOGI(TAG, "MQTT config message received");
-      uint16_t status = 0;
-      if (param->model_operation.length == 0) {
-        status = 1; // invalid message
-        esp_err_t err = esp_ble_mesh_server_model_send_msg(&vnd_models[1], param->model_operation.ctx,
-                                                           ESP_BLE_MESH_MQTT_CONFIG_MODEL_OP_STATUS, sizeof(status),
-                                                           (uint8_t *)&status);
-        ESP_LOGE(TAG, "Invalid MQTT Config message length: %zu", param->model_operation.length);
-        if (err) {
-          ESP_LOGE(TAG, "Failed to send message 0x%06x", ESP_BLE_MESH_MQTT_CONFIG_MODEL_OP_STATUS);
-        }
-        return;
-      }
+static void mqtt_config_apply(const vendor_msg_t *msg) {
+  config_field_copy(&msg->mqtt.uri, mqtt_uri, sizeof(mqtt_uri));
+  config_field_copy(&msg->mqtt.username, mqtt_username, sizeof(mqtt_username));
+  config_field_copy(&msg->mqtt.password, mqtt_password, sizeof(mqtt_password));
+  ESP_LOGI(TAG, "MQTT uri: %s, username: %s, password: %s", mqtt_uri, mqtt_username, mqtt_password);
+  store_mqtt_config(mqtt_uri, mqtt_username, mqtt_password);
+  mqtt_app_start(mqtt_uri, MQTT_URI_MAX_LEN, mqtt_username, MQTT_USERNAME_MAX_LEN, mqtt_password,
+                 MQTT_PASSWORD_MAX_LEN);
+}
 
-      ESP_LOGI(TAG, "Recv 0x%06" PRIx32 ", msg %s, len %d", param->model_operation.opcode, param->model_operation.msg,
-               param->model_operation.length);
-      // copy message in a null terminated string
-      size_t message_size = sizeof(char) * param->model_operation.length + 1;
-      char *message = malloc(message_size);
-      if (!message) {
-        status = 2; // out of memory
-        esp_err_t err = esp_ble_mesh_server_model_send_msg(&vnd_models[1], param->model_operation.ctx,
-                                                           ESP_BLE_MESH_MQTT_CONFIG_MODEL_OP_STATUS, sizeof(status),
-                                                           (uint8_t *)&status);
-        ESP_LOGE(TAG, "Could not allocate memory for MQTT Config message");
-        if (err) {
-          ESP_LOGE(TAG, "Failed to send message 0x%06x", ESP_BLE_MESH_MQTT_CONFIG_MODEL_OP_STATUS);
-        }
-        return;
-      }
+static const vendor_op_t vendor_ops[VENDOR_OP_COUNT] = {
+    [VENDOR_OP_INDEX(ESP_BLE_MESH_WIFI_CONFIG_MODEL_OP_SEND)] =
+        {
+            .parse = wifi_config_parse,
+            .apply = wifi_config_apply,
+            .min_len = VENDOR_CONFIG_MIN_LEN,
+            .status_opcode = ESP_BLE_MESH_WIFI_CONFIG_MODEL_OP_STATUS,
+            .model = &vnd_models[0],
+            .name = "WiFi config",
+        },
+    [VENDOR_OP_INDEX(ESP_BLE_MESH_MQTT_CONFIG_MODEL_OP_SEND)] =
+        {
+            .parse = mqtt_config_parse,
+            .apply = mqtt_config_apply,
+            .min_len = VENDOR_CONFIG_MIN_LEN,
+            .status_opcode = ESP_BLE_MESH_MQTT_CONFIG_MODEL_OP_STATUS,
+            .model = &vnd_models[1],
+            .name = "MQTT config",
+        },
+};
 
-      snprintf(message, message_size, "%s", param->model_operation.msg);
-      char *broker_uri = strtok(message, "|");
-      char *username = strtok(NULL, "|");
-      char *password = strtok(NULL, "|");
-      if (!broker_uri || !username || !password) {
-        status = 3; // invalid parameters
-        esp_err_t err = esp_ble_mesh_server_model_send_msg(&vnd_models[1], param->model_operation.ctx,
-                                                           ESP_BLE_MESH_MQTT_CONFIG_MODEL_OP_STATUS, sizeof(status),
-                                                           (uint8_t *)&status);
-        ESP_LOGE(TAG, "Invalid parameters for MQTT Config message");
-        if (err) {
-          ESP_LOGE(TAG, "Failed to send message 0x%06x", ESP_BLE_MESH_MQTT_CONFIG_MODEL_OP_STATUS);
-        }
-        free(message);
-        return;
-      }
+static void vendor_send_status(const vendor_op_t *op, esp_ble_mesh_msg_ctx_t *ctx, config_status_t config_status) {
+  if (!op->status_opcode) {
+    return;
+  }
+  uint16_t status = config_status;
+  esp_err_t err =
+      esp_ble_mesh_server_model_send_msg(op->model, ctx, op->status_opcode, sizeof(status), (uint8_t *)&status);
+  if (err) {
+    ESP_LOGE(TAG, "Failed to send message 0x%06" PRIx32, op->status_opcode);
+  }
+}
 
-      snprintf(mqtt_uri, strlen(broker_uri) + 1, "%s", broker_uri);
-      snprintf(mqtt_username, strlen(username) + 1, "%s", username);
-      snprintf(mqtt_password, strlen(password) + 1, "%s", password);
-      free(message);
+static void vendor_dispatch(uint32_t opcode, esp_ble_mesh_msg_ctx_t *ctx, const uint8_t *msg, size_t len) {
+  const vendor_op_t *op = &vendor_ops[VENDOR_OP_INDEX(opcode)];
+  if ((opcode & 0xFFC0FFFF) != ESP_BLE_MESH_MODEL_OP_3(0, CID_ESP) || !op->parse) {
+    ESP_LOGW(TAG, "Unhandled vendor opcode 0x%06" PRIx32, opcode);
+    return;
+  }
 
-      esp_err_t err = esp_ble_mesh_server_model_send_msg(&vnd_models[1], param->model_operation.ctx,
-                                                         ESP_BLE_MESH_MQTT_CONFIG_MODEL_OP_STATUS, sizeof(status),
-                                                         (uint8_t *)&status);
-      if (err) {
-        ESP_LOGE(TAG, "Failed to send message 0x%06x", ESP_BLE_MESH_MQTT_CONFIG_MODEL_OP_STATUS);
-      }
+  ESP_LOGI(TAG, "%s message received, len %zu", op->name, len);
+  vendor_msg_t parsed;
+  config_status_t status;
+  if (len < op->min_len) {
+    status = len ? CONFIG_STATUS_TRUNCATED : CONFIG_STATUS_EMPTY;
+  } else {
+    status = op->parse(msg, len, &parsed);
+  }
+  vendor_send_status(op, ctx, status);
+  if (status != CONFIG_STATUS_OK) {
+    ESP_LOGE(TAG, "Invalid %s message (status %d)", op->name, status);
+    return;
+  }
+  op->apply(&parsed);
+}
 
-      ESP_LOGI(TAG, "MQTT uri: %s, username: %s, password: %s", mqtt_uri, mqtt_username, mqtt_password);
-      store_mqtt_config(mqtt_uri, mqtt_username, mqtt_password);
-      mqtt_app_start(mqtt_uri, strlen(mqtt_uri), mqtt_username, strlen(mqtt_username), mqtt_password,
-                     strlen(mqtt_password));
-    }
+static void example_ble_mesh_custom_model_cb(esp_ble_mesh_model_cb_event_t event,
+                                             esp_ble_mesh_model_cb_param_t *param) {
+  switch (event) {
+  case ESP_BLE_MESH_MODEL_OPERATION_EVT:
+    ESP_LOGI(TAG, "Received message for Custom Model %d", param->model_operation.model->vnd.vnd_model_id);
+    vendor_dispatch(param->model_operation.opcode, param->model_operation.ctx, param->model_operation.msg,
+                    param->model_operation.length);
     break;
   case ESP_BLE_MESH_MODEL_SEND_COMP_EVT:
     if (param->model_send_comp.err_code) {
@@ -474,6 +536,13 @@ static esp_err_t ble_mesh_init(void) {
     return err;
   }
 
+  if (esp_ble_mesh_node_is_provisioned()) {
+    // Warm boot, the stack restored the network from NVS.
+    ESP_LOGI(TAG, "Node already provisioned");
+    restore_gateway_state();
+    return err;
+  }
+
   err = esp_ble_mesh_node_prov_enable(ESP_BLE_MESH_PROV_ADV | ESP_BLE_MESH_PROV_GATT);
   if (err != ESP_OK) {
     ESP_LOGE(TAG, "Failed to enable mesh node (err %d)", err);
@@ -490,14 +559,17 @@ void app_main(void) {
 
   ESP_LOGI(TAG, "Initializing...");
 
+  if (factory_reset_requested()) {
+    ESP_LOGW(TAG, "Factory reset requested, erasing NVS");
+    nvs_flash_erase();
+  }
   err = nvs_flash_init();
-  nvs_flash_erase();
-  err = nvs_flash_init();
-  if (err == ESP_ERR_NVS_NO_FREE_PAGES) {
+  if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
     ESP_ERROR_CHECK(nvs_flash_erase());
     err = nvs_flash_init();
   }
   ESP_ERROR_CHECK(err);
+  timestamp_init();
 
   err = bluetooth_init();
   if (err) {
@@ -516,4 +588,15 @@ void app_main(void) {
   esp_ble_gatt_set_local_mtu(200);
 
   sd_init();
+  topic_table_init();
+  mqtt_offline_store_init();
+  uplink_start();
+  metrics_start();
+  mesh_tx_start(&root_models[1]);
+  group_table_init();
+  fanout_start();
+  poller_start();
+  downlink_start();
+  // Credentials from an earlier boot, the offline store has to be up before MQTT starts.
+  start_network();
 }
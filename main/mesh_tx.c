@@ -0,0 +1,368 @@
+#include "mesh_tx.h"
+
+#include <stdbool.h>
+
+#include "esp_log.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "metrics.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "MESH_TX";
+
+#define MESH_TX_SIZE CONFIG_GATEWAY_MESH_TX_DESTINATIONS
+#define MESH_TX_MASK (MESH_TX_SIZE - 1)
+#define MESH_TX_INTERVAL_TICKS pdMS_TO_TICKS(CONFIG_GATEWAY_MESH_TX_INTERVAL_MS)
+
+_Static_assert((MESH_TX_SIZE & MESH_TX_MASK) == 0, "CONFIG_GATEWAY_MESH_TX_DESTINATIONS must be a power of two");
+
+typedef struct {
+  mesh_tx_done_cb_t done;
+  uint32_t submitted;
+  uint8_t op;
+  uint8_t onoff;
+  uint8_t tid;
+  uint8_t attempts; // messages sent for this command so far
+} mesh_tx_cmd_t;
+
+/* One slot per destination address, a free slot has addr 0. Slots are never freed, like in the node shadow. */
+typedef struct {
+  uint16_t addr;
+  bool has_queued;
+  bool has_inflight;
+  bool ready; // the slot is in s_ready
+  mesh_tx_cmd_t queued;
+  mesh_tx_cmd_t inflight;
+} mesh_tx_dest_t;
+
+/* A command that completed while s_lock was held, its callback is called once the lock is released. */
+typedef struct {
+  mesh_tx_done_cb_t done;
+  uint16_t addr;
+  uint8_t op;
+  uint8_t result;
+  uint8_t onoff;
+  uint32_t submitted;
+} mesh_tx_completion_t;
+
+static const uint32_t s_opcodes[] = {
+    [MESH_TX_SET] = ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET,
+    [MESH_TX_SET_UNACK] = ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET_UNACK,
+    [MESH_TX_GET] = ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET,
+};
+
+static SemaphoreHandle_t s_lock;
+static TaskHandle_t s_task;
+static esp_ble_mesh_model_t *s_model;
+static uint16_t s_net_idx = ESP_BLE_MESH_KEY_UNUSED;
+static uint16_t s_app_idx = ESP_BLE_MESH_KEY_UNUSED;
+static uint8_t s_tid;
+static mesh_tx_dest_t s_dest[MESH_TX_SIZE];
+/* Slots with a queued command and nothing in flight, in the order they became ready. A slot is in the ring at
+ * most once, so it cannot overflow. Head and tail are free-running. */
+static uint16_t s_ready[MESH_TX_SIZE];
+static unsigned s_ready_head;
+static unsigned s_ready_tail;
+static TickType_t s_last_send;
+/* Set when the stack refused a message while others were in flight: sending resumes once one of them completes,
+ * which frees the buffers the stack ran out of. */
+static bool s_stalled;
+static mesh_tx_stats_t s_stats;
+
+static inline unsigned mesh_tx_hash(uint16_t addr) { return (addr * 40503u >> 4) & MESH_TX_MASK; }
+
+/* Returns the slot holding addr, or the free slot where it would be inserted, or NULL if the table is full. */
+static mesh_tx_dest_t *mesh_tx_find(uint16_t addr) {
+  unsigned slot = mesh_tx_hash(addr);
+  for (unsigned probe = 0; probe < MESH_TX_SIZE; probe++) {
+    mesh_tx_dest_t *dest = &s_dest[(slot + probe) & MESH_TX_MASK];
+    if (dest->addr == addr || dest->addr == ESP_BLE_MESH_ADDR_UNASSIGNED) {
+      return dest;
+    }
+  }
+  return NULL;
+}
+
+/* The mesh_tx_* helpers below are called with s_lock held. */
+
+static void mesh_tx_make_ready(mesh_tx_dest_t *dest) {
+  if (dest->ready || !dest->has_queued || dest->has_inflight) {
+    return;
+  }
+  dest->ready = true;
+  s_ready[s_ready_tail++ & MESH_TX_MASK] = dest - s_dest;
+  xTaskNotifyGive(s_task);
+}
+
+static void mesh_tx_finish(mesh_tx_completion_t *completion, uint16_t addr, const mesh_tx_cmd_t *cmd,
+                           mesh_tx_result_t result, uint8_t onoff) {
+  switch (result) {
+  case MESH_TX_OK:
+    s_stats.completed++;
+    break;
+  case MESH_TX_TIMEOUT:
+    s_stats.timeouts++;
+    break;
+  case MESH_TX_SUPERSEDED:
+    s_stats.coalesced++;
+    metrics_count(METRICS_COUNTER_TX_COALESCED);
+    break;
+  case MESH_TX_FAILED:
+    s_stats.failed++;
+    break;
+  }
+  *completion = (mesh_tx_completion_t){
+      .done = cmd->done,
+      .addr = addr,
+      .op = cmd->op,
+      .result = result,
+      .onoff = onoff,
+      .submitted = cmd->submitted,
+  };
+}
+
+/* Puts cmd into the queued slot of dest. If a command is queued there already, the newer one wins unless it is a
+ * Get and the other one a Set; the loser goes to superseded. older is true when cmd is a retry, which is older
+ * than anything queued since. */
+static void mesh_tx_enqueue(mesh_tx_dest_t *dest, const mesh_tx_cmd_t *cmd, bool older,
+                            mesh_tx_completion_t *superseded) {
+  if (dest->has_queued) {
+    const mesh_tx_cmd_t *newer = older ? &dest->queued : cmd;
+    const mesh_tx_cmd_t *other = older ? cmd : &dest->queued;
+    bool newer_wins = newer->op != MESH_TX_GET || other->op == MESH_TX_GET;
+    if (newer_wins == older) {
+      mesh_tx_finish(superseded, dest->addr, cmd, MESH_TX_SUPERSEDED, 0);
+      return;
+    }
+    mesh_tx_finish(superseded, dest->addr, &dest->queued, MESH_TX_SUPERSEDED, 0);
+  } else {
+    s_stats.queued++;
+    if (s_stats.queued > s_stats.queued_max) {
+      s_stats.queued_max = s_stats.queued;
+    }
+  }
+  dest->queued = *cmd;
+  dest->has_queued = true;
+  mesh_tx_make_ready(dest);
+}
+
+static void mesh_tx_release(mesh_tx_dest_t *dest) {
+  dest->has_inflight = false;
+  s_stats.inflight--;
+  s_stalled = false;
+  mesh_tx_make_ready(dest);
+  xTaskNotifyGive(s_task);
+}
+
+/* The in-flight command of dest was refused or timed out: queue it again, or complete it with result once its
+ * retries are used up. */
+static void mesh_tx_retry(mesh_tx_dest_t *dest, mesh_tx_result_t result, mesh_tx_completion_t *completion,
+                          mesh_tx_completion_t *superseded) {
+  mesh_tx_cmd_t cmd = dest->inflight;
+  mesh_tx_release(dest);
+  if (cmd.attempts > CONFIG_GATEWAY_MESH_TX_RETRIES) {
+    mesh_tx_finish(completion, dest->addr, &cmd, result, 0);
+  } else {
+    mesh_tx_enqueue(dest, &cmd, true, superseded);
+  }
+}
+
+static void mesh_tx_complete(const mesh_tx_completion_t *completion) {
+  if (completion->done) {
+    completion->done(completion->addr, completion->op, completion->result, completion->onoff,
+                     completion->submitted);
+  }
+}
+
+static esp_err_t mesh_tx_send(uint16_t addr, const mesh_tx_cmd_t *cmd, uint16_t net_idx, uint16_t app_idx) {
+  esp_ble_mesh_client_common_param_t common = {
+      .opcode = s_opcodes[cmd->op],
+      .model = s_model,
+      .ctx.net_idx = net_idx,
+      .ctx.app_idx = app_idx,
+      .ctx.addr = addr,
+      .ctx.send_ttl = ESP_BLE_MESH_TTL_DEFAULT,
+      .msg_timeout = CONFIG_GATEWAY_MESH_TX_TIMEOUT_MS,
+  };
+  if (cmd->op == MESH_TX_GET) {
+    esp_ble_mesh_generic_client_get_state_t get = {0};
+    return esp_ble_mesh_generic_client_get_state(&common, &get);
+  }
+  esp_ble_mesh_generic_client_set_state_t set = {
+      .onoff_set.op_en = false,
+      .onoff_set.onoff = cmd->onoff,
+      .onoff_set.tid = cmd->tid,
+  };
+  return esp_ble_mesh_generic_client_set_state(&common, &set);
+}
+
+/* Sends what the window and the pacing allow. Returns how long to wait before calling it again if nothing else
+ * happens. */
+static TickType_t mesh_tx_pump(void) {
+  for (;;) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_ready_head == s_ready_tail || s_stalled || s_stats.inflight >= CONFIG_GATEWAY_MESH_TX_WINDOW) {
+      xSemaphoreGive(s_lock);
+      return portMAX_DELAY;
+    }
+    TickType_t now = xTaskGetTickCount();
+    if (now - s_last_send < MESH_TX_INTERVAL_TICKS) {
+      xSemaphoreGive(s_lock);
+      return MESH_TX_INTERVAL_TICKS - (now - s_last_send);
+    }
+    mesh_tx_dest_t *dest = &s_dest[s_ready[s_ready_head++ & MESH_TX_MASK]];
+    dest->ready = false;
+    mesh_tx_cmd_t cmd = dest->queued;
+    dest->has_queued = false;
+    s_stats.queued--;
+    if (cmd.attempts == 0) {
+      cmd.tid = s_tid++;
+    }
+    cmd.attempts++;
+    dest->inflight = cmd;
+    dest->has_inflight = true;
+    s_stats.inflight++;
+    s_last_send = now;
+    uint16_t addr = dest->addr;
+    uint16_t net_idx = s_net_idx;
+    uint16_t app_idx = s_app_idx;
+    xSemaphoreGive(s_lock);
+
+    // The answer to an acknowledged message can come in before the lock is taken again, the client callback
+    // completes it then.
+    esp_err_t err = mesh_tx_send(addr, &cmd, net_idx, app_idx);
+    if (err == ESP_OK && cmd.attempts == 1) {
+      metrics_record_since(METRICS_STAGE_TX_QUEUE, cmd.submitted);
+    } else if (err == ESP_OK) {
+      metrics_count(METRICS_COUNTER_TX_RETRY);
+    }
+
+    mesh_tx_completion_t completion = {0};
+    mesh_tx_completion_t superseded = {0};
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (err != ESP_OK) {
+      ESP_LOGW(TAG, "Stack refused message 0x%04x to 0x%04x (err %d), %u in flight", s_opcodes[cmd.op], addr, err,
+               s_stats.inflight - 1);
+      // With other messages in flight the stack is most likely out of buffers, which is no fault of this message:
+      // it does not use up a retry and sending pauses until one of the others completes.
+      bool congested = s_stats.inflight > 1;
+      if (congested) {
+        dest->inflight.attempts--;
+      }
+      mesh_tx_retry(dest, MESH_TX_FAILED, &completion, &superseded);
+      s_stalled = congested && s_stats.inflight > 0;
+    } else {
+      s_stats.sent++;
+      s_stats.retries += cmd.attempts > 1;
+      if (cmd.op == MESH_TX_SET_UNACK) {
+        mesh_tx_release(dest);
+        mesh_tx_finish(&completion, addr, &cmd, MESH_TX_OK, cmd.onoff);
+      }
+    }
+    xSemaphoreGive(s_lock);
+    mesh_tx_complete(&completion);
+    mesh_tx_complete(&superseded);
+  }
+}
+
+static void mesh_tx_task(void *pvParameters) {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, mesh_tx_pump());
+  }
+}
+
+void mesh_tx_on_client_event(esp_ble_mesh_generic_client_cb_event_t event,
+                             esp_ble_mesh_generic_client_cb_param_t *param) {
+  switch (event) {
+  case ESP_BLE_MESH_GENERIC_CLIENT_GET_STATE_EVT:
+  case ESP_BLE_MESH_GENERIC_CLIENT_SET_STATE_EVT:
+  case ESP_BLE_MESH_GENERIC_CLIENT_TIMEOUT_EVT:
+    break;
+  default:
+    return;
+  }
+  if (!s_lock) {
+    return;
+  }
+  uint16_t addr = param->params->ctx.addr;
+  mesh_tx_completion_t completion = {0};
+  mesh_tx_completion_t superseded = {0};
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  mesh_tx_dest_t *dest = mesh_tx_find(addr);
+  if (!dest || dest->addr != addr || addr == ESP_BLE_MESH_ADDR_UNASSIGNED || !dest->has_inflight ||
+      s_opcodes[dest->inflight.op] != param->params->opcode) {
+    xSemaphoreGive(s_lock);
+    return;
+  }
+  if (event == ESP_BLE_MESH_GENERIC_CLIENT_TIMEOUT_EVT) {
+    mesh_tx_retry(dest, MESH_TX_TIMEOUT, &completion, &superseded);
+  } else if (param->error_code) {
+    mesh_tx_retry(dest, MESH_TX_FAILED, &completion, &superseded);
+  } else {
+    mesh_tx_cmd_t cmd = dest->inflight;
+    mesh_tx_release(dest);
+    mesh_tx_finish(&completion, addr, &cmd, MESH_TX_OK, param->status_cb.onoff_status.present_onoff);
+  }
+  xSemaphoreGive(s_lock);
+  mesh_tx_complete(&completion);
+  mesh_tx_complete(&superseded);
+}
+
+esp_err_t mesh_tx_submit(uint16_t addr, mesh_tx_op_t op, uint8_t onoff, mesh_tx_done_cb_t done) {
+  if (addr == ESP_BLE_MESH_ADDR_UNASSIGNED) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (!s_task || s_app_idx == ESP_BLE_MESH_KEY_UNUSED) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  mesh_tx_cmd_t cmd = {.done = done, .submitted = metrics_now(), .op = op, .onoff = onoff};
+  mesh_tx_completion_t superseded = {0};
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  s_stats.submitted++;
+  mesh_tx_dest_t *dest = mesh_tx_find(addr);
+  if (!dest) {
+    s_stats.dropped++;
+    xSemaphoreGive(s_lock);
+    metrics_count(METRICS_COUNTER_TX_DROPPED);
+    ESP_LOGW(TAG, "Destination table full, dropping command for 0x%04x", addr);
+    return ESP_ERR_NO_MEM;
+  }
+  dest->addr = addr;
+  mesh_tx_enqueue(dest, &cmd, false, &superseded);
+  xSemaphoreGive(s_lock);
+  mesh_tx_complete(&superseded);
+  return ESP_OK;
+}
+
+void mesh_tx_set_keys(uint16_t net_idx, uint16_t app_idx) {
+  s_net_idx = net_idx;
+  s_app_idx = app_idx;
+}
+
+void mesh_tx_get_stats(mesh_tx_stats_t *stats) {
+  if (!s_lock) {
+    *stats = (mesh_tx_stats_t){0};
+    return;
+  }
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  *stats = s_stats;
+  xSemaphoreGive(s_lock);
+}
+
+esp_err_t mesh_tx_start(esp_ble_mesh_model_t *model) {
+  if (s_task) {
+    return ESP_OK;
+  }
+  s_model = model;
+  s_lock = xSemaphoreCreateMutex();
+  if (!s_lock) {
+    return ESP_ERR_NO_MEM;
+  }
+  if (xTaskCreate(mesh_tx_task, "mesh_tx", 3072, NULL, 5, &s_task) != pdPASS) {
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
@@ -0,0 +1,73 @@
+#ifndef _MESH_TX_H_
+#define _MESH_TX_H_
+
+#include <stdint.h>
+
+#include "esp_ble_mesh_defs.h"
+#include "esp_ble_mesh_generic_model_api.h"
+#include "esp_err.h"
+
+/*
+ * Scheduler for the Generic OnOff messages the gateway sends to the mesh.
+ *
+ * The mesh stack has a handful of TX buffers and the client model allows one outstanding acknowledged message per
+ * node and opcode, so a burst of commands sent straight to the stack mostly fails. Instead, every destination
+ * address has one queued and one in-flight command, and a scheduler task sends the queued ones in FIFO order of
+ * destinations while fewer than CONFIG_GATEWAY_MESH_TX_WINDOW acknowledged messages are in flight, at most one
+ * every CONFIG_GATEWAY_MESH_TX_INTERVAL_MS.
+ *
+ * A command submitted while another one for the same destination is queued replaces it (latest wins), the
+ * replaced command completes with MESH_TX_SUPERSEDED. The one exception is a Get, which never replaces a Set: a
+ * Set is answered with the state as well. An acknowledged command that times out or that the stack refuses is
+ * sent again, with the same TID, up to CONFIG_GATEWAY_MESH_TX_RETRIES times, unless a newer command for the
+ * destination is queued by then. A send the stack refuses while other messages are in flight does not count as a
+ * retry: the stack is out of buffers, and sending pauses until one of the others completes.
+ */
+
+typedef enum {
+  MESH_TX_SET,       // acknowledged Generic OnOff Set, unicast destinations
+  MESH_TX_SET_UNACK, // Generic OnOff Set Unacknowledged, completes as soon as it is sent
+  MESH_TX_GET,       // Generic OnOff Get
+} mesh_tx_op_t;
+
+typedef enum {
+  MESH_TX_OK,         // answered, onoff is the present state; for MESH_TX_SET_UNACK: sent
+  MESH_TX_TIMEOUT,    // no answer, retries included
+  MESH_TX_SUPERSEDED, // replaced by a newer command for the destination before it was answered
+  MESH_TX_FAILED,     // the stack did not take the message, retries included
+} mesh_tx_result_t;
+
+/* Called once per submitted command, from the scheduler task, the Generic Client callback or, for a command a newer
+ * one replaces, from mesh_tx_submit(). submitted is the metrics_now() of the submission. */
+typedef void (*mesh_tx_done_cb_t)(uint16_t addr, mesh_tx_op_t op, mesh_tx_result_t result, uint8_t onoff,
+                                  uint32_t submitted);
+
+/* Cumulative since boot, except queued and inflight. */
+typedef struct {
+  uint32_t submitted;
+  uint32_t sent;       // messages handed to the stack, retries included
+  uint32_t completed;  // commands that completed with MESH_TX_OK
+  uint32_t coalesced;  // commands replaced by a newer one
+  uint32_t dropped;    // submissions refused because the destination table was full
+  uint32_t retries;    // messages sent again after a timeout or a refused send
+  uint32_t timeouts;   // commands that completed with MESH_TX_TIMEOUT
+  uint32_t failed;     // commands that completed with MESH_TX_FAILED
+  uint32_t queued;     // commands waiting to be sent
+  uint32_t inflight;   // acknowledged messages waiting for their answer
+  uint32_t queued_max; // high watermark of queued
+} mesh_tx_stats_t;
+
+/* Starts the scheduler task. model is the Generic OnOff Client. */
+esp_err_t mesh_tx_start(esp_ble_mesh_model_t *model);
+/* Keys used for sending, called once they are known: at provisioning, AppKey Add and warm boot. */
+void mesh_tx_set_keys(uint16_t net_idx, uint16_t app_idx);
+/* Queues a command for addr, never blocks on the mesh. done may be NULL. Returns ESP_ERR_INVALID_STATE before the
+ * keys are known and ESP_ERR_NO_MEM when the destination table is full; done is not called then. */
+esp_err_t mesh_tx_submit(uint16_t addr, mesh_tx_op_t op, uint8_t onoff, mesh_tx_done_cb_t done);
+/* Feeds the Generic Client events to the scheduler, called from the Generic Client callback. Events for messages
+ * the scheduler did not send are ignored. */
+void mesh_tx_on_client_event(esp_ble_mesh_generic_client_cb_event_t event,
+                             esp_ble_mesh_generic_client_cb_param_t *param);
+void mesh_tx_get_stats(mesh_tx_stats_t *stats);
+
+#endif // _MESH_TX_H_
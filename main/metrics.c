@@ -0,0 +1,181 @@
+#include "metrics.h"
+
+#if CONFIG_GATEWAY_METRICS
+
+#include "esp_log.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "mqtt_app.h"
+
+static const char *TAG = "METRICS";
+
+#define METRICS_PENDING_SLOTS 32 // see metrics_track_puback()
+#define METRICS_PENDING_MASK (METRICS_PENDING_SLOTS - 1)
+
+typedef struct {
+  atomic_uint count;
+  atomic_uint max;
+  atomic_uint buckets[METRICS_BUCKETS];
+} metrics_histogram_t;
+
+/* A message waiting for its PUBACK. msg_id 0 marks a free slot, message ids of QoS 1 publishes are never 0. */
+typedef struct {
+  atomic_int msg_id;
+  atomic_uint sent;
+  atomic_uint origin;
+  atomic_uint kind;
+} metrics_pending_slot_t;
+
+static const char *const s_stage_names[METRICS_STAGE_COUNT] = {
+    "ring", "pub", "ack", "e2e", "sd", "rpl", "wifi", "dhcp", "boot", "cmd", "txq", "bulk",
+};
+
+static metrics_histogram_t s_stages[METRICS_STAGE_COUNT];
+static atomic_uint s_counters[METRICS_COUNTER_COUNT];
+static metrics_pending_slot_t s_pending[METRICS_PENDING_SLOTS];
+static TaskHandle_t s_task;
+static atomic_bool s_first_puback;
+
+void metrics_record(metrics_stage_t stage, uint32_t us) {
+  metrics_histogram_t *h = &s_stages[stage];
+  // 0..127 us land in bucket 0, every further power of two moves one bucket up
+  int bucket = us < 128 ? 0 : 31 - __builtin_clz(us) - 6;
+  if (bucket >= METRICS_BUCKETS) {
+    bucket = METRICS_BUCKETS - 1;
+  }
+  atomic_fetch_add_explicit(&h->buckets[bucket], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+  // racing updates can lose a new maximum to a slightly smaller one, good enough for monitoring
+  if (us > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+    atomic_store_explicit(&h->max, us, memory_order_relaxed);
+  }
+}
+
+void metrics_count(metrics_counter_t counter) {
+  atomic_fetch_add_explicit(&s_counters[counter], 1, memory_order_relaxed);
+}
+
+void metrics_add(metrics_counter_t counter, uint32_t n) {
+  atomic_fetch_add_explicit(&s_counters[counter], n, memory_order_relaxed);
+}
+
+/* Slots are indexed by msg_id, a newer message simply takes over the slot of an older one that is still waiting.
+ * The slot is invalidated before it is rewritten, so metrics_on_puback() notices a concurrent rewrite when it
+ * tries to release the slot and drops the sample instead of mixing up two messages. */
+void metrics_track_puback(int msg_id, metrics_pending_t kind, uint32_t origin) {
+  if (msg_id <= 0) {
+    return;
+  }
+  metrics_pending_slot_t *slot = &s_pending[msg_id & METRICS_PENDING_MASK];
+  atomic_store(&slot->msg_id, 0);
+  atomic_store_explicit(&slot->sent, metrics_now(), memory_order_relaxed);
+  atomic_store_explicit(&slot->origin, origin, memory_order_relaxed);
+  atomic_store_explicit(&slot->kind, kind, memory_order_relaxed);
+  atomic_store(&slot->msg_id, msg_id);
+}
+
+void metrics_on_puback(int msg_id) {
+  if (!atomic_exchange_explicit(&s_first_puback, true, memory_order_relaxed)) {
+    // esp_timer counts from boot, so this is reset -> first message acknowledged by the broker
+    uint32_t boot_us = (uint32_t)esp_timer_get_time();
+    metrics_record(METRICS_STAGE_BOOT, boot_us);
+    ESP_LOGI(TAG, "First PUBACK %u ms after boot", boot_us / 1000);
+  }
+  if (msg_id <= 0) {
+    return;
+  }
+  metrics_pending_slot_t *slot = &s_pending[msg_id & METRICS_PENDING_MASK];
+  if (atomic_load(&slot->msg_id) != msg_id) {
+    return;
+  }
+  uint32_t now = metrics_now();
+  uint32_t sent = atomic_load_explicit(&slot->sent, memory_order_relaxed);
+  uint32_t origin = atomic_load_explicit(&slot->origin, memory_order_relaxed);
+  metrics_pending_t kind = atomic_load_explicit(&slot->kind, memory_order_relaxed);
+  int expected = msg_id;
+  if (!atomic_compare_exchange_strong(&slot->msg_id, &expected, 0)) {
+    return;
+  }
+  if (kind == METRICS_PENDING_REPLAY) {
+    metrics_record(METRICS_STAGE_REPLAY, now - sent);
+  } else {
+    metrics_record(METRICS_STAGE_PUBACK, now - sent);
+    metrics_record(METRICS_STAGE_END_TO_END, now - origin);
+  }
+}
+
+size_t metrics_format(char *buf, size_t size) {
+  size_t len = 0;
+#define METRICS_APPEND(...)                                                                                            \
+  do {                                                                                                                 \
+    int n = snprintf(buf + len, size - len, __VA_ARGS__);                                                              \
+    if (n < 0 || (size_t)n >= size - len) {                                                                            \
+      return 0;                                                                                                        \
+    }                                                                                                                  \
+    len += n;                                                                                                          \
+  } while (0)
+
+  METRICS_APPEND("{\"up\":%lu,\"cnt\":[", (unsigned long)(esp_timer_get_time() / 1000000));
+  for (int i = 0; i < METRICS_COUNTER_COUNT; i++) {
+    METRICS_APPEND(i ? ",%u" : "%u", atomic_load_explicit(&s_counters[i], memory_order_relaxed));
+  }
+  METRICS_APPEND("]");
+  for (int stage = 0; stage < METRICS_STAGE_COUNT; stage++) {
+    metrics_histogram_t *h = &s_stages[stage];
+    unsigned buckets[METRICS_BUCKETS];
+    int used = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+      buckets[i] = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+      if (buckets[i]) {
+        used = i + 1;
+      }
+    }
+    METRICS_APPEND(",\"%s\":[%u,%u", s_stage_names[stage], atomic_load_explicit(&h->count, memory_order_relaxed),
+                   atomic_load_explicit(&h->max, memory_order_relaxed));
+    for (int i = 0; i < used; i++) {
+      METRICS_APPEND(",%u", buckets[i]);
+    }
+    METRICS_APPEND("]");
+  }
+  METRICS_APPEND("}");
+#undef METRICS_APPEND
+  return len;
+}
+
+void metrics_publish(void) {
+  char report[METRICS_REPORT_MAX_LEN];
+  if (!mqtt_is_connected()) {
+    return;
+  }
+  size_t len = metrics_format(report, sizeof(report));
+  if (len == 0) {
+    ESP_LOGW(TAG, "Report does not fit into %d bytes", (int)METRICS_REPORT_MAX_LEN);
+    return;
+  }
+  mqtt_publish(CONFIG_GATEWAY_METRICS_TOPIC, report, len, 0, 0);
+}
+
+static void metrics_task(void *pvParameters) {
+  for (;;) {
+    vTaskDelay(pdMS_TO_TICKS(CONFIG_GATEWAY_METRICS_INTERVAL_S * 1000));
+    metrics_publish();
+  }
+}
+
+esp_err_t metrics_start(void) {
+  if (s_task || CONFIG_GATEWAY_METRICS_INTERVAL_S == 0) {
+    return ESP_OK;
+  }
+  if (xTaskCreate(metrics_task, "metrics", 3072 + METRICS_REPORT_MAX_LEN, NULL, 2, &s_task) != pdPASS) {
+    ESP_LOGE(TAG, "Could not start report task");
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+#endif
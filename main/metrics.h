@@ -0,0 +1,123 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+/*
+ * Hot-path latency histograms and counters of the uplink pipeline, published periodically to
+ * CONFIG_GATEWAY_METRICS_TOPIC. Recording a sample is a few relaxed atomic increments on a static struct, cheap
+ * enough to leave the instrumentation enabled in production builds.
+ *
+ * Every stage keeps a sample count, the maximum and METRICS_BUCKETS power-of-two buckets: bucket 0 counts samples
+ * below 128 us, bucket i samples in [2^(i+6), 2^(i+7)) us and the last bucket everything from 2^21 us (~2.1 s) up.
+ * All values are cumulative since boot, consumers take the difference between two reports.
+ *
+ * Report format, one JSON object without whitespace, trailing zero buckets omitted:
+ *
+ *   {"up":<uptime s>,"cnt":[<counter>...],"<stage>":[<count>,<max us>,<bucket 0>,...],...}
+ *
+ * Counters are in metrics_counter_t order, stage names are the ones in metrics_stage_t comments.
+ */
+
+#define METRICS_BUCKETS 16
+
+typedef enum {
+  METRICS_STAGE_RING,         // "ring": mesh report received -> taken off the ingest ring by the publisher task
+  METRICS_STAGE_PUBLISH,      // "pub": duration of the publish call for a live message
+  METRICS_STAGE_PUBACK,       // "ack": live publish -> PUBACK
+  METRICS_STAGE_END_TO_END,   // "e2e": mesh report received -> PUBACK
+  METRICS_STAGE_SD_COMMIT,    // "sd": duration of a journal group commit
+  METRICS_STAGE_REPLAY,       // "rpl": replayed message queued -> PUBACK
+  METRICS_STAGE_WIFI_CONNECT, // "wifi": Wi-Fi link lost or credentials applied -> IP address, backoff included
+  METRICS_STAGE_WIFI_DHCP,    // "dhcp": associated with the AP -> IP address
+  METRICS_STAGE_BOOT,         // "boot": boot -> first PUBACK, one sample per boot
+  METRICS_STAGE_COMMAND,      // "cmd": MQTT command received -> node acknowledged the Set
+  METRICS_STAGE_TX_QUEUE,     // "txq": mesh command submitted -> first sent by the mesh TX scheduler
+  METRICS_STAGE_FANOUT,       // "bulk": bulk command submitted -> every node confirmed, acknowledged or failed
+  METRICS_STAGE_COUNT,
+} metrics_stage_t;
+
+typedef enum {
+  METRICS_COUNTER_MESH_RX,            // mesh reports handed to the uplink
+  METRICS_COUNTER_PUBLISHED,          // live messages accepted by the MQTT client
+  METRICS_COUNTER_OFFLINE_RAM,        // messages kept in the RAM tier
+  METRICS_COUNTER_OFFLINE_SD,         // messages handed to the journal writer
+  METRICS_COUNTER_REPLAYED,           // replayed messages, or batches of them, acknowledged by the broker
+  METRICS_COUNTER_WIFI_RETRY,         // failed Wi-Fi connection attempts
+  METRICS_COUNTER_WIFI_SCAN_FALLBACK, // connections to the cached AP that failed and fell back to a full scan
+  METRICS_COUNTER_COMMAND_TIMEOUT,    // MQTT commands the node did not acknowledge
+  METRICS_COUNTER_TX_COALESCED,       // mesh commands replaced by a newer one for the same destination
+  METRICS_COUNTER_TX_DROPPED,         // mesh commands refused because the scheduler table was full
+  METRICS_COUNTER_TX_RETRY,           // mesh messages sent again after a timeout or a refused send
+  METRICS_COUNTER_FANOUT_FALLBACK,    // nodes of a bulk command that needed an acknowledged unicast Set
+  METRICS_COUNTER_POLL_CHANGED,       // polls that found a state the gateway had missed
+  METRICS_COUNTER_JOURNAL_EVICTED,    // journal segments deleted before replay because the size limit was reached
+  METRICS_COUNTER_COMPACTED,          // journal records removed by the compactor before they were replayed
+  METRICS_COUNTER_BATCHES,            // batches handed to the MQTT client, live and replayed
+  METRICS_COUNTER_BATCH_RECORDS,      // records in them
+  METRICS_COUNTER_BATCH_BYTES,        // their payload bytes, the fill ratio is bytes / batches / BATCH_MAX_BYTES
+  METRICS_COUNTER_COUNT,
+} metrics_counter_t;
+
+// longest stage name in the report
+#define METRICS_STAGE_NAME_MAX_LEN 4
+/* Size of a buffer for metrics_format() that holds the report with every value at its longest: the uptime with 20
+ * digits, every count, maximum, bucket and counter with 10 digits plus a comma and no bucket omitted. */
+#define METRICS_REPORT_MAX_LEN                                                                                       \
+  (sizeof("{\"up\":,\"cnt\":[]}") + 20 + METRICS_COUNTER_COUNT * 11 +                                                \
+   METRICS_STAGE_COUNT * (sizeof(",\"\":[]") - 1 + METRICS_STAGE_NAME_MAX_LEN + (2 + METRICS_BUCKETS) * 11))
+
+/* What a message waiting for its PUBACK was sent for. */
+typedef enum {
+  METRICS_PENDING_LIVE,
+  METRICS_PENDING_REPLAY,
+} metrics_pending_t;
+
+/* Microsecond timestamp for metrics_record_since(). Wraps after ~71 minutes, which unsigned differences handle. */
+static inline uint32_t metrics_now(void) { return (uint32_t)esp_timer_get_time(); }
+
+#if CONFIG_GATEWAY_METRICS
+
+void metrics_record(metrics_stage_t stage, uint32_t us);
+void metrics_count(metrics_counter_t counter);
+void metrics_add(metrics_counter_t counter, uint32_t n);
+
+static inline void metrics_record_since(metrics_stage_t stage, uint32_t start) {
+  metrics_record(stage, metrics_now() - start);
+}
+
+/* Remembers when msg_id was sent, origin is the metrics_now() of the mesh report for live messages. The PUBACK
+ * stages are best effort: a message waiting in one of 32 slots indexed by msg_id loses its slot to a newer message,
+ * and then its PUBACK records nothing. Under load the stages are a sample, METRICS_COUNTER_REPLAYED counts every
+ * acknowledged replay message. */
+void metrics_track_puback(int msg_id, metrics_pending_t kind, uint32_t origin);
+/* Records the PUBACK stages for msg_id if it is being tracked, called from the MQTT event handler. The first
+ * PUBACK after boot also records the boot stage. */
+void metrics_on_puback(int msg_id);
+/* Starts the task that publishes the report every CONFIG_GATEWAY_METRICS_INTERVAL_S seconds. */
+esp_err_t metrics_start(void);
+/* Formats the current report into buf. Returns the length, or 0 if buf is too small. */
+size_t metrics_format(char *buf, size_t size);
+/* Publishes the current report right away if the broker is connected. */
+void metrics_publish(void);
+
+#else
+
+static inline void metrics_record(metrics_stage_t stage, uint32_t us) {}
+static inline void metrics_record_since(metrics_stage_t stage, uint32_t start) {}
+static inline void metrics_count(metrics_counter_t counter) {}
+static inline void metrics_add(metrics_counter_t counter, uint32_t n) {}
+static inline void metrics_track_puback(int msg_id, metrics_pending_t kind, uint32_t origin) {}
+static inline void metrics_on_puback(int msg_id) {}
+static inline esp_err_t metrics_start(void) { return ESP_OK; }
+static inline size_t metrics_format(char *buf, size_t size) { return 0; }
+static inline void metrics_publish(void) {}
+
+#endif
+
+#endif // _METRICS_H_
@@ -2,10 +2,6 @@
 
 #include "esp_event.h"
 #include "esp_log.h"
-#include "esp_netif.h"
-#include "esp_system.h"
-#include "esp_wifi.h"
-#include "nvs_flash.h"
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -17,20 +13,25 @@
 #include "freertos/semphr.h"
 #include "freertos/task.h"
 
-#include "lwip/dns.h"
-#include "lwip/netdb.h"
-#include "lwip/sockets.h"
-
+#include "batch.h"
+#include "compactor.h"
+#include "journal.h"
+#include "journal_writer.h"
+#include "metrics.h"
 #include "mqtt_client.h"
+#include "offline_buffer.h"
+#include "payload.h"
+#include "replay.h"
 #include "sdcard.h"
-#include "secrets.h"
+#include "sdkconfig.h"
+#include "topic_table.h"
 #include "wifi_connect.h"
 
 static const char *TAG = "MQTT";
 static esp_mqtt_client_handle_t client;
 static EventGroupHandle_t s_mqtt_event_group;
-static const char *mqtt_file = "mqttfile.txt";
-TaskHandle_t send_messages_from_file_task_handle;
+static const char *legacy_mqtt_file = "mqttfile.txt";
+static const char *legacy_mqtt_rest_file = "mqttfile.tmp";
 
 #define MQTT_CONNECTED_BIT BIT0
 
@@ -38,24 +39,118 @@ static char mqtt_broker_uri[MQTT_URI_MAX_LEN];
 static char mqtt_username[MQTT_USERNAME_MAX_LEN];
 static char mqtt_password[MQTT_PASSWORD_MAX_LEN];
 
-void mqtt_send_messages_from_file(void *pvParameters) {
-  FILE *f = sd_open_file_for_read(mqtt_file);
-  if (f) {
-    ESP_LOGI(TAG, "Begin sending messages from file");
-    char buffer[SD_MAX_LINE_LENGTH];
-    char topic[SD_MAX_LINE_LENGTH];
-    char data[SD_MAX_LINE_LENGTH];
-    while (sd_read_line_from_file(f, buffer, SD_MAX_LINE_LENGTH) == ESP_OK) {
-      strcpy(topic, strtok(buffer, "|"));
-      strcpy(data, strtok(NULL, "|"));
-      mqtt_send_message(buffer, data);
+#define MQTT_APP_MAX_SUBSCRIPTIONS 4
+
+typedef struct {
+  const char *filter;
+  mqtt_data_cb_t callback;
+} mqtt_subscription_t;
+
+static mqtt_subscription_t s_subscriptions[MQTT_APP_MAX_SUBSCRIPTIONS];
+static int s_subscription_count;
+
+bool mqtt_is_connected(void) {
+  return s_mqtt_event_group && (xEventGroupGetBits(s_mqtt_event_group) & MQTT_CONNECTED_BIT);
+}
+
+int mqtt_publish(const char *topic, const char *data, int len, int qos, int retain) {
+  if (!mqtt_is_connected()) {
+    return -1;
+  }
+  return esp_mqtt_client_publish(client, topic, data, len, qos, retain);
+}
+
+int mqtt_enqueue(const char *topic, const char *data, int len, int qos, int retain) {
+  if (!mqtt_is_connected()) {
+    return -1;
+  }
+  return esp_mqtt_client_enqueue(client, topic, data, len, qos, retain, true);
+}
+
+int mqtt_outbox_size(void) { return mqtt_is_connected() ? esp_mqtt_client_get_outbox_size(client) : 0; }
+
+/* Moves messages stored by older firmware as "topic|data" text lines into the journal. Lines the journal did not
+ * take are written back to the file, which is only deleted once every message is in the journal. */
+static void mqtt_import_legacy_file(void) {
+  FILE *f = sd_open_file_for_read(legacy_mqtt_file);
+  if (!f) {
+    // an import that was cut short between deleting the file and renaming the rest
+    if (!(f = sd_open_file_for_read(legacy_mqtt_rest_file))) {
+      return;
     }
     sd_close_file(f);
-    sd_clear_file(mqtt_file);
+    if (sd_rename_file(legacy_mqtt_rest_file, legacy_mqtt_file) != ESP_OK ||
+        !(f = sd_open_file_for_read(legacy_mqtt_file))) {
+      return;
+    }
   }
+  FILE *rest = NULL;
+  char buffer[SD_MAX_LINE_LENGTH];
+  int count = 0;
+  int failed = 0;
+  while (sd_read_line_from_file(f, buffer, SD_MAX_LINE_LENGTH) == ESP_OK) {
+    char *data = strchr(buffer, '|');
+    if (!data) {
+      ESP_LOGW(TAG, "Malformed line in %s dropped", legacy_mqtt_file);
+      continue;
+    }
+    *data++ = '\0';
+    if (journal_append(buffer, data, strlen(data)) == ESP_OK) {
+      count++;
+      continue;
+    }
+    if (!rest && !(rest = sd_open_file(legacy_mqtt_rest_file, "w"))) {
+      break;
+    }
+    if (fprintf(rest, "%s|%s\n", buffer, data) < 0) {
+      break;
+    }
+    failed++;
+  }
+  bool complete = feof(f);
+  sd_close_file(f);
+  if (rest) {
+    complete = fclose(rest) == 0 && complete;
+  }
+  if (journal_flush(true) != ESP_OK || !complete) {
+    // the file stays as it is and is imported again next time, messages already in the journal are sent twice
+    ESP_LOGE(TAG, "Import of %s incomplete, %d messages imported, file kept", legacy_mqtt_file, count);
+    if (rest) {
+      sd_delete_file(legacy_mqtt_rest_file);
+    }
+    return;
+  }
+  sd_delete_file(legacy_mqtt_file);
+  if (failed) {
+    ESP_LOGW(TAG, "%d messages from %s not imported, kept for the next start", failed, legacy_mqtt_file);
+    sd_rename_file(legacy_mqtt_rest_file, legacy_mqtt_file);
+  }
+  ESP_LOGI(TAG, "Imported %d messages from %s", count, legacy_mqtt_file);
+}
 
-  ESP_LOGI(TAG, "End sending messages from file");
-  vTaskDelete(NULL);
+bool mqtt_topic_matches(const char *filter, const char *topic, int topic_len) {
+  const char *end = topic + topic_len;
+  while (*filter) {
+    if (*filter == '#') {
+      return true;
+    }
+    if (*filter == '+') {
+      while (topic < end && *topic != '/') {
+        topic++;
+      }
+      filter++;
+    } else {
+      if (topic == end && strcmp(filter, "/#") == 0) {
+        return true;
+      }
+      if (topic == end || *topic != *filter) {
+        return false;
+      }
+      topic++;
+      filter++;
+    }
+  }
+  return topic == end;
 }
 
 /**
@@ -75,13 +170,17 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
   case MQTT_EVENT_CONNECTED:
     xEventGroupSetBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
     ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-    if (sd_get_file_size(mqtt_file) > 0) {
-      xTaskCreate(mqtt_send_messages_from_file, "msg_file", 4096, NULL, 3, &send_messages_from_file_task_handle);
+    for (int i = 0; i < s_subscription_count; i++) {
+      esp_mqtt_client_subscribe(client, s_subscriptions[i].filter, 1);
+    }
+    if (offline_buffer_count() > 0 || journal_size() > 0) {
+      replay_resume();
     }
     break;
   case MQTT_EVENT_DISCONNECTED:
     ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
     xEventGroupClearBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
+    replay_on_disconnected();
     break;
   case MQTT_EVENT_SUBSCRIBED:
     ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
@@ -90,12 +189,21 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
     break;
   case MQTT_EVENT_PUBLISHED:
-    ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+    ESP_LOGD(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+    metrics_on_puback(event->msg_id);
+    replay_on_published(event->msg_id);
     break;
   case MQTT_EVENT_DATA:
-    ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-    printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
-    printf("DATA=%.*s\r\n", event->data_len, event->data);
+    ESP_LOGD(TAG, "MQTT_EVENT_DATA, topic %.*s", event->topic_len, event->topic);
+    // Commands are short, a message that esp-mqtt had to split into several events is not one of ours.
+    if (event->current_data_offset != 0 || event->data_len != event->total_data_len) {
+      break;
+    }
+    for (int i = 0; i < s_subscription_count; i++) {
+      if (mqtt_topic_matches(s_subscriptions[i].filter, event->topic, event->topic_len)) {
+        s_subscriptions[i].callback(event->topic, event->topic_len, event->data, event->data_len);
+      }
+    }
     break;
   case MQTT_EVENT_ERROR:
     ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
@@ -106,12 +214,16 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
   }
 }
 
-static void mqtt_init() {
-  esp_mqtt_client_config_t mqtt_cfg = {
+static esp_mqtt_client_config_t mqtt_config(void) {
+  return (esp_mqtt_client_config_t){
       .broker.address.uri = mqtt_broker_uri,
       .credentials.username = mqtt_username,
       .credentials.authentication.password = mqtt_password,
   };
+}
+
+static void mqtt_init() {
+  esp_mqtt_client_config_t mqtt_cfg = mqtt_config();
 
   client = esp_mqtt_client_init(&mqtt_cfg);
   /* The last argument may be used to pass data to the event handler, in this example mqtt_event_handler */
@@ -121,32 +233,94 @@ static void mqtt_init() {
   }
 }
 
+/* Wi-Fi comes and goes under a running client: stop it while the link is down instead of letting it spin on
+ * reconnects, and start the same client again afterwards so that messages in its outbox are kept. */
 void on_wifi_status_change(int status) {
-  EventBits_t bits = xEventGroupGetBits(s_mqtt_event_group);
+  if (!client) {
+    return;
+  }
   if (status) {
-    if (!(bits & MQTT_CONNECTED_BIT)) {
-      ESP_LOGI(TAG, "Starting MQTT client");
-      mqtt_init();
-    }
+    ESP_LOGI(TAG, "Starting MQTT client");
+    esp_mqtt_client_start(client);
   } else {
-    if (bits & MQTT_CONNECTED_BIT) {
-      ESP_LOGI(TAG, "Stopping MQTT client");
-      esp_mqtt_client_destroy(client);
-    }
+    ESP_LOGI(TAG, "Stopping MQTT client");
+    esp_mqtt_client_stop(client);
+    xEventGroupClearBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
+    replay_on_disconnected();
   }
 }
 
-void mqtt_send_message(const char *topic, const char *data) {
-  if (s_mqtt_event_group) {
-    EventBits_t bits = xEventGroupGetBits(s_mqtt_event_group);
-    if (bits & MQTT_CONNECTED_BIT) {
-      esp_mqtt_client_publish(client, topic, data, 0, 1, 0);
-      return;
-    }
+int mqtt_send_message(uint16_t topic_id, uint64_t timestamp, const char *data, size_t data_len) {
+  char scratch[TOPIC_MAX_LEN + 1];
+  const char *topic = topic_table_get(topic_id, scratch);
+  uint32_t start = metrics_now();
+  int msg_id = -1;
+  if (topic && mqtt_is_connected()) {
+    char payload[PAYLOAD_MAX_LEN(OFFLINE_BUFFER_MAX_DATA_LEN)];
+    size_t len = payload_encode(topic_id, timestamp, data, data_len, payload);
+    msg_id = mqtt_publish(topic, payload, len, 1, 0);
   }
-  char buffer[SD_MAX_LINE_LENGTH];
-  snprintf(buffer, SD_MAX_LINE_LENGTH, "%s|%s", topic, data);
-  sd_append_to_file(mqtt_file, buffer);
+  if (msg_id >= 0) {
+    metrics_record_since(METRICS_STAGE_PUBLISH, start);
+    metrics_count(METRICS_COUNTER_PUBLISHED);
+    return msg_id;
+  }
+#if CONFIG_GATEWAY_UPLINK_TIMESTAMP
+  // Consumers order by the timestamp in the payload, so the RAM tier takes messages whenever it has room, even with
+  // older ones still on the card.
+  bool spilling = false;
+#else
+  // Once anything went to the SD tier everything follows it until the backlog is replayed, otherwise newer
+  // messages could sit in RAM while older ones wait on the card and the drain order would break.
+  bool spilling = journal_size() > 0 || journal_writer_pending() > 0;
+#endif
+  if (!spilling && offline_buffer_push(topic_id, timestamp, data, data_len) == ESP_OK) {
+    metrics_count(METRICS_COUNTER_OFFLINE_RAM);
+    return -1;
+  }
+  if (journal_writer_submit(topic_id, timestamp, data, data_len) == ESP_OK) {
+    metrics_count(METRICS_COUNTER_OFFLINE_SD);
+  }
+  return -1;
+}
+
+esp_err_t mqtt_offline_store_init(void) {
+  // the uplink batches as well, with or without an SD card
+  esp_err_t err = batch_init();
+  if (err != ESP_OK) {
+    return err;
+  }
+  err = journal_open();
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to open journal");
+    return err;
+  }
+  mqtt_import_legacy_file();
+  if (CONFIG_GATEWAY_OFFLINE_RAM_BUDGET > 0) {
+    offline_buffer_init(CONFIG_GATEWAY_OFFLINE_RAM_BUDGET);
+  }
+  err = journal_writer_start();
+  if (err != ESP_OK) {
+    return err;
+  }
+  err = replay_init();
+  if (err != ESP_OK) {
+    return err;
+  }
+  return compactor_start();
+}
+
+esp_err_t mqtt_app_subscribe(const char *filter, mqtt_data_cb_t callback) {
+  if (s_subscription_count == MQTT_APP_MAX_SUBSCRIPTIONS) {
+    ESP_LOGE(TAG, "No room for subscription %s", filter);
+    return ESP_ERR_NO_MEM;
+  }
+  s_subscriptions[s_subscription_count] = (mqtt_subscription_t){.filter = filter, .callback = callback};
+  s_subscription_count++;
+  if (mqtt_is_connected()) {
+    esp_mqtt_client_subscribe(client, filter, 1);
+  }
+  return ESP_OK;
 }
 
 void mqtt_app_start(const char *broker_uri, size_t broker_uri_len, const char *username, size_t username_len,
@@ -155,7 +329,24 @@ void mqtt_app_start(const char *broker_uri, size_t broker_uri_len, const char *u
   snprintf(mqtt_username, username_len, "%s", username);
   snprintf(mqtt_password, password_len, "%s", password);
 
-  s_mqtt_event_group = xEventGroupCreate();
+  if (!s_mqtt_event_group) {
+    s_mqtt_event_group = xEventGroupCreate();
+  }
+  if (client) {
+    // New broker settings go to the same client: the uplink, replay and downlink tasks keep using the handle, and
+    // the messages in its outbox are sent to the new broker once it connects.
+    esp_mqtt_client_stop(client);
+    xEventGroupClearBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
+    replay_on_disconnected();
+    esp_mqtt_client_config_t mqtt_cfg = mqtt_config();
+    if (esp_mqtt_set_config(client, &mqtt_cfg) != ESP_OK) {
+      ESP_LOGE(TAG, "Failed to apply the new broker settings");
+    }
+    if (wifi_is_connected()) {
+      esp_mqtt_client_start(client);
+    }
+    return;
+  }
   mqtt_init();
   wifi_register_on_status_change_callback(on_wifi_status_change);
 }
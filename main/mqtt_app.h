@@ -1,14 +1,39 @@
 #ifndef _MQTT_APP_H_
 #define _MQTT_APP_H_
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
 
 #define MQTT_URI_MAX_LEN 32
 #define MQTT_USERNAME_MAX_LEN 32
 #define MQTT_PASSWORD_MAX_LEN 32
 
+/* Called from the MQTT task for every message received on a subscribed topic filter. */
+typedef void (*mqtt_data_cb_t)(const char *topic, int topic_len, const char *data, int data_len);
+
 void mqtt_app_start(const char *broker_uri, size_t broker_uri_len, const char *username, size_t username_len,
                     const char *password, size_t password_len);
-void mqtt_send_message(const char *topic, const char *data);
+/* Publishes the message, or keeps it in the offline store if the broker is not reachable. timestamp is the source
+ * timestamp of timestamp.h, added to the payload when it is published. Returns the message id if it was published,
+ * -1 otherwise. */
+int mqtt_send_message(uint16_t topic_id, uint64_t timestamp, const char *data, size_t data_len);
+bool mqtt_is_connected(void);
+/* Publishes right away if the broker is connected. Returns the message id, or -1 if not connected. */
+int mqtt_publish(const char *topic, const char *data, int len, int qos, int retain);
+/* Like mqtt_publish() but only stores the message in the client outbox, the MQTT task sends it. Never blocks on
+ * the network. */
+int mqtt_enqueue(const char *topic, const char *data, int len, int qos, int retain);
+/* Bytes currently held in the client outbox, live and replayed messages alike. */
+int mqtt_outbox_size(void);
+esp_err_t mqtt_offline_store_init(void);
+/* Subscribes to filter (QoS 1) on every connection and hands the messages matching it to callback. Up to four
+ * subscriptions, made at startup; filter must stay valid. */
+esp_err_t mqtt_app_subscribe(const char *filter, mqtt_data_cb_t callback);
+/* Whether topic, topic_len bytes without terminator, matches the subscription filter with the '+' and '#'
+ * wildcards. A trailing "/#" matches the parent level as well. */
+bool mqtt_topic_matches(const char *filter, const char *topic, int topic_len);
 
 #endif // _MQTT_APP_H_
\ No newline at end of file
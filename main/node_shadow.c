@@ -0,0 +1,98 @@
+#include "node_shadow.h"
+
+#include "esp_log.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "sdkconfig.h"
+
+static const char *TAG = "NODE_SHADOW";
+
+#define NODE_SHADOW_SIZE CONFIG_GATEWAY_NODE_SHADOW_SIZE
+#define NODE_SHADOW_MASK (NODE_SHADOW_SIZE - 1)
+
+_Static_assert((NODE_SHADOW_SIZE & NODE_SHADOW_MASK) == 0, "CONFIG_GATEWAY_NODE_SHADOW_SIZE must be a power of two");
+
+static SemaphoreHandle_t s_lock;
+static node_shadow_entry_t s_table[NODE_SHADOW_SIZE];
+static size_t s_count;
+
+static inline unsigned node_shadow_hash(uint16_t addr) { return (addr * 40503u >> 4) & NODE_SHADOW_MASK; }
+
+/* Returns the slot holding addr, or the free slot where it would be inserted, or NULL if the table is full. */
+static node_shadow_entry_t *node_shadow_find(uint16_t addr) {
+  unsigned slot = node_shadow_hash(addr);
+  for (unsigned probe = 0; probe < NODE_SHADOW_SIZE; probe++) {
+    node_shadow_entry_t *entry = &s_table[(slot + probe) & NODE_SHADOW_MASK];
+    if (entry->addr == addr || entry->addr == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+esp_err_t node_shadow_init(void) {
+  if (s_lock) {
+    return ESP_OK;
+  }
+  s_lock = xSemaphoreCreateMutex();
+  return s_lock ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+esp_err_t node_shadow_update(uint16_t addr, uint8_t onoff, bool *changed) {
+  esp_err_t err = ESP_OK;
+  *changed = true;
+  if (addr == 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  node_shadow_entry_t *entry = node_shadow_find(addr);
+  if (!entry) {
+    err = ESP_ERR_NO_MEM;
+  } else {
+    if (entry->addr == 0) {
+      entry->addr = addr;
+      s_count++;
+    } else {
+      *changed = entry->onoff != onoff;
+    }
+    entry->onoff = onoff;
+    entry->seq++;
+    entry->last_seen = xTaskGetTickCount();
+  }
+  xSemaphoreGive(s_lock);
+  if (err == ESP_ERR_NO_MEM) {
+    ESP_LOGW(TAG, "Table full, 0x%04x not tracked", addr);
+  }
+  return err;
+}
+
+bool node_shadow_get(uint16_t addr, node_shadow_entry_t *entry) {
+  if (addr == 0) {
+    return false;
+  }
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  node_shadow_entry_t *found = node_shadow_find(addr);
+  bool exists = found && found->addr == addr;
+  if (exists) {
+    *entry = *found;
+  }
+  xSemaphoreGive(s_lock);
+  return exists;
+}
+
+size_t node_shadow_count(void) { return s_count; }
+
+size_t node_shadow_copy(node_shadow_entry_t *entries, size_t max) {
+  size_t copied = 0;
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  for (unsigned i = 0; i < NODE_SHADOW_SIZE && copied < max; i++) {
+    if (s_table[i].addr != 0) {
+      entries[copied++] = s_table[i];
+    }
+  }
+  xSemaphoreGive(s_lock);
+  return copied;
+}
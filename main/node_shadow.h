@@ -0,0 +1,31 @@
+#ifndef _NODE_SHADOW_H_
+#define _NODE_SHADOW_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/*
+ * Last known state of every mesh node that reported to the gateway, keyed by unicast address. Entries live in a
+ * flat open-addressing table so a lookup touches one or two adjacent 12 byte slots.
+ */
+
+typedef struct {
+  uint16_t addr;      // unicast address, 0 marks a free slot
+  uint16_t seq;       // number of reports received from the node, wraps around
+  uint32_t last_seen; // tick count of the latest report
+  uint8_t onoff;      // latest Generic OnOff present state
+} node_shadow_entry_t;
+
+esp_err_t node_shadow_init(void);
+/* Records a report from addr. changed is set when the state differs from the last report or the node is new.
+ * Returns ESP_ERR_NO_MEM if the node is new and the table is full; changed is set in that case too. */
+esp_err_t node_shadow_update(uint16_t addr, uint8_t onoff, bool *changed);
+bool node_shadow_get(uint16_t addr, node_shadow_entry_t *entry);
+size_t node_shadow_count(void);
+/* Copies up to max entries into entries and returns how many were copied. */
+size_t node_shadow_copy(node_shadow_entry_t *entries, size_t max);
+
+#endif // _NODE_SHADOW_H_
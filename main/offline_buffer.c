@@ -0,0 +1,136 @@
+#include "offline_buffer.h"
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "sdkconfig.h"
+
+static const char *TAG = "OFFLINE_BUF";
+
+#define OFFLINE_BUFFER_HEADER_LEN 11
+
+static SemaphoreHandle_t s_lock;
+static uint8_t *s_ring;
+static size_t s_capacity;
+static size_t s_head; // next byte to write
+static size_t s_tail; // first byte of the oldest message
+static size_t s_used;
+static size_t s_count;
+
+static void ring_write(size_t pos, const void *src, size_t len) {
+  size_t first = s_capacity - pos < len ? s_capacity - pos : len;
+  memcpy(s_ring + pos, src, first);
+  memcpy(s_ring, (const uint8_t *)src + first, len - first);
+}
+
+static void ring_read(size_t pos, void *dst, size_t len) {
+  size_t first = s_capacity - pos < len ? s_capacity - pos : len;
+  memcpy(dst, s_ring + pos, first);
+  memcpy((uint8_t *)dst + first, s_ring, len - first);
+}
+
+esp_err_t offline_buffer_init(size_t budget) {
+  if (s_ring) {
+    return ESP_OK;
+  }
+  s_lock = xSemaphoreCreateMutex();
+  if (!s_lock) {
+    return ESP_ERR_NO_MEM;
+  }
+  const char *region = "PSRAM";
+#if CONFIG_SPIRAM
+  s_ring = heap_caps_malloc(budget, MALLOC_CAP_SPIRAM);
+#endif
+  if (!s_ring) {
+    region = "DRAM";
+    s_ring = heap_caps_malloc(budget, MALLOC_CAP_8BIT);
+  }
+  if (!s_ring) {
+    ESP_LOGE(TAG, "Could not allocate %u bytes for the offline buffer", budget);
+    return ESP_ERR_NO_MEM;
+  }
+  s_capacity = budget;
+  ESP_LOGI(TAG, "Offline buffer of %u bytes in %s", budget, region);
+  return ESP_OK;
+}
+
+esp_err_t offline_buffer_push(uint16_t topic_id, uint64_t timestamp, const char *data, size_t data_len) {
+  if (data_len > OFFLINE_BUFFER_MAX_DATA_LEN) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  if (!s_ring) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  size_t len = OFFLINE_BUFFER_HEADER_LEN + data_len;
+  uint8_t header[OFFLINE_BUFFER_HEADER_LEN] = {topic_id & 0xff, topic_id >> 8, data_len};
+  memcpy(header + 3, &timestamp, sizeof(timestamp));
+
+  esp_err_t err = ESP_OK;
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  if (s_capacity - s_used < len) {
+    err = ESP_ERR_NO_MEM;
+  } else {
+    ring_write(s_head, header, OFFLINE_BUFFER_HEADER_LEN);
+    ring_write((s_head + OFFLINE_BUFFER_HEADER_LEN) % s_capacity, data, data_len);
+    s_head = (s_head + len) % s_capacity;
+    s_used += len;
+    s_count++;
+  }
+  xSemaphoreGive(s_lock);
+  return err;
+}
+
+esp_err_t offline_buffer_peek(uint16_t *topic_id, uint64_t *timestamp, char *data, size_t *data_len) {
+  return offline_buffer_peek_at(0, topic_id, timestamp, data, data_len);
+}
+
+esp_err_t offline_buffer_peek_at(size_t index, uint16_t *topic_id, uint64_t *timestamp, char *data,
+                                 size_t *data_len) {
+  if (!s_ring) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  esp_err_t err = ESP_OK;
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  if (index >= s_count) {
+    err = ESP_ERR_NOT_FOUND;
+  } else {
+    uint8_t header[OFFLINE_BUFFER_HEADER_LEN];
+    size_t pos = s_tail;
+    ring_read(pos, header, OFFLINE_BUFFER_HEADER_LEN);
+    for (size_t i = 0; i < index; i++) {
+      pos = (pos + OFFLINE_BUFFER_HEADER_LEN + header[2]) % s_capacity;
+      ring_read(pos, header, OFFLINE_BUFFER_HEADER_LEN);
+    }
+    ring_read((pos + OFFLINE_BUFFER_HEADER_LEN) % s_capacity, data, header[2]);
+    data[header[2]] = '\0';
+    *topic_id = header[0] | (header[1] << 8);
+    memcpy(timestamp, header + 3, sizeof(*timestamp));
+    *data_len = header[2];
+  }
+  xSemaphoreGive(s_lock);
+  return err;
+}
+
+void offline_buffer_pop(void) {
+  if (!s_ring) {
+    return;
+  }
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  if (s_count > 0) {
+    uint8_t header[OFFLINE_BUFFER_HEADER_LEN];
+    ring_read(s_tail, header, OFFLINE_BUFFER_HEADER_LEN);
+    size_t len = OFFLINE_BUFFER_HEADER_LEN + header[2];
+    s_tail = (s_tail + len) % s_capacity;
+    s_used -= len;
+    s_count--;
+  }
+  xSemaphoreGive(s_lock);
+}
+
+size_t offline_buffer_count(void) { return s_count; }
+
+size_t offline_buffer_used(void) { return s_used; }
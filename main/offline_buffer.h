@@ -0,0 +1,28 @@
+#ifndef _OFFLINE_BUFFER_H_
+#define _OFFLINE_BUFFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#define OFFLINE_BUFFER_MAX_DATA_LEN 190
+
+/*
+ * RAM tier of the offline store. Messages are kept in a byte ring of the configured budget as
+ * | topic_id (2) | data_len (1) | timestamp (8) | data | and handed out again in FIFO order.
+ */
+
+esp_err_t offline_buffer_init(size_t budget);
+esp_err_t offline_buffer_push(uint16_t topic_id, uint64_t timestamp, const char *data, size_t data_len);
+/* Copies the oldest message without removing it. data must hold OFFLINE_BUFFER_MAX_DATA_LEN + 1 bytes and is NUL
+ * terminated. */
+esp_err_t offline_buffer_peek(uint16_t *topic_id, uint64_t *timestamp, char *data, size_t *data_len);
+/* Like offline_buffer_peek() for the index-th oldest message, 0 being the oldest. Walks the messages before it. */
+esp_err_t offline_buffer_peek_at(size_t index, uint16_t *topic_id, uint64_t *timestamp, char *data,
+                                 size_t *data_len);
+void offline_buffer_pop(void);
+size_t offline_buffer_count(void);
+size_t offline_buffer_used(void);
+
+#endif // _OFFLINE_BUFFER_H_
@@ -0,0 +1,230 @@
+#include "payload.h"
+
+#include <string.h>
+
+#include "topic_table.h"
+
+#define PAYLOAD_REPORT_MARKER 0x01
+// model and value, see payload_state()
+#define PAYLOAD_STATE_OFFSET 1
+#define PAYLOAD_STATE_LEN 3
+
+// map keys of the CBOR encoding
+enum {
+  PAYLOAD_KEY_ADDR,
+  PAYLOAD_KEY_MODEL,
+  PAYLOAD_KEY_OP,
+  PAYLOAD_KEY_VALUE,
+  PAYLOAD_KEY_RSSI,
+  PAYLOAD_KEY_TTL,
+  PAYLOAD_KEY_TS,
+};
+
+size_t payload_pack(const payload_report_t *report, char *data) {
+  uint8_t *out = (uint8_t *)data;
+  out[0] = PAYLOAD_REPORT_MARKER;
+  out[1] = report->model_id;
+  out[2] = report->model_id >> 8;
+  out[3] = report->value;
+  out[4] = report->opcode;
+  out[5] = report->opcode >> 8;
+  out[6] = report->opcode >> 16;
+  out[7] = (uint8_t)report->rssi;
+  out[8] = report->ttl;
+  return PAYLOAD_REPORT_LEN;
+}
+
+bool payload_unpack(uint16_t topic_id, const char *data, size_t data_len, payload_report_t *report) {
+  const uint8_t *in = (const uint8_t *)data;
+  if (!topic_id_is_node(topic_id) || data_len != PAYLOAD_REPORT_LEN || in[0] != PAYLOAD_REPORT_MARKER) {
+    return false;
+  }
+  *report = (payload_report_t){
+      .addr = topic_id,
+      .model_id = in[1] | in[2] << 8,
+      .value = in[3],
+      .opcode = in[4] | in[5] << 8 | (uint32_t)in[6] << 16,
+      .rssi = (int8_t)in[7],
+      .ttl = in[8],
+  };
+  return true;
+}
+
+static inline bool payload_has_link(const payload_report_t *report) { return report->ttl != PAYLOAD_TTL_UNKNOWN; }
+
+static inline bool payload_has_timestamp(uint64_t timestamp) {
+#if CONFIG_GATEWAY_UPLINK_TIMESTAMP
+  return timestamp != TIMESTAMP_NONE;
+#else
+  return false;
+#endif
+}
+
+#if !CONFIG_GATEWAY_PAYLOAD_CBOR
+
+/* Writes value in decimal. Returns the end of it. */
+static char *payload_put_uint(char *out, uint64_t value) {
+  char digits[20];
+  size_t len = 0;
+  do {
+    digits[len++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  while (len) {
+    *out++ = digits[--len];
+  }
+  return out;
+}
+
+#endif
+
+#if CONFIG_GATEWAY_PAYLOAD_JSON
+
+static char *payload_put_str(char *out, const char *str) {
+  size_t len = strlen(str);
+  memcpy(out, str, len);
+  return out + len;
+}
+
+static char *payload_put_int(char *out, int32_t value) {
+  if (value < 0) {
+    *out++ = '-';
+    return payload_put_uint(out, -(int64_t)value);
+  }
+  return payload_put_uint(out, value);
+}
+
+static size_t payload_encode_json(const payload_report_t *report, uint64_t timestamp, char *payload) {
+  char *out = payload_put_str(payload, "{\"addr\":");
+  out = payload_put_uint(out, report->addr);
+  out = payload_put_uint(payload_put_str(out, ",\"model\":"), report->model_id);
+  out = payload_put_uint(payload_put_str(out, ",\"op\":"), report->opcode);
+  out = payload_put_uint(payload_put_str(out, ",\"value\":"), report->value);
+  if (payload_has_link(report)) {
+    out = payload_put_int(payload_put_str(out, ",\"rssi\":"), report->rssi);
+    out = payload_put_uint(payload_put_str(out, ",\"ttl\":"), report->ttl);
+  }
+  if (payload_has_timestamp(timestamp)) {
+    out = payload_put_str(out, ",\"ts\":");
+    if (timestamp & TIMESTAMP_BOOT_RELATIVE) {
+      *out++ = '"';
+      out += timestamp_format(timestamp, out);
+      *out++ = '"';
+    } else {
+      out = payload_put_uint(out, timestamp);
+    }
+  }
+  *out++ = '}';
+  return out - payload;
+}
+
+#elif CONFIG_GATEWAY_PAYLOAD_CBOR
+
+#define PAYLOAD_CBOR_UINT 0
+#define PAYLOAD_CBOR_NINT 1
+#define PAYLOAD_CBOR_ARRAY 4
+#define PAYLOAD_CBOR_MAP 5
+
+/* Writes a CBOR head, in the shortest form. Returns the end of it. */
+static uint8_t *payload_cbor_head(uint8_t *out, uint8_t major, uint64_t value) {
+  int bytes;
+  if (value < 24) {
+    *out++ = major << 5 | value;
+    return out;
+  } else if (value <= UINT8_MAX) {
+    *out++ = major << 5 | 24;
+    bytes = 1;
+  } else if (value <= UINT16_MAX) {
+    *out++ = major << 5 | 25;
+    bytes = 2;
+  } else if (value <= UINT32_MAX) {
+    *out++ = major << 5 | 26;
+    bytes = 4;
+  } else {
+    *out++ = major << 5 | 27;
+    bytes = 8;
+  }
+  while (bytes--) {
+    *out++ = value >> (8 * bytes);
+  }
+  return out;
+}
+
+static uint8_t *payload_cbor_int(uint8_t *out, int32_t value) {
+  if (value < 0) {
+    return payload_cbor_head(out, PAYLOAD_CBOR_NINT, -1 - (int64_t)value);
+  }
+  return payload_cbor_head(out, PAYLOAD_CBOR_UINT, value);
+}
+
+/* A map entry with an unsigned value. */
+static inline uint8_t *payload_cbor_entry(uint8_t *out, uint8_t key, uint64_t value) {
+  return payload_cbor_head(payload_cbor_head(out, PAYLOAD_CBOR_UINT, key), PAYLOAD_CBOR_UINT, value);
+}
+
+static size_t payload_encode_cbor(const payload_report_t *report, uint64_t timestamp, char *payload) {
+  bool link = payload_has_link(report);
+  bool stamped = payload_has_timestamp(timestamp);
+  uint8_t *out = payload_cbor_head((uint8_t *)payload, PAYLOAD_CBOR_MAP, 4 + (link ? 2 : 0) + (stamped ? 1 : 0));
+  out = payload_cbor_entry(out, PAYLOAD_KEY_ADDR, report->addr);
+  out = payload_cbor_entry(out, PAYLOAD_KEY_MODEL, report->model_id);
+  out = payload_cbor_entry(out, PAYLOAD_KEY_OP, report->opcode);
+  out = payload_cbor_entry(out, PAYLOAD_KEY_VALUE, report->value);
+  if (link) {
+    out = payload_cbor_int(payload_cbor_head(out, PAYLOAD_CBOR_UINT, PAYLOAD_KEY_RSSI), report->rssi);
+    out = payload_cbor_entry(out, PAYLOAD_KEY_TTL, report->ttl);
+  }
+  if (stamped) {
+    out = payload_cbor_head(out, PAYLOAD_CBOR_UINT, PAYLOAD_KEY_TS);
+    if (timestamp & TIMESTAMP_BOOT_RELATIVE) {
+      out = payload_cbor_head(out, PAYLOAD_CBOR_ARRAY, 2);
+      out = payload_cbor_head(out, PAYLOAD_CBOR_UINT, timestamp_boot(timestamp));
+      out = payload_cbor_head(out, PAYLOAD_CBOR_UINT, timestamp_uptime(timestamp));
+    } else {
+      out = payload_cbor_head(out, PAYLOAD_CBOR_UINT, timestamp);
+    }
+  }
+  return out - (uint8_t *)payload;
+}
+
+#endif
+
+/* The data followed by the timestamp, the text format. */
+static size_t payload_encode_text(const char *data, size_t data_len, uint64_t timestamp, char *payload) {
+  memmove(payload, data, data_len);
+  if (payload_has_timestamp(timestamp)) {
+    payload[data_len++] = ' ';
+    data_len += timestamp_format(timestamp, payload + data_len);
+  }
+  return data_len;
+}
+
+size_t payload_encode_report(const payload_report_t *report, uint64_t timestamp, char *payload) {
+  timestamp = timestamp_resolve(timestamp);
+#if CONFIG_GATEWAY_PAYLOAD_JSON
+  return payload_encode_json(report, timestamp, payload);
+#elif CONFIG_GATEWAY_PAYLOAD_CBOR
+  return payload_encode_cbor(report, timestamp, payload);
+#else
+  char value[3];
+  size_t len = payload_put_uint(value, report->value) - value;
+  return payload_encode_text(value, len, timestamp, payload);
+#endif
+}
+
+size_t payload_encode(uint16_t topic_id, uint64_t timestamp, const char *data, size_t data_len, char *payload) {
+  payload_report_t report;
+  if (payload_unpack(topic_id, data, data_len, &report)) {
+    return payload_encode_report(&report, timestamp, payload);
+  }
+  return payload_encode_text(data, data_len, timestamp_resolve(timestamp), payload);
+}
+
+size_t payload_state(const char *data, size_t data_len, const char **state) {
+  if (data_len == PAYLOAD_REPORT_LEN && (uint8_t)data[0] == PAYLOAD_REPORT_MARKER) {
+    *state = data + PAYLOAD_STATE_OFFSET;
+    return PAYLOAD_STATE_LEN;
+  }
+  *state = data;
+  return data_len;
+}
@@ -0,0 +1,65 @@
+#ifndef _PAYLOAD_H_
+#define _PAYLOAD_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdkconfig.h"
+#include "timestamp.h"
+
+/*
+ * Uplink payloads. A status report from a node waits in the ingest ring, the RAM tier or the journal as a packed
+ * report and is only encoded when it is published, in the format chosen with CONFIG_GATEWAY_PAYLOAD_FORMAT:
+ *
+ *   text  the value and the timestamp: "1 1760000000123"
+ *   JSON  {"addr":5,"model":4096,"op":33284,"value":1,"rssi":-61,"ttl":4,"ts":1760000000123}
+ *   CBOR  a map of the same fields under integer keys: 0 addr, 1 model, 2 op, 3 value, 4 rssi, 5 ttl, 6 ts
+ *
+ * addr is the unicast address of the node, model the SIG model the report is about and op the opcode it came
+ * with. rssi and ttl describe the reception of the message and are left out for reports that did not arrive as
+ * one, such as snapshots and the answers to polls. ts is the timestamp of timestamp.h: wall time as a number, boot
+ * relative time as the string "b12+4711" in JSON and as the array [12, 4711] in CBOR. It is left out without
+ * CONFIG_GATEWAY_UPLINK_TIMESTAMP, and so is the space before it in text.
+ *
+ * The packed report, little endian:
+ *
+ *   | 0x01 | model (2) | value (1) | opcode (3) | rssi (1) | ttl (1) |
+ *
+ * Record data that does not start with the 0x01 marker, written by older firmware, is published as it is, followed
+ * by the timestamp as in text.
+ */
+
+#define PAYLOAD_REPORT_LEN 9
+#define PAYLOAD_RSSI_UNKNOWN 0
+#define PAYLOAD_TTL_UNKNOWN 0xff
+// JSON with every field at its longest
+#define PAYLOAD_REPORT_MAX_LEN 112
+/* Size of a buffer for the payload of record data of up to data_len bytes. */
+#define PAYLOAD_MAX_LEN(data_len)                                                                                    \
+  ((data_len) + 1 + TIMESTAMP_MAX_LEN + 1 > PAYLOAD_REPORT_MAX_LEN ? (data_len) + 1 + TIMESTAMP_MAX_LEN + 1         \
+                                                                    : PAYLOAD_REPORT_MAX_LEN)
+
+typedef struct {
+  uint16_t addr;
+  uint16_t model_id;
+  uint32_t opcode;
+  uint8_t value;
+  int8_t rssi; // PAYLOAD_RSSI_UNKNOWN and
+  uint8_t ttl; // PAYLOAD_TTL_UNKNOWN if the report did not arrive as a message
+} payload_report_t;
+
+/* Packs report, all but the address, into data, which must hold PAYLOAD_REPORT_LEN bytes. Returns the length. */
+size_t payload_pack(const payload_report_t *report, char *data);
+/* Unpacks the record data of topic_id. Returns false if it is not a packed report. */
+bool payload_unpack(uint16_t topic_id, const char *data, size_t data_len, payload_report_t *report);
+/* Encodes report into payload, which must hold PAYLOAD_REPORT_MAX_LEN bytes. Returns the length. */
+size_t payload_encode_report(const payload_report_t *report, uint64_t timestamp, char *payload);
+/* Builds the payload of a record into payload, which must hold PAYLOAD_MAX_LEN(data_len) bytes. Returns the
+ * length. */
+size_t payload_encode(uint16_t topic_id, uint64_t timestamp, const char *data, size_t data_len, char *payload);
+/* The part of record data that is the state of the node, what compaction compares: the model and the value of a
+ * packed report, all of anything else. */
+size_t payload_state(const char *data, size_t data_len, const char **state);
+
+#endif // _PAYLOAD_H_
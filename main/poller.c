@@ -0,0 +1,207 @@
+#include "poller.h"
+
+#if CONFIG_GATEWAY_POLL
+
+#include <stdbool.h>
+
+#include "esp_log.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "mesh_tx.h"
+#include "metrics.h"
+#include "sdkconfig.h"
+#include "uplink.h"
+
+static const char *TAG = "POLLER";
+
+#define POLLER_SIZE CONFIG_GATEWAY_NODE_SHADOW_SIZE
+#define POLLER_MASK (POLLER_SIZE - 1)
+#define POLLER_MIN_INTERVAL pdMS_TO_TICKS(CONFIG_GATEWAY_POLL_MIN_INTERVAL_S * 1000)
+#define POLLER_MAX_INTERVAL pdMS_TO_TICKS(CONFIG_GATEWAY_POLL_MAX_INTERVAL_S * 1000)
+
+_Static_assert(CONFIG_GATEWAY_POLL_MIN_INTERVAL_S <= CONFIG_GATEWAY_POLL_MAX_INTERVAL_S,
+               "CONFIG_GATEWAY_POLL_MIN_INTERVAL_S must not exceed CONFIG_GATEWAY_POLL_MAX_INTERVAL_S");
+
+/* Same layout as the node shadow, a free slot has addr 0 and slots are never freed. */
+typedef struct {
+  uint16_t addr;
+  uint8_t onoff;  // last known state
+  bool polling;   // a Get is in flight, due is set once it completes
+  TickType_t interval;
+  TickType_t due;
+} poller_node_t;
+
+static SemaphoreHandle_t s_lock;
+static TaskHandle_t s_task;
+static poller_node_t s_nodes[POLLER_SIZE];
+static uint32_t s_inflight;
+static poller_stats_t s_stats;
+
+static inline unsigned poller_hash(uint16_t addr) { return (addr * 40503u >> 4) & POLLER_MASK; }
+
+/* Returns the slot holding addr, or the free slot where it would be inserted, or NULL if the table is full. Called
+ * with s_lock held. */
+static poller_node_t *poller_find(uint16_t addr) {
+  unsigned slot = poller_hash(addr);
+  for (unsigned probe = 0; probe < POLLER_SIZE; probe++) {
+    poller_node_t *node = &s_nodes[(slot + probe) & POLLER_MASK];
+    if (node->addr == addr || node->addr == 0) {
+      return node;
+    }
+  }
+  return NULL;
+}
+
+static void poller_back_off(poller_node_t *node) {
+  node->interval = node->interval > POLLER_MAX_INTERVAL / 2 ? POLLER_MAX_INTERVAL : node->interval * 2;
+}
+
+/* Outcome of a Get, from the mesh TX scheduler. */
+static void poller_on_done(uint16_t addr, mesh_tx_op_t op, mesh_tx_result_t result, uint8_t onoff,
+                           uint32_t submitted) {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  poller_node_t *node = poller_find(addr);
+  if (node && node->addr == addr && node->polling) {
+    node->polling = false;
+    s_inflight--;
+    switch (result) {
+    case MESH_TX_OK:
+      s_stats.answered++;
+      if (onoff != node->onoff) {
+        s_stats.changed++;
+        metrics_count(METRICS_COUNTER_POLL_CHANGED);
+        node->onoff = onoff;
+        node->interval = POLLER_MIN_INTERVAL;
+      } else {
+        poller_back_off(node);
+      }
+      break;
+    case MESH_TX_SUPERSEDED:
+      break; // a Set took its place, and its answer refreshes the node
+    default:
+      s_stats.timeouts++;
+      poller_back_off(node);
+      break;
+    }
+    node->due = xTaskGetTickCount() + node->interval;
+  }
+  xSemaphoreGive(s_lock);
+  if (result == MESH_TX_OK) {
+    // Answers come from the Generic Client callback, the one producer of the uplink ring.
+    uplink_post_onoff(addr, onoff, NULL);
+  }
+  xTaskNotifyGive(s_task);
+}
+
+static void poller_task(void *pvParameters) {
+  uint16_t sends[CONFIG_GATEWAY_POLL_WINDOW];
+  for (;;) {
+    size_t count = 0;
+    TickType_t wait = portMAX_DELAY;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    TickType_t now = xTaskGetTickCount();
+    for (int i = 0; i < POLLER_SIZE; i++) {
+      poller_node_t *node = &s_nodes[i];
+      if (node->addr == 0 || node->polling) {
+        continue;
+      }
+      int32_t left = (int32_t)(node->due - now);
+      if (left > 0) {
+        if ((TickType_t)left < wait) {
+          wait = left;
+        }
+      } else if (s_inflight + count < CONFIG_GATEWAY_POLL_WINDOW) {
+        node->polling = true;
+        sends[count++] = node->addr;
+      }
+      // with the window full, a completing Get wakes the task up
+    }
+    s_inflight += count;
+    s_stats.polls += count;
+    xSemaphoreGive(s_lock);
+    for (size_t i = 0; i < count; i++) {
+      if (mesh_tx_submit(sends[i], MESH_TX_GET, 0, poller_on_done) != ESP_OK) {
+        ESP_LOGD(TAG, "Scheduler refused Get to 0x%04x", sends[i]);
+        poller_on_done(sends[i], MESH_TX_GET, MESH_TX_FAILED, 0, 0);
+      }
+    }
+    ulTaskNotifyTake(pdTRUE, wait);
+  }
+}
+
+void poller_on_status(uint16_t addr, uint8_t onoff) {
+  if (!s_task || !ESP_BLE_MESH_ADDR_IS_UNICAST(addr)) {
+    return;
+  }
+  bool added = false;
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  poller_node_t *node = poller_find(addr);
+  if (node && node->addr == 0) {
+    *node = (poller_node_t){.addr = addr, .onoff = onoff, .interval = POLLER_MIN_INTERVAL};
+    s_stats.nodes++;
+    added = true;
+  } else if (node && node->onoff != onoff) {
+    node->onoff = onoff;
+    node->interval = POLLER_MIN_INTERVAL;
+  }
+  if (node && !node->polling) {
+    node->due = xTaskGetTickCount() + node->interval;
+  }
+  xSemaphoreGive(s_lock);
+  if (added) {
+    xTaskNotifyGive(s_task); // the task may be waiting for a node that is due later
+  } else if (!node) {
+    ESP_LOGW(TAG, "No room to poll 0x%04x", addr);
+  }
+}
+
+void poller_sweep(void) {
+  if (!s_task) {
+    return;
+  }
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  TickType_t now = xTaskGetTickCount();
+  for (int i = 0; i < POLLER_SIZE; i++) {
+    if (s_nodes[i].addr != 0 && !s_nodes[i].polling) {
+      s_nodes[i].due = now;
+    }
+  }
+  xSemaphoreGive(s_lock);
+  xTaskNotifyGive(s_task);
+}
+
+void poller_get_stats(poller_stats_t *stats) {
+  if (!s_lock) {
+    *stats = (poller_stats_t){0};
+    return;
+  }
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  TickType_t now = xTaskGetTickCount();
+  *stats = s_stats;
+  stats->inflight = s_inflight;
+  for (int i = 0; i < POLLER_SIZE; i++) {
+    const poller_node_t *node = &s_nodes[i];
+    stats->due += node->addr != 0 && (node->polling || (int32_t)(node->due - now) <= 0);
+  }
+  xSemaphoreGive(s_lock);
+}
+
+esp_err_t poller_start(void) {
+  if (s_task) {
+    return ESP_OK;
+  }
+  s_lock = xSemaphoreCreateMutex();
+  if (!s_lock) {
+    return ESP_ERR_NO_MEM;
+  }
+  if (xTaskCreate(poller_task, "poller", 3072, NULL, 4, &s_task) != pdPASS) {
+    ESP_LOGE(TAG, "Could not start poller task");
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef _POLLER_H_
+#define _POLLER_H_
+
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+/*
+ * State polling. A node that missed a publication or rebooted stays stale until it next publishes on its own, so
+ * every node the gateway has heard from is sent a Generic OnOff Get now and then, through the mesh TX scheduler and
+ * with at most CONFIG_GATEWAY_POLL_WINDOW of them in flight. The answer goes to the uplink like a publication.
+ *
+ * Every node has its own interval, between CONFIG_GATEWAY_POLL_MIN_INTERVAL_S and CONFIG_GATEWAY_POLL_MAX_INTERVAL_S:
+ * it drops to the minimum when the node's state changes and doubles after each poll that finds nothing new or gets
+ * no answer. Any status from the node restarts its interval, so nodes that publish by themselves are hardly polled.
+ */
+
+typedef struct {
+  uint32_t nodes;    // nodes the poller knows
+  uint32_t polls;    // Gets submitted
+  uint32_t answered; // Gets answered
+  uint32_t changed;  // answers with a state that differed from the last known one
+  uint32_t timeouts; // Gets that went unanswered or could not be sent
+  uint32_t due;      // nodes whose poll is due or in flight
+  uint32_t inflight; // Gets in flight
+} poller_stats_t;
+
+#if CONFIG_GATEWAY_POLL
+
+/* Starts the poller task. The mesh TX scheduler and the uplink must be started. */
+esp_err_t poller_start(void);
+/* A Generic OnOff Status from addr, published or answering a Set, called from the Generic Client callback. */
+void poller_on_status(uint16_t addr, uint8_t onoff);
+/* Makes every known node due now, for a full refresh. */
+void poller_sweep(void);
+void poller_get_stats(poller_stats_t *stats);
+
+#else
+
+static inline esp_err_t poller_start(void) { return ESP_OK; }
+static inline void poller_on_status(uint16_t addr, uint8_t onoff) {}
+static inline void poller_sweep(void) {}
+static inline void poller_get_stats(poller_stats_t *stats) { *stats = (poller_stats_t){0}; }
+
+#endif
+
+#endif // _POLLER_H_
@@ -0,0 +1,502 @@
+#include "replay.h"
+
+#include "esp_log.h"
+#include "nvs_flash.h"
+#include <stdbool.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "batch.h"
+#include "journal.h"
+#include "metrics.h"
+#include "mqtt_app.h"
+#include "offline_buffer.h"
+#include "payload.h"
+#include "sdkconfig.h"
+#include "topic_table.h"
+
+static const char *TAG = "REPLAY";
+
+#define REPLAY_WINDOW CONFIG_GATEWAY_REPLAY_WINDOW
+#define REPLAY_WAIT_TICKS pdMS_TO_TICKS(100)
+#define REPLAY_SEGMENT_RAM UINT32_MAX
+
+typedef struct {
+  uint32_t segment;
+  uint32_t offset;
+} replay_checkpoint_t;
+
+typedef struct {
+  int msg_id;
+  uint32_t segment; // REPLAY_SEGMENT_RAM for messages from the RAM tier, they do not move the checkpoint
+  uint32_t end;     // offset just past the record
+  uint16_t bytes;
+  uint16_t records; // messages from the RAM tier it carries, they are removed from there once it is acknowledged
+  bool acked;
+} replay_inflight_t;
+
+static SemaphoreHandle_t s_lock;
+static TaskHandle_t s_task;
+
+/* Published but not yet acknowledged records, oldest first. Guarded by s_lock together with s_checkpoint, which
+ * only ever moves over the acknowledged prefix of this window. */
+static replay_inflight_t s_inflight[REPLAY_WINDOW];
+static unsigned s_inflight_first;
+static unsigned s_inflight_count;
+static size_t s_inflight_bytes;
+// messages at the front of the RAM tier that are in the window, the RAM tier still holds them until they are acked
+static size_t s_inflight_ram;
+static replay_checkpoint_t s_checkpoint;
+static replay_checkpoint_t s_persisted;
+static unsigned s_acks_since_persist;
+// the connection went down since the window was last reset
+static bool s_disconnected = true;
+
+#if CONFIG_GATEWAY_BATCH
+/* Records published but not enqueued yet, only touched by the replay task. They all come from the RAM tier or
+ * from s_batch_segment, s_batch_end is the offset just past the newest of them. */
+static batch_t s_batch;
+static uint32_t s_batch_segment;
+static uint32_t s_batch_end;
+#endif
+
+static void replay_load_checkpoint(void) {
+  nvs_handle_t handle;
+  if (nvs_open("replay", NVS_READONLY, &handle) != ESP_OK) {
+    return;
+  }
+  size_t size = sizeof(s_checkpoint);
+  if (nvs_get_blob(handle, "ckpt", &s_checkpoint, &size) != ESP_OK || size != sizeof(s_checkpoint)) {
+    memset(&s_checkpoint, 0, sizeof(s_checkpoint));
+  }
+  nvs_close(handle);
+}
+
+static void replay_persist_checkpoint(bool force) {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  replay_checkpoint_t checkpoint = s_checkpoint;
+  bool due = force || s_acks_since_persist >= CONFIG_GATEWAY_REPLAY_CHECKPOINT_EVERY;
+  if (due) {
+    s_acks_since_persist = 0;
+  }
+  xSemaphoreGive(s_lock);
+
+  if (!due || memcmp(&checkpoint, &s_persisted, sizeof(checkpoint)) == 0) {
+    return;
+  }
+  nvs_handle_t handle;
+  if (nvs_open("replay", NVS_READWRITE, &handle) != ESP_OK) {
+    ESP_LOGE(TAG, "could not open checkpoint storage");
+    return;
+  }
+  if (nvs_set_blob(handle, "ckpt", &checkpoint, sizeof(checkpoint)) == ESP_OK && nvs_commit(handle) == ESP_OK) {
+    s_persisted = checkpoint;
+  } else {
+    ESP_LOGE(TAG, "could not commit checkpoint");
+  }
+  nvs_close(handle);
+}
+
+/* Forgets what was in flight on an earlier connection. */
+static void replay_inflight_reset(void) {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  if (!s_disconnected) {
+    // the window is still good, acknowledgements woke the task
+    xSemaphoreGive(s_lock);
+    return;
+  }
+  s_disconnected = false;
+  s_inflight_first = 0;
+  s_inflight_count = 0;
+  s_inflight_bytes = 0;
+  s_inflight_ram = 0;
+  xSemaphoreGive(s_lock);
+}
+
+/* Retires the acknowledged prefix of the window, with s_lock held. The checkpoint only moves over it, a record
+ * acked out of order waits for its predecessors, and so do the RAM tier messages of a RAM entry. */
+static void replay_inflight_advance(void) {
+  while (s_inflight_count > 0 && s_inflight[s_inflight_first].acked) {
+    replay_inflight_t *entry = &s_inflight[s_inflight_first];
+    if (entry->segment != REPLAY_SEGMENT_RAM) {
+      s_checkpoint.segment = entry->segment;
+      s_checkpoint.offset = entry->end;
+      s_acks_since_persist++;
+    }
+    for (unsigned i = 0; i < entry->records; i++) {
+      offline_buffer_pop();
+    }
+    s_inflight_ram -= entry->records;
+    s_inflight_bytes -= entry->bytes;
+    s_inflight_first = (s_inflight_first + 1) % REPLAY_WINDOW;
+    s_inflight_count--;
+  }
+}
+
+/* Appends an entry to the window, with s_lock held. */
+static void replay_inflight_push(int msg_id, uint32_t segment, uint32_t end, size_t len, size_t records,
+                                 bool acked) {
+  replay_inflight_t *entry = &s_inflight[(s_inflight_first + s_inflight_count) % REPLAY_WINDOW];
+  entry->msg_id = msg_id;
+  entry->segment = segment;
+  entry->end = end;
+  entry->bytes = len;
+  entry->records = records;
+  entry->acked = acked;
+  s_inflight_count++;
+  s_inflight_bytes += len;
+  s_inflight_ram += records;
+}
+
+static unsigned replay_inflight_count(void) {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  unsigned count = s_inflight_count;
+  xSemaphoreGive(s_lock);
+  return count;
+}
+
+/* Deletes every sealed segment the checkpoint has moved past. */
+static void replay_collect(void) {
+  bool deleted = false;
+  for (;;) {
+    uint32_t oldest = journal_oldest_segment();
+    if (oldest >= journal_active_segment()) {
+      break;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    replay_checkpoint_t checkpoint = s_checkpoint;
+    xSemaphoreGive(s_lock);
+    bool done = checkpoint.segment > oldest ||
+                (checkpoint.segment == oldest && checkpoint.offset >= journal_segment_size(oldest));
+    if (!done) {
+      break;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_checkpoint.segment == oldest) {
+      s_checkpoint.segment = oldest + 1;
+      s_checkpoint.offset = 0;
+    }
+    xSemaphoreGive(s_lock);
+    if (journal_delete_oldest() != ESP_OK) {
+      break;
+    }
+    ESP_LOGI(TAG, "Segment %04x replayed", oldest);
+    deleted = true;
+  }
+  replay_persist_checkpoint(deleted);
+}
+
+/* Waits until a message of len bytes fits into the in-flight window and the client outbox has room for it, so that
+ * the replay neither grows the outbox without bound nor crowds out live traffic. A message larger than the byte
+ * budget is let through once the window is empty. Returns false if the connection went down. */
+static bool replay_wait_window(size_t len) {
+  for (;;) {
+    if (!mqtt_is_connected()) {
+      return false;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    bool fits = s_inflight_count == 0 ||
+                (s_inflight_count < REPLAY_WINDOW && s_inflight_bytes + len <= CONFIG_GATEWAY_REPLAY_MAX_BYTES_IN_FLIGHT);
+    xSemaphoreGive(s_lock);
+    if (fits && mqtt_outbox_size() + len <= CONFIG_GATEWAY_REPLAY_MAX_OUTBOX_SIZE) {
+      return true;
+    }
+    ulTaskNotifyTake(pdTRUE, REPLAY_WAIT_TICKS);
+    replay_collect();
+  }
+}
+
+/* Blocks until every replayed message has been acknowledged. Returns false if the connection went down. */
+static bool replay_wait_idle(void) {
+  while (replay_inflight_count() > 0) {
+    if (!mqtt_is_connected()) {
+      return false;
+    }
+    ulTaskNotifyTake(pdTRUE, REPLAY_WAIT_TICKS);
+    replay_collect();
+  }
+  return true;
+}
+
+/* Enqueues a message carrying records records, which are from the RAM tier for REPLAY_SEGMENT_RAM. */
+static bool replay_enqueue(const char *topic, const char *data, size_t len, uint32_t segment, uint32_t end,
+                           size_t records) {
+  if (!replay_wait_window(len)) {
+    return false;
+  }
+  int msg_id = mqtt_enqueue(topic, data, len, 1, 0);
+  if (msg_id < 0) {
+    return false;
+  }
+  metrics_track_puback(msg_id, METRICS_PENDING_REPLAY, 0);
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  replay_inflight_push(msg_id, segment, end, len, segment == REPLAY_SEGMENT_RAM ? records : 0, false);
+  xSemaphoreGive(s_lock);
+  return true;
+}
+
+/* Enqueues the batch, if there is one. Returns false if the connection went down. */
+static bool replay_flush(bool full) {
+#if CONFIG_GATEWAY_BATCH
+  if (s_batch.count == 0) {
+    return true;
+  }
+  if (!replay_enqueue(CONFIG_GATEWAY_BATCH_TOPIC, s_batch.data, s_batch.len, s_batch_segment, s_batch_end,
+                      s_batch.count)) {
+    return false;
+  }
+  batch_published(&s_batch, full);
+  batch_reset(&s_batch);
+#endif
+  return true;
+}
+
+/* Publishes a record, on its own or as part of the batch. Returns false if the connection went down. */
+static bool replay_publish(const char *topic, const char *payload, size_t len, uint32_t segment, uint32_t end) {
+#if CONFIG_GATEWAY_BATCH
+  if (!batch_add(&s_batch, topic, payload, len)) {
+    if (!replay_flush(true)) {
+      return false;
+    }
+    batch_add(&s_batch, topic, payload, len);
+  }
+  s_batch_segment = segment;
+  s_batch_end = end;
+  return !batch_due(&s_batch) || replay_flush(false);
+#else
+  return replay_enqueue(topic, payload, len, segment, end, 1);
+#endif
+}
+
+/* Records passed to replay_publish() that are still waiting in the batch. */
+static inline size_t replay_batched(void) {
+#if CONFIG_GATEWAY_BATCH
+  return s_batch.count;
+#else
+  return 0;
+#endif
+}
+
+/* Passes over something that cannot be published as if the broker had acknowledged it: the RAM tier message next in
+ * line, which has no topic, for REPLAY_SEGMENT_RAM, otherwise the records of segment up to end. The checkpoint or
+ * the RAM tier moves past it once the messages ahead of it are acknowledged. Returns false if the connection went
+ * down. */
+static bool replay_skip(uint32_t segment, uint32_t end) {
+  if (!replay_flush(false) || !replay_wait_window(0)) {
+    return false;
+  }
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  replay_inflight_push(-1, segment, end, 0, segment == REPLAY_SEGMENT_RAM ? 1 : 0, true);
+  replay_inflight_advance();
+  xSemaphoreGive(s_lock);
+  return true;
+}
+
+static esp_err_t replay_segment(uint32_t segment, uint32_t offset) {
+  // in-flight records keep offsets into the segment, the compactor must leave it alone from here on
+  journal_set_replay_position(segment + 1, 0);
+  journal_reader_t reader;
+  if (journal_reader_open(&reader, segment, offset) != ESP_OK) {
+    // a missing segment has nothing left to replay
+    return ESP_OK;
+  }
+
+  esp_err_t err = ESP_OK;
+  journal_record_t record;
+  esp_err_t read_err;
+  char scratch[TOPIC_MAX_LEN + 1];
+  char payload[PAYLOAD_MAX_LEN(JOURNAL_MAX_DATA_LEN)];
+  while ((read_err = journal_reader_next(&reader, &record)) == ESP_OK) {
+    const char *topic = record.topic_id != TOPIC_ID_NONE ? topic_table_get(record.topic_id, scratch) : record.topic;
+    if (!topic) {
+      ESP_LOGW(TAG, "Unknown topic id 0x%04x in segment %04x, record skipped", record.topic_id, segment);
+      if (!replay_skip(segment, reader.offset)) {
+        err = ESP_FAIL;
+        break;
+      }
+      continue;
+    }
+    size_t len = payload_encode(record.topic_id, record.timestamp, record.data, record.data_len, payload);
+    if (!replay_publish(topic, payload, len, segment, reader.offset)) {
+      err = ESP_FAIL;
+      break;
+    }
+  }
+  // a batch does not span segments, its acknowledgement moves the checkpoint within one
+  if (err == ESP_OK && !replay_flush(false)) {
+    err = ESP_FAIL;
+  }
+  if (err == ESP_OK && read_err != ESP_ERR_NOT_FOUND) {
+    ESP_LOGW(TAG, "Segment %04x is corrupt after offset %ld, skipping the rest", segment, reader.offset);
+    // the segment is sealed, with the checkpoint at its end replay_collect() deletes it
+    long size = journal_segment_size(segment);
+    if (!replay_skip(segment, size > reader.offset ? (uint32_t)size : (uint32_t)reader.offset)) {
+      err = ESP_FAIL;
+    }
+  }
+  journal_reader_close(&reader);
+  return err;
+}
+
+/* Publishes the RAM tier. Its messages stay there until the broker acknowledged them, replay_on_published() removes
+ * them, so that a message the client drops from its outbox or loses to a reboot is sent again. */
+static void replay_drain_ram(void) {
+  char scratch[TOPIC_MAX_LEN + 1];
+  char data[OFFLINE_BUFFER_MAX_DATA_LEN + 1];
+  char payload[PAYLOAD_MAX_LEN(OFFLINE_BUFFER_MAX_DATA_LEN)];
+  uint16_t topic_id;
+  uint64_t timestamp;
+  size_t data_len;
+  size_t count = 0;
+  for (;;) {
+    // the next message is behind those in flight and those in the batch
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    esp_err_t err = offline_buffer_peek_at(s_inflight_ram + replay_batched(), &topic_id, &timestamp, data, &data_len);
+    xSemaphoreGive(s_lock);
+    if (err != ESP_OK) {
+      break;
+    }
+    const char *topic = topic_table_get(topic_id, scratch);
+    bool published;
+    if (topic) {
+      size_t len = payload_encode(topic_id, timestamp, data, data_len, payload);
+      published = replay_publish(topic, payload, len, REPLAY_SEGMENT_RAM, 0);
+    } else {
+      published = replay_skip(REPLAY_SEGMENT_RAM, 0);
+    }
+    if (!published) {
+      ESP_LOGW(TAG, "Connection lost, %u messages left in RAM", offline_buffer_count());
+      return;
+    }
+    count += topic != NULL;
+  }
+  if (!replay_flush(false)) {
+    ESP_LOGW(TAG, "Connection lost, %u messages left in RAM", offline_buffer_count());
+    return;
+  }
+  if (count) {
+    ESP_LOGI(TAG, "Queued %u messages from RAM", count);
+  }
+}
+
+static void replay_drain_journal(void) {
+  replay_collect();
+
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  if (s_checkpoint.segment < journal_oldest_segment()) {
+    // the journal was full and evicted segments that had not been replayed
+    ESP_LOGW(TAG, "Segments %04x..%04x were evicted before replay", s_checkpoint.segment,
+             journal_oldest_segment() - 1);
+    s_checkpoint.segment = journal_oldest_segment();
+    s_checkpoint.offset = 0;
+  }
+  uint32_t segment = s_checkpoint.segment;
+  uint32_t offset = s_checkpoint.offset;
+  xSemaphoreGive(s_lock);
+  // nothing is in flight, what replay_segment() protected on an earlier connection is free again
+  journal_set_replay_position(segment, offset);
+
+  for (;;) {
+    // seal whatever was appended so far, new records go to a fresh segment while the sealed ones are replayed
+    journal_rotate();
+    uint32_t active = journal_active_segment();
+    if (segment >= active) {
+      break;
+    }
+    ESP_LOGI(TAG, "Replaying segments %04x..%04x from offset %u", segment, active - 1, offset);
+    for (; segment < active; segment++, offset = 0) {
+      if (replay_segment(segment, offset) != ESP_OK) {
+        replay_persist_checkpoint(true);
+        return;
+      }
+    }
+    if (!replay_wait_idle()) {
+      replay_persist_checkpoint(true);
+      return;
+    }
+    replay_collect();
+  }
+  replay_persist_checkpoint(true);
+  ESP_LOGI(TAG, "Backlog replayed");
+}
+
+static void replay_task(void *pvParameters) {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    if (!mqtt_is_connected()) {
+      continue;
+    }
+    // anything still in flight from an earlier connection is sent again from the checkpoint
+    replay_inflight_reset();
+#if CONFIG_GATEWAY_BATCH
+    batch_reset(&s_batch);
+#endif
+    replay_drain_ram();
+    replay_drain_journal();
+  }
+}
+
+esp_err_t replay_init(void) {
+  if (s_task) {
+    return ESP_OK;
+  }
+  s_lock = xSemaphoreCreateMutex();
+  if (!s_lock) {
+    return ESP_ERR_NO_MEM;
+  }
+  replay_load_checkpoint();
+  uint32_t oldest = journal_oldest_segment();
+  if (s_checkpoint.segment < oldest || s_checkpoint.segment > journal_active_segment()) {
+    s_checkpoint.segment = oldest;
+    s_checkpoint.offset = 0;
+  }
+  s_persisted = s_checkpoint;
+  journal_set_replay_position(s_checkpoint.segment, s_checkpoint.offset);
+  ESP_LOGI(TAG, "Checkpoint at segment %04x offset %u", s_checkpoint.segment, s_checkpoint.offset);
+
+  if (xTaskCreate(replay_task, "replay", 4096, NULL, 3, &s_task) != pdPASS) {
+    ESP_LOGE(TAG, "Could not start replay task");
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+void replay_resume(void) {
+  if (s_task) {
+    xTaskNotifyGive(s_task);
+  }
+}
+
+void replay_on_published(int msg_id) {
+  if (!s_task) {
+    return;
+  }
+  bool found = false;
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  for (unsigned i = 0; i < s_inflight_count; i++) {
+    replay_inflight_t *entry = &s_inflight[(s_inflight_first + i) % REPLAY_WINDOW];
+    if (entry->msg_id == msg_id && !entry->acked) {
+      entry->acked = true;
+      found = true;
+      metrics_count(METRICS_COUNTER_REPLAYED);
+      break;
+    }
+  }
+  replay_inflight_advance();
+  xSemaphoreGive(s_lock);
+  if (found) {
+    xTaskNotifyGive(s_task);
+  }
+}
+
+void replay_on_disconnected(void) {
+  if (s_task) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    s_disconnected = true;
+    xSemaphoreGive(s_lock);
+    xTaskNotifyGive(s_task);
+  }
+}
@@ -0,0 +1,19 @@
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+#include "esp_err.h"
+
+/*
+ * Backlog replay. Drains the RAM tier and then the sealed journal segments to the broker. The position of the
+ * oldest message not yet acknowledged by the broker (checkpoint) is persisted in NVS, so an interrupted replay
+ * resumes where it stopped, after a reconnect as well as after a reboot. Messages of the RAM tier are removed from
+ * it only once they are acknowledged, and are sent again after a reconnect otherwise.
+ */
+
+esp_err_t replay_init(void);
+/* Starts or resumes the replay, called when the broker connection is up. */
+void replay_resume(void);
+void replay_on_published(int msg_id);
+void replay_on_disconnected(void);
+
+#endif // _REPLAY_H_
@@ -1,5 +1,6 @@
 #include "esp_vfs_fat.h"
 #include "sdmmc_cmd.h"
+#include <dirent.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/unistd.h>
@@ -110,6 +111,18 @@ FILE *sd_open_file_for_read(const char *filename) {
   return f;
 }
 
+FILE *sd_open_file(const char *filename, const char *mode) {
+  char path_to_file[SD_MAX_PATH_LENGTH];
+  snprintf(path_to_file, SD_MAX_PATH_LENGTH, "%s/%s", MOUNT_POINT, filename);
+  ESP_LOGI(TAG, "Opening file %s (%s)", path_to_file, mode);
+  FILE *f = fopen(path_to_file, mode);
+  if (f == NULL) {
+    ESP_LOGE(TAG, "Failed to open file %s", path_to_file);
+    return NULL;
+  }
+  return f;
+}
+
 void sd_close_file(FILE *f) { fclose(f); }
 
 esp_err_t sd_read_line_from_file(FILE *f, char *buffer, size_t size) {
@@ -135,6 +148,43 @@ void sd_clear_file(const char *filename) {
   fclose(f);
 }
 
+void sd_for_each_file(sd_file_cb_t callback, void *arg) {
+  DIR *dir = opendir(MOUNT_POINT);
+  if (dir == NULL) {
+    ESP_LOGE(TAG, "Failed to open directory %s", MOUNT_POINT);
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_type == DT_REG) {
+      callback(entry->d_name, arg);
+    }
+  }
+  closedir(dir);
+}
+
+esp_err_t sd_truncate_file(const char *filename, long size) {
+  char path_to_file[SD_MAX_PATH_LENGTH];
+  snprintf(path_to_file, SD_MAX_PATH_LENGTH, "%s/%s", MOUNT_POINT, filename);
+  if (truncate(path_to_file, size) != 0) {
+    ESP_LOGE(TAG, "Failed to truncate file %s to %ld", path_to_file, size);
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+esp_err_t sd_rename_file(const char *from, const char *to) {
+  char path_from[SD_MAX_PATH_LENGTH];
+  char path_to[SD_MAX_PATH_LENGTH];
+  snprintf(path_from, SD_MAX_PATH_LENGTH, "%s/%s", MOUNT_POINT, from);
+  snprintf(path_to, SD_MAX_PATH_LENGTH, "%s/%s", MOUNT_POINT, to);
+  if (rename(path_from, path_to) != 0) {
+    ESP_LOGE(TAG, "Failed to rename %s to %s", path_from, path_to);
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
 long sd_get_file_size(const char *filename) {
   char path_to_file[SD_MAX_PATH_LENGTH];
   snprintf(path_to_file, SD_MAX_PATH_LENGTH, "%s/%s", MOUNT_POINT, filename);
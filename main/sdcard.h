@@ -5,13 +5,20 @@
 
 #define SD_MAX_LINE_LENGTH 255
 
+typedef void (*sd_file_cb_t)(const char *filename, void *arg);
+
 void sd_init(void);
 void sd_delete_file(const char *filename);
 void sd_append_to_file(const char *filename, const char *buffer);
 FILE *sd_open_file_for_read(const char *filename);
+FILE *sd_open_file(const char *filename, const char *mode);
 void sd_close_file(FILE *f);
 esp_err_t sd_read_line_from_file(FILE *f, char *buffer, size_t size);
 void sd_clear_file(const char *filename);
+esp_err_t sd_truncate_file(const char *filename, long size);
+/* Renames from to to, which must not exist. */
+esp_err_t sd_rename_file(const char *from, const char *to);
+void sd_for_each_file(sd_file_cb_t callback, void *arg);
 long sd_get_file_size(const char *filename);
 
 #endif // _SDCARD_H_
\ No newline at end of file
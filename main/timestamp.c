@@ -0,0 +1,90 @@
+#include "timestamp.h"
+
+#include "esp_log.h"
+#include "esp_sntp.h"
+#include "esp_timer.h"
+#include "nvs_flash.h"
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "sdkconfig.h"
+
+static const char *TAG = "TIMESTAMP";
+
+// 2024-01-01, the clock of a cold booted ESP32 starts at 1970, anything earlier means SNTP has not set it yet
+#define TIMESTAMP_VALID_AFTER_MS 1704067200000ULL
+
+static uint32_t s_boot;
+
+static uint64_t timestamp_wall_ms(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static uint64_t timestamp_uptime_ms(void) { return (uint64_t)(esp_timer_get_time() / 1000); }
+
+esp_err_t timestamp_init(void) {
+  nvs_handle_t handle;
+  esp_err_t err = nvs_open("timestamp", NVS_READWRITE, &handle);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "could not open boot counter storage");
+    return err;
+  }
+  uint32_t boot = 0;
+  nvs_get_u32(handle, "boot", &boot);
+  s_boot = (boot + 1) & TIMESTAMP_BOOT_MASK;
+  err = nvs_set_u32(handle, "boot", s_boot);
+  if (err == ESP_OK) {
+    err = nvs_commit(handle);
+  }
+  nvs_close(handle);
+  ESP_LOGI(TAG, "Boot %u, clock %s", s_boot, timestamp_synced() ? "set" : "not set");
+  return err;
+}
+
+static void timestamp_on_sntp_sync(struct timeval *tv) { ESP_LOGI(TAG, "Clock set over SNTP"); }
+
+void timestamp_start_sntp(void) {
+  if (esp_sntp_enabled()) {
+    return;
+  }
+  esp_sntp_setoperatingmode(ESP_SNTP_OPMODE_POLL);
+  esp_sntp_setservername(0, CONFIG_GATEWAY_SNTP_SERVER);
+  sntp_set_time_sync_notification_cb(timestamp_on_sntp_sync);
+  esp_sntp_init();
+}
+
+bool timestamp_synced(void) { return timestamp_wall_ms() >= TIMESTAMP_VALID_AFTER_MS; }
+
+uint64_t timestamp_now(void) {
+  uint64_t wall = timestamp_wall_ms();
+  if (wall >= TIMESTAMP_VALID_AFTER_MS) {
+    return wall;
+  }
+  return TIMESTAMP_BOOT_RELATIVE | (uint64_t)s_boot << TIMESTAMP_BOOT_SHIFT |
+         (timestamp_uptime_ms() & TIMESTAMP_UPTIME_MASK);
+}
+
+uint64_t timestamp_resolve(uint64_t timestamp) {
+  if (!(timestamp & TIMESTAMP_BOOT_RELATIVE) || timestamp_boot(timestamp) != s_boot) {
+    return timestamp;
+  }
+  uint64_t wall = timestamp_wall_ms();
+  if (wall < TIMESTAMP_VALID_AFTER_MS) {
+    return timestamp;
+  }
+  // uptime and wall time advance together, the difference between them is the wall time of the boot
+  return wall - timestamp_uptime_ms() + timestamp_uptime(timestamp);
+}
+
+size_t timestamp_format(uint64_t timestamp, char *buffer) {
+  int len;
+  if (timestamp & TIMESTAMP_BOOT_RELATIVE) {
+    len = snprintf(buffer, TIMESTAMP_MAX_LEN + 1, "b%lu+%llu", (unsigned long)timestamp_boot(timestamp),
+                   (unsigned long long)timestamp_uptime(timestamp));
+  } else {
+    len = snprintf(buffer, TIMESTAMP_MAX_LEN + 1, "%llu", (unsigned long long)timestamp);
+  }
+  return len;
+}
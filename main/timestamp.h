@@ -0,0 +1,51 @@
+#ifndef _TIMESTAMP_H_
+#define _TIMESTAMP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/*
+ * Source timestamps. A mesh report is stamped when it comes in, and the stamp travels with the record through the
+ * ingest ring, the RAM tier and the journal, so that consumers can put live and replayed messages back in order.
+ *
+ * A timestamp is one of
+ *
+ *   TIMESTAMP_NONE              records written by older firmware
+ *   wall time                   milliseconds since the Unix epoch, once SNTP has set the clock
+ *   TIMESTAMP_BOOT_RELATIVE |   before that: the boot count, kept in NVS, in bits 40..62 and the milliseconds since
+ *   boot << 40 | ms             that boot in bits 0..39
+ *
+ * timestamp_resolve() turns a boot relative timestamp of the current boot into wall time once the clock is set,
+ * records from an earlier boot that never saw a synced clock keep the boot relative form.
+ *
+ * With CONFIG_GATEWAY_UPLINK_TIMESTAMP the payload carries the timestamp, see payload.h. In text form it is
+ * "1760000000123", or "b12+4711" for boot 12, 4.711 s after it started.
+ */
+
+#define TIMESTAMP_NONE 0
+#define TIMESTAMP_BOOT_RELATIVE (1ULL << 63)
+#define TIMESTAMP_MAX_LEN 24 // formatted, without the terminator
+#define TIMESTAMP_BOOT_SHIFT 40
+#define TIMESTAMP_BOOT_MASK 0x7fffff
+#define TIMESTAMP_UPTIME_MASK ((1ULL << TIMESTAMP_BOOT_SHIFT) - 1)
+
+/* Counts the boot. NVS must be initialised. */
+esp_err_t timestamp_init(void);
+/* Starts setting the clock over SNTP, called once the network is up. Later calls do nothing. */
+void timestamp_start_sntp(void);
+bool timestamp_synced(void);
+uint64_t timestamp_now(void);
+uint64_t timestamp_resolve(uint64_t timestamp);
+/* Formats timestamp into buffer, which must hold TIMESTAMP_MAX_LEN + 1 bytes. Returns the length. */
+size_t timestamp_format(uint64_t timestamp, char *buffer);
+
+/* The parts of a boot relative timestamp. */
+static inline uint32_t timestamp_boot(uint64_t timestamp) {
+  return (timestamp >> TIMESTAMP_BOOT_SHIFT) & TIMESTAMP_BOOT_MASK;
+}
+static inline uint64_t timestamp_uptime(uint64_t timestamp) { return timestamp & TIMESTAMP_UPTIME_MASK; }
+
+#endif // _TIMESTAMP_H_
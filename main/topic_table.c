@@ -0,0 +1,98 @@
+#include "topic_table.h"
+
+#include "esp_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "sdkconfig.h"
+
+static const char *TAG = "TOPIC_TABLE";
+
+#define TOPIC_TABLE_SIZE CONFIG_GATEWAY_TOPIC_TABLE_SIZE
+#define TOPIC_TABLE_MASK (TOPIC_TABLE_SIZE - 1)
+#define TOPIC_TABLE_MAX_FIXED 16
+
+_Static_assert((TOPIC_TABLE_SIZE & TOPIC_TABLE_MASK) == 0, "CONFIG_GATEWAY_TOPIC_TABLE_SIZE must be a power of two");
+
+static SemaphoreHandle_t s_lock;
+static uint16_t s_ids[TOPIC_TABLE_SIZE];
+static char *s_strings; // TOPIC_TABLE_SIZE strings of s_stride bytes, slot i belongs to s_ids[i]
+static size_t s_stride;
+static const char *s_fixed[TOPIC_TABLE_MAX_FIXED];
+static uint16_t s_fixed_count;
+
+static inline unsigned topic_table_hash(uint16_t id) { return (id * 40503u >> 4) & TOPIC_TABLE_MASK; }
+
+static void topic_table_format(uint16_t id, char *topic, size_t size) {
+  snprintf(topic, size, CONFIG_GATEWAY_TOPIC_TEMPLATE, id);
+}
+
+esp_err_t topic_table_init(void) {
+  if (s_lock) {
+    return ESP_OK;
+  }
+  s_lock = xSemaphoreCreateMutex();
+  if (!s_lock) {
+    return ESP_ERR_NO_MEM;
+  }
+  // every node topic has the same length, so the longest one sizes all slots
+  s_stride = snprintf(NULL, 0, CONFIG_GATEWAY_TOPIC_TEMPLATE, TOPIC_ID_FIXED_BASE - 1) + 1;
+  if (s_stride > TOPIC_MAX_LEN + 1) {
+    ESP_LOGE(TAG, "Topic template \"%s\" too long", CONFIG_GATEWAY_TOPIC_TEMPLATE);
+    return ESP_ERR_INVALID_SIZE;
+  }
+  s_strings = malloc(TOPIC_TABLE_SIZE * s_stride);
+  if (!s_strings) {
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+uint16_t topic_table_register(const char *topic) {
+  if (s_fixed_count >= TOPIC_TABLE_MAX_FIXED) {
+    ESP_LOGE(TAG, "Too many fixed topics, %s not registered", topic);
+    return TOPIC_ID_NONE;
+  }
+  s_fixed[s_fixed_count] = topic;
+  return TOPIC_ID_FIXED_BASE + s_fixed_count++;
+}
+
+const char *topic_table_get(uint16_t id, char *scratch) {
+  if (id >= TOPIC_ID_FIXED_BASE) {
+    return id - TOPIC_ID_FIXED_BASE < s_fixed_count ? s_fixed[id - TOPIC_ID_FIXED_BASE] : NULL;
+  }
+  if (id == TOPIC_ID_NONE) {
+    return NULL;
+  }
+  if (!s_strings) {
+    topic_table_format(id, scratch, TOPIC_MAX_LEN + 1);
+    return scratch;
+  }
+
+  const char *topic = NULL;
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  unsigned slot = topic_table_hash(id);
+  for (unsigned probe = 0; probe < TOPIC_TABLE_SIZE; probe++) {
+    unsigned i = (slot + probe) & TOPIC_TABLE_MASK;
+    if (s_ids[i] == id) {
+      topic = s_strings + i * s_stride;
+      break;
+    }
+    if (s_ids[i] == TOPIC_ID_NONE) {
+      topic_table_format(id, s_strings + i * s_stride, s_stride);
+      s_ids[i] = id;
+      topic = s_strings + i * s_stride;
+      break;
+    }
+  }
+  xSemaphoreGive(s_lock);
+
+  if (!topic) {
+    topic_table_format(id, scratch, TOPIC_MAX_LEN + 1);
+    topic = scratch;
+  }
+  return topic;
+}
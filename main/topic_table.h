@@ -0,0 +1,31 @@
+#ifndef _TOPIC_TABLE_H_
+#define _TOPIC_TABLE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/*
+ * Interned MQTT topics. Queues, the RAM tier and the journal carry a 16 bit topic id instead of the topic string:
+ *
+ *   0x0001..0x7fff  per-node topic, the id is the unicast address and the string is built from
+ *                   CONFIG_GATEWAY_TOPIC_TEMPLATE the first time it is needed
+ *   0x8000..        fixed topics registered with topic_table_register(), numbered in registration order. Ids are
+ *                   stored in the journal, so registration must happen in the same order on every boot.
+ */
+
+#define TOPIC_ID_NONE 0x0000
+#define TOPIC_ID_FIXED_BASE 0x8000
+#define TOPIC_MAX_LEN 64
+
+esp_err_t topic_table_init(void);
+/* Registers a topic that is not tied to a node. The string must stay valid forever. */
+uint16_t topic_table_register(const char *topic);
+/* Returns the topic string for id. Falls back to formatting into scratch (TOPIC_MAX_LEN + 1 bytes) if the table is
+ * full, and returns NULL for an unknown id. */
+const char *topic_table_get(uint16_t id, char *scratch);
+
+static inline bool topic_id_is_node(uint16_t id) { return id != TOPIC_ID_NONE && id < TOPIC_ID_FIXED_BASE; }
+
+#endif // _TOPIC_TABLE_H_
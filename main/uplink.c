@@ -0,0 +1,301 @@
+#include "uplink.h"
+
+#include "esp_log.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "batch.h"
+#include "journal_writer.h"
+#include "metrics.h"
+#include "mqtt_app.h"
+#include "node_shadow.h"
+#include "payload.h"
+#include "sdkconfig.h"
+#include "timestamp.h"
+#include "topic_table.h"
+
+static const char *TAG = "UPLINK";
+
+#define UPLINK_RING_SIZE CONFIG_GATEWAY_UPLINK_RING_SIZE
+#define UPLINK_RING_MASK (UPLINK_RING_SIZE - 1)
+
+_Static_assert((UPLINK_RING_SIZE & UPLINK_RING_MASK) == 0, "CONFIG_GATEWAY_UPLINK_RING_SIZE must be a power of two");
+
+typedef struct {
+  uint16_t addr;
+  uint8_t onoff;
+  int8_t rssi;        // PAYLOAD_RSSI_UNKNOWN and
+  uint8_t ttl;        // PAYLOAD_TTL_UNKNOWN without a received message
+  uint32_t opcode;
+  uint32_t rx_us;     // metrics_now() when the report came in
+  uint64_t timestamp; // timestamp_now() at the same moment
+} uplink_event_t;
+
+/* Single-producer single-consumer ring. The mesh callback (BTC task) is the only producer and only writes head,
+ * the publisher task is the only consumer and only writes tail. Both indices run freely and are masked on access. */
+static uplink_event_t s_ring[UPLINK_RING_SIZE];
+static atomic_uint s_head;
+static atomic_uint s_tail;
+
+static TaskHandle_t s_task;
+static uplink_stats_t s_stats;
+
+#if CONFIG_GATEWAY_SNAPSHOT_INTERVAL_S > 0
+static node_shadow_entry_t s_snapshot[CONFIG_GATEWAY_NODE_SHADOW_SIZE];
+#endif
+
+#if CONFIG_GATEWAY_BATCH
+// events in a batch at most, a batch that holds this many is published as full
+#define UPLINK_BATCH_MAX_EVENTS 64
+
+/* Only touched by the publisher task. The events of s_batch are kept as well, so that they can go to the offline
+ * store if the batch cannot be published. */
+static batch_t s_batch;
+static uplink_event_t s_batch_events[UPLINK_BATCH_MAX_EVENTS];
+#endif
+
+static size_t uplink_pack(const uplink_event_t *event, char *data) {
+  payload_report_t report = {
+      .addr = event->addr,
+      .model_id = ESP_BLE_MESH_MODEL_ID_GEN_ONOFF_SRV,
+      .opcode = event->opcode,
+      .value = event->onoff,
+      .rssi = event->rssi,
+      .ttl = event->ttl,
+  };
+  return payload_pack(&report, data);
+}
+
+/* Publishes event on its own, or hands it to the offline store. */
+static void uplink_send_event(const uplink_event_t *event) {
+  char data[PAYLOAD_REPORT_LEN];
+  size_t len = uplink_pack(event, data);
+  int msg_id = mqtt_send_message(event->addr, event->timestamp, data, len);
+  if (msg_id >= 0) {
+    metrics_track_puback(msg_id, METRICS_PENDING_LIVE, event->rx_us);
+  }
+}
+
+static bool uplink_ring_pop(uplink_event_t *event) {
+  unsigned tail = atomic_load_explicit(&s_tail, memory_order_relaxed);
+  if (tail == atomic_load(&s_head)) {
+    return false;
+  }
+  *event = s_ring[tail & UPLINK_RING_MASK];
+  atomic_store(&s_tail, tail + 1);
+  return true;
+}
+
+#if CONFIG_GATEWAY_SNAPSHOT_INTERVAL_S > 0
+/* Publishes the state of every known node as a retained message, so that new subscribers and nodes whose
+ * unchanged reports were suppressed are covered. */
+static void uplink_publish_snapshot(void) {
+  if (!mqtt_is_connected()) {
+    return;
+  }
+  size_t count = node_shadow_copy(s_snapshot, CONFIG_GATEWAY_NODE_SHADOW_SIZE);
+  char scratch[TOPIC_MAX_LEN + 1];
+  char payload[PAYLOAD_REPORT_MAX_LEN];
+  uint64_t now = timestamp_now();
+  for (size_t i = 0; i < count; i++) {
+    const char *topic = topic_table_get(s_snapshot[i].addr, scratch);
+    if (!topic) {
+      continue;
+    }
+    payload_report_t report = {
+        .addr = s_snapshot[i].addr,
+        .model_id = ESP_BLE_MESH_MODEL_ID_GEN_ONOFF_SRV,
+        .opcode = ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_STATUS,
+        .value = s_snapshot[i].onoff,
+        .rssi = PAYLOAD_RSSI_UNKNOWN,
+        .ttl = PAYLOAD_TTL_UNKNOWN,
+    };
+    size_t len = payload_encode_report(&report, now, payload);
+    if (mqtt_enqueue(topic, payload, len, 1, 1) < 0) {
+      return;
+    }
+  }
+  s_stats.snapshots++;
+  ESP_LOGI(TAG, "Snapshot of %u nodes published", count);
+}
+#endif
+
+#if CONFIG_GATEWAY_BATCH
+/* Publishes s_batch. If the broker went away in the meantime its events go to the offline store one by one, ahead
+ * of any event after them, as they would have without batching. */
+static void uplink_publish_batch(bool full) {
+  uint32_t start = metrics_now();
+  int msg_id = mqtt_publish(CONFIG_GATEWAY_BATCH_TOPIC, s_batch.data, s_batch.len, 1, 0);
+  if (msg_id < 0) {
+    ESP_LOGW(TAG, "Batch of %u events not published, storing them", s_batch.count);
+    for (uint16_t i = 0; i < s_batch.count; i++) {
+      uplink_send_event(&s_batch_events[i]);
+    }
+    batch_reset(&s_batch);
+    return;
+  }
+  metrics_record_since(METRICS_STAGE_PUBLISH, start);
+  metrics_add(METRICS_COUNTER_PUBLISHED, s_batch.count);
+  metrics_track_puback(msg_id, METRICS_PENDING_LIVE, s_batch_events[0].rx_us);
+  batch_published(&s_batch, full);
+  batch_reset(&s_batch);
+}
+
+/* Adds event to s_batch, publishing the batch first if the event does not fit. Returns false if the event is not
+ * in the batch, the caller hands it to mqtt_send_message() instead. */
+static bool uplink_batch_event(const uplink_event_t *event) {
+  char scratch[TOPIC_MAX_LEN + 1];
+  const char *topic = topic_table_get(event->addr, scratch);
+  if (!topic) {
+    return false;
+  }
+  char data[PAYLOAD_REPORT_LEN];
+  char payload[PAYLOAD_REPORT_MAX_LEN];
+  size_t len = payload_encode(event->addr, event->timestamp, data, uplink_pack(event, data), payload);
+  if (s_batch.count == UPLINK_BATCH_MAX_EVENTS || !batch_add(&s_batch, topic, payload, len)) {
+    uplink_publish_batch(true);
+    if (!mqtt_is_connected() || !batch_add(&s_batch, topic, payload, len)) {
+      return false;
+    }
+  }
+  s_batch_events[s_batch.count - 1] = *event;
+  return true;
+}
+#endif
+
+static void uplink_publisher_task(void *pvParameters) {
+  uplink_event_t event;
+#if CONFIG_GATEWAY_SNAPSHOT_INTERVAL_S > 0
+  const TickType_t snapshot_interval = pdMS_TO_TICKS(CONFIG_GATEWAY_SNAPSHOT_INTERVAL_S * 1000);
+  TickType_t last_snapshot = xTaskGetTickCount();
+#endif
+  for (;;) {
+    TickType_t wait = portMAX_DELAY;
+#if CONFIG_GATEWAY_SNAPSHOT_INTERVAL_S > 0
+    TickType_t elapsed = xTaskGetTickCount() - last_snapshot;
+    wait = elapsed >= snapshot_interval ? 0 : snapshot_interval - elapsed;
+#endif
+#if CONFIG_GATEWAY_BATCH
+    TickType_t batch_wait = batch_wait_ticks(&s_batch);
+    if (batch_wait < wait) {
+      wait = batch_wait;
+    }
+#endif
+    ulTaskNotifyTake(pdTRUE, wait);
+    while (uplink_ring_pop(&event)) {
+      metrics_record_since(METRICS_STAGE_RING, event.rx_us);
+#if CONFIG_GATEWAY_BATCH
+      // while the broker is away events go to the offline store one by one, as without batching
+      if (mqtt_is_connected() && uplink_batch_event(&event)) {
+        s_stats.published++;
+        continue;
+      }
+      // after the batched events, which are older
+      if (s_batch.count > 0) {
+        uplink_publish_batch(false);
+      }
+#endif
+      uplink_send_event(&event);
+      s_stats.published++;
+    }
+#if CONFIG_GATEWAY_BATCH
+    if (batch_due(&s_batch)) {
+      uplink_publish_batch(false);
+    }
+#endif
+#if CONFIG_GATEWAY_SNAPSHOT_INTERVAL_S > 0
+    if (xTaskGetTickCount() - last_snapshot >= snapshot_interval) {
+      last_snapshot = xTaskGetTickCount();
+      uplink_publish_snapshot();
+    }
+#endif
+  }
+}
+
+static esp_err_t uplink_overflow(const uplink_event_t *event) {
+  s_stats.overflows++;
+#if CONFIG_GATEWAY_UPLINK_OVERFLOW_SPILL
+  char data[PAYLOAD_REPORT_LEN];
+  size_t len = uplink_pack(event, data);
+  if (journal_writer_submit(event->addr, event->timestamp, data, len) == ESP_OK) {
+    metrics_count(METRICS_COUNTER_OFFLINE_SD);
+    s_stats.spilled++;
+    return ESP_OK;
+  }
+#endif
+  s_stats.dropped++;
+  ESP_LOGW(TAG, "Ingest ring full, event from 0x%04x dropped", event->addr);
+  return ESP_ERR_NO_MEM;
+}
+
+esp_err_t uplink_post_onoff(uint16_t addr, uint8_t onoff, const esp_ble_mesh_msg_ctx_t *ctx) {
+  uplink_event_t event = {
+      .addr = addr,
+      .onoff = onoff,
+      .rssi = ctx ? ctx->recv_rssi : PAYLOAD_RSSI_UNKNOWN,
+      .ttl = ctx ? ctx->recv_ttl : PAYLOAD_TTL_UNKNOWN,
+      .opcode = ctx ? ctx->recv_op : ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_STATUS,
+      .rx_us = metrics_now(),
+      .timestamp = timestamp_now(),
+  };
+  if (!s_task) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  metrics_count(METRICS_COUNTER_MESH_RX);
+
+  bool changed;
+#if CONFIG_GATEWAY_SUPPRESS_UNCHANGED
+  node_shadow_entry_t known;
+  if (node_shadow_get(addr, &known) && known.onoff == onoff) {
+    node_shadow_update(addr, onoff, &changed);
+    s_stats.suppressed++;
+    return ESP_OK;
+  }
+#endif
+
+  // The shadow only takes the report once the event is in the ring or spilled, a dropped event must not suppress
+  // the identical reports after it.
+  unsigned head = atomic_load_explicit(&s_head, memory_order_relaxed);
+  unsigned used = head - atomic_load(&s_tail);
+  if (used >= UPLINK_RING_SIZE) {
+    esp_err_t err = uplink_overflow(&event);
+    if (err == ESP_OK) {
+      node_shadow_update(addr, onoff, &changed);
+    }
+    return err;
+  }
+  s_ring[head & UPLINK_RING_MASK] = event;
+  atomic_store(&s_head, head + 1);
+  node_shadow_update(addr, onoff, &changed);
+  s_stats.enqueued++;
+  if (used + 1 > s_stats.high_watermark) {
+    s_stats.high_watermark = used + 1;
+  }
+
+  // The consumer only blocks after it has seen an empty ring, so it only needs a wakeup when this event is the only
+  // one left in it. Both sides use sequentially consistent accesses on head/tail, which makes this check race free.
+  if (head + 1 - atomic_load(&s_tail) == 1) {
+    xTaskNotifyGive(s_task);
+  }
+  return ESP_OK;
+}
+
+esp_err_t uplink_start(void) {
+  if (s_task) {
+    return ESP_OK;
+  }
+  esp_err_t err = node_shadow_init();
+  if (err != ESP_OK) {
+    return err;
+  }
+  if (xTaskCreate(uplink_publisher_task, "uplink_pub", 4096, NULL, 5, &s_task) != pdPASS) {
+    ESP_LOGE(TAG, "Could not start publisher task");
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+void uplink_get_stats(uplink_stats_t *stats) { *stats = s_stats; }
@@ -0,0 +1,26 @@
+#ifndef _UPLINK_H_
+#define _UPLINK_H_
+
+#include <stdint.h>
+
+#include "esp_ble_mesh_defs.h"
+#include "esp_err.h"
+
+typedef struct {
+  uint32_t enqueued;       // events accepted into the ingest ring
+  uint32_t published;      // events handed to mqtt_send_message() by the publisher task
+  uint32_t overflows;      // events that found the ring full
+  uint32_t spilled;        // overflowed events written to the SD journal instead
+  uint32_t dropped;        // overflowed events that were lost
+  uint32_t high_watermark; // largest ring occupancy seen by the producer
+  uint32_t suppressed;     // reports dropped because the node state did not change
+  uint32_t snapshots;      // retained full snapshots published
+} uplink_stats_t;
+
+esp_err_t uplink_start(void);
+/* A Generic OnOff Status from addr. ctx is that of the message it came in, for the opcode, RSSI and TTL in the
+ * payload, or NULL for a state learned otherwise. */
+esp_err_t uplink_post_onoff(uint16_t addr, uint8_t onoff, const esp_ble_mesh_msg_ctx_t *ctx);
+void uplink_get_stats(uplink_stats_t *stats);
+
+#endif // _UPLINK_H_
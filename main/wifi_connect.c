@@ -2,32 +2,85 @@
 
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_random.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 #include "freertos/task.h"
-#include "nvs_flash.h"
 #include <string.h>
 
-#include "lwip/err.h"
-#include "lwip/sys.h"
+#include "metrics.h"
+#include "nvs.h"
+#include "sdkconfig.h"
+#include "timestamp.h"
 
-#include "secrets.h"
+/*
+ * Asynchronous station connection manager. wifi_init_sta() only posts the new credentials to the default event loop
+ * and returns; everything else, including the state below, is handled by event_handler() in the event loop task, so
+ * no locking is needed and the mesh callbacks that apply credentials never wait for an access point.
+ *
+ * A lost or failed connection is retried after a jittered exponential backoff between
+ * CONFIG_GATEWAY_WIFI_BACKOFF_MIN_MS and CONFIG_GATEWAY_WIFI_BACKOFF_MAX_MS. New credentials are applied to the
+ * running driver and connected to right away.
+ *
+ * The BSSID and channel of the last access point that gave us an address are kept in NVS. The first attempt after
+ * boot or after losing the link goes straight to that AP on its channel instead of scanning all channels; if it
+ * fails, the next attempt, right away, is a regular full scan. With CONFIG_LWIP_DHCP_RESTORE_LAST_IP the DHCP
+ * client also asks for the previous lease instead of starting with a discover.
+ */
 
 /* FreeRTOS event group to signal when we are connected*/
 static EventGroupHandle_t s_wifi_event_group;
 
-/* The event group allows multiple bits for each event, but we only care about two events:
- * - we are connected to the AP with an IP
- * - we failed to connect after the maximum amount of retries */
 #define WIFI_CONNECTED_BIT BIT0
-#define WIFI_FAIL_BIT BIT1
+
+/* Longest backoff exponent, CONFIG_GATEWAY_WIFI_BACKOFF_MAX_MS is reached long before. */
+#define WIFI_BACKOFF_MAX_SHIFT 16
+
+#define WIFI_NVS_NAMESPACE "wifi"
+#define WIFI_NVS_AP_KEY "ap"
+
+/* Last access point that gave us an address, stored as a blob under WIFI_NVS_AP_KEY. */
+typedef struct {
+  uint8_t ssid[32]; // the cache only applies to the same network
+  uint8_t bssid[6];
+  uint8_t channel;
+} __attribute__((packed)) wifi_ap_cache_t;
+
+ESP_EVENT_DEFINE_BASE(GATEWAY_WIFI_EVENT);
+
+enum {
+  GATEWAY_WIFI_EVENT_APPLY, // event data is the wifi_config_t to apply
+  GATEWAY_WIFI_EVENT_RETRY, // backoff expired
+};
+
+typedef enum {
+  WIFI_STATE_IDLE,       // driver not started yet
+  WIFI_STATE_CONNECTING, // waiting for association and an IP address
+  WIFI_STATE_CONNECTED,
+  WIFI_STATE_BACKOFF,    // waiting for the retry timer
+} wifi_state_t;
 
 static const char *TAG = "WIFI";
 
 wifi_status_cb_t wifi_event_callback = NULL;
 
+static wifi_state_t s_state = WIFI_STATE_IDLE;
+static bool s_initialized;
+static bool s_restart;        // the next disconnect is ours, for new credentials, and is followed by a connect
+static uint32_t s_attempts;   // failed attempts since the last successful connection
+static uint32_t s_down_since; // metrics_now() when the link went down or credentials were applied, 0 while up
+static uint32_t s_associated; // metrics_now() of the association, 0 until then
+static esp_timer_handle_t s_retry_timer;
+static wifi_config_t s_wifi_config; // credentials as applied, without BSSID and channel
+static wifi_ap_cache_t s_ap_cache;
+static wifi_ap_cache_t s_associated_ap; // the AP of the current association, cached once it handed out an address
+static bool s_ap_cache_valid;
+static bool s_directed;        // the current attempt goes to the cached AP
+static bool s_directed_failed; // skip the cached AP until the next successful connection
+
 void wifi_register_on_status_change_callback(wifi_status_cb_t callback) { wifi_event_callback = callback; }
 
 int wifi_is_connected(void) {
@@ -38,44 +91,208 @@ int wifi_is_connected(void) {
   return bits ? (bits & WIFI_CONNECTED_BIT) : 0;
 }
 
+static void wifi_load_ap_cache(void) {
+  nvs_handle_t handle;
+  if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+    return;
+  }
+  size_t size = sizeof(s_ap_cache);
+  s_ap_cache_valid = nvs_get_blob(handle, WIFI_NVS_AP_KEY, &s_ap_cache, &size) == ESP_OK && size == sizeof(s_ap_cache);
+  nvs_close(handle);
+  if (s_ap_cache_valid) {
+    ESP_LOGI(TAG, "cached AP " MACSTR " on channel %u", MAC2STR(s_ap_cache.bssid), s_ap_cache.channel);
+  }
+}
+
+/* Remembers the AP we got an address from. NVS is only written when it changed, roaming between APs of one
+ * network is rare enough that flash wear does not matter. */
+static void wifi_store_ap_cache(const wifi_ap_cache_t *ap) {
+  if (s_ap_cache_valid && memcmp(ap, &s_ap_cache, sizeof(*ap)) == 0) {
+    return;
+  }
+  s_ap_cache = *ap;
+  s_ap_cache_valid = true;
+  nvs_handle_t handle;
+  if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+    return;
+  }
+  if (nvs_set_blob(handle, WIFI_NVS_AP_KEY, ap, sizeof(*ap)) == ESP_OK) {
+    nvs_commit(handle);
+  }
+  nvs_close(handle);
+}
+
+static void wifi_connect_now(void) {
+  if (!s_down_since) {
+    s_down_since = metrics_now() | 1;
+  }
+  wifi_config_t wifi_config = s_wifi_config;
+  s_directed = s_ap_cache_valid && !s_directed_failed &&
+               memcmp(s_ap_cache.ssid, wifi_config.sta.ssid, sizeof(s_ap_cache.ssid)) == 0;
+  if (s_directed) {
+    wifi_config.sta.bssid_set = true;
+    memcpy(wifi_config.sta.bssid, s_ap_cache.bssid, sizeof(wifi_config.sta.bssid));
+    wifi_config.sta.channel = s_ap_cache.channel;
+  }
+  esp_err_t err = esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "esp_wifi_set_config failed (err %d)", err);
+  }
+  s_associated = 0;
+  s_state = WIFI_STATE_CONNECTING;
+  err = esp_wifi_connect();
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "esp_wifi_connect failed (err %d)", err);
+  }
+}
+
+/* Full jitter in the upper half of the window, so that gateways that lost the same AP do not retry in lockstep. */
+static uint32_t wifi_backoff_ms(uint32_t attempt) {
+  uint32_t shift = attempt < WIFI_BACKOFF_MAX_SHIFT ? attempt : WIFI_BACKOFF_MAX_SHIFT;
+  uint64_t window = (uint64_t)CONFIG_GATEWAY_WIFI_BACKOFF_MIN_MS << shift;
+  if (window > CONFIG_GATEWAY_WIFI_BACKOFF_MAX_MS) {
+    window = CONFIG_GATEWAY_WIFI_BACKOFF_MAX_MS;
+  }
+  uint32_t half = (uint32_t)window / 2;
+  return half + esp_random() % (half + 1);
+}
+
+static void wifi_schedule_retry(void) {
+  uint32_t delay_ms = wifi_backoff_ms(s_attempts++);
+  metrics_count(METRICS_COUNTER_WIFI_RETRY);
+  s_state = WIFI_STATE_BACKOFF;
+  ESP_LOGI(TAG, "retry to connect to the AP in %u ms (attempt %u)", delay_ms, s_attempts);
+  esp_timer_stop(s_retry_timer);
+  esp_timer_start_once(s_retry_timer, (uint64_t)delay_ms * 1000);
+}
+
+static void wifi_retry_timer_cb(void *arg) {
+  // Runs in the esp_timer task, the connect is made from the event loop like every other state change.
+  esp_event_post(GATEWAY_WIFI_EVENT, GATEWAY_WIFI_EVENT_RETRY, NULL, 0, 0);
+}
+
+static void wifi_apply_config(const wifi_config_t *wifi_config) {
+  esp_timer_stop(s_retry_timer);
+  s_attempts = 0;
+  s_down_since = 0;
+  s_directed_failed = false;
+  s_wifi_config = *wifi_config;
+  if (s_state == WIFI_STATE_IDLE) {
+    ESP_ERROR_CHECK(esp_wifi_start()); // WIFI_EVENT_STA_START connects
+    return;
+  }
+  if (s_state == WIFI_STATE_CONNECTED || s_state == WIFI_STATE_CONNECTING) {
+    // Drop the current association first, the disconnect event then connects with the new credentials.
+    s_restart = true;
+    esp_wifi_disconnect();
+    return;
+  }
+  wifi_connect_now();
+}
+
 static void event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
-  if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-    esp_wifi_connect();
+  if (event_base == GATEWAY_WIFI_EVENT && event_id == GATEWAY_WIFI_EVENT_APPLY) {
+    wifi_apply_config((const wifi_config_t *)event_data);
+  } else if (event_base == GATEWAY_WIFI_EVENT && event_id == GATEWAY_WIFI_EVENT_RETRY) {
+    if (s_state == WIFI_STATE_BACKOFF) {
+      wifi_connect_now();
+    }
+  } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
+    wifi_connect_now();
   } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+    wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t *)event_data;
+    bool was_connected = s_state == WIFI_STATE_CONNECTED;
     xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
-    if (wifi_event_callback) {
+    if (was_connected && wifi_event_callback) {
       wifi_event_callback(0);
     }
-    ESP_LOGI(TAG, "connect to the AP fail");
-    ESP_LOGI(TAG, "retry to connect to the AP");
-    esp_wifi_connect();
+    if (s_restart) {
+      s_restart = false;
+      wifi_connect_now();
+      return;
+    }
+    ESP_LOGI(TAG, "connect to the AP fail (reason %d)", event->reason);
+    if (was_connected) {
+      s_down_since = metrics_now() | 1;
+      s_directed_failed = false;
+    } else if (s_directed) {
+      // The AP moved or is gone, scan for the network right away instead of backing off.
+      ESP_LOGI(TAG, "cached AP not reachable, scanning");
+      metrics_count(METRICS_COUNTER_WIFI_SCAN_FALLBACK);
+      s_directed_failed = true;
+      wifi_connect_now();
+      return;
+    }
+    wifi_schedule_retry();
+  } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+    wifi_event_sta_connected_t *event = (wifi_event_sta_connected_t *)event_data;
+    ESP_LOGI(TAG, "associated with " MACSTR " on channel %u%s", MAC2STR(event->bssid), event->channel,
+             s_directed ? " (cached)" : "");
+    s_associated = metrics_now() | 1;
+    // an AP that associates but never hands out an address must not become the cached one
+    s_associated_ap = (wifi_ap_cache_t){.channel = event->channel};
+    memcpy(s_associated_ap.ssid, s_wifi_config.sta.ssid, sizeof(s_associated_ap.ssid));
+    memcpy(s_associated_ap.bssid, event->bssid, sizeof(s_associated_ap.bssid));
   } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
     ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
-    ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
+    ESP_LOGI(TAG, "got ip:" IPSTR " after %u failed attempts", IP2STR(&event->ip_info.ip), s_attempts);
+    if (s_down_since) {
+      metrics_record_since(METRICS_STAGE_WIFI_CONNECT, s_down_since);
+      ESP_LOGI(TAG, "time to IP %u ms", (metrics_now() - s_down_since) / 1000);
+      s_down_since = 0;
+    }
+    if (s_associated) {
+      metrics_record_since(METRICS_STAGE_WIFI_DHCP, s_associated);
+      wifi_store_ap_cache(&s_associated_ap);
+    }
+    s_attempts = 0;
+    s_directed_failed = false;
+    s_state = WIFI_STATE_CONNECTED;
     xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+    timestamp_start_sntp();
     if (wifi_event_callback) {
       wifi_event_callback(1);
     }
   }
 }
 
-void wifi_init_sta(const char *ssid, size_t ssid_len, const char *password, size_t password_len) {
+/* Brings up netif, the event loop and the Wi-Fi driver. Runs once, credentials are applied by posting events. */
+static void wifi_init_once(void) {
+  if (s_initialized) {
+    return;
+  }
+  s_initialized = true;
   s_wifi_event_group = xEventGroupCreate();
 
   ESP_ERROR_CHECK(esp_netif_init());
-
-  ESP_ERROR_CHECK(esp_event_loop_create_default());
+  esp_err_t err = esp_event_loop_create_default();
+  if (err != ESP_ERR_INVALID_STATE) { // already created by another component
+    ESP_ERROR_CHECK(err);
+  }
   esp_netif_create_default_wifi_sta();
 
   wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
   ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+  // The credentials are kept by the application, and the config is set before every attempt, which must not wear
+  // the flash.
+  ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+  ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+  wifi_load_ap_cache();
 
-  esp_event_handler_instance_t instance_any_id;
-  esp_event_handler_instance_t instance_got_ip;
-  ESP_ERROR_CHECK(
-      esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL, &instance_any_id));
+  const esp_timer_create_args_t timer_args = {
+      .callback = wifi_retry_timer_cb,
+      .name = "wifi_retry",
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &s_retry_timer));
+
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL, NULL));
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL, NULL));
   ESP_ERROR_CHECK(
-      esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL, &instance_got_ip));
+      esp_event_handler_instance_register(GATEWAY_WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL, NULL));
+}
+
+void wifi_init_sta(const char *ssid, size_t ssid_len, const char *password, size_t password_len) {
+  wifi_init_once();
 
   wifi_config_t wifi_config = {
       .sta =
@@ -85,24 +302,12 @@ void wifi_init_sta(const char *ssid, size_t ssid_len, const char *password, size
   };
   memcpy((void *)&wifi_config.sta.ssid, (void *)ssid, ssid_len);
   memcpy((void *)&wifi_config.sta.password, (void *)password, password_len);
-  ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-  ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
-  ESP_ERROR_CHECK(esp_wifi_start());
-
+  // The event loop copies the event data, so the stack copy can go away once this returns.
+  esp_err_t err = esp_event_post(GATEWAY_WIFI_EVENT, GATEWAY_WIFI_EVENT_APPLY, &wifi_config, sizeof(wifi_config),
+                                 pdMS_TO_TICKS(100));
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to queue Wi-Fi credentials (err %d)", err);
+    return;
+  }
   ESP_LOGI(TAG, "wifi_init_sta finished.");
-
-  /* Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
-   * number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see above) */
-  EventBits_t bits =
-      xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT, pdFALSE, pdFALSE, portMAX_DELAY);
-
-  /* xEventGroupWaitBits() returns the bits before the call returned, hence we can test which event actually
-   * happened. */
-  if (bits & WIFI_CONNECTED_BIT) {
-    ESP_LOGI(TAG, "connected to ap SSID:%s password:%s", BLE_MESH_PROJ_WIFI_SSID, BLE_MESH_PROJ_WIFI_PASSWORD);
-  } else if (bits & WIFI_FAIL_BIT) {
-    ESP_LOGI(TAG, "Failed to connect to SSID:%s, password:%s", BLE_MESH_PROJ_WIFI_SSID, BLE_MESH_PROJ_WIFI_PASSWORD);
-  } else {
-    ESP_LOGE(TAG, "UNEXPECTED EVENT");
-  }
-}
\ No newline at end of file
+}
@@ -8,6 +8,8 @@
 
 typedef void (*wifi_status_cb_t)(int status);
 
+/* Connects to the access point, or switches to it if already connected, without waiting for the connection. The
+ * first call also brings up the Wi-Fi driver. Connection changes are reported through the status callback. */
 void wifi_init_sta(const char *ssid, size_t ssid_len, const char *password, size_t password_len);
 int wifi_is_connected(void);
 void wifi_register_on_status_change_callback(wifi_status_cb_t callback);